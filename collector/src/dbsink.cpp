@@ -0,0 +1,225 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+#include "dbsink.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <sqlite3.h>
+
+#define DBSINK_BUSY_TIMEOUT	5000	// wait for web UI readers holding a lock, ms
+
+// rollup tables, same as in sql/pzem_sqlite.sql
+static const char rollup_schema[] =
+	"CREATE TABLE IF NOT EXISTS data_hourly ("
+	" devid INT NOT NULL references meters(id), hour timestamp NOT NULL,"
+	" cnt INT NOT NULL, sumP REAL NOT NULL, maxP REAL NOT NULL, sumPF REAL NOT NULL, cntPF INT NOT NULL, minW INT NOT NULL, maxW INT NOT NULL,"
+	" PRIMARY KEY (devid, hour));"
+	"CREATE TABLE IF NOT EXISTS data_daily ("
+	" devid INT NOT NULL references meters(id), date TEXT NOT NULL,"
+	" cnt INT NOT NULL, sumP REAL NOT NULL, maxP REAL NOT NULL, sumPF REAL NOT NULL, cntPF INT NOT NULL, minW INT NOT NULL, maxW INT NOT NULL,"
+	" PRIMARY KEY (devid, date));";
+
+// buckets are merged with stored ones, that's what makes late samples work
+#define ROLLUP_MERGE(key)                                                                                                   \
+	" ON CONFLICT (devid, " key ") DO UPDATE SET cnt = cnt + excluded.cnt, sumP = sumP + excluded.sumP,"                  \
+	" maxP = max(maxP, excluded.maxP), sumPF = sumPF + excluded.sumPF, cntPF = cntPF + excluded.cntPF,"                   \
+	" minW = min(minW, excluded.minW), maxW = max(maxW, excluded.maxW)"
+
+static const char upsert_hourly[] =
+	"INSERT INTO data_hourly (devid, hour, cnt, sumP, maxP, sumPF, cntPF, minW, maxW)"
+	" VALUES (?1, datetime(?2, 'unixepoch'), ?3, ?4, ?5, ?6, ?7, ?8, ?9)" ROLLUP_MERGE("hour");
+static const char upsert_daily[] =
+	"INSERT INTO data_daily (devid, date, cnt, sumP, maxP, sumPF, cntPF, minW, maxW)"
+	" VALUES (?1, printf('%04d-%02d-%02d', ?2 / 10000, ?2 / 100 % 100, ?2 % 100), ?3, ?4, ?5, ?6, ?7, ?8, ?9)" ROLLUP_MERGE("date");
+
+// hours and days are local, like DATE(dtime, 'localtime') grouping in stat reports
+// U and I have numeric affinity and whole values are stored as integers, power factor needs real division
+#define ROLLUP_AGGREGATES " COUNT(*), TOTAL(P), MAX(P), TOTAL(P/(cast(U as real)*I)), COUNT(P/(cast(U as real)*I)), MIN(W), MAX(W) FROM data"
+static const char rebuild[] =
+	"DELETE FROM data_hourly;"
+	"DELETE FROM data_daily;"
+	"INSERT INTO data_hourly SELECT devid, DATETIME(strftime('%Y-%m-%d %H:00:00', dtime, 'localtime'), 'utc') AS h," ROLLUP_AGGREGATES " GROUP BY devid, h;"
+	"INSERT INTO data_daily SELECT devid, DATE(dtime, 'localtime') AS d," ROLLUP_AGGREGATES " GROUP BY devid, d;";
+
+namespace pzcollect {
+
+void rollup::add(double U, double I, double P, uint32_t W) {
+	++cnt;
+	sumP += P;
+	maxP = std::max(maxP, P);
+	// same as P/(U*I) in SQL, division by zero gives NULL that is not counted
+	if (U * I != 0) {
+		sumPF += P / (U * I);
+		++cntPF;
+	}
+	minW = std::min(minW, W);
+	maxW = std::max(maxW, W);
+}
+
+bool DbSink::fail() {
+	err = db ? sqlite3_errmsg(db) : "database is not open";
+	++stats.errors;
+	return false;
+}
+
+bool DbSink::exec(const char *sql) {
+	return sqlite3_exec(db, sql, nullptr, nullptr, nullptr) == SQLITE_OK || fail();
+}
+
+bool DbSink::open(const char *path) {
+	close();
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK)
+		return fail();
+	sqlite3_busy_timeout(db, DBSINK_BUSY_TIMEOUT);
+	// column names must match the ones 'pzem_poller.php' writes
+	if (!exec(rollup_schema) ||
+		sqlite3_prepare_v2(db, "INSERT INTO data (devid, dtime, U, I, P, W) VALUES (?, datetime(?, 'unixepoch'), ?, ?, ?, ?)", -1, &ins, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, upsert_hourly, -1, &up_hourly, nullptr) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, upsert_daily, -1, &up_daily, nullptr) != SQLITE_OK) {
+		fail();
+		close();
+		return false;
+	}
+	return true;
+}
+
+void DbSink::close() {
+	if (!db)
+		return;
+	flush();
+	sqlite3_finalize(ins);
+	sqlite3_finalize(up_hourly);
+	sqlite3_finalize(up_daily);
+	ins = up_hourly = up_daily = nullptr;
+	sqlite3_close(db);
+	db = nullptr;
+}
+
+bool DbSink::meters(std::function<void(uint16_t id, const std::string &hostname)> cb) {
+	sqlite3_stmt *q;
+	if (!db || sqlite3_prepare_v2(db, "SELECT id, hostname FROM meters WHERE hostname <> '' ORDER BY id", -1, &q, nullptr) != SQLITE_OK)
+		return fail();
+	while (sqlite3_step(q) == SQLITE_ROW)
+		cb(sqlite3_column_int(q, 0), reinterpret_cast<const char *>(sqlite3_column_text(q, 1)));
+	sqlite3_finalize(q);
+	return true;
+}
+
+uint32_t DbSink::lastTime(uint16_t devid) {
+	sqlite3_stmt *q;
+	if (!db || sqlite3_prepare_v2(db, "SELECT strftime('%s', max(dtime)) FROM data WHERE devid = ?", -1, &q, nullptr) != SQLITE_OK)
+		return fail();
+	sqlite3_bind_int(q, 1, devid);
+	uint32_t t = 0;
+	if (sqlite3_step(q) == SQLITE_ROW)
+		t = sqlite3_column_int64(q, 0);
+	sqlite3_finalize(q);
+	return t;
+}
+
+bool DbSink::add(const row &r) {
+	if (!db)
+		return fail();
+	if (!pending && !exec("BEGIN"))
+		return false;
+
+	// values are rounded to columns precision, rollups are made of the same values as stored ones
+	double U = std::round(r.U * 10) / 10;
+	double I = std::round(r.I * 100) / 100;
+	long   P = std::lround(r.P);
+	sqlite3_bind_int(ins, 1, r.devid);
+	sqlite3_bind_int64(ins, 2, r.dtime);
+	sqlite3_bind_double(ins, 3, U);
+	sqlite3_bind_double(ins, 4, I);
+	sqlite3_bind_int(ins, 5, P);
+	sqlite3_bind_int64(ins, 6, r.W);
+	bool ok = sqlite3_step(ins) == SQLITE_DONE;
+	sqlite3_reset(ins);
+	++pending;
+	if (!ok) {
+		fail();
+		rollback();
+		return false;
+	}
+
+	time_t t = r.dtime;
+	tm	   lt;
+	localtime_r(&t, &lt);
+	hourly[{r.devid, static_cast<uint32_t>(t - lt.tm_min * 60 - lt.tm_sec)}].add(U, I, P, r.W);
+	daily[{r.devid, static_cast<uint32_t>((lt.tm_year + 1900) * 10000 + (lt.tm_mon + 1) * 100 + lt.tm_mday)}].add(U, I, P, r.W);
+
+	if (pending >= batch)
+		return flush();
+	return true;
+}
+
+bool DbSink::upsert(sqlite3_stmt *stmt, uint16_t devid, uint32_t key, const rollup &r) {
+	sqlite3_bind_int(stmt, 1, devid);
+	sqlite3_bind_int64(stmt, 2, key);
+	sqlite3_bind_int(stmt, 3, r.cnt);
+	sqlite3_bind_double(stmt, 4, r.sumP);
+	sqlite3_bind_double(stmt, 5, r.maxP);
+	sqlite3_bind_double(stmt, 6, r.sumPF);
+	sqlite3_bind_int(stmt, 7, r.cntPF);
+	sqlite3_bind_int64(stmt, 8, r.minW);
+	sqlite3_bind_int64(stmt, 9, r.maxW);
+	bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+	sqlite3_reset(stmt);
+	++stats.buckets;
+	return ok || fail();
+}
+
+void DbSink::rollback() {
+	sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+	pending = 0;
+	hourly.clear();
+	daily.clear();
+	if (on_commit)
+		on_commit(false);
+}
+
+bool DbSink::flush() {
+	if (!pending)
+		return true;
+	auto t = std::chrono::steady_clock::now();
+
+	// rollups go into the same transaction as the rows they are made of
+	bool ok = true;
+	for (const auto &h : hourly)
+		ok = ok && upsert(up_hourly, h.first.first, h.first.second, h.second);
+	for (const auto &d : daily)
+		ok = ok && upsert(up_daily, d.first.first, d.first.second, d.second);
+
+	if (!ok || !exec("COMMIT")) {
+		rollback();
+		return false;
+	}
+	stats.rows += pending;
+	pending = 0;
+	hourly.clear();
+	daily.clear();
+	++stats.commits;
+	stats.commit_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t).count();
+	if (on_commit)
+		on_commit(true);
+	return true;
+}
+
+bool DbSink::rebuildRollups() {
+	if (!db)
+		return fail();
+	if (!flush() || !exec("BEGIN"))
+		return false;
+	if (!exec(rebuild)) {
+		exec("ROLLBACK");
+		return false;
+	}
+	return exec("COMMIT");
+}
+
+}  // namespace pzcollect
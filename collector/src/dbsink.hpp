@@ -0,0 +1,136 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// SQLite sink for meter samples, writes to 'data' table from sql/pzem_sqlite.sql in batched transactions
+// and maintains hourly/daily rollup tables for stat reports in the same transactions
+
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace pzcollect {
+
+// a row of 'data' table
+struct row {
+	uint16_t devid;
+	uint32_t dtime;		// unixtime, stored as UTC 'YYYY-MM-DD HH:MM:SS' like CURRENT_TIMESTAMP default
+	float	 U;			// V
+	float	 I;			// A
+	float	 P;			// W
+	uint32_t W;			// Wh
+};
+
+/**
+ * @brief rollup bucket, aggregates of samples in an hour or a day
+ * all aggregates are order-independent, so late and out-of-order samples are merged into stored buckets as is
+ */
+struct rollup {
+	uint32_t cnt{0};			// number of samples
+	double	 sumP{0};			// sum of P, for average power
+	double	 maxP{0};
+	double	 sumPF{0};			// sum of power factor P/(U*I)
+	uint32_t cntPF{0};			// number of samples with U*I != 0
+	uint32_t minW{UINT32_MAX};	// energy counter range
+	uint32_t maxW{0};
+
+	void add(double U, double I, double P, uint32_t W);
+};
+
+struct DbSink_stats {
+	uint64_t rows{0};			// rows committed
+	uint32_t commits{0};		// transactions committed
+	uint32_t errors{0};			// failed inserts/commits
+	uint64_t commit_us{0};		// total time spent in commits
+	uint64_t buckets{0};		// rollup rows upserted
+};
+
+class DbSink {
+	sqlite3		 *db{nullptr};
+	sqlite3_stmt *ins{nullptr};
+	sqlite3_stmt *up_hourly{nullptr};
+	sqlite3_stmt *up_daily{nullptr};
+	size_t		  batch;
+	size_t		  pending{0};	// rows in an open transaction
+	std::string	  err;
+	DbSink_stats  stats;
+	std::function<void(bool committed)> on_commit;
+
+	// rollups of the rows in an open transaction, written on commit
+	std::map<std::pair<uint16_t, uint32_t>, rollup> hourly;	// devid, start of the local hour (unixtime)
+	std::map<std::pair<uint16_t, uint32_t>, rollup> daily;		// devid, local date as YYYYMMDD
+
+	bool		  exec(const char *sql);
+	bool		  fail();
+	bool		  upsert(sqlite3_stmt *stmt, uint16_t devid, uint32_t key, const rollup &r);
+	void		  rollback();
+
+   public:
+	/**
+	 * @param batch_size - rows per transaction, transaction is also committed on flush()
+	 */
+	explicit DbSink(size_t batch_size = 1000) : batch(batch_size ? batch_size : 1) {}
+	~DbSink() { close(); }
+	DbSink(const DbSink &) = delete;
+	DbSink &operator=(const DbSink &) = delete;
+
+	/**
+	 * @brief open database, 'data' and 'meters' tables must exist
+	 * rollup tables are created if missing, use rebuildRollups() to fill them from existing data
+	 * @return false on error, check error()
+	 */
+	bool open(const char *path);
+
+	// commit pending rows and close database
+	void close();
+
+	/**
+	 * @brief iterate 'meters' table, entries with empty hostname are skipped
+	 * @param cb - callback(id, hostname)
+	 */
+	bool meters(std::function<void(uint16_t id, const std::string &hostname)> cb);
+
+	/**
+	 * @brief newest sample time stored for a meter, used to skip samples stored by a previous run
+	 * @return unixtime, 0 if there is none
+	 */
+	uint32_t lastTime(uint16_t devid);
+
+	/**
+	 * @brief add a row, it is written when a batch is full or on flush()
+	 * if a row can't be inserted, the whole open transaction is rolled back
+	 */
+	bool add(const row &r);
+
+	/**
+	 * @brief commit open transaction
+	 * @return false if transaction was rolled back, rows added since the last commit are not stored
+	 */
+	bool flush();
+
+	/**
+	 * @brief set a callback for the end of each transaction
+	 * rows are only stored once it is called with 'committed' set, ingest positions should be advanced then
+	 * and reverted to the last committed ones on rollback, so that rolled back samples are fetched again
+	 */
+	void onCommit(std::function<void(bool committed)> cb) { on_commit = std::move(cb); }
+
+	/**
+	 * @brief recalculate rollup tables from 'data' table
+	 * i.e. after the DB was filled by pzem_poller.php or rows were edited by hand
+	 */
+	bool rebuildRollups();
+
+	const std::string	&error() const { return err; }
+	const DbSink_stats	&getStats() const { return stats; }
+};
+
+}  // namespace pzcollect
@@ -0,0 +1,239 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+#include "httpc.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace pzcollect {
+
+int64_t millis() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool resolve(const std::string &host, uint16_t port, sockaddr_storage &addr, socklen_t &alen) {
+	addrinfo hints{};
+	hints.ai_family	  = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *res	  = nullptr;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) || !res)
+		return false;
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	alen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+bool HttpGet::start(int efd, const sockaddr_storage &addr, socklen_t alen, const std::string &host, const std::string &path, int64_t deadline) {
+	close();
+	epfd	  = efd;
+	_deadline = deadline;
+	req		  = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\nAccept-Encoding: identity\r\nUser-Agent: pzcollect\r\n\r\n";
+
+	fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		finish(false, strerror(errno));
+		return false;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), alen) && errno != EINPROGRESS) {
+		finish(false, strerror(errno));
+		return false;
+	}
+	st = state_t::connecting;
+
+	epoll_event ev{};
+	ev.events	= EPOLLOUT;
+	ev.data.ptr = this;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		finish(false, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool HttpGet::rearm(uint32_t events) {
+	epoll_event ev{};
+	ev.events	= events;
+	ev.data.ptr = this;
+	return !epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+bool HttpGet::onEvent(uint32_t events) {
+	if (!busy())
+		return true;
+
+	if (st == state_t::connecting) {
+		int		  err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			finish(false, strerror(err ? err : errno));
+			return true;
+		}
+		st = state_t::sending;
+	}
+
+	if (st == state_t::sending) {
+		while (sent < req.size()) {
+			ssize_t n = send(fd, req.data() + sent, req.size() - sent, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return false;
+				finish(false, strerror(errno));
+				return true;
+			}
+			sent += n;
+		}
+		st = state_t::receiving;
+		if (!rearm(EPOLLIN | EPOLLRDHUP)) {
+			finish(false, strerror(errno));
+			return true;
+		}
+		return false;
+	}
+
+	// receiving
+	char buff[HTTPC_READ_CHUNK];
+	for (;;) {
+		ssize_t n = recv(fd, buff, sizeof(buff), 0);
+		if (n > 0) {
+			raw.append(buff, n);
+			if (raw.size() > HTTPC_MAX_RESPONSE) {
+				finish(false, "response is too large");
+				return true;
+			}
+			if (!hdr_len)
+				parse_headers();
+			if (hdr_len && complete()) {
+				finish(true);
+				return true;
+			}
+			continue;
+		}
+		if (!n) {	// peer closed connection
+			if (!hdr_len)
+				finish(false, "connection closed before headers");
+			else if (clen >= 0 && raw.size() - hdr_len < static_cast<size_t>(clen))
+				finish(false, "truncated body");
+			else
+				finish(true);
+			return true;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return false;
+		finish(false, strerror(errno));
+		return true;
+	}
+}
+
+void HttpGet::parse_headers() {
+	size_t end = raw.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return;
+	hdr_len = end + 4;
+
+	// status line 'HTTP/1.1 200 OK'
+	size_t sp = raw.find(' ');
+	if (sp != std::string::npos && sp < end)
+		_status = atoi(raw.c_str() + sp + 1);
+
+	size_t pos = raw.find("\r\n") + 2;
+	while (pos < end) {
+		size_t eol = raw.find("\r\n", pos);
+		std::string h = raw.substr(pos, eol - pos);
+		size_t colon = h.find(':');
+		if (colon != std::string::npos) {
+			const char *v = h.c_str() + colon + 1;
+			while (*v == ' ')
+				++v;
+			if (colon == 14 && !strncasecmp(h.c_str(), "Content-Length", colon))
+				clen = atoll(v);
+			else if (colon == 17 && !strncasecmp(h.c_str(), "Transfer-Encoding", colon) && strcasestr(v, "chunked"))
+				chunked = true;
+		}
+		pos = eol + 2;
+	}
+}
+
+bool HttpGet::complete() const {
+	if (chunked)
+		return raw.size() >= 5 && !raw.compare(raw.size() - 5, 5, "0\r\n\r\n");
+	return clen >= 0 && raw.size() - hdr_len >= static_cast<size_t>(clen);
+}
+
+bool HttpGet::decode_chunked() {
+	size_t pos = hdr_len;
+	for (;;) {
+		size_t eol = raw.find("\r\n", pos);
+		if (eol == std::string::npos)
+			return false;
+		size_t len = strtoul(raw.c_str() + pos, nullptr, 16);
+		if (!len)
+			return true;
+		pos = eol + 2;
+		if (pos + len > raw.size())
+			return false;
+		_body.append(raw, pos, len);
+		pos += len + 2;
+	}
+}
+
+void HttpGet::finish(bool ok, const char *err) {
+	if (ok && hdr_len) {
+		if (chunked) {
+			if (!decode_chunked()) {
+				ok	= false;
+				err = "bad chunked encoding";
+			}
+		} else
+			_body.assign(raw, hdr_len, clen >= 0 ? static_cast<size_t>(clen) : std::string::npos);
+	}
+	st = ok ? state_t::done : state_t::failed;
+	if (err)
+		_error = err;
+	if (fd >= 0) {
+		::close(fd);	// also removes it from epoll set
+		fd = -1;
+	}
+	raw.clear();
+	raw.shrink_to_fit();
+}
+
+bool HttpGet::expire(int64_t now) {
+	if (!busy() || now < _deadline)
+		return false;
+	finish(false, "timeout");
+	return true;
+}
+
+void HttpGet::close() {
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	st = state_t::idle;
+	sent = hdr_len = 0;
+	clen = -1;
+	chunked = false;
+	_status = 0;
+	raw.clear();
+	_body.clear();
+	_error.clear();
+}
+
+}  // namespace pzcollect
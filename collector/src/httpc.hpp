@@ -0,0 +1,101 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Non-blocking HTTP/1.1 GET client driven by an external epoll loop, Linux only
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+
+#define HTTPC_MAX_RESPONSE	(4 * 1024 * 1024)	// responses larger than this are dropped, bytes
+#define HTTPC_READ_CHUNK	16384
+
+namespace pzcollect {
+
+/**
+ * @brief resolve host name, blocking
+ * fleet hosts are resolved once on startup, so the event loop never waits for DNS
+ *
+ * @return true on success
+ */
+bool resolve(const std::string &host, uint16_t port, sockaddr_storage &addr, socklen_t &alen);
+
+/**
+ * @brief a single GET request over a fresh connection
+ * connection is registered in epoll set with 'this' as event data, loop calls onEvent() for it's events.
+ * Response is read until Content-Length is reached or the peer closes connection, chunked body is decoded
+ */
+class HttpGet {
+   public:
+	enum class state_t : uint8_t { idle, connecting, sending, receiving, done, failed };
+
+   private:
+	int			fd{-1};
+	int			epfd{-1};
+	state_t		st{state_t::idle};
+	std::string	req;
+	size_t		sent{0};
+	std::string	raw;			// response as received
+	size_t		hdr_len{0};		// header length including blank line, 0 - headers are not complete yet
+	int64_t		clen{-1};		// Content-Length, -1 - not provided
+	bool		chunked{false};
+	int			_status{0};
+	std::string	_body;
+	std::string	_error;
+	int64_t		_deadline{0};
+
+	void		finish(bool ok, const char *err = nullptr);
+	void		parse_headers();
+	bool		complete() const;
+	bool		decode_chunked();
+	bool		rearm(uint32_t events);
+
+   public:
+	void *arg{nullptr};		// user context, i.e. an owner of the request
+
+	HttpGet() = default;
+	~HttpGet() { close(); }
+	HttpGet(const HttpGet &) = delete;
+	HttpGet &operator=(const HttpGet &) = delete;
+
+	/**
+	 * @brief start a request
+	 *
+	 * @param efd - epoll descriptor
+	 * @param addr - resolved peer address
+	 * @param host - Host header value
+	 * @param path - request path with query
+	 * @param deadline - monotonic time to give up at, ms
+	 * @return false if a socket could not be set up, check error()
+	 */
+	bool start(int efd, const sockaddr_storage &addr, socklen_t alen, const std::string &host, const std::string &path, int64_t deadline);
+
+	/**
+	 * @brief process epoll events for the connection
+	 * @return true when request is finished, either done or failed
+	 */
+	bool onEvent(uint32_t events);
+
+	// fail request if deadline has passed, @return true if timed out
+	bool expire(int64_t now);
+
+	// close socket and drop state
+	void close();
+
+	state_t				state() const { return st; }
+	bool				busy() const { return st == state_t::connecting || st == state_t::sending || st == state_t::receiving; }
+	int64_t				deadline() const { return _deadline; }
+	int					status() const { return _status; }
+	const std::string	&body() const { return _body; }
+	const std::string	&error() const { return _error; }
+	size_t				received() const { return raw.size(); }
+};
+
+// monotonic clock, ms
+int64_t millis();
+
+}  // namespace pzcollect
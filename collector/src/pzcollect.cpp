@@ -0,0 +1,439 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+/*
+	Fleet collector daemon, Linux only
+
+	Polls a number of espem nodes concurrently from a single epoll loop and writes samples into
+	'data' table of the SQLite database made from sql/pzem_sqlite.sql, a replacement for running
+	www/inc/pzem_poller.php per meter per cacti cycle.
+
+	Nodes are asked for a binary TimeSeries archive of a tier (/archive.bin), only samples newer than the ones
+	already stored are requested and written, so every sample of the tier gets to the DB once.
+	Nodes that do not serve archives (404, older firmware) are polled via /getpmdata, one sample per cycle.
+
+	usage: pzcollect --db pzem.sqlite [options], see usage() below
+*/
+
+#include "dbsink.hpp"
+#include "httpc.hpp"
+#include "tsareader.hpp"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define PZC_MAX_EVENTS		64
+#define PZC_MIN_VALID_TIME	1000000000		// samples stamped before 2001 come from nodes without NTP sync, skipped
+
+using namespace pzcollect;
+
+namespace {
+
+struct options {
+	const char *db	   = nullptr;
+	unsigned	interval = 60;		// poll cycle, sec
+	unsigned	tier	 = 1;		// TimeSeries id to fetch
+	unsigned	parallel = 64;		// max requests in flight
+	unsigned	timeout	 = 10;		// request timeout, sec
+	unsigned	batch	 = 1000;	// rows per transaction
+	bool		once	 = false;	// run one cycle and exit
+	bool		rebuild	 = false;	// recalculate rollup tables and exit
+	bool		verbose	 = false;
+	std::vector<std::string> meters;	// 'devid,host[:port]'
+};
+
+struct node {
+	std::string		 host;
+	uint16_t		 port{80};
+	uint16_t		 devid{0};
+	sockaddr_storage addr{};
+	socklen_t		 alen{0};
+	bool			 archive{true};		// node serves /archive.bin, cleared on 404
+	bool			 seq_valid{false};
+	uint32_t		 last_seq{0};		// TimeSeries seq of the newest sample stored
+	uint32_t		 last_time{0};		// timestamp of the newest sample stored
+	int64_t			 last_ok{0};		// last successful poll, ms
+	HttpGet			 http;
+
+	// counters
+	uint32_t		 polls{0};
+	uint32_t		 fails{0};
+	uint32_t		 gaps{0};			// samples missed between polls
+	uint32_t		 unsynced{0};		// samples skipped for the lack of node's time sync
+	uint64_t		 rows{0};
+
+	// position of the last committed transaction, rows added after it are not stored yet
+	struct {
+		bool		 seq_valid{false};
+		uint32_t	 last_seq{0};
+		uint32_t	 last_time{0};
+		uint64_t	 rows{0};
+	} committed;
+
+	void commit() { committed = {seq_valid, last_seq, last_time, rows}; }
+
+	// transaction was rolled back, samples added since the last commit will be fetched again
+	void revert() {
+		seq_valid = committed.seq_valid;
+		last_seq  = committed.last_seq;
+		last_time = committed.last_time;
+		rows	  = committed.rows;
+	}
+};
+
+volatile sig_atomic_t stop = 0;
+
+void onsignal(int) { stop = 1; }
+
+void usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s --db <pzem.sqlite> [options]\n"
+		"  --meter <devid>,<host>[:port]  meter to poll, could be repeated, default - all meters from 'meters' table\n"
+		"  --interval <sec>               poll cycle (60)\n"
+		"  --tier <tsid>                  TimeSeries tier to collect (1)\n"
+		"  --parallel <n>                 max requests in flight (64)\n"
+		"  --timeout <sec>                request timeout (10)\n"
+		"  --batch <rows>                 rows per DB transaction (1000)\n"
+		"  --once                         run one poll cycle and exit\n"
+		"  --rebuild-rollups              recalculate hourly/daily rollup tables from 'data' table and exit\n"
+		"  --verbose                      log each poll\n",
+		name);
+}
+
+bool parse_args(int argc, char **argv, options &o) {
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		auto		val = [&]() -> const char * { return i + 1 < argc ? argv[++i] : nullptr; };
+		const char *v	= nullptr;
+		if (a == "--once")
+			o.once = true;
+		else if (a == "--verbose")
+			o.verbose = true;
+		else if (a == "--rebuild-rollups")
+			o.rebuild = true;
+		else if (a == "--db" && (v = val()))
+			o.db = v;
+		else if (a == "--meter" && (v = val()))
+			o.meters.emplace_back(v);
+		else if (a == "--interval" && (v = val()))
+			o.interval = atoi(v);
+		else if (a == "--tier" && (v = val()))
+			o.tier = atoi(v);
+		else if (a == "--parallel" && (v = val()))
+			o.parallel = atoi(v);
+		else if (a == "--timeout" && (v = val()))
+			o.timeout = atoi(v);
+		else if (a == "--batch" && (v = val()))
+			o.batch = atoi(v);
+		else
+			return false;
+	}
+	return o.db && o.interval && o.parallel && o.timeout;
+}
+
+// 'host[:port]'
+void set_host(node &n, const std::string &hostport) {
+	size_t colon = hostport.rfind(':');
+	n.host		 = hostport.substr(0, colon);
+	if (colon != std::string::npos)
+		n.port = atoi(hostport.c_str() + colon + 1);
+}
+
+std::string request_path(const node &n, const options &o) {
+	if (!n.archive)
+		return "/getpmdata";
+
+	std::string path = "/archive.bin?tsid=" + std::to_string(o.tier);
+	// resume after the newest sample stored, all samples on the first poll
+	// firmware without resume support ignores 'after_seq' and replies with all samples, those are deduplicated below
+	if (n.seq_valid)
+		path += "&after_seq=" + std::to_string(n.last_seq);
+	return path;
+}
+
+// write new samples from an archive
+bool ingest_archive(node &n, const std::string &body, const options &o, DbSink &db) {
+	// Reader works in place and needs an aligned buffer
+	std::vector<uint64_t> buff((body.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+	memcpy(buff.data(), body.data(), body.size());
+	tsarchive::Reader a;
+	if (!a.open(buff.data(), body.size())) {
+		fprintf(stderr, "%s: bad archive: %s\n", n.host.c_str(), a.error().c_str());
+		return false;
+	}
+	int idx = a.find(o.tier);
+	if (idx < 0) {
+		fprintf(stderr, "%s: no tier %u in archive\n", n.host.c_str(), o.tier);
+		return false;
+	}
+
+	tsarchive::TierView t = a.tier(idx);
+	if (!t.size()) {
+		// nothing new, or node's sequence numbers went back behind the last one stored (restarted without history persistence),
+		// then fetch all samples on the next poll and match them by time
+		if (n.seq_valid && static_cast<int32_t>(t.header().first_seq - (n.last_seq + 1)) < 0)
+			n.seq_valid = false;
+		return true;
+	}
+
+	// node restarted without history persistence, sequence numbers start over, match by time
+	uint32_t after	= n.last_seq;
+	bool	 by_seq = n.seq_valid && static_cast<int32_t>(t.seq(t.size() - 1) - after) >= 0;
+	if (by_seq && static_cast<int32_t>(t.seq(0) - after) > 1)
+		n.gaps += t.seq(0) - after - 1;
+
+	for (uint32_t i = 0; i != t.size(); ++i) {
+		const tsarchive::record &r = t[i];
+		uint32_t ts = t.timestamp(i);
+		if (!(r.flags & TSA_VALID) || (by_seq ? static_cast<int32_t>(t.seq(i) - after) <= 0 : ts <= n.last_time))
+			continue;
+		if (ts < PZC_MIN_VALID_TIME) {
+			++n.unsynced;
+			continue;
+		}
+		int64_t energy = static_cast<int64_t>(r.energy) + a.header().energy_offset;
+		row		rw{n.devid, ts, t.value(r, tsarchive::field_t::voltage), t.value(r, tsarchive::field_t::current),
+				   t.value(r, tsarchive::field_t::power), static_cast<uint32_t>(energy > 0 ? energy : 0)};
+		// position is advanced before add(), it may commit the row right away
+		++n.rows;
+		n.last_seq	= t.seq(i);
+		n.last_time = ts;
+		if (!db.add(rw)) {
+			fprintf(stderr, "DB error: %s\n", db.error().c_str());
+			return false;
+		}
+	}
+	n.last_seq	= t.seq(t.size() - 1);
+	n.seq_valid = true;
+	return true;
+}
+
+// write a sample from /getpmdata reply 'U:220.3 I:0.51 P:112 W:95432'
+bool ingest_pmdata(node &n, const std::string &body, DbSink &db) {
+	row r{n.devid, static_cast<uint32_t>(time(nullptr)), 0, 0, 0, 0};
+	float w = -1;
+	if (sscanf(body.c_str(), "U:%f I:%f P:%f W:%f", &r.U, &r.I, &r.P, &w) != 4 || w < 0) {
+		fprintf(stderr, "%s: bad pmdata reply\n", n.host.c_str());
+		return false;
+	}
+	r.W = w;
+	++n.rows;
+	n.last_time = r.dtime;
+	if (!db.add(r)) {
+		fprintf(stderr, "DB error: %s\n", db.error().c_str());
+		return false;
+	}
+	return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+	options o;
+	if (!parse_args(argc, argv, o)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	DbSink db(o.batch);
+	if (!db.open(o.db)) {
+		fprintf(stderr, "%s: %s\n", o.db, db.error().c_str());
+		return EXIT_FAILURE;
+	}
+
+	if (o.rebuild) {
+		if (!db.rebuildRollups()) {
+			fprintf(stderr, "%s: %s\n", o.db, db.error().c_str());
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// fleet setup
+	std::deque<node> fleet;
+	for (const auto &m : o.meters) {
+		size_t comma = m.find(',');
+		if (comma == std::string::npos) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		fleet.emplace_back();
+		fleet.back().devid = atoi(m.c_str());
+		set_host(fleet.back(), m.substr(comma + 1));
+	}
+	if (o.meters.empty())
+		db.meters([&fleet](uint16_t id, const std::string &hostname) {
+			fleet.emplace_back();
+			fleet.back().devid = id;
+			set_host(fleet.back(), hostname);
+		});
+
+	for (auto &n : fleet) {
+		n.http.arg	= &n;
+		n.last_time = db.lastTime(n.devid);
+		n.commit();
+		if (!resolve(n.host, n.port, n.addr, n.alen))
+			fprintf(stderr, "%s: can't resolve, will retry\n", n.host.c_str());
+	}
+	if (fleet.empty()) {
+		fprintf(stderr, "No meters to poll\n");
+		return EXIT_FAILURE;
+	}
+
+	// node positions follow DB transactions, so samples are never skipped over a failed commit
+	db.onCommit([&fleet](bool committed) {
+		for (auto &n : fleet)
+			if (committed)
+				n.commit();
+			else
+				n.revert();
+	});
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return EXIT_FAILURE;
+	}
+
+	std::deque<node *>	queue;		// nodes waiting for a request slot
+	std::vector<node *> inflight;
+	int64_t				next_cycle = millis();
+	int64_t				cycle_start = 0;
+	uint64_t			cycle_rows = 0;
+	unsigned			cycles = 0;
+	epoll_event			events[PZC_MAX_EVENTS];
+
+	// request is done, ingest the reply
+	auto finished = [&](node &n) {
+		int64_t now = millis();
+		bool	ok	= n.http.state() == HttpGet::state_t::done && n.http.status() == 200;
+		if (ok)
+			ok = n.archive ? ingest_archive(n, n.http.body(), o, db) : ingest_pmdata(n, n.http.body(), db);
+		else if (n.archive && n.http.status() == 404) {
+			// older firmware, fall back to single samples and retry right away
+			n.archive = false;
+			queue.push_front(&n);
+			n.http.close();
+			return;
+		}
+		if (ok)
+			n.last_ok = now;
+		else {
+			++n.fails;
+			if (n.http.state() == HttpGet::state_t::failed || n.http.status() != 200)
+				fprintf(stderr, "%s: poll failed: %s\n", n.host.c_str(), n.http.status() ? ("HTTP " + std::to_string(n.http.status())).c_str() : n.http.error().c_str());
+		}
+		if (o.verbose)
+			printf("%s: devid %u, %s, %zu bytes, rows total %llu\n", n.host.c_str(), n.devid, n.archive ? "archive" : "pmdata",
+				n.http.body().size(), static_cast<unsigned long long>(n.rows));
+		n.http.close();
+	};
+
+	while (!stop) {
+		int64_t now = millis();
+
+		// start a new cycle, nodes still busy with a previous one are skipped
+		if (now >= next_cycle && queue.empty() && inflight.empty()) {
+			++cycles;
+			cycle_start = now;
+			cycle_rows	= db.getStats().rows;
+			for (auto &n : fleet)
+				queue.push_back(&n);
+			next_cycle += o.interval * 1000;
+			if (next_cycle <= now)
+				next_cycle = now + o.interval * 1000;	// fell behind, do not try to catch up
+		}
+
+		// fill request slots
+		while (!queue.empty() && inflight.size() < o.parallel) {
+			node &n = *queue.front();
+			queue.pop_front();
+			++n.polls;
+			if (!n.alen && !resolve(n.host, n.port, n.addr, n.alen)) {
+				++n.fails;
+				continue;
+			}
+			if (n.http.start(epfd, n.addr, n.alen, n.host, request_path(n, o), now + o.timeout * 1000))
+				inflight.push_back(&n);
+			else
+				finished(n);
+		}
+
+		// cycle is done, commit rows
+		if (queue.empty() && inflight.empty() && cycle_start) {
+			if (!db.flush())
+				fprintf(stderr, "DB error: %s, rows will be fetched again\n", db.error().c_str());
+			uint32_t failed = 0;
+			for (const auto &n : fleet)
+				failed += n.last_ok < cycle_start;
+			printf("cycle %u: %zu nodes, %u failed, %llu rows in %lld ms\n", cycles, fleet.size(), failed,
+				static_cast<unsigned long long>(db.getStats().rows - cycle_rows), static_cast<long long>(millis() - cycle_start));
+			fflush(stdout);
+			cycle_start = 0;
+			if (o.once)
+				break;
+			continue;
+		}
+
+		// wait for events till the nearest deadline
+		int64_t wake = queue.empty() && inflight.empty() ? next_cycle : now + 1000;
+		for (const node *n : inflight)
+			if (n->http.deadline() < wake)
+				wake = n->http.deadline();
+		int timeout = wake > now ? static_cast<int>(wake - now) : 0;
+
+		int nev = epoll_wait(epfd, events, PZC_MAX_EVENTS, timeout);
+		for (int i = 0; i < nev; ++i) {
+			HttpGet *h = static_cast<HttpGet *>(events[i].data.ptr);
+			h->onEvent(events[i].events);
+		}
+
+		// reap finished and timed out requests
+		now = millis();
+		for (size_t i = 0; i < inflight.size();) {
+			node &n = *inflight[i];
+			n.http.expire(now);
+			if (n.http.busy()) {
+				++i;
+				continue;
+			}
+			inflight[i] = inflight.back();
+			inflight.pop_back();
+			finished(n);
+		}
+	}
+
+	for (auto &n : fleet)
+		n.http.close();
+	close(epfd);
+	db.close();
+
+	const auto &st = db.getStats();
+	uint64_t	polls = 0, fails = 0, gaps = 0, unsynced = 0;
+	for (const auto &n : fleet) {
+		polls += n.polls;
+		fails += n.fails;
+		gaps += n.gaps;
+		unsynced += n.unsynced;
+	}
+	printf("total: %u cycles, %llu polls, %llu failed, %llu rows, %llu rollup upserts, %u commits (%llu us avg), %llu samples missed, %llu unsynced, %u DB errors\n",
+		cycles, static_cast<unsigned long long>(polls), static_cast<unsigned long long>(fails), static_cast<unsigned long long>(st.rows),
+		static_cast<unsigned long long>(st.buckets), st.commits, static_cast<unsigned long long>(st.commits ? st.commit_us / st.commits : 0), static_cast<unsigned long long>(gaps),
+		static_cast<unsigned long long>(unsynced), st.errors);
+	return EXIT_SUCCESS;
+}
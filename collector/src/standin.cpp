@@ -0,0 +1,354 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+/*
+	Stand-in espem HTTP server serving recorded responses, Linux only
+	Used to run pzcollect against a fleet of fake nodes without the hardware
+
+	Listens on a range of ports, each port plays a separate node. Request path without query string
+	is mapped to a file in recordings dir - '<dir>/<port>/<name>' if it exists, otherwise '<dir>/<name>',
+	i.e. 'curl -o rec/archive.bin http://espem/archive.bin' and 'curl -o rec/getpmdata http://espem/getpmdata'.
+	Missing files are replied with 404, like an older firmware would do. Files are read on each request,
+	so recordings could be swapped while collector is running.
+	Recorded TimeSeries archives are cut like the node does it - 'tsid' leaves only the requested tier,
+	'after_seq' leaves only the records following that sequence number.
+
+	usage: pzstandin --dir <recordings> [--port 8080] [--count 1] [--latency <ms>] [--chunked]
+*/
+
+#include "httpc.hpp"
+#include "tsarchive.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STANDIN_MAX_EVENTS	64
+#define STANDIN_MAX_REQUEST	8192
+
+using namespace pzcollect;
+
+namespace {
+
+struct options {
+	std::string dir;
+	unsigned	port	= 8080;
+	unsigned	count	= 1;
+	unsigned	latency = 0;		// reply delay, ms
+	bool		chunked = false;	// send body with chunked transfer encoding
+};
+
+struct conn {
+	int			fd;
+	uint16_t	port;		// local port, i.e. node
+	std::string in;
+	std::string out;
+	size_t		sent{0};
+	int64_t		reply_at{0};	// 0 - request is not complete yet
+};
+
+volatile sig_atomic_t stop = 0;
+
+void onsignal(int) { stop = 1; }
+
+bool readfile(const std::string &path, std::string &data) {
+	struct stat st;
+	if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+		return false;
+	std::ifstream f(path, std::ios::binary);
+	std::ostringstream ss;
+	ss << f.rdbuf();
+	data = ss.str();
+	return static_cast<bool>(f);
+}
+
+// numeric query parameter, @return false if it is missing
+bool qparam(const std::string &query, const char *name, uint32_t &val) {
+	std::string key = std::string(name) + '=';
+	for (size_t pos = 0; pos < query.size();) {
+		size_t end = query.find('&', pos);
+		if (end == std::string::npos)
+			end = query.size();
+		if (!query.compare(pos, key.size(), key)) {
+			val = strtoul(query.c_str() + pos + key.size(), nullptr, 10);
+			return true;
+		}
+		pos = end + 1;
+	}
+	return false;
+}
+
+/**
+ * @brief cut recorded archive to the tier and sequence range requested
+ * follows device side tsarchive::Writer::addAfter() - if 'after_seq' sample is not in the tier anymore, records start from the oldest one,
+ * if it is ahead of the tier, there are no records and first_seq is the sequence number of the next sample
+ * @return false if data is not an archive
+ */
+bool cut_archive(std::string &data, const std::string &query) {
+	using namespace tsarchive;
+	file_hdr fh;
+	if (data.size() < sizeof(fh))
+		return false;
+	memcpy(&fh, data.data(), sizeof(fh));
+	if (fh.magic != TSA_MAGIC || data.size() < sizeof(fh) + fh.ntiers * sizeof(tier_hdr))
+		return false;
+
+	uint32_t tsid = 0, after = 0;
+	bool	 by_id = qparam(query, "tsid", tsid), by_seq = qparam(query, "after_seq", after);
+
+	std::vector<tier_hdr> tiers;
+	std::vector<uint64_t> from;		// source offsets of the records
+	for (unsigned i = 0; i != fh.ntiers; ++i) {
+		tier_hdr t;
+		memcpy(&t, data.data() + sizeof(fh) + i * sizeof(tier_hdr), sizeof(t));
+		if (by_id && t.id != tsid)
+			continue;
+		if (t.offset + static_cast<uint64_t>(t.count) * sizeof(record) > data.size())
+			return false;
+		uint64_t src = t.offset;
+		if (by_seq) {
+			uint32_t first = after + 1, next = t.first_seq + t.count;
+			if (static_cast<int32_t>(first - next) >= 0) {
+				t.first_seq = next;
+				t.base_time += t.count * t.interval;
+				t.count = 0;
+			} else if (static_cast<int32_t>(first - t.first_seq) > 0) {
+				uint32_t skip = first - t.first_seq;
+				t.first_seq = first;
+				t.base_time += skip * t.interval;
+				t.count -= skip;
+				src += static_cast<uint64_t>(skip) * sizeof(record);
+			}
+		}
+		tiers.push_back(t);
+		from.push_back(src);
+	}
+
+	fh.ntiers = tiers.size();
+	uint64_t	offset = data_offset(fh.ntiers);
+	std::string out(offset, '\0');
+	for (size_t i = 0; i != tiers.size(); ++i) {
+		tiers[i].offset = offset;
+		out.resize(offset);
+		out.append(data, from[i], static_cast<size_t>(tiers[i].count) * sizeof(record));
+		offset = next_offset(offset, tiers[i].count);
+		memcpy(&out[sizeof(fh) + i * sizeof(tier_hdr)], &tiers[i], sizeof(tier_hdr));
+	}
+	out.resize(offset);
+	fh.size = out.size();
+	memcpy(&out[0], &fh, sizeof(fh));
+	data.swap(out);
+	return true;
+}
+
+std::string mkreply(const options &o, uint16_t port, const std::string &request) {
+	// 'GET /archive.bin?tsid=1 HTTP/1.1'
+	std::string name, query;
+	size_t		sp = request.find(' ');
+	if (sp != std::string::npos) {
+		size_t end = request.find_first_of("? ", sp + 1);
+		name	   = request.substr(sp + 1, end - sp - 1);
+		if (end != std::string::npos && request[end] == '?')
+			query = request.substr(end + 1, request.find(' ', end) - end - 1);
+	}
+	while (!name.empty() && name[0] == '/')
+		name.erase(0, 1);
+
+	std::string body;
+	bool		found = !name.empty() && name.find("..") == std::string::npos &&
+				 (readfile(o.dir + '/' + std::to_string(port) + '/' + name, body) || readfile(o.dir + '/' + name, body));
+	if (!found)
+		body = "Not found";
+	else if (!query.empty())
+		cut_archive(body, query);
+
+	std::string r = found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n";
+	r += "Content-Type: application/octet-stream\r\nConnection: close\r\n";
+	if (o.chunked && found) {
+		r += "Transfer-Encoding: chunked\r\n\r\n";
+		// split in MSS-sized chunks like AsyncWebServer does
+		for (size_t pos = 0; pos < body.size(); pos += 1436) {
+			size_t len = std::min<size_t>(1436, body.size() - pos);
+			char   hdr[16];
+			snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+			r += hdr;
+			r.append(body, pos, len);
+			r += "\r\n";
+		}
+		r += "0\r\n\r\n";
+	} else {
+		r += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+		r += body;
+	}
+	return r;
+}
+
+bool parse_args(int argc, char **argv, options &o) {
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (a == "--chunked")
+			o.chunked = true;
+		else if (!v)
+			return false;
+		else if (a == "--dir")
+			o.dir = argv[++i];
+		else if (a == "--port")
+			o.port = atoi(argv[++i]);
+		else if (a == "--count")
+			o.count = atoi(argv[++i]);
+		else if (a == "--latency")
+			o.latency = atoi(argv[++i]);
+		else
+			return false;
+	}
+	return !o.dir.empty() && o.count && o.port + o.count <= 65536;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+	options o;
+	if (!parse_args(argc, argv, o)) {
+		fprintf(stderr, "usage: %s --dir <recordings> [--port 8080] [--count 1] [--latency <ms>] [--chunked]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	// listening sockets are registered with their port number, connections - with a pointer
+	std::map<int, uint16_t> listeners;
+	for (unsigned p = o.port; p != o.port + o.count; ++p) {
+		int s	= socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in a{};
+		a.sin_family	  = AF_INET;
+		a.sin_port		  = htons(p);
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(s, reinterpret_cast<sockaddr *>(&a), sizeof(a)) || listen(s, 128)) {
+			fprintf(stderr, "port %u: %s\n", p, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		listeners[s] = p;
+		epoll_event ev{};
+		ev.events  = EPOLLIN;
+		ev.data.fd = s;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+	}
+	fprintf(stderr, "serving '%s' on 127.0.0.1:%u..%u\n", o.dir.c_str(), o.port, o.port + o.count - 1);
+
+	std::map<int, conn> conns;
+	uint64_t			served = 0;
+	epoll_event			events[STANDIN_MAX_EVENTS];
+
+	auto drop = [&conns](int fd) {
+		close(fd);
+		conns.erase(fd);
+	};
+
+	// try to send reply, @return true when done
+	auto flush = [&](conn &c) {
+		while (c.sent < c.out.size()) {
+			ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+			if (n < 0)
+				return errno != EAGAIN && errno != EWOULDBLOCK;
+			c.sent += n;
+		}
+		return true;
+	};
+
+	while (!stop) {
+		// replies that are due
+		int64_t now	 = millis();
+		int64_t wake = -1;
+		for (auto i = conns.begin(); i != conns.end();) {
+			conn &c = i->second;
+			++i;
+			if (!c.reply_at)
+				continue;
+			if (c.reply_at > now) {
+				if (wake < 0 || c.reply_at < wake)
+					wake = c.reply_at;
+				continue;
+			}
+			if (c.out.empty()) {
+				c.out = mkreply(o, c.port, c.in);
+				++served;
+				epoll_event ev{};
+				ev.events  = EPOLLOUT;
+				ev.data.fd = c.fd;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+			}
+			if (flush(c))
+				drop(c.fd);
+		}
+
+		int nev = epoll_wait(epfd, events, STANDIN_MAX_EVENTS, wake < 0 ? 1000 : static_cast<int>(wake - now));
+		for (int i = 0; i < nev; ++i) {
+			int	 fd = events[i].data.fd;
+			auto l	= listeners.find(fd);
+			if (l != listeners.end()) {
+				int c;
+				while ((c = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					conns[c] = conn{c, l->second, {}, {}, 0, 0};
+					epoll_event ev{};
+					ev.events  = EPOLLIN;
+					ev.data.fd = c;
+					epoll_ctl(epfd, EPOLL_CTL_ADD, c, &ev);
+				}
+				continue;
+			}
+
+			auto it = conns.find(fd);
+			if (it == conns.end())
+				continue;
+			conn &c = it->second;
+			if (c.reply_at) {	// sending
+				if (!c.out.empty() && flush(c))
+					drop(fd);
+				continue;
+			}
+			char	buff[1024];
+			ssize_t n;
+			while ((n = recv(fd, buff, sizeof(buff), 0)) > 0)
+				c.in.append(buff, n);
+			if (!n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || c.in.size() > STANDIN_MAX_REQUEST) {
+				drop(fd);
+				continue;
+			}
+			if (c.in.find("\r\n\r\n") != std::string::npos) {
+				c.reply_at = millis() + o.latency;
+				epoll_event ev{};
+				ev.events  = 0;		// wait for the reply time
+				ev.data.fd = fd;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+			}
+		}
+	}
+
+	for (auto &c : conns)
+		close(c.first);
+	for (auto &l : listeners)
+		close(l.first);
+	close(epfd);
+	fprintf(stderr, "served %llu requests\n", static_cast<unsigned long long>(served));
+	return EXIT_SUCCESS;
+}
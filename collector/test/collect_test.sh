@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# ESPEM - ESP Energy monitor
+# pzcollect test against pzstandin nodes serving recorded responses from test/rec (made by mkrec.py)
+#  - node1, node2 serve /archive.bin, node3 is an older firmware serving /getpmdata only
+#  - a single '--once' cycle stores every valid sample of tier 1 once, rollups match raw rows
+#  - a restarted collector skips samples already stored, then fetches only new ones with 'after_seq'
+#    once node1 recording advances by 30 samples, node2 replies with an empty tier
+#  - a cycle whose commit fails is rolled back, its samples are fetched again on the next one
+#
+# usage: collect_test.sh <pzcollect> <pzstandin> <collector source dir>, needs sqlite3 CLI
+
+COLLECT=$1
+STANDIN=$2
+SRC=$3
+REC=$SRC/test/rec
+TMP=$(mktemp -d)
+DB=$TMP/pzem.sqlite
+PORT=$((20000 + $$ % 20000))
+PIDS=
+FAILED=0
+
+cleanup() {
+	kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+check() {
+	if [ "$2" != "$3" ]; then
+		echo "FAIL: $1: expected $3, got $2"
+		FAILED=1
+	else
+		echo "ok: $1: $2"
+	fi
+}
+
+sql() { sqlite3 "$DB" "$1"; }
+
+# wait for a line in a log, up to 10 s
+waitfor() {
+	for i in $(seq 100); do
+		grep -q "$2" "$1" && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+# leading 'DROP TABLE' statements fail on an empty DB
+sqlite3 "$DB" < "$SRC/../sql/pzem_sqlite.sql" 2>/dev/null
+sql "INSERT INTO meters VALUES (2, 'n2', '', ''), (3, 'n3', '', '')"
+
+cp -r "$REC/node1" "$TMP/node1"
+"$STANDIN" --dir "$TMP/node1" --port $PORT 2>/dev/null &
+PIDS="$PIDS $!"
+"$STANDIN" --dir "$REC/node2" --port $((PORT + 1)) 2>/dev/null &
+PIDS="$PIDS $!"
+"$STANDIN" --dir "$REC/node3" --port $((PORT + 2)) 2>/dev/null &
+PIDS="$PIDS $!"
+sleep 0.5
+
+METERS="--meter 1,127.0.0.1:$PORT --meter 2,127.0.0.1:$((PORT + 1)) --meter 3,127.0.0.1:$((PORT + 2))"
+
+# full archives in one cycle
+"$COLLECT" --db "$DB" --once $METERS > "$TMP/once.log" 2>&1
+check "node1 rows" "$(sql 'SELECT COUNT(*) FROM data WHERE devid=1')" 115
+check "node2 rows" "$(sql 'SELECT COUNT(*) FROM data WHERE devid=2')" 60
+check "node3 rows" "$(sql 'SELECT COUNT(*) FROM data WHERE devid=3')" 1
+check "node2 energy offset" "$(sql 'SELECT MIN(W) FROM data WHERE devid=2')" 105250
+check "hourly rollup samples" "$(sql 'SELECT SUM(cnt) FROM data_hourly')" 176
+check "daily rollup samples" "$(sql 'SELECT SUM(cnt) FROM data_daily')" 176
+
+# restarted collector, samples already stored are skipped, then resumes by sequence number
+"$COLLECT" --db "$DB" --interval 2 --verbose $METERS > "$TMP/run.log" 2>&1 &
+CPID=$!
+PIDS="$PIDS $CPID"
+waitfor "$TMP/run.log" "^cycle 1:" || echo "FAIL: no cycle 1"
+# rollups can't be written, so the cycle's transaction fails
+sql "CREATE TRIGGER fail_hourly_i BEFORE INSERT ON data_hourly BEGIN SELECT RAISE(ABORT, 'test'); END;
+	CREATE TRIGGER fail_hourly_u BEFORE UPDATE ON data_hourly BEGIN SELECT RAISE(ABORT, 'test'); END;"
+cp "$REC/node1-next/archive.bin" "$TMP/node1/archive.bin"
+waitfor "$TMP/run.log" "^cycle 2:" || echo "FAIL: no cycle 2"
+sql "DROP TRIGGER fail_hourly_i; DROP TRIGGER fail_hourly_u;"
+waitfor "$TMP/run.log" "^cycle 3:" || echo "FAIL: no cycle 3"
+kill $CPID
+wait $CPID 2>/dev/null
+check "cycle 1 rows" "$(sed -n 's/^cycle 1: .* \([0-9]*\) rows.*/\1/p' "$TMP/run.log")" 1
+check "cycle 2 rows" "$(sed -n 's/^cycle 2: .* \([0-9]*\) rows.*/\1/p' "$TMP/run.log")" 0
+check "cycle 2 DB error" "$(grep -c 'rows will be fetched again' "$TMP/run.log")" 1
+# node1 samples of the failed cycle again, node3 sample of the failed cycle is lost, it serves only the current one
+check "cycle 3 rows" "$(sed -n 's/^cycle 3: .* \([0-9]*\) rows.*/\1/p' "$TMP/run.log")" 31
+check "node1 rows" "$(sql 'SELECT COUNT(*) FROM data WHERE devid=1')" 145
+check "node1 duplicates" "$(sql 'SELECT COUNT(*) - COUNT(DISTINCT dtime) FROM data WHERE devid=1')" 0
+# tier 1 only, no records after the last one stored: headers only
+check "rollups match rows" "$(sql 'SELECT (SELECT SUM(cnt) FROM data_hourly) - (SELECT COUNT(*) FROM data)')" 0
+check "node2 resumed reply, bytes" "$(grep -c 'devid 2, archive, 104 bytes' "$TMP/run.log")" 2
+
+[ $FAILED = 0 ] || { cat "$TMP/once.log" "$TMP/run.log"; exit 1; }
+echo PASSED
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+#
+# ESPEM - ESP Energy monitor
+# generates recorded node responses for collector test, see collect_test.sh
+# archives follow lib_pzem-edl_main/src/tsarchive.h layout, samples are derived from sequence numbers,
+# so overlapping parts of 'node1' and 'node1-next' recordings are identical like on a live node
+#
+# usage: mkrec.py <rec dir>
+
+import os
+import struct
+import sys
+
+TSA_MAGIC = 0x41545a50
+TSA_VALID = 0x0001
+PZEM004V3 = 1                                   # pzmbus::pzmodel_t
+BASE_TIME = 1700000000
+SCALES = (0.1, 0.001, 0.1, 1.0, 0.1, 0.01)     # PZEM004 units: dV, mA, dW, Wh, dHz, %
+
+
+def record(seq, valid):
+    # current, power, energy, voltage, freq, pf, flags
+    return struct.pack('<IIIHHHH', 500 + seq % 50, 1100 + seq % 100, 100000 + seq // 4, 2300 + seq % 20, 500, 95,
+                       TSA_VALID if valid else 0)
+
+
+def archive(tiers, energy_offset=0):
+    """tiers - list of (id, interval, first_seq, count, capacity, invalid seqs)"""
+    align = lambda n: (n + 7) // 8 * 8
+    offset = align(32 + 72 * len(tiers))
+    hdrs, data = b'', b''
+    for tid, interval, first, count, cap, invalid in tiers:
+        data += b'\0' * (offset - 32 - 72 * len(tiers) - len(data))
+        descr = ('tier %u' % tid).encode()
+        hdrs += struct.pack('<B3xIIIIIQ6f16s', tid, interval, BASE_TIME + first * interval, first, count, cap, offset, *SCALES, descr)
+        data += b''.join(record(s, s not in invalid) for s in range(first, first + count))
+        offset = align(offset + count * 20)
+    data += b'\0' * (offset - 32 - 72 * len(tiers) - len(data))
+    fh = struct.pack('<IHHHHBBHiIQ', TSA_MAGIC, 1, 32, 72, 20, PZEM004V3, len(tiers), 0, energy_offset, BASE_TIME + 200, offset)
+    return fh + hdrs + data
+
+
+def write(path, data):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb') as f:
+        f.write(data)
+
+
+rec = sys.argv[1] if len(sys.argv) > 1 else 'rec'
+# node1: tier 1 with 5 empty records and tier 2, then the same node 30 samples later
+write(os.path.join(rec, 'node1', 'archive.bin'), archive([(1, 1, 1, 120, 120, {10, 11, 12, 50, 90}), (2, 60, 1, 2, 60, set())]))
+write(os.path.join(rec, 'node1-next', 'archive.bin'), archive([(1, 1, 31, 120, 120, {50, 90}), (2, 60, 1, 2, 60, set())]))
+# node2: two tiers, energy offset
+write(os.path.join(rec, 'node2', 'archive.bin'), archive([(1, 1, 1001, 60, 120, set()), (2, 60, 17, 1, 60, set())], 5000))
+# node3: older firmware without archives
+write(os.path.join(rec, 'node3', 'getpmdata'), b'U:220.3 I:0.51 P:112 W:95432')
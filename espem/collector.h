@@ -0,0 +1,122 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// TimeSeries collector task, decouples samples ingestion from UART RX task
+
+#pragma once
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "spscring.hpp"
+#include "trace.hpp"
+
+#ifndef COLLECTOR_QUEUE_LEN
+	#define COLLECTOR_QUEUE_LEN		16			// samples ring length, must be a power of 2
+#endif
+#ifndef COLLECTOR_BATCH
+	#define COLLECTOR_BATCH			4			// max number of samples taken from the ring in one go
+#endif
+#define COLLECTOR_TASK_PRIO			2			// must be lower than UART RX task priority
+#define COLLECTOR_TASK_STACK		4096
+#define COLLECTOR_TASK_NAME			"TS_COLL"
+
+/**
+ * @brief hands samples from a producer (bus subscriber) over to a dedicated task that feeds TimeSeries container
+ * Producer only copies a sample into a lock-free ring and wakes up collector task,
+ * so RX latency does not depend on a number of TimeSeries tiers and their averaging functions.
+ * If collector falls behind and the ring is full, new samples are dropped and counted.
+ *
+ * @tparam T - metrics struct
+ * @tparam C - TimeSeries container type, must provide push(const T&, uint32_t)
+ */
+template <class T, class C>
+class TSCollector {
+	struct sample {
+		T			m;
+		uint32_t	t;
+	};
+
+	C &ds;
+	SPSCRing<sample, COLLECTOR_QUEUE_LEN> ring;
+	volatile TaskHandle_t t_coll = nullptr;		// reset by the task itself on exit
+	std::atomic<bool> quit{false};
+
+	static void task(void *arg){
+		static_cast<TSCollector*>(arg)->run();
+	}
+
+	void run(){
+		sample batch[COLLECTOR_BATCH];
+		while (!quit){
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			size_t n;
+			while (!quit && (n = ring.pop(batch, COLLECTOR_BATCH))){
+				for (size_t i = 0; i != n; ++i){
+					PZTRACE_BEGIN(ts_push, 0);
+					ds.push(batch[i].m, batch[i].t);
+					PZTRACE_END(ts_push, 0);
+				}
+			}
+		}
+		// signal stop() that we are done with the container
+		t_coll = nullptr;
+		vTaskDelete(NULL);
+	}
+
+   public:
+	explicit TSCollector(C &container) : ds(container) {}
+	~TSCollector(){ stop(); }
+
+	// Copy semantics : forbidden
+	TSCollector(const TSCollector&) = delete;
+	TSCollector& operator=(const TSCollector&) = delete;
+
+	// start collector task
+	bool start(){
+		if (t_coll)
+			return true;
+		TaskHandle_t h = nullptr;
+		if (xTaskCreate(TSCollector::task, COLLECTOR_TASK_NAME, COLLECTOR_TASK_STACK, this, COLLECTOR_TASK_PRIO, &h) != pdPASS)
+			return false;
+		t_coll = h;
+		return true;
+	}
+
+	// stop collector task, waits for the task to finish pending push, samples left in the ring are discarded
+	void stop(){
+		if (!t_coll)
+			return;
+		quit = true;
+		xTaskNotifyGive(t_coll);
+		while (t_coll)
+			vTaskDelay(1);
+		quit = false;
+		sample s;
+		while (ring.pop(s)) {}
+	}
+
+	bool running() const { return t_coll; }
+
+	/**
+	 * @brief enqueue a sample for collection, never blocks
+	 * must be called from a single producer context (bus subscriber task),
+	 * producer must be stopped before stop() is called
+	 *
+	 * @return false - sample dropped, ring is full or collector is not running
+	 */
+	bool post(const T &m, uint32_t time){
+		TaskHandle_t h = t_coll;		// read once, task resets it on exit
+		if (!h || !ring.push(sample{m, time}))
+			return false;
+		xTaskNotifyGive(h);
+		return true;
+	}
+
+	SPSCRing_stats getStats() const { return ring.getStats(); }
+
+	// samples waiting in the ring
+	size_t pending() const { return ring.size(); }
+};
@@ -0,0 +1,123 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Transport and device statistics renderer for /stats endpoint
+
+#pragma once
+#include <ArduinoJson.h>
+#include <esp_timer.h>
+#include "pzem_modbus.hpp"
+#include "msgq.hpp"
+
+/**
+ * @brief put histogram into json object as {"le":[bounds...],"cnt":[counters...],"p50":x,"p90":x,"p99":x}
+ * overflow bucket bound is reported as -1, so are the percentiles falling into it
+ */
+template <class H>
+void histogram_json(JsonObject obj, const H &h){
+	JsonArray le = obj["le"].to<JsonArray>();
+	JsonArray cnt = obj["cnt"].to<JsonArray>();
+	for (size_t i = 0; i != H::buckets(); ++i){
+		uint32_t b = H::bound(i);
+		if (b == UINT32_MAX)
+			le.add(-1);
+		else
+			le.add(b);
+		cnt.add(h.cnt[i]);
+	}
+	obj["total"] = h.total;
+	const unsigned pct[] = {50, 90, 99};
+	char key[4];
+	for (unsigned p : pct){
+		snprintf(key, sizeof(key), "p%u", p);
+		uint32_t v = h.percentile(p);
+		if (v == UINT32_MAX)
+			obj[key] = -1;
+		else
+			obj[key] = v;
+	}
+}
+
+/**
+ * @brief put PZEM device counters into json object
+ *
+ * @param s - device state
+ */
+inline void devstats_json(JsonObject obj, const pzmbus::state *s){
+	obj["polls"] = s->polls;
+	obj["replies"] = s->replies;
+	obj["timeouts"] = s->timeouts;
+	obj["errors"] = s->errors;
+	obj["stray"] = s->stray;
+	obj["err"] = static_cast<uint8_t>(s->err);
+	JsonObject exc = obj["exceptions"].to<JsonObject>();
+	exc["other"] = s->exceptions[0];
+	exc["func"] = s->exceptions[ERR_FUNC];
+	exc["addr"] = s->exceptions[ERR_ADDR];
+	exc["data"] = s->exceptions[ERR_DATA];
+	exc["slave"] = s->exceptions[ERR_SLAVE];
+	if (s->update_us)
+		obj["age"] = s->dataAge();
+	obj["stale"] = s->dataStale();
+	if (s->rtt_max_us){
+		JsonObject rtt = obj["rtt_us"].to<JsonObject>();
+		rtt["last"] = s->rtt_us;
+		rtt["min"] = s->rtt_min_us;
+		rtt["max"] = s->rtt_max_us;
+		rtt["jitter"] = s->jitter_us;
+	}
+	histogram_json(obj["rtt_ms"].to<JsonObject>(), s->rtt_hist);
+	histogram_json(obj["age_ms"].to<JsonObject>(), s->age_hist);
+}
+
+/**
+ * @brief put port transport counters into json object
+ */
+inline void portstats_json(JsonObject obj, const MsgQ_stats &st, uint32_t rx_stray){
+	obj["tx_frames"] = st.tx_frames;
+	obj["tx_drops"] = st.tx_drops;
+	obj["rx_frames"] = st.rx_frames;
+	obj["rx_crc_err"] = st.rx_crc_err;
+	obj["rx_ovf"] = st.rx_ovf;
+	obj["rx_errors"] = st.rx_errors;
+	obj["rx_drops"] = st.rx_drops;
+	obj["rx_timeouts"] = st.rx_timeouts;
+	obj["rx_stray"] = rx_stray;
+}
+
+/**
+ * @brief reply to /stats request with transport and device counters in json
+ * {"uptime":s, "ports":[{"id":1,...}], "devices":[{"id":1,"port":1,...}]}
+ *
+ * @param pz - PZEM object, PZ004/PZ003, could be nullptr
+ * @param q - PZEM's message queue, could be nullptr
+ * @param port_id - port id to report queue stats with
+ */
+template <class PZ>
+void serve_stats(AsyncWebServerRequest *request, const PZ *pz, const MsgQ *q, uint8_t port_id){
+	JsonDocument doc;
+	doc["uptime"] = esp_timer_get_time() / 1000000;
+
+	JsonArray ports = doc["ports"].to<JsonArray>();
+	if (q){
+		JsonObject p = ports.add<JsonObject>();
+		p["id"] = port_id;
+		// single device on a port, replies for other addresses are counted by the device itself
+		portstats_json(p, q->getStats(), pz ? pz->getState()->stray : 0);
+	}
+
+	JsonArray devs = doc["devices"].to<JsonArray>();
+	if (pz){
+		JsonObject d = devs.add<JsonObject>();
+		d["id"] = pz->id;
+		d["port"] = port_id;
+		devstats_json(d, pz->getState());
+	}
+
+	AsyncResponseStream *response = request->beginResponseStream(FPSTR(PGmimejson));
+	serializeJson(doc, *response);
+	request->send(response);
+}
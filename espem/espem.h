@@ -9,6 +9,8 @@
 // #include "main.h"
 #include "pzem_edl.hpp"
 #include "timeseries.hpp"
+#include "tspersist.hpp"
+#include "tsarchive.hpp"
 
 // Tasker object from EmbUI
 #include "ts.h"
@@ -18,6 +20,15 @@
 	#define DEFAULT_WS_UPD_RATE 2  // ws clients update rate, sec
 #endif
 
+// CPU core for UART RX/TX tasks, WiFi and LwIP run on core 0 of dual-core chips
+#ifndef ESPEM_UART_CORE
+	#if portNUM_PROCESSORS > 1
+		#define ESPEM_UART_CORE 1
+	#else
+		#define ESPEM_UART_CORE tskNO_AFFINITY
+	#endif
+#endif
+
 #define PZEM_ID		   1
 #define PORT_1_ID	   1
 
@@ -28,6 +39,13 @@
 #define TS_T3_CNT	   1000	 // default Tier 3 TimeSeries count
 #define TS_T3_INTERVAL 300	 // default Tier 3 TimeSeries interval (5 min)
 
+// TimeSeries history persistence on LittleFS
+#ifndef ESPEM_TS_PERSIST
+	#define ESPEM_TS_PERSIST 1
+#endif
+#define TSLOG_PATH	   "/littlefs/tslog"	 // log segment files prefix, LittleFS is mounted by EmbUI
+#define TSLOG_SEG_SIZE (96 * 1024)			 // log segment size, TSPERSIST_SEGMENTS files are used
+
 // Metrics collector state
 enum class mcstate_t {
 	MC_DISABLE = 0,
@@ -47,25 +65,43 @@ extern Scheduler ts;
 #define 		MAX_FREE_MEM_BLK		ESP.getMaxAllocHeap()
 #define 		PUB_JSSIZE			1024
 // sprintf template for json sampling data
-#define 		JSON_SMPL_LEN			85	 	// {"t":1615496537000,"U":229.50,"I":1.47,"P":1216,"W":5811338,"hz":50.0,"pF":0.64},
+#define 		JSON_SMPL_LEN			100	 	// ,{"t":1615496537000,"U":229.50,"I":1.47,"P":1216,"W":5811338,"hz":50.0,"pF":0.64}
 
 
 
 #if  defined(G_B00_PZEM_MODEL_PZEM003)
-    static const char	PGsmpljsontpl[] PROGMEM 	= "{\"t\":%u000,\"U\":%.2f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f},";
+    static const char	PGsmpljsontpl[] PROGMEM 	= ",{\"t\":%u000,\"U\":%.2f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f}";
     static const char	PGdatajsontpl[] PROGMEM 	= "{\"age\":%llu,\"U\":%.1f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f}";
 #elif defined(G_B00_PZEM_MODEL_PZEM004V3)
-    static const char	PGsmpljsontpl[] PROGMEM 	= "{\"t\":%u000,\"U\":%.2f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f,\"hz\":%.1f,\"pF\":%.2f},";
+    static const char	PGsmpljsontpl[] PROGMEM 	= ",{\"t\":%u000,\"U\":%.2f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f,\"hz\":%.1f,\"pF\":%.2f}";
     static const char	PGdatajsontpl[] PROGMEM 	= "{\"age\":%llu,\"U\":%.1f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f,\"hz\":%.1f,\"pF\":%.2f}";
 #endif
 
+#include "expcache.h"
+#include "zstream.h"
+
 // HTTP responce messages
 static const char       PGsmpld[]			= "Metrics collector disabled";
 static const char       PGdre[]				= "Data read error";
 static const char       PGacao[]		        = "Access-Control-Allow-Origin";
+static const char       PGaceh[]		        = "Access-Control-Expose-Headers";
+// TimeSeries export window, sequence numbers of the oldest sample retained, the first sample in response and the next sample to be pushed
+static const char       PGseqoldest[]		= "X-Seq-Oldest";
+static const char       PGseqfirst[]		= "X-Seq-First";
+static const char       PGseqnext[]			= "X-Seq-Next";
 static const char*      PGmimetxt			= "text/plain";
+static const char*      PGmimebin			= "application/octet-stream";
 // static const char* PGmimehtml = "text/html; charset=utf-8";
 
+#include "prometheus.h"
+#include "mbtcp.h"
+#include "devstats.h"
+#include "mqttbatch.h"
+#include "wspub.h"
+#include "collector.h"
+#include "evbus.hpp"
+#include "trace.hpp"
+
 /////////////////
 void block_menu(Interface *interf);
 
@@ -99,6 +135,31 @@ class DataStorage : public TSContainer<T> {
 	// energy offset
 	int32_t	nrg_offset{0};
 
+	// serialized samples cache for export requests
+	ExportCache xcache;
+
+#if ESPEM_TS_PERSIST
+	// tiers history log
+	TSPersist<T> tslog{*this, TSLOG_PATH, TSLOG_SEG_SIZE};
+#endif
+
+	/**
+	 * @brief print json object for a sample with sequence number 'seq'
+	 * object is prepended with a comma
+	 * @return size_t - number of chars printed
+	 */
+	size_t smpl_json(char *dst, size_t len, const TimeSeries<T> *ts, uint32_t seq);
+
+	/**
+	 * @brief samples window [first, last) to export, by 'scnt' and 'after_seq' request params
+	 * with 'after_seq' window starts with the sample following it or the oldest one retained and 'scnt' limits it from the start,
+	 * otherwise it's the last 'scnt' samples
+	 */
+	static void export_window(AsyncWebServerRequest *request, const TimeSeries<T> *ts, uint32_t &first, uint32_t &last);
+
+	// add sequence numbers headers for export window
+	static void seq_headers(AsyncWebServerResponse *response, const TimeSeries<T> *ts, uint32_t first);
+
    public:
 	
 	// @brief setup TimeSeries Container based on saved params in EmbUI config
@@ -112,15 +173,41 @@ class DataStorage : public TSContainer<T> {
 	
 	void setEnergyOffset(int32_t offset) {
 		nrg_offset = offset;
+		xcache.invalidate();
 	}
 
 	// @brief Get the Energy offset value
 	 // @return float
-	int32_t getEnergyOffset() {
+	int32_t getEnergyOffset() const {
 		return nrg_offset;
 	}
 
+	// @brief destroy all TimeSeries and drop export cache
+	void purge() {
+		xcache.purge();
+#if ESPEM_TS_PERSIST
+		tslog.end();
+#endif
+		TSContainer<T>::purge();
+	}
+
+	// @brief push sample to all tiers, sealed blocks are appended to the history log
+	void push(const T& val, uint32_t time) {
+		TSContainer<T>::push(val, time);
+#if ESPEM_TS_PERSIST
+		tslog.sync();
+#endif
+	}
+
+	// @brief export cache memory usage, bytes
+	size_t getCacheSize() const {
+		return xcache.size();
+	}
+
 	void wsamples(AsyncWebServerRequest *request);
+
+	// binary archive of TimeSeries tiers, see tsarchive.h for the file format
+	void warchive(AsyncWebServerRequest *request);
 };
 
 template <class T>
@@ -159,6 +246,13 @@ void DataStorage<T>::reset() {
 	tsids.push_back(a);
 	// LOG(printf, "Add TS: %d\n", a);
 
+#if ESPEM_TS_PERSIST
+	// load tiers history saved before reboot
+	tslog.begin();
+	LOG(printf, "TS log: %s, restored %u samples in %u us, damaged records: %u\n", tslog.active() ? "ok" : "failed"
+		, tslog.getStats().restored, tslog.getStats().restore_us, tslog.getStats().bad_records);
+#endif
+
 	LOG(println, "Setup TimeSeries DB:");
 	LOG_CALL(
 		for (auto i : tsids) {
@@ -213,6 +307,13 @@ void DataStorage<pz004::metrics>::reset() {
 	tsids.push_back(a);
 	// LOG(printf, "Add TS: %d\n", a);
 
+#if ESPEM_TS_PERSIST
+	// load tiers history saved before reboot
+	tslog.begin();
+	LOG(printf, "TS log: %s, restored %u samples in %u us, damaged records: %u\n", tslog.active() ? "ok" : "failed"
+		, tslog.getStats().restored, tslog.getStats().restore_us, tslog.getStats().bad_records);
+#endif
+
 	LOG(println, "Setup TimeSeries DB:");
 	LOG_CALL(
 		for (auto i : tsids) {
@@ -234,53 +335,71 @@ void DataStorage<pz004::metrics>::reset() {
 
 
 template <class T>
-////// return json-formatted response for in-RAM sampled data
-void DataStorage<T>::wsamples(AsyncWebServerRequest *request) {
-    uint8_t id = 1;	 // default ts id
-
-    if (request->hasParam("tsid")) {
-	const AsyncWebParameter *p = request->getParam("tsid");
-	id = p->value().toInt();
-    }
-
-    // check if there is any sampled data
-    if (!this->getTSsize(id)) {
-	request->send(503, PGmimejson, "[]");
-	return;
-    }
+size_t DataStorage<T>::smpl_json(char *dst, size_t len, const TimeSeries<T> *ts, uint32_t seq) {
+	const T *p = ts->at(seq - (ts->getSeq() - ts->getSize()));
+	if (!p) {
+		LOG(println, "SMLP pointer is null");
+		return 0;
+	}
+	// obtain a copy of a struct (.asFloat() member method crashes for dereferenced obj - TODO: investigate)
+	T m = *p;
+
+	int n = snprintf(dst, len, PGsmpljsontpl
+				, ts->getTstamp() - (ts->getSeq() - seq) * ts->getInterval()	// timestamp
+				, m.asFloat(meter_t::vol)
+				, m.asFloat(meter_t::cur)
+				, m.asFloat(meter_t::pwr)
+				, m.asFloat(meter_t::enrg) + nrg_offset
+				#ifdef G_B00_PZEM_MODEL_PZEM004V3
+				, m.asFloat(meter_t::frq)
+				, m.asFloat(meter_t::pf)
+				#endif
+		);
 
-	// json response maybe pretty large and needs too much of a precious ram to store it in a temp 'string'
-	// So I'm going to generate it on-the-fly and stream to client in chunks
+	if (n < 0)
+		return 0;
+	return static_cast<size_t>(n) < len ? n : len - 1;
+}
 
-	size_t cnt = 0;	 // cnt - return last 'cnt' samples, 0 - all samples
+template <class T>
+////// return json-formatted response for in-RAM sampled data
+void DataStorage<T>::wsamples(AsyncWebServerRequest *request) {
+	uint8_t id = 1;	 // default ts id
 
-	if (request->hasParam(C_scnt)) {
-		const AsyncWebParameter *p = request->getParam(C_scnt);
-		if (!p->value().isEmpty())
-			cnt = p->value().toInt();
+	if (request->hasParam("tsid")) {
+		const AsyncWebParameter *p = request->getParam("tsid");
+		id = p->value().toInt();
 	}
 
 	const auto ts = this->getTS(id);
-	if (!ts){
+
+	// check if there is any sampled data, resuming client gets an empty array and sequence numbers
+	if (!ts || (!ts->getSize() && !request->hasParam(C_after_seq))) {
 		request->send(503, PGmimejson, "[]");
+		return;
 	}
-	auto iter = ts->cbegin();  // get const iterator
 
-	// set number of samples to send in responce
-	if (cnt > 0 && cnt < ts->getSize()){
-		iter += ts->getSize() - cnt;  // offset iterator to the last cnt elements
-	}
+	// json response maybe pretty large and needs too much of a precious ram to store it in a temp 'string'
+	// So I'm going to generate it on-the-fly and stream to client in chunks
 
-	LOG(printf, "TimeSeries buffer has %d items, scntr: %d\n", ts->getSize(), cnt);
+	// window of samples to send in responce, [first, last) seq numbers
+	uint32_t first, last;
+	export_window(request, ts, first, last);
 
-	AsyncWebServerResponse *response = request->beginChunkedResponse(FPSTR(PGmimejson),
-		[this, iter, ts](uint8_t *buffer, size_t buffsize, size_t index) mutable -> size_t {
-			// If provided bufer is not large enough to fit 1 sample chunk, than I'm just sending
-			// an empty white space char (allowed json symbol) and wait for the next buffer
-			if (buffsize < JSON_SMPL_LEN) {
-				buffer[0] = 0x20;	// ASCII 'white space'
-				return 1;
-			}
+	LOG(printf, "TimeSeries buffer has %d items, sending seq %u..%u\n", ts->getSize(), first, last);
+	const uint32_t wfirst = first;
+
+	// chunk that is being sent and it's offset
+	std::shared_ptr<const ExpChunk> chunk;
+	size_t coff = 0;
+	bool   head = true;	 // no samples sent yet
+	bool   done = false;	 // json array is closed
+
+	// response is compressed on-the-fly if client accepts it
+	AsyncWebServerResponse *response = beginZChunkedResponse(request, FPSTR(PGmimejson),
+		[this, ts, first, last, chunk, coff, head, done](uint8_t *buffer, size_t buffsize, size_t index) mutable -> size_t {
+			if (done)
+				return 0;
 
 			size_t len = 0;
 
@@ -289,132 +408,146 @@ void DataStorage<T>::wsamples(AsyncWebServerRequest *request) {
 				++len;
 			}
 
-			// prepare a chunk of sampled data wrapped in json
-			while (len < (buffsize - JSON_SMPL_LEN) && iter != ts->cend()) {
-				if (iter.operator->() != nullptr) {
-					// obtain a copy of a struct (.asFloat() member method crashes for dereferenced obj - TODO: investigate)
-					T m = *iter.operator->();
-
-					len += sprintf((char *)buffer + len, PGsmpljsontpl
-								, ts->getTstamp() - (ts->cend() - iter) * ts->getInterval()	// timestamp
-								, m.asFloat(meter_t::vol)
-								, m.asFloat(meter_t::cur)
-								, m.asFloat(meter_t::pwr)
-								, m.asFloat(meter_t::enrg) + nrg_offset
-						                #ifdef G_B00_PZEM_MODEL_PZEM004V3
-								    , m.asFloat(meter_t::frq)
-								    , m.asFloat(meter_t::pf)
-						                #endif
-						);
-				} else {
-					LOG(println, "SMLP pointer is null");
+			while (len < buffsize) {
+				// copy cached chunk data first
+				if (chunk) {
+					size_t n = std::min(chunk->len - coff, buffsize - len);
+					memcpy(buffer + len, chunk->data.get() + coff, n);
+					len += n;
+					coff += n;
+					if (coff == chunk->len)
+						chunk.reset();
+					continue;
+				}
+
+				// samples could be overwritten by new data while client is slowly reading, skip those
+				uint32_t oldest = ts->getSeq() - ts->getSize();
+				if (static_cast<int32_t>(first - oldest) < 0)
+					first = oldest;
+
+				if (static_cast<int32_t>(last - first) <= 0) {
+					buffer[len++] = 0x5d;	// close json array with ASCII ']'
+					done = true;
+					break;
+				}
+
+				// a whole chunk of samples, excluding the newest one, won't change anymore and could be taken from cache
+				if (!(first % EXPCACHE_CHUNK_SMPLS) && last - first > EXPCACHE_CHUNK_SMPLS) {
+					chunk = xcache.get(ts->id, expfmt_t::json, first, JSON_SMPL_LEN,
+						[this, ts](char *dst, size_t len, uint32_t seq) { return smpl_json(dst, len, ts, seq); });
+					if (chunk) {
+						coff = head;	// skip leading comma
+						head = false;
+						first += EXPCACHE_CHUNK_SMPLS;
+						continue;
+					}
 				}
 
-				if (++iter == ts->cend())
-					buffer[len - 1] = 0x5d;  // ASCII ']' implaced over last comma
+				// encode single sample on-the-fly
+				if (buffsize - len < JSON_SMPL_LEN)
+					break;
+
+				size_t n = smpl_json((char *)buffer + len, buffsize - len, ts, first++);
+				if (n && head) {
+					memmove(buffer + len, buffer + len + 1, --n);	// skip leading comma
+					head = false;
+				}
+				len += n;
+			}
+
+			// If provided bufer is not large enough to fit 1 sample chunk, than I'm just sending
+			// an empty white space char (allowed json symbol) and wait for the next buffer
+			if (!len) {
+				buffer[0] = 0x20;	// ASCII 'white space'
+				return 1;
 			}
 
 			LOG(printf, "Sending timeseries JSON, buffer %d/%d, items left: %d\n"
 				, len
 				, buffsize
-				, ts->cend() - iter
+				, done ? 0 : last - first
 			);
 			return len;
 		});
 
 	response->addHeader(PGacao, "*");  // CORS header
+	seq_headers(response, ts, wfirst);
 	request->send(response);
 }
 
-template <>
-////// return json-formatted response for in-RAM sampled data
-void DataStorage<pz004::metrics>::wsamples(AsyncWebServerRequest *request) {
-    uint8_t id = 1;	 // default ts id
-
-    if (request->hasParam("tsid")) {
-	const AsyncWebParameter *p = request->getParam("tsid");
-	id = p->value().toInt();
-    }
-
-    // check if there is any sampled data
-    if (!this->getTSsize(id)) {
-	request->send(503, PGmimejson, "[]");
-	return;
-    }
-
-	// json response maybe pretty large and needs too much of a precious ram to store it in a temp 'string'
-	// So I'm going to generate it on-the-fly and stream to client in chunks
-
-	size_t cnt = 0;	 // cnt - return last 'cnt' samples, 0 - all samples
-
+template <class T>
+void DataStorage<T>::export_window(AsyncWebServerRequest *request, const TimeSeries<T> *ts, uint32_t &first, uint32_t &last) {
+	size_t cnt = 0;	 // cnt - limit window to 'cnt' samples, 0 - all samples
 	if (request->hasParam(C_scnt)) {
 		const AsyncWebParameter *p = request->getParam(C_scnt);
 		if (!p->value().isEmpty())
 			cnt = p->value().toInt();
 	}
 
-	const auto ts = this->getTS(id);
-	if (!ts)
-		request->send(503, PGmimejson, "[]");
-
-	auto iter = ts->cbegin();  // get const iterator
-
-	// set number of samples to send in responce
-	if (cnt > 0 && cnt < ts->getSize())
-		iter += ts->getSize() - cnt;  // offset iterator to the last cnt elements
-
-	LOG(printf, "TimeSeries buffer has %d items, scntr: %d\n", ts->getSize(), cnt);
-
-	AsyncWebServerResponse *response = request->beginChunkedResponse(FPSTR(PGmimejson),
-		[this, iter, ts](uint8_t *buffer, size_t buffsize, size_t index) mutable -> size_t {
-			// If provided bufer is not large enough to fit 1 sample chunk, than I'm just sending
-			// an empty white space char (allowed json symbol) and wait for the next buffer
-			if (buffsize < JSON_SMPL_LEN) {
-				buffer[0] = 0x20;	// ASCII 'white space'
-				return 1;
-			}
+	last = ts->getSeq();
+	uint32_t oldest = last - ts->getSize();
+	first = oldest;
+
+	if (request->hasParam(C_after_seq)) {
+		// resume after the last sample client has, sequence numbers are 32 bit unsigned
+		first = strtoul(request->getParam(C_after_seq)->value().c_str(), nullptr, 10) + 1;
+		if (static_cast<int32_t>(first - last) > 0)
+			first = last;		// client is ahead, series has been reset
+		else if (static_cast<int32_t>(first - oldest) < 0)
+			first = oldest;		// samples are lost
+		if (cnt && cnt < last - first)
+			last = first + cnt;	// first 'cnt' samples, client could continue with the next request
+		return;
+	}
 
-			size_t len = 0;
+	if (cnt && cnt < ts->getSize())
+		first = last - cnt;		// offset to the last cnt elements
+}
 
-			if (!index) {
-				buffer[0] = 0x5b;	// Open json array with ASCII '['
-				++len;
-			}
+template <class T>
+void DataStorage<T>::seq_headers(AsyncWebServerResponse *response, const TimeSeries<T> *ts, uint32_t first) {
+	response->addHeader(PGseqoldest, String(ts->getSeq() - ts->getSize()));
+	response->addHeader(PGseqfirst, String(first));
+	response->addHeader(PGseqnext, String(ts->getSeq()));
+	response->addHeader(PGaceh, "X-Seq-Oldest, X-Seq-First, X-Seq-Next");
+}
 
-			// prepare a chunk of sampled data wrapped in json
-			while (len < (buffsize - JSON_SMPL_LEN) && iter != ts->cend()) {
-				if (iter.operator->() != nullptr) {
-					// obtain a copy of a struct (.asFloat() member method crashes for dereferenced obj - TODO: investigate)
-					pz004::metrics m = *iter.operator->();
-
-					len += sprintf((char *)buffer + len, PGsmpljsontpl
-								, ts->getTstamp() - (ts->cend() - iter) * ts->getInterval()	// timestamp
-								, m.asFloat(meter_t::vol)
-								, m.asFloat(meter_t::cur)
-								, m.asFloat(meter_t::pwr)
-								, m.asFloat(meter_t::enrg) + nrg_offset
-						                #ifdef G_B00_PZEM_MODEL_PZEM004V3
-								    , m.asFloat(meter_t::frq)
-								    , m.asFloat(meter_t::pf)
-						                #endif
-						);
-				} else {
-					LOG(println, "SMLP pointer is null");
-				}
+template <class T>
+////// return binary archive for in-RAM sampled data, all tiers or the one requested
+void DataStorage<T>::warchive(AsyncWebServerRequest *request) {
+	uint8_t id = 0;	 // all tiers
+
+	if (request->hasParam("tsid"))
+		id = request->getParam("tsid")->value().toInt();
+
+	// archive keeps pointers to the tiers, so it must not outlive DataStorage reset, the response is short-lived
+	auto w = std::make_shared<tsarchive::Writer<T>>(nrg_offset, time(nullptr));
+	const TimeSeries<T> *single = nullptr;
+	uint32_t sfirst = 0;
+	this->foreach([&w, &single, &sfirst, id, request](const TimeSeries<T> &ts){
+		if (id && ts.id != id)
+			return;
+		uint32_t first, last;
+		export_window(request, &ts, first, last);
+		w->addAfter(&ts, first - 1, last - first);
+		single = &ts;
+		sfirst = first;
+	});
 
-				if (++iter == ts->cend())
-					buffer[len - 1] = 0x5d;  // ASCII ']' implaced over last comma
-			}
+	if (!w->tiersCount()) {
+		request->send(503, PGmimetxt, PGdre);
+		return;
+	}
 
-			LOG(printf, "Sending timeseries JSON, buffer %d/%d, items left: %d\n"
-				, len
-				, buffsize
-				, ts->cend() - iter
-			);
-			return len;
-		});
+	LOG(printf, "TimeSeries archive: %u tiers, %u bytes\n", w->tiersCount(), static_cast<uint32_t>(w->size()));
 
+	AsyncWebServerResponse *response = request->beginResponse(FPSTR(PGmimebin), w->size(),
+		[w](uint8_t *dst, size_t maxlen, size_t index) -> size_t { return w->read(dst, maxlen, index); });
 	response->addHeader(PGacao, "*");  // CORS header
+	response->addHeader("Content-Disposition", "attachment; filename=\"espem.pzta\"");
+	// tier headers have the window, sequence numbers are reported for a single tier request
+	if (id && single)
+		seq_headers(response, single, sfirst);
 	request->send(response);
 }
 
@@ -432,13 +565,21 @@ class Espem {
 	// TimeSeries data storage
 	DataStorage<T> ds;
 
+	// TimeSeries ingestion task, fed from device events bus subscriber
+	TSCollector<T, DataStorage<T>> collector{ds};
+
+	// device events bus, consumers subscribe to it with their own queues
+	PZEventBus bus;
+
 	 // Class constructor
 	 // uses predefined values of a ESPEM_CFG
 	Espem() {
 	}
 
 	~Espem() {
+		mbtcp.end();
 		ts.deleteTask(t_uiupdater);
+		drop_tssub();
 		delete pz;
 		pz = nullptr;
 		delete qport;
@@ -458,6 +599,12 @@ class Espem {
 
 	void wpmdata(AsyncWebServerRequest *request);
 
+	// @brief - HTTP request callback with metrics in Prometheus text format
+	void wmetrics(AsyncWebServerRequest *request) { prom.serve(request, pz, qport, ds, collector.getStats(), bus); }
+
+	// @brief - HTTP request callback with transport and device counters (as json)
+	void wstats(AsyncWebServerRequest *request) { serve_stats(request, pz, qport, PORT_1_ID); }
+
 	 // @brief - set webUI refresh rate in seconds
 	 // @param seconds - webUI interval
 	uint8_t set_uirate(uint8_t seconds);
@@ -466,6 +613,23 @@ class Espem {
 	// @return uint8_t
 	uint8_t get_uirate();  // TaskScheduler class does not allow it to declare const'ness
 
+	// @brief - set WebUI/MQTT publishing filter options
+	// @param deadband - publish new data only if some value changed more than this, percents
+	// @param heartbeat - publish anyway if nothing has been sent for this long, seconds
+	void set_pubfilter(uint8_t deadband, uint16_t heartbeat) { wsfilter.setup(deadband, heartbeat); }
+
+	// @brief - publish metrics on next UI cycle regardless of filter, i.e. when a new client opens the page
+	void ws_refresh() { wsfilter.force(); }
+
+	// @brief - start Modbus TCP server with meter's cached registers
+	// @param port - listen port, 0 - stop server
+	bool modbus_tcp(uint16_t port) {
+		if (!pz)
+			return false;
+		mbtcp.addUnit(mbtcp::unit(pz, PZEM_ID));
+		return mbtcp.begin(port);
+	}
+
 	// @brief - Control meter polling
 	// @param active - enable/disable
 	// @return - current state
@@ -478,6 +642,44 @@ class Espem {
 	}
 
 	mcstate_t set_collector_state(mcstate_t state);
+
+	// @brief - reinitialize TimeSeries storage
+	// collector task is stopped meanwhile, so it does not push into containers being rebuilt,
+	// it's bus subscriber is dropped first, so it does not post to a stopped collector
+	void ds_reset() {
+		bool run = collector.running();
+		bool sub = tssub != nullptr;
+		drop_tssub();
+		collector.stop();
+		ds.reset();
+		if (run) collector.start();
+		if (sub && !sub_tssub()) ts_state = mcstate_t::MC_PAUSE;
+	}
+
+	// @brief - configure batched MQTT publishing
+	// @param smpls - number of samples packed in a message, 0 - publish metrics on each UI cycle
+	// @param period - max batch period, seconds
+	// @param fsspool - spool unsent batches to flash
+	void mqtt_batching(uint16_t smpls, uint16_t period, bool fsspool) {
+		mqb.setup(smpls, period, fsspool, [this, last = int64_t(0)](mqsample &s) mutable {
+			time_t now = time(nullptr);
+			if (!pz || pz->getState()->dataStale() || now < MQTT_BATCH_MIN_TIME)
+				return false;
+			const auto snap = pz->getSnapshot();
+			if (snap.update_us == last)
+				return false;
+			last = snap.update_us;
+			s.set(now, &snap.data, ds.getEnergyOffset());
+			return true;
+		});
+
+		// batcher replaces raw metrics feeder
+		if (mqb.enabled() && _mqtt_feed_id >= 0) {
+			embui.feeders.remove(_mqtt_feed_id);
+			_mqtt_feed_id = -1;
+		} else if (!mqb.enabled() && _mqtt_feed_id < 0)
+			_mqtt_feed_id = embui.feeders.add(std::make_unique<FrameSendMQTTRaw>(&embui));
+	}
 	mcstate_t get_collector_state() const {
 	    return ts_state;
 	}
@@ -485,11 +687,41 @@ class Espem {
    private:
 	UartQ	 *qport	   = nullptr;
 	mcstate_t ts_state = mcstate_t::MC_DISABLE;
+	// /metrics renderer
+	PromExporter prom;
+	// Modbus TCP server
+	MbTcpServer mbtcp;
 	// Tasks
 	Task	  t_uiupdater;
 
 	// mqtt feeder id
-	int	_mqtt_feed_id{0};
+	int	_mqtt_feed_id{-1};
+
+	// batched MQTT publisher
+	MQTTBatcher mqb{C_mqtt_pzem_jbatch};
+
+	// change-driven publishing filter and persistent document for published values
+	WsPubFilter wsfilter;
+	JsonDocument pubdoc;
+
+	#ifdef ESPEM_DEBUG
+	// bus subscriber printing device events
+	std::shared_ptr<PZSubscriber> trace;
+	#endif
+
+	// bus subscriber feeding TimeSeries collector
+	std::shared_ptr<PZSubscriber> tssub;
+
+	// subscribe collector to metrics updates on the bus, collector must be running
+	bool sub_tssub();
+
+	// remove collector's subscriber from the bus and stop it's handler task
+	void drop_tssub() {
+		if (!tssub) return;
+		bus.unsubscribe(tssub);
+		tssub->stop();
+		tssub.reset();
+	}
 
 	String	 &mktxtdata(String &txtdata);
 
@@ -515,12 +747,20 @@ class Espem<pz004::metrics> {
 	// TimeSeries data storage
 	DataStorage<pz004::metrics> ds;
 
+	// TimeSeries ingestion task, fed from device events bus subscriber
+	TSCollector<pz004::metrics, DataStorage<pz004::metrics>> collector{ds};
+
+	// device events bus, consumers subscribe to it with their own queues
+	PZEventBus bus;
+
 	// Class constructor
 	// uses predefined values of a ESPEM_CFG
 	Espem(){};
 
 	~Espem() {
+		mbtcp.end();
 		ts.deleteTask(t_uiupdater);
+		drop_tssub();
 		delete pz;
 		pz = nullptr;
 		delete qport;
@@ -540,6 +780,12 @@ class Espem<pz004::metrics> {
 
 	void wpmdata(AsyncWebServerRequest *request);
 
+	// @brief - HTTP request callback with metrics in Prometheus text format
+	void wmetrics(AsyncWebServerRequest *request) { prom.serve(request, pz, qport, ds, collector.getStats(), bus); }
+
+	// @brief - HTTP request callback with transport and device counters (as json)
+	void wstats(AsyncWebServerRequest *request) { serve_stats(request, pz, qport, PORT_1_ID); }
+
 	 // @brief - set webUI refresh rate in seconds
 	 // @param seconds - webUI interval
 	uint8_t set_uirate(uint8_t seconds);
@@ -548,6 +794,23 @@ class Espem<pz004::metrics> {
 	// @return uint8_t
 	uint8_t get_uirate();  // TaskScheduler class does not allow it to declare const'ness
 
+	// @brief - set WebUI/MQTT publishing filter options
+	// @param deadband - publish new data only if some value changed more than this, percents
+	// @param heartbeat - publish anyway if nothing has been sent for this long, seconds
+	void set_pubfilter(uint8_t deadband, uint16_t heartbeat) { wsfilter.setup(deadband, heartbeat); }
+
+	// @brief - publish metrics on next UI cycle regardless of filter, i.e. when a new client opens the page
+	void ws_refresh() { wsfilter.force(); }
+
+	// @brief - start Modbus TCP server with meter's cached registers
+	// @param port - listen port, 0 - stop server
+	bool modbus_tcp(uint16_t port) {
+		if (!pz)
+			return false;
+		mbtcp.addUnit(mbtcp::unit(pz, PZEM_ID));
+		return mbtcp.begin(port);
+	}
+
 	// @brief - Control meter polling
 	// @param active - enable/disable
 	// @return - current state
@@ -559,6 +822,44 @@ class Espem<pz004::metrics> {
 	};
 
 	mcstate_t set_collector_state(mcstate_t state);
+
+	// @brief - reinitialize TimeSeries storage
+	// collector task is stopped meanwhile, so it does not push into containers being rebuilt,
+	// it's bus subscriber is dropped first, so it does not post to a stopped collector
+	void ds_reset() {
+		bool run = collector.running();
+		bool sub = tssub != nullptr;
+		drop_tssub();
+		collector.stop();
+		ds.reset();
+		if (run) collector.start();
+		if (sub && !sub_tssub()) ts_state = mcstate_t::MC_PAUSE;
+	}
+
+	// @brief - configure batched MQTT publishing
+	// @param smpls - number of samples packed in a message, 0 - publish metrics on each UI cycle
+	// @param period - max batch period, seconds
+	// @param fsspool - spool unsent batches to flash
+	void mqtt_batching(uint16_t smpls, uint16_t period, bool fsspool) {
+		mqb.setup(smpls, period, fsspool, [this, last = int64_t(0)](mqsample &s) mutable {
+			time_t now = time(nullptr);
+			if (!pz || pz->getState()->dataStale() || now < MQTT_BATCH_MIN_TIME)
+				return false;
+			const auto snap = pz->getSnapshot();
+			if (snap.update_us == last)
+				return false;
+			last = snap.update_us;
+			s.set(now, &snap.data, ds.getEnergyOffset());
+			return true;
+		});
+
+		// batcher replaces raw metrics feeder
+		if (mqb.enabled() && _mqtt_feed_id >= 0) {
+			embui.feeders.remove(_mqtt_feed_id);
+			_mqtt_feed_id = -1;
+		} else if (!mqb.enabled() && _mqtt_feed_id < 0)
+			_mqtt_feed_id = embui.feeders.add(std::make_unique<FrameSendMQTTRaw>(&embui));
+	}
 	mcstate_t get_collector_state() const {
 		return ts_state;
 	};
@@ -566,11 +867,41 @@ class Espem<pz004::metrics> {
    private:
 	UartQ	 *qport	   = nullptr;
 	mcstate_t ts_state = mcstate_t::MC_DISABLE;
+	// /metrics renderer
+	PromExporter prom;
+	// Modbus TCP server
+	MbTcpServer mbtcp;
 	// Tasks
 	Task	  t_uiupdater;
 
 	// mqtt feeder id
-	int		  _mqtt_feed_id{0};
+	int		  _mqtt_feed_id{-1};
+
+	// batched MQTT publisher
+	MQTTBatcher mqb{C_mqtt_pzem_jbatch};
+
+	// change-driven publishing filter and persistent document for published values
+	WsPubFilter wsfilter;
+	JsonDocument pubdoc;
+
+	#ifdef ESPEM_DEBUG
+	// bus subscriber printing device events
+	std::shared_ptr<PZSubscriber> trace;
+	#endif
+
+	// bus subscriber feeding TimeSeries collector
+	std::shared_ptr<PZSubscriber> tssub;
+
+	// subscribe collector to metrics updates on the bus, collector must be running
+	bool sub_tssub();
+
+	// remove collector's subscriber from the bus and stop it's handler task
+	void drop_tssub() {
+		if (!tssub) return;
+		bus.unsubscribe(tssub);
+		tssub->stop();
+		tssub.reset();
+	}
 
 	String	 &mktxtdata(String &txtdata);
 
@@ -613,7 +944,9 @@ bool Espem<T>::begin(const uart_port_t p, int rx, int tx) {
 		qport = nullptr;
 	}
 
-	qport = new UartQ(p, rx, tx);
+	UartQ_tasks tcfg;
+	tcfg.core = ESPEM_UART_CORE;
+	qport = new UartQ(p, rx, tx, tcfg);
 	if (!qport) return false;  // failed to create qport
 
 	if (pz) {  // obj already exist
@@ -641,6 +974,13 @@ bool Espem<T>::begin(const uart_port_t p, int rx, int tx) {
 
 	pz->attachMsgQ(qport);
 	qport->startQueues();
+	pz->attach_bus(&bus);
+
+	#ifdef ESPEM_DEBUG
+	trace = bus.subscribe("trace", pzevt::id_any, pzevt::evt_any, PZEVT_QUEUE_DEPTH, pzevt::policy_t::coalesce_latest);
+	if (trace)
+		trace->run([](const pzevt::event &e){ Serial.printf("PZEM ID:%u event:%u at %lld us\n", e.id, static_cast<unsigned>(e.type), e.us); });
+	#endif
 
 	// WebUI updater task
 	t_uiupdater.set(DEFAULT_WS_UPD_RATE * TASK_SECOND, TASK_FOREVER, std::bind(&Espem::wspublish, this));
@@ -664,9 +1004,23 @@ bool Espem<T>::begin(const uart_port_t p, int rx, int tx) {
 
 	// generate json with sampled meter data
 	embui.server.on("/samples.json", HTTP_GET, [this](AsyncWebServerRequest *r) { ds.wsamples(r); });
+	embui.server.on("/archive.bin", HTTP_GET, [this](AsyncWebServerRequest *r) { ds.warchive(r); });
+	embui.server.on("/metrics", HTTP_GET, [this](AsyncWebServerRequest *r) { wmetrics(r); });
+	embui.server.on("/stats", HTTP_GET, [this](AsyncWebServerRequest *r) { wstats(r); });
+#ifdef PZEM_EDL_TRACE
+	// hot-path trace records in Chrome trace_event format, '?clear' drops records once dumped
+	embui.server.on("/trace.json", HTTP_GET, [](AsyncWebServerRequest *r) {
+		AsyncResponseStream *response = r->beginResponseStream(FPSTR(PGmimejson));
+		pztrace::recorder.dump([response](const char *data, size_t len){ response->write(reinterpret_cast<const uint8_t*>(data), len); });
+		if (r->hasParam("clear"))
+			pztrace::recorder.clear();
+		r->send(response);
+	});
+#endif
 
-	// create MQTT rawdata feeder and add into the chain
-	_mqtt_feed_id = embui.feeders.add(std::make_unique<FrameSendMQTTRaw>(&embui));
+	// create MQTT rawdata feeder and add into the chain, unless batched publishing is active
+	if (!mqb.enabled() && _mqtt_feed_id < 0)
+		_mqtt_feed_id = embui.feeders.add(std::make_unique<FrameSendMQTTRaw>(&embui));
 
 	return true;
 }
@@ -680,7 +1034,8 @@ String &Espem<T>::mktxtdata(String &txtdata) {
 
 	#if defined(G_B00_PZEM_MODEL_PZEM003)
             // pmeterData pdata = meter->getData();
-	    const auto m = pz->getMetricsPZ003();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
 	
 	//#if defined(G_B00_PZEM_MODEL_PZEM004V3)
         //    // pmeterData pdata = meter->getData();
@@ -720,7 +1075,8 @@ void Espem<T>::wdatareply(AsyncWebServerRequest *request) {
 	}
 
 	#if defined(G_B00_PZEM_MODEL_PZEM003)
-	    const auto m = pz->getMetricsPZ003();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
 	
 	//#if defined(G_B00_PZEM_MODEL_PZEM004V3)
 	//    const auto m = pz->getMetricsPZ004();
@@ -753,20 +1109,25 @@ void Espem<T>::wspublish() {
 	}
 
 	#if defined(G_B00_PZEM_MODEL_PZEM003)
-	    const auto m = pz->getMetricsPZ003();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
 	
 	//#if defined(G_B00_PZEM_MODEL_PZEM004V3)
 	//    const auto m = pz->getMetricsPZ004();
 	//#endif
 
-	JsonDocument  doc;
-	JsonObject obj  = doc.to<JsonObject>();
-	doc["stale"]	= pz->getState()->dataStale();
-	doc["age"]	= pz->getState()->dataAge();
-	doc["U"]	= m->voltage;
-	doc["I"]	= m->current;
-	doc["P"]	= m->power;
-	doc["W"]	= m->energy + ds.getEnergyOffset();
+	const auto st = pz->getState();
+	pubsnap s{{m->voltage, m->current, m->power, m->energy + ds.getEnergyOffset(), 0, 0}, st->dataStale()};
+	if (!wsfilter.check(snap.update_us, s))
+		return;
+
+	// document is kept between cycles, values are updated in place
+	pubdoc["stale"]	= s.stale;
+	pubdoc["age"]	= st->dataAge();
+	pubdoc["U"]	= s.v[pubsnap::U];
+	pubdoc["I"]	= s.v[pubsnap::I];
+	pubdoc["P"]	= s.v[pubsnap::P];
+	pubdoc["W"]	= s.v[pubsnap::W];
 	// #if defined(G_B00_PZEM_MODEL_PZEM004V3)
 	//   doc["Pf"]	= m->pf;
 	//    doc["freq"]	= m->freq;
@@ -776,7 +1137,7 @@ void Espem<T>::wspublish() {
 	// Interface interf(&embui.feeders, 128);
 	interf.json_frame(C_espem);
 
-	interf.json_frame_add(doc);
+	interf.json_frame_add(pubdoc);
 	// interf.jobject(doc, true);
 
 	interf.json_frame_flush();
@@ -802,6 +1163,24 @@ uint8_t Espem<T>::get_uirate() {
 	return 0;
 }
 
+template <class T>
+bool Espem<T>::sub_tssub() {
+	// samples are handed over to the collector task by a bus subscriber, newest update replaces a pending one
+	tssub = bus.subscribe("collector", pzevt::id_any, pzevt::mask(pzevt::evt_t::update), PZEVT_QUEUE_DEPTH, pzevt::policy_t::coalesce_latest);
+	if (!tssub || !tssub->run([this](const pzevt::event &e) {
+			if (pz->getState()->dataStale())
+				return;
+		#if defined(G_B00_PZEM_MODEL_PZEM003)
+			const auto snap = pz->getSnapshot();
+			collector.post(snap.data, time(nullptr));
+		#endif
+		})) {
+		drop_tssub();
+		return false;
+	}
+	return true;
+}
+
 template <class T>
 mcstate_t Espem<T>::set_collector_state(mcstate_t state) {
 	if (!pz) {
@@ -812,36 +1191,28 @@ mcstate_t Espem<T>::set_collector_state(mcstate_t state) {
 	switch (state) {
 		case mcstate_t::MC_RUN: {
 			if (ts_state == mcstate_t::MC_RUN) return mcstate_t::MC_RUN;
-			if (!ds.getTScap()) ds.reset();	 // reinitialize TS Container if empty
-
-			// attach collector's callback
-			pz->attach_rx_callback([this](uint8_t id, const RX_msg *m) {
-				// collect time-series data
-				if (!pz->getState()->dataStale()) {
-				    #if defined(G_B00_PZEM_MODEL_PZEM003)
-					ds.push(*(pz->getMetricsPZ003()), time(nullptr));
-				    #endif
-				    // #elif defined(G_B00_PZEM_MODEL_PZEM004V3)
-				    //    ds.push(*(pz->getMetricsPZ004()), time(nullptr));
-				    // #endif
-					
-				}
-				#ifdef ESPEM_DEBUG
-					if (m) {
-						msgdebug(id, m);
-					}	 // it will print every data packet coming from PZEM
-				#endif
+			if (!ds.getTScap()) ds_reset();	 // reinitialize TS Container if empty
+			if (!collector.start() || !sub_tssub()) return ts_state;
+			#ifdef ESPEM_DEBUG
+			// it will print every data packet coming from PZEM
+			pz->attach_rx_callback([](uint8_t id, const RX_msg *m) {
+				if (m)
+					msgdebug(id, m);
 			});
+			#endif
 			ts_state = mcstate_t::MC_RUN;
 			break;
 		}
 		case mcstate_t::MC_PAUSE: {
+			drop_tssub();
 			pz->detach_rx_callback();
 			ts_state = mcstate_t::MC_PAUSE;
 			break;
 		}
 		default: {
+			drop_tssub();
 			pz->detach_rx_callback();
+			collector.stop();
 			ds.purge();
 			ts_state = mcstate_t::MC_DISABLE;
 		}
@@ -865,7 +1236,9 @@ bool Espem<pz004::metrics>::begin(const uart_port_t p, int rx, int tx) {
 		qport = nullptr;
 	}
 
-	qport = new UartQ(p, rx, tx);
+	UartQ_tasks tcfg;
+	tcfg.core = ESPEM_UART_CORE;
+	qport = new UartQ(p, rx, tx, tcfg);
 	if (!qport) return false;  // failed to create qport
 
 	if (pz) {  // obj already exist
@@ -893,6 +1266,13 @@ bool Espem<pz004::metrics>::begin(const uart_port_t p, int rx, int tx) {
 
 	pz->attachMsgQ(qport);
 	qport->startQueues();
+	pz->attach_bus(&bus);
+
+	#ifdef ESPEM_DEBUG
+	trace = bus.subscribe("trace", pzevt::id_any, pzevt::evt_any, PZEVT_QUEUE_DEPTH, pzevt::policy_t::coalesce_latest);
+	if (trace)
+		trace->run([](const pzevt::event &e){ Serial.printf("PZEM ID:%u event:%u at %lld us\n", e.id, static_cast<unsigned>(e.type), e.us); });
+	#endif
 
 	// WebUI updater task
 	t_uiupdater.set(DEFAULT_WS_UPD_RATE * TASK_SECOND, TASK_FOREVER, std::bind(&Espem::wspublish, this));
@@ -916,9 +1296,23 @@ bool Espem<pz004::metrics>::begin(const uart_port_t p, int rx, int tx) {
 
 	// generate json with sampled meter data
 	embui.server.on("/samples.json", HTTP_GET, [this](AsyncWebServerRequest *r) { ds.wsamples(r); });
+	embui.server.on("/archive.bin", HTTP_GET, [this](AsyncWebServerRequest *r) { ds.warchive(r); });
+	embui.server.on("/metrics", HTTP_GET, [this](AsyncWebServerRequest *r) { wmetrics(r); });
+	embui.server.on("/stats", HTTP_GET, [this](AsyncWebServerRequest *r) { wstats(r); });
+#ifdef PZEM_EDL_TRACE
+	// hot-path trace records in Chrome trace_event format, '?clear' drops records once dumped
+	embui.server.on("/trace.json", HTTP_GET, [](AsyncWebServerRequest *r) {
+		AsyncResponseStream *response = r->beginResponseStream(FPSTR(PGmimejson));
+		pztrace::recorder.dump([response](const char *data, size_t len){ response->write(reinterpret_cast<const uint8_t*>(data), len); });
+		if (r->hasParam("clear"))
+			pztrace::recorder.clear();
+		r->send(response);
+	});
+#endif
 
-	// create MQTT rawdata feeder and add into the chain
-	_mqtt_feed_id = embui.feeders.add(std::make_unique<FrameSendMQTTRaw>(&embui));
+	// create MQTT rawdata feeder and add into the chain, unless batched publishing is active
+	if (!mqb.enabled() && _mqtt_feed_id < 0)
+		_mqtt_feed_id = embui.feeders.add(std::make_unique<FrameSendMQTTRaw>(&embui));
 
 	return true;
 }
@@ -937,7 +1331,8 @@ String &Espem<pz004::metrics>::mktxtdata(String &txtdata) {
 	//    const auto m = pz->getMetricsPZ003();
 	#if defined(G_B00_PZEM_MODEL_PZEM004V3)
             // pmeterData pdata = meter->getData();
-	    const auto m = pz->getMetricsPZ004();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
 	
 
 	  txtdata	 = "U:";
@@ -975,9 +1370,11 @@ void Espem<pz004::metrics>::wdatareply(AsyncWebServerRequest *request) {
 	}
 
 	#if defined(G_B00_PZEM_MODEL_PZEM003)
-	    const auto m = pz->getMetricsPZ003();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
 	#elif defined(G_B00_PZEM_MODEL_PZEM004V3)
-	    const auto m = pz->getMetricsPZ004();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
 	#endif
 	//const auto m = pz->getMetricsPZ004();
 	
@@ -1005,29 +1402,37 @@ void Espem<pz004::metrics>::wspublish() {
 	}
 
 	#if defined(G_B00_PZEM_MODEL_PZEM003)
-	    const auto m = pz->getMetricsPZ003();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
+	    pubsnap s{{m->voltage, m->current, m->power, m->energy + ds.getEnergyOffset(), 0, 0}, false};
 	#elif defined(G_B00_PZEM_MODEL_PZEM004V3)
-	    const auto m = pz->getMetricsPZ004();
+	    const auto snap = pz->getSnapshot();	// consistent copy, metrics are updated from RX task
+	    const auto m = &snap.data;
+	    pubsnap s{{m->voltage, m->current, m->power, m->energy + ds.getEnergyOffset(), m->pf, m->freq}, false};
 	#endif
 
-	JsonDocument  doc;
-	JsonObject obj  = doc.to<JsonObject>();
-	doc["stale"]	= pz->getState()->dataStale();
-	doc["age"]	= pz->getState()->dataAge();
-	doc["U"]	= m->voltage;
-	doc["I"]	= m->current;
-	doc["P"]	= m->power;
-	doc["W"]	= m->energy + ds.getEnergyOffset();
+	const auto st = pz->getState();
+	s.stale = st->dataStale();
+	if (!wsfilter.check(snap.update_us, s))
+		return;
+
+	// document is kept between cycles, values are updated in place
+	pubdoc["stale"]	= s.stale;
+	pubdoc["age"]	= st->dataAge();
+	pubdoc["U"]	= s.v[pubsnap::U];
+	pubdoc["I"]	= s.v[pubsnap::I];
+	pubdoc["P"]	= s.v[pubsnap::P];
+	pubdoc["W"]	= s.v[pubsnap::W];
 	#if defined(G_B00_PZEM_MODEL_PZEM004V3)
-	    doc["Pf"]	= m->pf;
-	    doc["freq"]	= m->freq;
+	    pubdoc["Pf"]	= s.v[pubsnap::pf];
+	    pubdoc["freq"]	= s.v[pubsnap::hz];
 	#endif
 
 	Interface interf(&embui.feeders);
 	// Interface interf(&embui.feeders, 128);
 	interf.json_frame(C_espem);
 
-	interf.json_frame_add(doc);
+	interf.json_frame_add(pubdoc);
 	// interf.jobject(doc, true);
 
 	interf.json_frame_flush();
@@ -1052,6 +1457,24 @@ uint8_t Espem<pz004::metrics>::get_uirate() {
 	return 0;
 }
 
+//template <>
+bool Espem<pz004::metrics>::sub_tssub() {
+	// samples are handed over to the collector task by a bus subscriber, newest update replaces a pending one
+	tssub = bus.subscribe("collector", pzevt::id_any, pzevt::mask(pzevt::evt_t::update), PZEVT_QUEUE_DEPTH, pzevt::policy_t::coalesce_latest);
+	if (!tssub || !tssub->run([this](const pzevt::event &e) {
+			if (pz->getState()->dataStale())
+				return;
+		#if defined(G_B00_PZEM_MODEL_PZEM004V3)
+			const auto snap = pz->getSnapshot();
+			collector.post(snap.data, time(nullptr));
+		#endif
+		})) {
+		drop_tssub();
+		return false;
+	}
+	return true;
+}
+
 //template <>
 mcstate_t Espem<pz004::metrics>::set_collector_state(mcstate_t state) {
 	if (!pz) {
@@ -1062,34 +1485,28 @@ mcstate_t Espem<pz004::metrics>::set_collector_state(mcstate_t state) {
 	switch (state) {
 		case mcstate_t::MC_RUN: {
 			if (ts_state == mcstate_t::MC_RUN) return mcstate_t::MC_RUN;
-			if (!ds.getTScap()) ds.reset();	 // reinitialize TS Container if empty
-
-			// attach collector's callback
-			pz->attach_rx_callback([this](uint8_t id, const RX_msg *m) {
-				// collect time-series data
-				if (!pz->getState()->dataStale()) {
-				    // #if defined(G_B00_PZEM_MODEL_PZEM003)
-	                            //     ds.push(*(pz->getMetricsPZ003()), time(nullptr));
-	                            #if defined(G_B00_PZEM_MODEL_PZEM004V3)
-	                                ds.push(*(pz->getMetricsPZ004()), time(nullptr));
-	                            #endif	
-				}
-				#ifdef ESPEM_DEBUG
-					if (m) {
-						msgdebug(id, m);
-					}	 // it will print every data packet coming from PZEM
-				#endif
+			if (!ds.getTScap()) ds_reset();	 // reinitialize TS Container if empty
+			if (!collector.start() || !sub_tssub()) return ts_state;
+			#ifdef ESPEM_DEBUG
+			// it will print every data packet coming from PZEM
+			pz->attach_rx_callback([](uint8_t id, const RX_msg *m) {
+				if (m)
+					msgdebug(id, m);
 			});
+			#endif
 			ts_state = mcstate_t::MC_RUN;
 			break;
 		}
 		case mcstate_t::MC_PAUSE: {
+			drop_tssub();
 			pz->detach_rx_callback();
 			ts_state = mcstate_t::MC_PAUSE;
 			break;
 		}
 		default: {
+			drop_tssub();
 			pz->detach_rx_callback();
+			collector.stop();
 			ds.purge();
 			ts_state = mcstate_t::MC_DISABLE;
 		}
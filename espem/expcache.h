@@ -0,0 +1,157 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Shared cache of serialized TimeSeries chunks for data export
+
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <new>
+#include <esp_heap_caps.h>
+
+#ifndef EXPCACHE_CHUNK_SMPLS
+	#define EXPCACHE_CHUNK_SMPLS	32			// number of samples in a cached chunk
+#endif
+#ifndef EXPCACHE_MAX_SIZE
+	#define EXPCACHE_MAX_SIZE		(64*1024)	// cache memory budget, bytes
+#endif
+#ifndef EXPCACHE_MIN_FREE_BLK
+	#define EXPCACHE_MIN_FREE_BLK	(32*1024)	// drop cache if largest free heap block goes below this mark, bytes
+#endif
+
+// export formats
+enum class expfmt_t : uint8_t {
+	json = 0
+};
+
+/**
+ * @brief immutable encoded chunk of TimeSeries samples
+ * chunk covers samples window [seq, seq + EXPCACHE_CHUNK_SMPLS)
+ */
+struct ExpChunk {
+	const uint8_t	tsid;		// TimeSeries id
+	const expfmt_t	fmt;		// encoding format
+	const uint32_t	seq;		// sequence number of the first sample in chunk
+	const uint32_t	gen;		// cache generation chunk was encoded for
+	const size_t	len;		// data length
+	std::unique_ptr<char[], decltype(free)*> data{nullptr, free};
+
+	ExpChunk(uint8_t _id, expfmt_t _f, uint32_t _s, uint32_t _g, size_t _l) : tsid(_id), fmt(_f), seq(_s), gen(_g), len(_l) {
+		auto p = static_cast<char*>(heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));	// try SPI-RAM first
+		if (!p)
+			p = static_cast<char*>(malloc(len));
+		data.reset(p);
+	}
+};
+
+/**
+ * @brief Export cache keeps serialized chunks of sealed TimeSeries data
+ * Sample sequence numbers never change once sample is pushed to TimeSeries, so a chunk that is fully populated
+ * could be encoded once and shared between any number of concurrent export requests.
+ * Chunks are evicted in LRU order to fit memory budget and all dropped under heap pressure.
+ * Any chunk handed out stays valid for the holder even if evicted from cache.
+ *
+ * Not thread-safe, meant to be used from the web-server's context, except invalidate() that could be called from anywhere
+ */
+class ExportCache {
+	std::list< std::shared_ptr<const ExpChunk> > chunks;		// LRU list, most recent in front
+	std::unique_ptr<char[]> scratch;							// encoding buffer
+	std::atomic<uint32_t> gen{0};
+	size_t	 _size{0};
+	uint32_t _hits{0};
+	uint32_t _misses{0};
+
+	void evict(){
+		_size -= chunks.back()->len + sizeof(ExpChunk);
+		chunks.pop_back();
+	}
+
+   public:
+	/**
+	 * @brief get encoded chunk for the samples window [seq, seq + EXPCACHE_CHUNK_SMPLS)
+	 * caller must ensure that all of the samples in window are present in TimeSeries
+	 *
+	 * @param tsid - TimeSeries id
+	 * @param fmt - export format
+	 * @param seq - first sample seq number, must be aligned to EXPCACHE_CHUNK_SMPLS
+	 * @param maxlen - max encoded length of a single sample
+	 * @param enc - encoder functor 'size_t (char *dst, size_t len, uint32_t seq)' that prints one sample into dst buffer
+	 * @return std::shared_ptr<const ExpChunk> - or nullptr if chunk can't be cached, caller should encode samples by itself
+	 */
+	template <class F>
+	std::shared_ptr<const ExpChunk> get(uint8_t tsid, expfmt_t fmt, uint32_t seq, size_t maxlen, F&& enc){
+		// under heap pressure cache is not worth it
+		if (MAX_FREE_MEM_BLK < EXPCACHE_MIN_FREE_BLK){
+			purge();
+			return nullptr;
+		}
+
+		uint32_t g = gen.load();
+		for (auto i = chunks.begin(); i != chunks.end(); ++i){
+			auto &c = *i;
+			if (c->gen != g){
+				// cache has been invalidated, all chunks are stale
+				purge();
+				break;
+			}
+			if (c->tsid == tsid && c->fmt == fmt && c->seq == seq){
+				if (i != chunks.begin())
+					chunks.splice(chunks.begin(), chunks, i);
+				++_hits;
+				return chunks.front();
+			}
+		}
+		++_misses;
+
+		if (!scratch)
+			scratch.reset(new(std::nothrow) char[EXPCACHE_CHUNK_SMPLS * maxlen]);
+		if (!scratch)
+			return nullptr;
+
+		size_t len = 0;
+		for (uint32_t i = 0; i != EXPCACHE_CHUNK_SMPLS; ++i)
+			len += enc(scratch.get() + len, EXPCACHE_CHUNK_SMPLS * maxlen - len, seq + i);
+
+		auto c = std::make_shared<ExpChunk>(tsid, fmt, seq, g, len);
+		if (!c->data)
+			return nullptr;
+		memcpy(c->data.get(), scratch.get(), len);
+
+		while (chunks.size() && _size + len + sizeof(ExpChunk) > EXPCACHE_MAX_SIZE)
+			evict();
+
+		chunks.emplace_front(c);
+		_size += len + sizeof(ExpChunk);
+		return c;
+	}
+
+	/**
+	 * @brief mark all cached chunks as stale
+	 * i.e. when data representation changes (energy offset)
+	 */
+	void invalidate(){ ++gen; }
+
+	/**
+	 * @brief drop all cached chunks and release memory
+	 * must be called when TimeSeries are recreated
+	 */
+	void purge(){
+		chunks.clear();
+		scratch.reset();
+		_size = 0;
+	}
+
+	// memory used by cache, bytes
+	size_t size() const { return _size; }
+
+	// number of chunks in cache
+	size_t count() const { return chunks.size(); }
+
+	uint32_t hits() const { return _hits; }
+	uint32_t misses() const { return _misses; }
+};
@@ -14,6 +14,9 @@ void set_sampler_opts(Interface *interf, const JsonObject *data, const char *act
 void set_directctrls(Interface *interf, const JsonObject *data, const char *action);
 void set_uart_opts(Interface *interf, const JsonObject *data, const char *action);
 void set_pzopts(Interface *interf, const JsonObject *data, const char *action);
+void set_mqbatch_opts(Interface *interf, const JsonObject *data, const char *action);
+void set_pubfilter_opts(Interface *interf, const JsonObject *data, const char *action);
+void set_mbtcp_opts(Interface *interf, const JsonObject *data, const char *action);
 
 // Callbacks
 void pubCallback(Interface *interf);
@@ -143,6 +146,9 @@ void ui_block_chart_ctrls(Interface *interf) {
  *
  */
 void ui_page_espem(Interface *interf, const JsonObject *data, const char *action) {
+	// page is built on each new WS connection, fresh client should get the values without waiting for the change or heartbeat
+	espem->ws_refresh();
+
 	interf->json_frame_interface();
 	interf->json_section_main(A_ui_page_espem, C_DICT[lang][CD::ESPEM_H]);
 
@@ -156,10 +162,12 @@ void ui_page_espem(Interface *interf, const JsonObject *data, const char *action
 	interf->json_section_line();  // "Live controls"
 
 	#if defined(G_B00_PZEM_MODEL_PZEM003)
-	   auto *m = espem->pz->getMetricsPZ003();
+	   const auto snap = espem->pz->getSnapshot();
+	   auto *m = &snap.data;
 	#endif
 	#if defined(G_B00_PZEM_MODEL_PZEM004V3)
-	   auto *m = espem->pz->getMetricsPZ004();
+	   const auto snap = espem->pz->getSnapshot();
+	   auto *m = &snap.data;
 	#endif
 
 	// Widgets & left side menu
@@ -207,6 +215,15 @@ void block_page_espemset(Interface *interf, const JsonObject *data, const char *
 	interf->value(V_RX, embui.paramVariant(V_RX).as<int>());
 	interf->value(V_TX, embui.paramVariant(V_TX).as<int>());
 	interf->value(V_EOFFSET, espem->ds.getEnergyOffset());
+	// MQTT batching
+	interf->value(V_MQB_CNT, embui.paramVariant(V_MQB_CNT).as<int>());
+	interf->value(V_MQB_INT, embui.paramVariant(V_MQB_INT).as<int>());
+	interf->value(V_MQB_SPOOL, embui.paramVariant(V_MQB_SPOOL).as<bool>());
+	// publishing filter
+	interf->value(V_PUB_DBAND, embui.paramVariant(V_PUB_DBAND).as<int>());
+	interf->value(V_PUB_HBEAT, embui.paramVariant(V_PUB_HBEAT).as<int>());
+	// Modbus TCP server
+	interf->value(V_MBT_PORT, embui.paramVariant(V_MBT_PORT).as<int>());
 	// TimeSeries capacity
 	interf->value(V_TS_T1_CNT, embui.paramVariant(V_TS_T1_CNT).as<int>());
 	interf->value(V_TS_T1_INT, embui.paramVariant(V_TS_T1_INT).as<int>());
@@ -309,7 +326,7 @@ void set_sampler_opts(Interface *interf, const JsonObject *data, const char *act
 	SETPARAM(V_TS_T3_CNT);
 	SETPARAM(V_TS_T3_INT);
 
-	espem->ds.reset();
+	espem->ds_reset();
 	// display main page
 	if (interf)
 		ui_page_espem(interf, nullptr, NULL);
@@ -431,6 +448,63 @@ void set_pzopts(Interface *interf, const JsonObject *data, const char *action) {
 		ui_page_espem(interf, nullptr, NULL);
 }
 
+/**
+ * @brief Set MQTT batching opts
+ *
+ * @param interf
+ * @param data
+ */
+void set_mqbatch_opts(Interface *interf, const JsonObject *data, const char *action) {
+	if (!data)
+		return;
+
+	SETPARAM(V_MQB_CNT);
+	SETPARAM(V_MQB_INT);
+	SETPARAM(V_MQB_SPOOL);
+	espem->mqtt_batching(embui.paramVariant(V_MQB_CNT), embui.paramVariant(V_MQB_INT), embui.paramVariant(V_MQB_SPOOL));
+
+	// display main page
+	if (interf)
+		ui_page_espem(interf, nullptr, NULL);
+}
+
+/**
+ * @brief Set metrics publishing filter opts
+ *
+ * @param interf
+ * @param data
+ */
+void set_pubfilter_opts(Interface *interf, const JsonObject *data, const char *action) {
+	if (!data)
+		return;
+
+	SETPARAM(V_PUB_DBAND);
+	SETPARAM(V_PUB_HBEAT);
+	espem->set_pubfilter(embui.paramVariant(V_PUB_DBAND), embui.paramVariant(V_PUB_HBEAT));
+
+	// display main page
+	if (interf)
+		ui_page_espem(interf, nullptr, NULL);
+}
+
+/**
+ * @brief Set Modbus TCP server opts
+ *
+ * @param interf
+ * @param data
+ */
+void set_mbtcp_opts(Interface *interf, const JsonObject *data, const char *action) {
+	if (!data)
+		return;
+
+	SETPARAM(V_MBT_PORT);
+	espem->modbus_tcp(embui.paramVariant(V_MBT_PORT));
+
+	// display main page
+	if (interf)
+		ui_page_espem(interf, nullptr, NULL);
+}
+
 // Define configuration variables and controls handlers
 // variables has literal names and are kept within json-configuration file on flash
 //
@@ -456,6 +530,12 @@ void embui_actions_register() {
 	embui.var_create(V_TX, -1);		 // TX pin (default)
 	embui.var_create(V_TX, -1);		 // TX pin (default)
 	embui.var_create(V_EOFFSET, 0);	 // Energy counter offset
+	embui.var_create(V_MQB_CNT, 0);		 // MQTT batch size (disabled)
+	embui.var_create(V_MQB_INT, 60);	 // MQTT batch period, sec
+	embui.var_create(V_MQB_SPOOL, false);	 // MQTT flash spool
+	embui.var_create(V_PUB_DBAND, WSPUB_DEADBAND);	 // publishing deadband, %
+	embui.var_create(V_PUB_HBEAT, WSPUB_HEARTBEAT);	 // publishing heartbeat, sec
+	embui.var_create(V_MBT_PORT, 0);	 // Modbus TCP server port (disabled)
 
 	/**
 	 * обработчики действий
@@ -475,6 +555,9 @@ void embui_actions_register() {
 	embui.action.add(A_SET_MCOLLECTOR, set_sampler_opts);  // set options for TimeSeries collector
 	embui.action.add(A_SET_UART, set_uart_opts);		   // set UART gpios
 	embui.action.add(A_SET_PZOPTS, set_pzopts);			   // set options for PZEM (egergy offset)
+	embui.action.add(A_SET_MQBATCH, set_mqbatch_opts);	   // set MQTT batching options
+	embui.action.add(A_SET_PUBFLTR, set_pubfilter_opts);   // set metrics publishing filter options
+	embui.action.add(A_SET_MBTCP, set_mbtcp_opts);		   // set Modbus TCP server options
 
 	// direct controls
 	embui.action.add(A_DIRECT_CTL, set_directctrls);  // process onChange update controls
@@ -109,6 +109,9 @@ void setup() {
 							  embui.paramVariant(V_RX),
 							  embui.paramVariant(V_TX))) {
 		espem->ds.setEnergyOffset(embui.paramVariant(V_EOFFSET));
+		espem->mqtt_batching(embui.paramVariant(V_MQB_CNT), embui.paramVariant(V_MQB_INT), embui.paramVariant(V_MQB_SPOOL));
+		espem->set_pubfilter(embui.paramVariant(V_PUB_DBAND), embui.paramVariant(V_PUB_HBEAT));
+		espem->modbus_tcp(embui.paramVariant(V_MBT_PORT));
 
 		// postpone TimeSeries setup until NTP aquires valid time
 		TimeProcessor::getInstance().attach_callback([espem]() {
@@ -0,0 +1,407 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Modbus TCP server, serves a cached view of the PZEM bus to SCADA/HA/historian clients
+
+#pragma once
+#include <AsyncTCP.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include "pzem_edl.hpp"
+
+#ifndef MBTCP_PORT
+	#define MBTCP_PORT			502		// default listen port, 0 - server disabled
+#endif
+#ifndef MBTCP_MAX_CLIENTS
+	#define MBTCP_MAX_CLIENTS	4		// concurrent client connections, extra ones are closed on accept
+#endif
+#ifndef MBTCP_IDLE_TIMEOUT
+	#define MBTCP_IDLE_TIMEOUT	60		// close connections idle for that long, sec
+#endif
+#define MBTCP_MAX_UNITS		4			// unit ids served
+#define MBTCP_ADU_SIZE		260			// max MBAP ADU
+#define MBTCP_MAX_REGS		125			// max registers per read request
+#define MBTCP_EXC_BUSY		0x06		// slave device busy
+#define MBTCP_EXC_PATH		0x0A		// gateway path unavailable, no such unit
+#define MBTCP_EXC_TARGET	0x0B		// gateway target device failed to respond, meter data is stale
+
+/**
+ * @brief Modbus TCP unit, a device behind the server
+ * handlers are called from AsyncTCP task and must not block
+ */
+struct mbtcp_unit {
+	uint8_t id = 0;			// unit id, 0 - slot is free
+	/**
+	 * read registers
+	 * @param fc - function code, CMD_RHR/CMD_RIR
+	 * @param reg - first register
+	 * @param cnt - number of registers
+	 * @param dst - buffer for cnt big-endian registers
+	 * @return 0 or modbus exception code
+	 */
+	std::function<uint8_t (uint8_t fc, uint16_t reg, uint16_t cnt, uint8_t *dst)> read;
+	// write a single register, returns 0 or modbus exception code
+	std::function<uint8_t (uint16_t reg, uint16_t val)> write;
+};
+
+struct mbtcp_stats {
+	uint32_t requests = 0;		// requests served
+	uint32_t exceptions = 0;	// exception replies
+	uint32_t writes = 0;		// writes forwarded to the bus
+	uint32_t rejects = 0;		// connections closed due to client limit
+	uint32_t errors = 0;		// malformed frames, connection is closed
+	uint8_t	 clients = 0;		// connected clients
+};
+
+/**
+ * @brief Modbus TCP server exposing a cached view of the meters
+ * Each device is mapped to a unit id. Reads of input (0x04) and holding (0x03) registers are served
+ * from the latest polled state, the serial bus is not touched, so any number of clients cost the same bus time
+ * as the regular poller alone. Writes (0x06) are forwarded to the bus through port's TX queue and acknowledged
+ * once queued, the device applies it on it's turn and the cached state follows with it's reply.
+ *
+ * Server runs on AsyncTCP, requests are handled right in the network task, there are no extra tasks or buffers
+ * besides a partial frame holder per connection.
+ */
+class MbTcpServer {
+	// client connection
+	struct session {
+		MbTcpServer	*srv;
+		AsyncClient	*c;
+		uint8_t		 buf[MBTCP_ADU_SIZE];	// partial frame
+		size_t		 len{0};
+	};
+
+	std::unique_ptr<AsyncServer> server;
+	session		*sessions[MBTCP_MAX_CLIENTS] = {};
+	mbtcp_unit	 units[MBTCP_MAX_UNITS];
+	mbtcp_stats	 stats;
+	uint16_t	 _port{0};
+
+	void onClient(AsyncClient *c);
+	void onDisconnect(session *s);
+	void onData(session *s, const uint8_t *data, size_t len);
+
+	// handle complete request, false if connection should be closed
+	bool request(session *s, const uint8_t *adu, size_t len);
+
+	// send exception reply
+	void exception(session *s, const uint8_t *adu, uint8_t code);
+
+	const mbtcp_unit *unit(uint8_t id) const;
+
+   public:
+	MbTcpServer() = default;
+	~MbTcpServer() { end(); }
+
+	// Copy semantics : forbidden
+	MbTcpServer(const MbTcpServer &) = delete;
+	MbTcpServer &operator=(const MbTcpServer &) = delete;
+
+	/**
+	 * @brief start listening, restarts server if running
+	 *
+	 * @param port - TCP port, 0 - stop server
+	 * @return true on success
+	 */
+	bool begin(uint16_t port = MBTCP_PORT);
+
+	// stop server and close client connections
+	void end();
+
+	/**
+	 * @brief map device to unit id, replaces existing mapping for the same id
+	 * units should be set before server is started
+	 *
+	 * @return false if there are no free slots
+	 */
+	bool addUnit(const mbtcp_unit &u);
+
+	// listen port, 0 - server is stopped
+	uint16_t port() const { return _port; }
+
+	const mbtcp_stats &getStats() const { return stats; }
+};
+
+namespace mbtcp {
+
+// copy registers [reg, reg+cnt) of a block starting at 'first' into dst
+inline uint8_t copyregs(const uint8_t *block, uint16_t first, uint16_t size, uint16_t reg, uint16_t cnt, uint8_t *dst) {
+	if (reg < first || reg + cnt > first + size)
+		return ERR_ADDR;
+	memcpy(dst, block + (reg - first) * 2, cnt * 2);
+	return 0;
+}
+
+inline void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+// queue a request to the bus
+inline uint8_t forward(PZEM *pz, TX_msg *msg) {
+	return pz->send(msg) ? 0 : MBTCP_EXC_BUSY;
+}
+
+/**
+ * @brief PZEM004 unit
+ * input registers are encoded from metrics snapshot with the same register map that decodes meter's replies,
+ * holding registers are alarm threshold and modbus address. Only alarm threshold is writable,
+ * changing slave address would detach the meter from it's poller
+ *
+ * @param pz - meter object, must outlive the server, writes are sent to it's port
+ * @param id - unit id
+ */
+inline mbtcp_unit unit(PZ004 *pz, uint8_t id) {
+	mbtcp_unit u;
+	u.id = id;
+	u.read = [pz](uint8_t fc, uint16_t reg, uint16_t cnt, uint8_t *dst) -> uint8_t {
+		if (pz->getState()->dataStale())
+			return MBTCP_EXC_TARGET;
+		if (fc == CMD_RIR) {
+			const auto snap = pz->getSnapshot();
+			uint8_t block[pz004::regmap::data_len];
+			pz004::regmap::encode(snap.data, block);
+			return copyregs(block, pz004::regmap::first, pz004::regmap::count, reg, cnt, dst);
+		}
+		const auto st = pz->getStatePZ004();
+		uint8_t block[PZ004_RHR_LEN * 2];
+		put16(block, st->alrm_thrsh);
+		put16(block + 2, pz->getaddr());
+		return copyregs(block, PZ004_RHR_BEGIN, PZ004_RHR_LEN, reg, cnt, dst);
+	};
+	u.write = [pz](uint16_t reg, uint16_t val) -> uint8_t {
+		if (reg != PZ004_RHR_ALARM_THR)
+			return ERR_ADDR;
+		return forward(pz, pz004::cmd_set_alarm_thr(val, pz->getaddr()));
+	};
+	return u;
+}
+
+/**
+ * @brief PZEM003/017 unit
+ * holding registers are alarm thresholds, modbus address and shunt type,
+ * thresholds and shunt type are writable
+ */
+inline mbtcp_unit unit(PZ003 *pz, uint8_t id) {
+	mbtcp_unit u;
+	u.id = id;
+	u.read = [pz](uint8_t fc, uint16_t reg, uint16_t cnt, uint8_t *dst) -> uint8_t {
+		if (pz->getState()->dataStale())
+			return MBTCP_EXC_TARGET;
+		if (fc == CMD_RIR) {
+			const auto snap = pz->getSnapshot();
+			uint8_t block[pz003::regmap::data_len];
+			pz003::regmap::encode(snap.data, block);
+			return copyregs(block, pz003::regmap::first, pz003::regmap::count, reg, cnt, dst);
+		}
+		const auto st = pz->getStatePZ003();
+		uint8_t block[PZ003_RHR_CNT * 2];
+		put16(block, st->alrmh_thrsh);
+		put16(block + 2, st->alrml_thrsh);
+		put16(block + 4, pz->getaddr());
+		put16(block + 6, st->irange);
+		return copyregs(block, PZ003_RHR_BEGIN, PZ003_RHR_CNT, reg, cnt, dst);
+	};
+	u.write = [pz](uint16_t reg, uint16_t val) -> uint8_t {
+		switch (reg) {
+			case PZ003_RHR_ALARM_H:
+				return forward(pz, pz003::cmd_set_alarmh_thr(val, pz->getaddr()));
+			case PZ003_RHR_ALARM_L:
+				return forward(pz, pz003::cmd_set_alarml_thr(val, pz->getaddr()));
+			case PZ003_RHR_CURRENT_RANGE:
+				if (val > static_cast<uint8_t>(pz003::shunt_t::type_300A))
+					return ERR_DATA;
+				return forward(pz, pz003::cmd_set_shunt(static_cast<pz003::shunt_t>(val), pz->getaddr()));
+			default:
+				return ERR_ADDR;
+		}
+	};
+	return u;
+}
+
+}  // namespace mbtcp
+
+
+bool MbTcpServer::addUnit(const mbtcp_unit &u) {
+	mbtcp_unit *slot = nullptr;
+	for (auto &i : units) {
+		if (i.id == u.id) {
+			slot = &i;
+			break;
+		}
+		if (!i.id && !slot)
+			slot = &i;
+	}
+	if (!slot || !u.id)
+		return false;
+	*slot = u;
+	return true;
+}
+
+const mbtcp_unit *MbTcpServer::unit(uint8_t id) const {
+	for (const auto &i : units)
+		if (i.id && i.id == id)
+			return &i;
+	return nullptr;
+}
+
+bool MbTcpServer::begin(uint16_t port) {
+	end();
+	if (!port)
+		return true;
+
+	server.reset(new AsyncServer(port));
+	if (!server)
+		return false;
+	server->onClient([](void *arg, AsyncClient *c) { static_cast<MbTcpServer *>(arg)->onClient(c); }, this);
+	server->setNoDelay(true);
+	server->begin();
+	_port = port;
+	LOG(printf, "Modbus TCP server on port %u\n", port);
+	return true;
+}
+
+void MbTcpServer::end() {
+	if (!server)
+		return;
+	server->end();
+	server.reset();
+	_port = 0;
+	for (auto s : sessions)
+		if (s)
+			s->c->close(true);		// session is released by disconnect handler
+}
+
+void MbTcpServer::onClient(AsyncClient *c) {
+	session *s = nullptr;
+	for (auto &i : sessions) {
+		if (!i) {
+			s = i = new (std::nothrow) session{this, c};
+			break;
+		}
+	}
+
+	if (!s) {
+		++stats.rejects;
+		c->onDisconnect([](void *, AsyncClient *c) { delete c; });
+		c->close(true);
+		return;
+	}
+
+	++stats.clients;
+	c->setRxTimeout(MBTCP_IDLE_TIMEOUT);
+	c->setNoDelay(true);
+	c->onData([](void *arg, AsyncClient *, void *data, size_t len) {
+		auto s = static_cast<session *>(arg);
+		s->srv->onData(s, static_cast<const uint8_t *>(data), len);
+	}, s);
+	c->onTimeout([](void *, AsyncClient *c, uint32_t) { c->close(); }, s);
+	c->onDisconnect([](void *arg, AsyncClient *) {
+		auto s = static_cast<session *>(arg);
+		s->srv->onDisconnect(s);
+	}, s);
+}
+
+void MbTcpServer::onDisconnect(session *s) {
+	for (auto &i : sessions)
+		if (i == s)
+			i = nullptr;
+	--stats.clients;
+	delete s->c;
+	delete s;
+}
+
+void MbTcpServer::onData(session *s, const uint8_t *data, size_t len) {
+	while (len) {
+		// MBAP header first, then the rest of the frame it announces
+		size_t need = s->len < 6 ? 6 : 6 + (s->buf[4] << 8 | s->buf[5]);
+		if (s->len >= 6 && (s->buf[2] || s->buf[3] || need < 8 || need > MBTCP_ADU_SIZE)) {
+			++stats.errors;
+			s->c->close();
+			return;
+		}
+		size_t n = std::min(len, need - s->len);
+		memcpy(s->buf + s->len, data, n);
+		s->len += n;
+		data += n;
+		len -= n;
+
+		if (s->len == need && need > 6) {
+			s->len = 0;
+			if (!request(s, s->buf, need)) {
+				++stats.errors;
+				s->c->close();
+				return;
+			}
+		}
+	}
+}
+
+void MbTcpServer::exception(session *s, const uint8_t *adu, uint8_t code) {
+	uint8_t r[9];
+	memcpy(r, adu, 4);		// transaction and protocol ids
+	mbtcp::put16(r + 4, 3);
+	r[6] = adu[6];
+	r[7] = adu[7] | 0x80;
+	r[8] = code;
+	++stats.exceptions;
+	s->c->write(reinterpret_cast<const char *>(r), sizeof(r));
+}
+
+bool MbTcpServer::request(session *s, const uint8_t *adu, size_t len) {
+	++stats.requests;
+	const uint8_t fc = adu[7];
+	const mbtcp_unit *u = unit(adu[6]);
+	if (!u) {
+		exception(s, adu, MBTCP_EXC_PATH);
+		return true;
+	}
+
+	// all supported functions have register address and count/value
+	if (len != 12) {
+		exception(s, adu, fc == CMD_RIR || fc == CMD_RHR || fc == CMD_WSR ? ERR_DATA : ERR_FUNC);
+		return true;
+	}
+	uint16_t reg = adu[8] << 8 | adu[9];
+	uint16_t val = adu[10] << 8 | adu[11];
+
+	switch (fc) {
+		case CMD_RIR:
+		case CMD_RHR: {
+			if (!val || val > MBTCP_MAX_REGS) {
+				exception(s, adu, ERR_DATA);
+				return true;
+			}
+			uint8_t r[9 + MBTCP_MAX_REGS * 2];
+			uint8_t e = u->read ? u->read(fc, reg, val, r + 9) : ERR_FUNC;
+			if (e) {
+				exception(s, adu, e);
+				return true;
+			}
+			memcpy(r, adu, 4);
+			mbtcp::put16(r + 4, 3 + val * 2);
+			r[6] = adu[6];
+			r[7] = fc;
+			r[8] = val * 2;
+			return s->c->write(reinterpret_cast<const char *>(r), 9 + val * 2) == 9 + val * 2U;
+		}
+		case CMD_WSR: {
+			uint8_t e = u->write ? u->write(reg, val) : ERR_FUNC;
+			if (e) {
+				exception(s, adu, e);
+				return true;
+			}
+			++stats.writes;
+			// echo is the reply to a write
+			return s->c->write(reinterpret_cast<const char *>(adu), len) == len;
+		}
+		default:
+			exception(s, adu, ERR_FUNC);
+			return true;
+	}
+}
@@ -0,0 +1,308 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Batched MQTT publisher with offline spool
+
+#pragma once
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <vector>
+#include <LittleFS.h>
+
+#ifndef MQTT_BATCH_MAX_SMPLS
+	#define MQTT_BATCH_MAX_SMPLS	120					// max number of samples packed in one message
+#endif
+#ifndef MQTT_SPOOL_RAM
+	#define MQTT_SPOOL_RAM			(16*1024)			// RAM spool budget for unsent batches, bytes
+#endif
+#ifndef MQTT_SPOOL_FS_MAX
+	#define MQTT_SPOOL_FS_MAX		(256*1024)			// max size of the flash spool file, bytes
+#endif
+#ifndef MQTT_DRAIN_RATE
+	#define MQTT_DRAIN_RATE			2					// max number of messages published per second
+#endif
+#define MQTT_SPOOL_FILE				"/mqspool.bin"
+#define MQTT_BATCH_MIN_TIME			1600000000			// samples are not collected until system clock is set
+#define MQTT_BATCH_VER				1
+
+/**
+ * @brief a single metrics sample in a fixed-point units
+ * all meters are mapped to the same units, missing values are 0
+ */
+struct __attribute__((packed)) mqsample {
+	uint32_t t;		// unixtime
+	uint16_t U;		// voltage, dV
+	uint32_t I;		// current, mA
+	uint32_t P;		// power, dW
+	uint32_t W;		// energy, Wh (with offset)
+	uint16_t hz;	// frequency, dHz
+	uint8_t	 pf;	// power factor, %
+
+	/**
+	 * @brief fill sample from meter metrics
+	 * @param m - PZEM metrics
+	 * @param offset - energy offset, Wh
+	 */
+	void set(uint32_t time, const pzmbus::metrics *m, int32_t offset){
+		auto fx = [](float v, float k) -> uint32_t { return std::isnan(v) || v < 0 ? 0 : lroundf(v * k); };
+		t  = time;
+		U  = fx(m->asFloat(pzmbus::meter_t::vol), 10);
+		I  = fx(m->asFloat(pzmbus::meter_t::cur), 1000);
+		P  = fx(m->asFloat(pzmbus::meter_t::pwr), 10);
+		W  = fx(m->asFloat(pzmbus::meter_t::enrg) + offset, 1);
+		hz = fx(m->asFloat(pzmbus::meter_t::frq), 10);
+		pf = fx(m->asFloat(pzmbus::meter_t::pf), 100);
+	}
+};
+
+/**
+ * @brief MQTT publisher that packs N samples (or T seconds worth of samples) into one message
+ * Sealed batches are kept in a compact binary form:
+ *  [uint8_t version][uint8_t reserved][uint16_t count][mqsample x count]
+ * and rendered to json only when published. While broker is unreachable batches are spooled into a bounded RAM ring,
+ * ring overflow either drops the oldest batches or, if enabled, moves them to a spool file on flash.
+ * On reconnect spool is drained oldest first, with a rate limit of MQTT_DRAIN_RATE messages per second.
+ *
+ * Published json object has columnar layout, each metric is an array of integer fixed-point values:
+ * {"v":1,"t0":1700000000,"t":[0,1,2],"U":[2301,2299,2300],"I":[...],"P":[...],"W":[...],"hz":[...],"pF":[...]}
+ * 't' are offsets in seconds from 't0', 'hz' and 'pF' are omitted for meters that do not report it
+ */
+class MQTTBatcher {
+   public:
+	// sampler call-back, should fill the sample and return true if there is a fresh data available
+	using sampler_t = std::function<bool (mqsample &s)>;
+	// publisher call-back, should return true only if message was accepted for sending
+	using publisher_t = std::function<bool (const char *topic, const char *payload)>;
+
+	MQTTBatcher(const char *topic, publisher_t pub = embui_publish) : _topic(topic), publisher(std::move(pub)) {}
+	~MQTTBatcher() { ts.deleteTask(t_batch); }
+
+	// Copy semantics : forbidden
+	MQTTBatcher(const MQTTBatcher&) = delete;
+	MQTTBatcher& operator=(const MQTTBatcher&) = delete;
+
+	/**
+	 * @brief (re)configure batching
+	 *
+	 * @param smpls - number of samples in a batch, 0 - disable batching
+	 * @param period - max batch duration, seconds. Partially filled batch is sent once period expires, 0 - no limit
+	 * @param fsspool - spool batches that do not fit RAM ring to flash
+	 * @param f - sampler call-back
+	 */
+	void setup(uint16_t smpls, uint16_t period, bool fsspool, sampler_t f){
+		sampler = std::move(f);
+		bperiod = period;
+		fs = fsspool;
+		if (cnt() && smpls != bsize)
+			seal();
+		bsize = smpls > MQTT_BATCH_MAX_SMPLS ? MQTT_BATCH_MAX_SMPLS : smpls;
+
+		if (!bsize){
+			ts.deleteTask(t_batch);
+			return;
+		}
+
+		if (!jbuff){
+			jbuff.reset(new(std::nothrow) char[jbuff_len()]);
+			if (!jbuff){
+				bsize = 0;
+				return;
+			}
+		}
+
+		t_batch.set(TASK_SECOND, TASK_FOREVER, [this](){ tick(); });
+		ts.addTask(t_batch);
+		t_batch.enableIfNot();
+	}
+
+	// batching is active
+	bool enabled() const { return bsize; }
+
+	// number of batches lost due to spool overflow
+	uint32_t drops() const { return _drops; }
+
+	// RAM spool usage, bytes
+	size_t spoolSize() const { return spool_size; }
+
+   private:
+	const char	*_topic;
+	publisher_t	publisher;
+	Task		t_batch;
+	sampler_t	sampler;
+	uint16_t	bsize{0};
+	uint16_t	bperiod{0};
+	bool		fs{false};
+	uint32_t	t_open{0};				// current batch open time, ms
+	std::vector<uint8_t>	cur;		// current batch
+	std::deque< std::vector<uint8_t> >	spool;
+	size_t		spool_size{0};
+	size_t		fs_rd{0};				// spool file read position
+	size_t		fs_end{0};				// spool file size at last read
+	uint32_t	_drops{0};
+	std::unique_ptr<char[]>	jbuff;		// json render buffer
+
+	static constexpr size_t hdr_len = 4;
+	static constexpr size_t smpl_json_len = 64;		// ",4294967295" x 5 + ",65535" + ",100"
+	static constexpr size_t jbuff_len() { return 64 + MQTT_BATCH_MAX_SMPLS * smpl_json_len; }
+
+	uint16_t cnt() const { return cur.size() > hdr_len ? (cur.size() - hdr_len) / sizeof(mqsample) : 0; }
+
+	void tick(){
+		mqsample s;
+		if (sampler && sampler(s)){
+			if (cur.empty()){
+				cur.reserve(hdr_len + bsize * sizeof(mqsample));
+				cur.assign(hdr_len, 0);
+				cur[0] = MQTT_BATCH_VER;
+				t_open = millis();
+			}
+			const uint8_t *p = reinterpret_cast<const uint8_t*>(&s);
+			cur.insert(cur.end(), p, p + sizeof(mqsample));
+		}
+
+		if (cnt() >= bsize || (cnt() && bperiod && millis() - t_open >= bperiod * 1000U))
+			seal();
+
+		drain();
+	}
+
+	// close current batch and move it to the spool
+	void seal(){
+		uint16_t c = cnt();
+		memcpy(&cur[2], &c, sizeof(c));
+		spool_size += cur.size();
+		spool.emplace_back(std::move(cur));
+		cur.clear();
+
+		while (spool_size > MQTT_SPOOL_RAM){
+			if (!fs || !fs_append(spool.front()))
+				++_drops;
+			spool_size -= spool.front().size();
+			spool.pop_front();
+		}
+	}
+
+	// publish spooled batches, oldest first
+	// a batch leaves the spool only when it was accepted by publisher, draining stops on first failure
+	void drain(){
+		for (unsigned n = 0; n != MQTT_DRAIN_RATE; ++n){
+			std::vector<uint8_t> b;
+			size_t next;
+			if (fs && fs_peek(b, next)){
+				if (!publish(b))
+					return;
+				fs_commit(next);
+				continue;
+			}
+			if (spool.empty() || !publish(spool.front()))
+				return;
+			spool_size -= spool.front().size();
+			spool.pop_front();
+		}
+	}
+
+	bool fs_append(const std::vector<uint8_t> &b){
+		File f = LittleFS.open(MQTT_SPOOL_FILE, "a");
+		if (!f)
+			return false;
+		uint16_t len = b.size();
+		bool ok = f.size() + sizeof(len) + len <= MQTT_SPOOL_FS_MAX
+				&& f.write(reinterpret_cast<const uint8_t*>(&len), sizeof(len)) == sizeof(len)
+				&& f.write(b.data(), len) == len;
+		f.close();
+		return ok;
+	}
+
+	/**
+	 * @brief read next batch from the spool file without removing it
+	 * a damaged spool file is removed
+	 * @param b - batch buffer
+	 * @param next - file offset of the batch that follows, should be passed to fs_commit() once 'b' is published
+	 */
+	bool fs_peek(std::vector<uint8_t> &b, size_t &next){
+		if (!LittleFS.exists(MQTT_SPOOL_FILE))
+			return false;
+		File f = LittleFS.open(MQTT_SPOOL_FILE, "r");
+		if (!f)
+			return false;
+
+		uint16_t len = 0;
+		bool ok = f.seek(fs_rd) && f.read(reinterpret_cast<uint8_t*>(&len), sizeof(len)) == sizeof(len) && len >= hdr_len;
+		if (ok){
+			b.resize(len);
+			ok = f.read(b.data(), len) == len;
+		}
+		next = fs_rd + sizeof(len) + len;
+		fs_end = f.size();
+		f.close();
+
+		if (!ok)
+			fs_commit(fs_end);
+		return ok;
+	}
+
+	// advance spool file read position, file is removed once drained
+	void fs_commit(size_t next){
+		fs_rd = next;
+		if (fs_rd >= fs_end){
+			LittleFS.remove(MQTT_SPOOL_FILE);
+			fs_rd = 0;
+		}
+	}
+
+	// default publisher, sends message via EmbUI's MQTT client
+	static bool embui_publish(const char *topic, const char *payload){
+		if (!embui.mqttAvailable())
+			return false;
+		embui.publish(topic, payload);
+		// EmbUI does not report publish result, consider message lost if connection went down meanwhile
+		return embui.mqttAvailable();
+	}
+
+	// render batch to json and publish it
+	// @return false if batch should be kept for retry, malformed batches are discarded
+	bool publish(const std::vector<uint8_t> &b){
+		uint16_t c;
+		memcpy(&c, &b[2], sizeof(c));
+		if (b.size() < hdr_len + c * sizeof(mqsample) || c > MQTT_BATCH_MAX_SMPLS || !c)
+			return true;
+
+		auto smpl = [&b](unsigned i){ mqsample s; memcpy(&s, &b[hdr_len + i * sizeof(mqsample)], sizeof(s)); return s; };
+		char *p = jbuff.get();
+		char *end = p + jbuff_len();
+		uint32_t t0 = smpl(0).t;
+		bool hz = false, pf = false;
+		for (unsigned i = 0; i != c; ++i){
+			hz |= smpl(i).hz;
+			pf |= smpl(i).pf;
+		}
+
+		p += snprintf(p, end - p, "{\"v\":%u,\"t0\":%u", b[0], t0);
+		auto column = [&](const char *name, auto get){
+			p += snprintf(p, end - p, ",\"%s\":[", name);
+			for (unsigned i = 0; i != c; ++i)
+				p += snprintf(p, end - p, i ? ",%u" : "%u", get(smpl(i)));
+			p += snprintf(p, end - p, "]");
+		};
+		column("t",  [t0](const mqsample &s) -> uint32_t { return s.t - t0; });
+		column("U",  [](const mqsample &s) -> uint32_t { return s.U; });
+		column("I",  [](const mqsample &s) -> uint32_t { return s.I; });
+		column("P",  [](const mqsample &s) -> uint32_t { return s.P; });
+		column("W",  [](const mqsample &s) -> uint32_t { return s.W; });
+		if (hz)
+			column("hz", [](const mqsample &s) -> uint32_t { return s.hz; });
+		if (pf)
+			column("pF", [](const mqsample &s) -> uint32_t { return s.pf; });
+		snprintf(p, end - p, "}");
+
+		return publisher && publisher(_topic, jbuff.get());
+	}
+};
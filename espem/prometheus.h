@@ -0,0 +1,249 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Prometheus text exposition format renderer for /metrics endpoint
+
+#pragma once
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <esp_timer.h>
+#include "spscring.hpp"
+#include "evbus.hpp"
+
+#ifndef PROM_BUFF_SIZE
+	#define PROM_BUFF_SIZE		4096		// initial render buffer size, bytes. Buffer grows if metrics do not fit
+#endif
+#ifndef PROM_MIN_RENDER_MS
+	#define PROM_MIN_RENDER_MS	1000		// scrapes coming more often than this get previously rendered data, ms
+#endif
+
+static const char PGmimeprom[] PROGMEM = "text/plain; version=0.0.4; charset=utf-8";
+
+/**
+ * @brief append-only text buffer with printf-like writer
+ * memory is allocated once and reused between renders, no String concatenation
+ */
+class PromBuffer {
+	std::unique_ptr<char[]> buf;
+	size_t	_cap;
+	size_t	_len{0};
+	bool	_ovf{false};
+
+   public:
+	explicit PromBuffer(size_t capacity) : buf(new(std::nothrow) char[capacity]), _cap(buf ? capacity : 0) {}
+
+	void clear(){ _len = 0; _ovf = false; }
+
+	// print formatted text to the buffer, sets overflow flag if data does not fit
+	void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+		if (_ovf)
+			return;
+		va_list args;
+		va_start(args, fmt);
+		int l = vsnprintf(buf.get() + _len, _cap - _len, fmt, args);
+		va_end(args);
+		if (l < 0 || _len + l >= _cap)
+			_ovf = true;
+		else
+			_len += l;
+	}
+
+	const char *data() const { return buf.get(); }
+	size_t size() const { return _len; }
+	size_t capacity() const { return _cap; }
+	bool overflow() const { return _ovf || !_cap; }
+};
+
+/**
+ * @brief renders meter, library and system metrics in Prometheus text format
+ * Rendered page is kept in a shared buffer, responses hold a reference to it,
+ * so the buffer is never touched while some client is still reading it, a new one is allocated instead
+ */
+class PromExporter {
+	std::shared_ptr<PromBuffer> buff;
+	int64_t	rendered_us{0};
+
+	// print HELP and TYPE lines for a metric family
+	void family(const char *name, const char *type, const char *help){
+		buff->printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	}
+
+	// print sample name with an optional labels set
+	void sample(const char *name, const char *labels){
+		if (labels && *labels)
+			buff->printf("%s{%s} ", name, labels);
+		else
+			buff->printf("%s ", name);
+	}
+
+	// print single-sample gauge, NaN values are skipped
+	void gauge(const char *name, const char *help, const char *labels, double v){
+		if (std::isnan(v))
+			return;
+		family(name, "gauge", help);
+		sample(name, labels);
+		buff->printf("%.10g\n", v);
+	}
+
+	// print single-sample counter
+	void counter(const char *name, const char *help, const char *labels, double v){
+		if (std::isnan(v))
+			return;
+		family(name, "counter", help);
+		sample(name, labels);
+		buff->printf("%.10g\n", v);
+	}
+
+	template <class PZ, class DS>
+	void render(const PZ *pz, const MsgQ *q, const DS &ds, const SPSCRing_stats &cs, PZEventBus &bus);
+
+   public:
+	/**
+	 * @brief reply to /metrics scrape request
+	 *
+	 * @param pz - PZEM object, PZ004/PZ003
+	 * @param q - PZEM's message queue, could be nullptr
+	 * @param ds - TimeSeries storage, DataStorage<T>
+	 * @param cs - TimeSeries collector queue counters
+	 * @param bus - device events bus
+	 */
+	template <class PZ, class DS>
+	void serve(AsyncWebServerRequest *request, const PZ *pz, const MsgQ *q, const DS &ds, const SPSCRing_stats &cs, PZEventBus &bus);
+};
+
+template <class PZ, class DS>
+void PromExporter::render(const PZ *pz, const MsgQ *q, const DS &ds, const SPSCRing_stats &cs, PZEventBus &bus){
+	char l[24];
+
+	if (pz){
+		const auto s = pz->getState();
+		const auto snap = pz->getSnapshot();
+		const auto m = &snap.data;
+		snprintf(l, sizeof(l), "meter=\"%u\"", pz->id);
+
+		gauge("espem_voltage_volts", "Line voltage", l, m->asFloat(pzmbus::meter_t::vol));
+		gauge("espem_current_amperes", "Line current", l, m->asFloat(pzmbus::meter_t::cur));
+		gauge("espem_power_watts", "Active power", l, m->asFloat(pzmbus::meter_t::pwr));
+		counter("espem_energy_watthours_total", "Active energy counter, including configured offset", l, m->asFloat(pzmbus::meter_t::enrg) + ds.getEnergyOffset());
+		gauge("espem_frequency_hertz", "Line frequency", l, m->asFloat(pzmbus::meter_t::frq));
+		gauge("espem_power_factor", "Power factor", l, m->asFloat(pzmbus::meter_t::pf));
+		gauge("espem_alarm", "Power alarm state", l, m->asFloat(pzmbus::meter_t::alrmh));
+		gauge("espem_alarm_low", "Low power alarm state", l, m->asFloat(pzmbus::meter_t::alrml));
+		gauge("espem_data_age_seconds", "Time since last successful meter reply", l, s->update_us ? s->dataAge() / 1000.0 : NAN);
+		gauge("espem_data_stale", "Meter data is stale", l, s->dataStale());
+		counter("espem_polls_total", "Meter poll requests sent", l, s->polls);
+		counter("espem_replies_total", "Valid meter replies received", l, s->replies);
+		counter("espem_poll_timeouts_total", "Meter polls left without a reply", l, s->timeouts);
+		counter("espem_reply_errors_total", "Error or unparsable meter replies", l, s->errors);
+		counter("espem_reply_stray_total", "Valid replies addressed to some other device", l, s->stray);
+		family("espem_modbus_exceptions_total", "counter", "Modbus exception replies by exception code");
+		for (unsigned c = 0; c != PZ_EXC_CODES; ++c)
+			buff->printf("espem_modbus_exceptions_total{%s,code=\"%u\"} %u\n", l, c, (unsigned)s->exceptions[c]);
+		if (s->rtt_max_us){
+			gauge("espem_reply_latency_seconds", "Last poll-to-reply time", l, s->rtt_us / 1e6);
+			gauge("espem_reply_latency_min_seconds", "Min poll-to-reply time", l, s->rtt_min_us / 1e6);
+			gauge("espem_reply_latency_max_seconds", "Max poll-to-reply time", l, s->rtt_max_us / 1e6);
+			gauge("espem_reply_jitter_seconds", "Poll-to-reply time variation, smoothed mean deviation", l, s->jitter_us / 1e6);
+		}
+	}
+
+	if (q){
+		const auto &st = q->getStats();
+		snprintf(l, sizeof(l), "port=\"%u\"", PORT_1_ID);
+		counter("espem_uart_tx_frames_total", "Frames sent to UART", l, st.tx_frames);
+		counter("espem_uart_tx_drops_total", "Frames dropped on TX queue", l, st.tx_drops);
+		counter("espem_uart_rx_frames_total", "Frames received from UART", l, st.rx_frames);
+		counter("espem_uart_rx_crc_errors_total", "Received frames with bad CRC", l, st.rx_crc_err);
+		counter("espem_uart_rx_overflows_total", "UART RX FIFO/buffer overflows", l, st.rx_ovf);
+		counter("espem_uart_rx_line_errors_total", "UART RX break/framing errors", l, st.rx_errors);
+		counter("espem_uart_rx_drops_total", "Received data discarded", l, st.rx_drops);
+		counter("espem_uart_rx_timeouts_total", "Reply wait timeouts", l, st.rx_timeouts);
+	}
+
+	int cnt = ds.getTScnt();
+	if (cnt){
+		family("espem_ts_samples", "gauge", "Samples stored in TimeSeries tier");
+		for (int id = 1, n = 0; n != cnt && id < 256; ++id){
+			auto t = ds.getTS(id);
+			if (!t)
+				continue;
+			++n;
+			buff->printf("espem_ts_samples{tsid=\"%d\"} %d\n", id, t->getSize());
+		}
+	}
+	counter("espem_collector_samples_total", "Samples handed over to TimeSeries collector", nullptr, cs.pushed);
+	counter("espem_collector_drops_total", "Samples dropped due to collector queue overflow", nullptr, cs.drops);
+	gauge("espem_collector_queue_hwm", "Collector queue max fill level", nullptr, cs.hwm);
+	if (bus.size()){
+		// per-subscriber counters, one family at a time
+		struct { const char *name, *type, *help; } const fams[] = {
+			{"espem_bus_delivered_total", "counter", "Events taken by bus subscriber"},
+			{"espem_bus_dropped_total", "counter", "Events lost due to subscriber queue overflow"},
+			{"espem_bus_coalesced_total", "counter", "Events replaced with a newer one in subscriber queue"},
+			{"espem_bus_pending", "gauge", "Events waiting in subscriber queue"},
+			{"espem_bus_lag_seconds", "gauge", "Age of the oldest event in subscriber queue"}
+		};
+		for (unsigned f = 0; f != sizeof(fams) / sizeof(fams[0]); ++f){
+			family(fams[f].name, fams[f].type, fams[f].help);
+			bus.foreach([this, &fams, f](const PZSubscriber &sub){
+				const auto st = sub.getStats();
+				const double v[] = { (double)st.delivered, (double)st.dropped, (double)st.coalesced, (double)st.pending, st.lag_us / 1e6 };
+				buff->printf("%s{sub=\"%s\"} %.10g\n", fams[f].name, sub.getName(), v[f]);
+			});
+		}
+	}
+	gauge("espem_export_cache_bytes", "Export cache memory usage", nullptr, ds.getCacheSize());
+
+	gauge("espem_heap_free_bytes", "Free heap", nullptr, ESP.getFreeHeap());
+	gauge("espem_heap_min_free_bytes", "Free heap low watermark", nullptr, ESP.getMinFreeHeap());
+	gauge("espem_heap_max_alloc_bytes", "Largest allocatable heap block", nullptr, MAX_FREE_MEM_BLK);
+	if (ESP.getPsramSize())
+		gauge("espem_psram_free_bytes", "Free PSRAM", nullptr, ESP.getFreePsram());
+	gauge("espem_uptime_seconds", "Time since boot", nullptr, esp_timer_get_time() / 1000000);
+}
+
+template <class PZ, class DS>
+void PromExporter::serve(AsyncWebServerRequest *request, const PZ *pz, const MsgQ *q, const DS &ds, const SPSCRing_stats &cs, PZEventBus &bus){
+	int64_t now = esp_timer_get_time();
+	if (!buff || now - rendered_us > PROM_MIN_RENDER_MS * 1000){
+		size_t cap = buff ? buff->capacity() : PROM_BUFF_SIZE;
+		// buffer is still held by some in-flight response, leave it to them
+		if (buff && buff.use_count() > 1)
+			buff.reset();
+
+		for (int attempt = 0; attempt != 2; ++attempt){
+			if (!buff)
+				buff = std::make_shared<PromBuffer>(cap);
+			buff->clear();
+			render(pz, q, ds, cs, bus);
+			if (!buff->overflow())
+				break;
+			// does not fit, grow buffer and retry
+			cap = buff->capacity() ? buff->capacity() * 2 : PROM_BUFF_SIZE;
+			buff.reset();
+		}
+
+		if (!buff || buff->overflow()){
+			buff.reset();
+			request->send(503, PGmimetxt, PGdre);
+			return;
+		}
+		rendered_us = now;
+	}
+
+	auto b = buff;
+	AsyncWebServerResponse *response = request->beginResponse(FPSTR(PGmimeprom), b->size(),
+		[b](uint8_t *dst, size_t maxlen, size_t index) -> size_t {
+			size_t len = std::min(maxlen, b->size() - index);
+			memcpy(dst, b->data() + index, len);
+			return len;
+		});
+	request->send(response);
+}
@@ -9,7 +9,9 @@ static constexpr const char C_mkchart[] = "mkchart";
 static constexpr const char C_mkgauge[] = "mkgauge";
 static constexpr const char C_gsmini[] = "gsmini";
 static constexpr const char C_mqtt_pzem_jmetrics[] = "pub/pzem/jmetrics";
+static constexpr const char C_mqtt_pzem_jbatch[] = "pub/pzem/jbatch";
 static constexpr const char C_scnt[] = "scnt";                  // samle counter
+static constexpr const char C_after_seq[] = "after_seq";        // export samples following this sequence number
 static constexpr const char C_tier[] = "tier";
 static constexpr const char C_lchart[] = "lchart";
 
@@ -26,6 +28,12 @@ static constexpr const char V_RX[] = "rx";                      // rx pin
 static constexpr const char V_TX[] = "tx";                      // tx ping
 static constexpr const char V_UART[] = "uart";                  // uart interface
 static constexpr const char V_EOFFSET[] = "eoffset";            // energy offset
+static constexpr const char V_MQB_CNT[] = "mqbcnt";             // MQTT batch size, samples (0 - publish each UI cycle)
+static constexpr const char V_MQB_INT[] = "mqbint";             // MQTT batch max period, sec
+static constexpr const char V_MQB_SPOOL[] = "mqbspool";         // MQTT spool unsent batches to flash
+static constexpr const char V_PUB_DBAND[] = "pubdband";         // metrics publishing deadband, %
+static constexpr const char V_PUB_HBEAT[] = "pubhbeat";         // metrics publishing heartbeat, sec
+static constexpr const char V_MBT_PORT[] = "mbtport";           // Modbus TCP server port, 0 - disabled
 
 // directly changed vars, must match actions with prefixed "dctl_"
 static constexpr const char V_EPOLLENA[] = "poll";              // Enable/disable poller
@@ -48,6 +56,9 @@ static constexpr const char A_set_espem_pool[] = "set_espem_pool";  //  ESPEM se
 static constexpr const char A_SET_UART[] =  "set_uart";
 static constexpr const char A_SET_PZOPTS[] =  "set_nrgoffset";
 static constexpr const char A_SET_MCOLLECTOR[] = "set_mcollector";    // apply metrics collector settings
+static constexpr const char A_SET_MQBATCH[] = "set_mqbatch";        // apply MQTT batching settings
+static constexpr const char A_SET_PUBFLTR[] = "set_pubfilter";      // apply metrics publishing filter settings
+static constexpr const char A_SET_MBTCP[] = "set_mbtcp";            // apply Modbus TCP server settings
 
 // onChange controls actions
 static constexpr const char A_EPOLLENA[] = "dctl_poll";             // Enable/disable poller
@@ -0,0 +1,93 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// Change-driven publishing filter for WebUI/MQTT metrics updates
+
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+
+#ifndef WSPUB_DEADBAND
+	#define WSPUB_DEADBAND		0		// default deadband, percents of the last published value
+#endif
+#ifndef WSPUB_HEARTBEAT
+	#define WSPUB_HEARTBEAT		10		// default heartbeat, seconds
+#endif
+
+// metrics values to compare between publish cycles, raw integers as reported by meter
+struct pubsnap {
+	enum : uint8_t { U = 0, I, P, W, pf, hz, size };
+	uint32_t v[size];
+	bool	 stale;
+};
+
+/**
+ * @brief decides whether metrics should be published on a periodic publisher tick
+ * publish takes place if:
+ *  - meter reported new data and any of the values has moved beyond deadband since last publish (any change if deadband is 0),
+ *    energy counter is always published on change
+ *  - data stale state changed
+ *  - heartbeat interval expired since last publish
+ */
+class WsPubFilter {
+	pubsnap	 last{};
+	int64_t	 last_upd{-1};
+	uint32_t last_pub{0};		// millis() of the last publish
+	uint8_t	 dband{WSPUB_DEADBAND};
+	uint16_t hbeat{WSPUB_HEARTBEAT};
+	bool	 _force{true};
+
+	bool moved(const pubsnap &s) const {
+		if (s.v[pubsnap::W] != last.v[pubsnap::W])
+			return true;
+		for (uint8_t i = 0; i != pubsnap::size; ++i){
+			uint32_t d = s.v[i] > last.v[i] ? s.v[i] - last.v[i] : last.v[i] - s.v[i];
+			if (d && d * 100 >= static_cast<uint64_t>(last.v[i]) * dband)
+				return true;
+		}
+		return false;
+	}
+
+   public:
+	/**
+	 * @brief set filter options
+	 *
+	 * @param deadband - value change threshold, percents
+	 * @param heartbeat - max publish interval, seconds. 0 - publish only on change
+	 */
+	void setup(uint8_t deadband, uint16_t heartbeat){
+		dband = deadband;
+		hbeat = heartbeat;
+		_force = true;
+	}
+
+	// make next check() to pass unconditionally
+	void force(){ _force = true; }
+
+	/**
+	 * @brief check if metrics snapshot should be published, if so - snapshot is remembered as published
+	 *
+	 * @param update_us - meter's last update time
+	 * @param s - metrics snapshot
+	 * @return true - publish
+	 */
+	bool check(int64_t update_us, const pubsnap &s){
+		uint32_t now = millis();
+		bool pub = _force
+				|| s.stale != last.stale
+				|| (update_us != last_upd && moved(s))
+				|| (hbeat && now - last_pub >= hbeat * 1000U);
+		// new data within deadband is not published, but keep the last reference value
+		last_upd = update_us;
+		if (!pub)
+			return false;
+
+		last = s;
+		last_pub = now;
+		_force = false;
+		return true;
+	}
+};
@@ -0,0 +1,366 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// On-the-fly gzip/deflate compression for chunked HTTP responses
+
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <ESPAsyncWebServer.h>
+
+#ifndef ZSTREAM_WSIZE
+	#define ZSTREAM_WSIZE			2048		// LZ77 window size, bytes (power of 2, 1024...32768)
+#endif
+#ifndef ZSTREAM_HSIZE
+	#define ZSTREAM_HSIZE			512			// match finder hash table size (power of 2)
+#endif
+#ifndef ZSTREAM_MAX_ACTIVE
+	#define ZSTREAM_MAX_ACTIVE		2			// max number of concurrently compressed responses, 0 - disable compression
+#endif
+#ifndef ZSTREAM_HEAP_RESERVE
+	#define ZSTREAM_HEAP_RESERVE	(24*1024)	// do not start new compressor if largest free heap block would go below this mark, bytes
+#endif
+
+#define ZS_MIN_MATCH	3
+#define ZS_MAX_MATCH	258
+#define ZS_MIN_INPUT	512						// min free space in input buffer to call data source
+
+static_assert(ZSTREAM_WSIZE >= 1024 && ZSTREAM_WSIZE <= 32768 && !(ZSTREAM_WSIZE & (ZSTREAM_WSIZE - 1)), "ZSTREAM_WSIZE must be a power of 2 in range 1024...32768");
+static_assert(ZSTREAM_HSIZE && !(ZSTREAM_HSIZE & (ZSTREAM_HSIZE - 1)), "ZSTREAM_HSIZE must be a power of 2");
+
+// content encodings
+enum class zenc_t : uint8_t {
+	identity = 0,
+	gzip,
+	deflate		// zlib wrapped deflate, RFC1950
+};
+
+/**
+ * @brief Streaming deflate compressor (RFC1951) with gzip/zlib framing
+ * Pulls data from a chunked response filler and returns compressed stream of the same data.
+ * Fixed Huffman codes and greedy LZ77 matching over a small window keeps RAM usage constant,
+ * about 2*ZSTREAM_WSIZE + 4*ZSTREAM_HSIZE bytes per stream, whatever the size of the response
+ */
+class ZStream {
+	enum class zstate_t : uint8_t { head, data, tail, done };
+
+	AwsResponseFiller _src;
+	const zenc_t _enc;
+	zstate_t _state = zstate_t::head;
+	bool	 _eof = false;
+
+	std::unique_ptr<uint8_t[]>	_buf;		// input data with LZ77 history, 2*ZSTREAM_WSIZE
+	std::unique_ptr<uint32_t[]>	_hash;		// last positions of 3-byte sequences (+1)
+	uint32_t _base = 0;						// stream position of _buf[0]
+	uint32_t _pos = 0;						// stream position of next byte to encode
+	uint32_t _fill = 0;						// stream position of input data end
+
+	uint64_t _bits = 0;						// output bit accumulator
+	uint32_t _nbits = 0;
+	uint8_t	 _hidx = 0;						// header/trailer byte index
+	uint32_t _crc = 0xffffffff;				// gzip crc32
+	uint32_t _adler = 1;					// zlib adler32
+
+	static std::atomic<int>& active(){
+		static std::atomic<int> a{0};
+		return a;
+	}
+
+	ZStream(zenc_t enc, AwsResponseFiller src) : _src(src), _enc(enc) {}
+
+	inline void put(uint32_t v, uint32_t n){
+		_bits |= static_cast<uint64_t>(v) << _nbits;
+		_nbits += n;
+	}
+
+	// Huffman codes are packed starting from the most significant bit
+	inline void putcode(uint32_t code, uint32_t n){
+		uint32_t r = 0;
+		for (uint32_t i = 0; i != n; ++i, code >>= 1)
+			r = (r << 1) | (code & 1);
+		put(r, n);
+	}
+
+	void literal(uint8_t c){
+		if (c < 144)
+			putcode(0x30 + c, 8);
+		else
+			putcode(0x190 + c - 144, 9);
+	}
+
+	void match(uint32_t len, uint32_t dist){
+		static const uint16_t lbase[] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+		static const uint8_t  lext[]  = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+		static const uint16_t dbase[] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+		static const uint8_t  dext[]  = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+		uint32_t i = sizeof(lext) - 1;
+		while (lbase[i] > len) --i;
+		uint32_t sym = 257 + i;
+		if (sym < 280)
+			putcode(sym - 256, 7);
+		else
+			putcode(0xc0 + sym - 280, 8);
+		put(len - lbase[i], lext[i]);
+
+		i = sizeof(dext) - 1;
+		while (dbase[i] > dist) --i;
+		putcode(i, 5);
+		put(dist - dbase[i], dext[i]);
+	}
+
+	static inline uint32_t hash3(const uint8_t *p){
+		return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 16 & (ZSTREAM_HSIZE - 1);
+	}
+
+	void checksum(const uint8_t *p, size_t len){
+		// nibble-wise crc32, just 16 words of table
+		static const uint32_t crctbl[] = {
+			0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+			0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+
+		if (_enc == zenc_t::gzip){
+			for (size_t i = 0; i != len; ++i){
+				_crc ^= p[i];
+				_crc = crctbl[_crc & 0x0f] ^ (_crc >> 4);
+				_crc = crctbl[_crc & 0x0f] ^ (_crc >> 4);
+			}
+			return;
+		}
+
+		uint32_t a = _adler & 0xffff, b = _adler >> 16;
+		for (size_t i = 0; i != len; ++i){
+			a += p[i];
+			if (a >= 65521) a -= 65521;
+			b += a;
+			if (b >= 65521) b -= 65521;
+		}
+		_adler = b << 16 | a;
+	}
+
+	// pull more data from the source
+	void refill(){
+		if (_fill - _base + ZS_MIN_INPUT > 2*ZSTREAM_WSIZE){
+			// slide the window, keeping ZSTREAM_WSIZE bytes of history
+			memmove(_buf.get(), _buf.get() + ZSTREAM_WSIZE, ZSTREAM_WSIZE);
+			_base += ZSTREAM_WSIZE;
+		}
+
+		size_t off = _fill - _base;
+		size_t n = _src(_buf.get() + off, 2*ZSTREAM_WSIZE - off, _fill);
+		if (!n){
+			_eof = true;
+			return;
+		}
+		checksum(_buf.get() + off, n);
+		_fill += n;
+	}
+
+	// encode one literal or match at current position
+	void encode(){
+		const uint8_t *p = _buf.get() + (_pos - _base);
+		uint32_t avail = _fill - _pos;
+		uint32_t len = 0, cand = 0;
+
+		if (avail >= ZS_MIN_MATCH){
+			auto &h = _hash[hash3(p)];
+			cand = h;
+			h = _pos + 1;
+			if (cand && --cand >= _base && _pos - cand <= ZSTREAM_WSIZE){
+				const uint8_t *c = _buf.get() + (cand - _base);
+				uint32_t max = avail < ZS_MAX_MATCH ? avail : ZS_MAX_MATCH;
+				while (len != max && c[len] == p[len]) ++len;
+			}
+		}
+
+		if (len < ZS_MIN_MATCH){
+			literal(*p);
+			++_pos;
+			return;
+		}
+
+		match(len, _pos - cand);
+		// index sequences inside the match, so that next matches could refer to it
+		for (uint32_t i = 1; i != len && avail - i >= ZS_MIN_MATCH; ++i)
+			_hash[hash3(p + i)] = _pos + i + 1;
+		_pos += len;
+	}
+
+   public:
+	~ZStream(){ --active(); }
+
+	/**
+	 * @brief create a compressor for the response data source
+	 * checks concurrent streams budget and free heap
+	 * @return std::shared_ptr<ZStream> - nullptr if no compression could be done at the moment
+	 */
+	static std::shared_ptr<ZStream> create(zenc_t enc, AwsResponseFiller src){
+		if (enc == zenc_t::identity || active() >= ZSTREAM_MAX_ACTIVE)
+			return nullptr;
+		if (MAX_FREE_MEM_BLK < ZSTREAM_HEAP_RESERVE + 2*ZSTREAM_WSIZE + ZSTREAM_HSIZE*sizeof(uint32_t) + sizeof(ZStream))
+			return nullptr;
+
+		++active();
+		std::shared_ptr<ZStream> z(new(std::nothrow) ZStream(enc, src));
+		if (!z){
+			--active();
+			return nullptr;
+		}
+		z->_buf.reset(new(std::nothrow) uint8_t[2*ZSTREAM_WSIZE]);
+		z->_hash.reset(new(std::nothrow) uint32_t[ZSTREAM_HSIZE]());
+		if (!z->_buf || !z->_hash)
+			return nullptr;
+		return z;
+	}
+
+	/**
+	 * @brief pick content encoding from 'Accept-Encoding' header value
+	 * gzip is preferred over deflate, encodings with q=0 are ignored
+	 */
+	static zenc_t negotiate(const char *ae){
+		zenc_t enc = zenc_t::identity;
+		while (ae && *ae){
+			while (*ae == ' ' || *ae == ',') ++ae;
+			const char *t = ae;
+			while (*ae && *ae != ',' && *ae != ';' && *ae != ' ') ++ae;
+			size_t tlen = ae - t;
+
+			// check for a 'q=0' parameter
+			bool q0 = false;
+			while (*ae && *ae != ','){
+				if (*ae == '=' && ae[-1] == 'q'){
+					const char *v = ae + 1;
+					while (*v == '0' || *v == '.') ++v;
+					q0 = (v != ae + 1) && (!*v || *v == ',' || *v == ' ' || *v == ';');
+				}
+				++ae;
+			}
+			if (q0)
+				continue;
+
+			if (tlen == 4 && !strncasecmp(t, "gzip", 4))
+				return zenc_t::gzip;
+			if (tlen == 7 && !strncasecmp(t, "deflate", 7))
+				enc = zenc_t::deflate;
+		}
+		return enc;
+	}
+
+	/**
+	 * @brief read compressed data
+	 * could be used as a chunked response filler
+	 * @return size_t - number of bytes written to buffer, 0 when stream is complete
+	 */
+	size_t read(uint8_t *buffer, size_t maxlen){
+		size_t len = 0;
+
+		for (;;){
+			// flush accumulated bits, each step below adds no more than 32 bits
+			while (_nbits >= 8 && len != maxlen){
+				buffer[len++] = _bits & 0xff;
+				_bits >>= 8;
+				_nbits -= 8;
+			}
+			if (_nbits >= 8 || _state == zstate_t::done)
+				return len;
+
+			switch (_state){
+				case zstate_t::head: {
+					static const uint8_t gzhdr[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+					static const uint8_t zhdr[]  = {0x78, 0x01};
+					const uint8_t *h = _enc == zenc_t::gzip ? gzhdr : zhdr;
+					size_t hlen = _enc == zenc_t::gzip ? sizeof(gzhdr) : sizeof(zhdr);
+
+					if (_hidx != hlen){
+						put(h[_hidx++], 8);
+						break;
+					}
+					// non-final block with fixed Huffman codes
+					put(0, 1);
+					put(1, 2);
+					_state = zstate_t::data;
+					break;
+				}
+				case zstate_t::data: {
+					if (_fill - _pos < ZS_MAX_MATCH && !_eof){
+						refill();
+						break;
+					}
+					if (_pos != _fill){
+						encode();
+						break;
+					}
+					// end of block, then an empty final block
+					putcode(0, 7);
+					put(1, 1);
+					put(1, 2);
+					putcode(0, 7);
+					if (_nbits & 7)
+						put(0, 8 - (_nbits & 7));
+					_hidx = 0;
+					_state = zstate_t::tail;
+					break;
+				}
+				case zstate_t::tail: {
+					uint8_t b;
+					if (_enc == zenc_t::gzip){
+						if (_hidx == 8){
+							_state = zstate_t::done;
+							break;
+						}
+						// crc32 and input size, little-endian
+						uint32_t v = _hidx < 4 ? ~_crc : _fill;
+						b = v >> (8 * (_hidx & 3));
+					} else {
+						if (_hidx == 4){
+							_state = zstate_t::done;
+							break;
+						}
+						// adler32, big-endian
+						b = _adler >> (8 * (3 - _hidx));
+					}
+					put(b, 8);
+					++_hidx;
+					break;
+				}
+				default:
+					return len;
+			}
+		}
+	}
+};
+
+/**
+ * @brief begin chunked response compressed with content encoding accepted by the client
+ * falls back to uncompressed response if client does not support it or compressors budget is exhausted
+ *
+ * @param request - http request
+ * @param contentType - content MIME type
+ * @param filler - response data source
+ * @return AsyncWebServerResponse*
+ */
+static AsyncWebServerResponse *beginZChunkedResponse(AsyncWebServerRequest *request, const String &contentType, AwsResponseFiller filler) {
+	zenc_t enc = zenc_t::identity;
+	if (request->hasHeader("Accept-Encoding"))
+		enc = ZStream::negotiate(request->getHeader("Accept-Encoding")->value().c_str());
+
+	auto z = ZStream::create(enc, filler);
+	if (!z) {
+		auto response = request->beginChunkedResponse(contentType, filler);
+		response->addHeader("Vary", "Accept-Encoding");
+		return response;
+	}
+
+	auto response = request->beginChunkedResponse(contentType, [z](uint8_t *buffer, size_t buffsize, size_t index) -> size_t {
+		return z->read(buffer, buffsize);
+	});
+	response->addHeader("Content-Encoding", enc == zenc_t::gzip ? "gzip" : "deflate");
+	response->addHeader("Vary", "Accept-Encoding");
+	return response;
+}
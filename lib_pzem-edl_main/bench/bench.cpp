@@ -0,0 +1,448 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    Micro-benchmarks for the library hot paths, host build only
+
+    usage: pzem_edl_bench [--filter <substr>] [--min-time <ms>] [--repeat <n>]
+    results are printed to stdout as json, so that runs for different commits could be diffed
+*/
+
+#include "pzem_modbus.hpp"
+#include "timeseries.hpp"
+#include "tspersist.hpp"
+#include "tsarchive.hpp"
+#include "tsareader.hpp"
+#include "modbus_crc16.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using clk = std::chrono::steady_clock;
+using pzmbus::meter_t;
+
+// same as espem sample template for PZEM004
+#define TSLOG_SEG_SIZE  (96*1024)       // same as espem
+
+static const char smpljsontpl[] = ",{\"t\":%u000,\"U\":%.2f,\"I\":%.2f,\"P\":%.0f,\"W\":%.0f,\"hz\":%.1f,\"pF\":%.2f}";
+
+namespace {
+
+// keep compiler from optimizing away benchmarked code
+template <class T>
+inline void keep(T const &v){ asm volatile("" : : "g"(&v) : "memory"); }
+
+struct result {
+    std::string name;
+    uint64_t iterations;    // iterations per run
+    double ns_op;           // median time per op across runs, ns
+    double ns_op_min;       // best run, ns
+};
+
+struct options {
+    const char *filter = nullptr;
+    double min_time_ms = 200;
+    unsigned repeat = 5;
+};
+
+options opt;
+std::vector<result> results;
+
+/**
+ * @brief run benchmark case
+ * number of iterations is doubled until a run takes at least 'min_time', then the case is repeated
+ * to get median and best time
+ *
+ * @param name - case name
+ * @param f - function to run, takes number of iterations, returns number of ops done
+ */
+// case is selected by --filter
+bool selected(const char *name){
+    return !opt.filter || strstr(name, opt.filter);
+}
+
+template <class F>
+void bench(const char *name, F f){
+    if (!selected(name))
+        return;
+
+    uint64_t n = 1;
+    double ns = 0;
+    uint64_t ops = 0;
+    for (;;){
+        auto t = clk::now();
+        ops = f(n);
+        ns = std::chrono::duration<double, std::nano>(clk::now() - t).count();
+        if (ns >= opt.min_time_ms * 1e6 || n >= (1ULL << 40))
+            break;
+        n = ns > 1e6 ? static_cast<uint64_t>(n * opt.min_time_ms * 1e6 / ns * 1.1) + 1 : n * 2;
+    }
+
+    std::vector<double> runs{ns / ops};
+    for (unsigned i = 1; i < opt.repeat; ++i){
+        auto t = clk::now();
+        ops = f(n);
+        runs.push_back(std::chrono::duration<double, std::nano>(clk::now() - t).count() / ops);
+    }
+    std::sort(runs.begin(), runs.end());
+    results.push_back(result{name, n, runs[runs.size() / 2], runs.front()});
+    fprintf(stderr, "%-32s %12.2f ns/op\n", name, runs[runs.size() / 2]);
+}
+
+// valid PZEM004 metrics reply frame
+std::vector<uint8_t> pz004_reply(uint8_t addr){
+    std::vector<uint8_t> f(PZ004_RIR_RESP_LEN + 5);
+    f[0] = addr;
+    f[1] = CMD_RIR;
+    f[2] = PZ004_RIR_RESP_LEN;
+    const uint16_t regs[] = {2301, 1520, 0, 3310, 0, 5811, 0, 500, 64, 0};
+    for (size_t i = 0; i != sizeof(regs) / sizeof(regs[0]); ++i){
+        f[3 + i * 2] = regs[i] >> 8;
+        f[4 + i * 2] = regs[i] & 0xff;
+    }
+    modbus::setcrc16(f.data(), f.size());
+    return f;
+}
+
+// valid PZEM003/017 metrics reply frame
+std::vector<uint8_t> pz003_reply(uint8_t addr){
+    std::vector<uint8_t> f(PZ003_RIR_RESP_LEN + 5);
+    f[0] = addr;
+    f[1] = CMD_RIR;
+    f[2] = PZ003_RIR_RESP_LEN;
+    const uint16_t regs[] = {1245, 312, 3885, 0, 12034, 0, 0, 0};
+    for (size_t i = 0; i != sizeof(regs) / sizeof(regs[0]); ++i){
+        f[3 + i * 2] = regs[i] >> 8;
+        f[4 + i * 2] = regs[i] & 0xff;
+    }
+    modbus::setcrc16(f.data(), f.size());
+    return f;
+}
+
+RX_msg* make_rx(const std::vector<uint8_t> &frame){
+    uint8_t *b = RX_msg::buff_alloc(frame.size());
+    memcpy(b, frame.data(), frame.size());
+    return new RX_msg(b, frame.size());
+}
+
+// pseudo-random metrics sample
+pz004::metrics sample(uint32_t i){
+    pz004::metrics m;
+    m.voltage = 2200 + i % 200;
+    m.current = 1000 + i % 5000;
+    m.power = 2000 + i % 20000;
+    m.energy = 5000000 + i / 10;
+    m.freq = 495 + i % 10;
+    m.pf = 60 + i % 40;
+    return m;
+}
+
+// default espem TimeSeries tiers
+void tiers(TSContainer<pz004::metrics> &c){
+    c.addTS(900, 0, 1, "Tier 1", 1);
+    c.addTS(1000, 0, 15, "Tier 2", 2);
+    c.addTS(1000, 0, 300, "Tier 3", 3);
+}
+
+// TimeSeries log with all tiers filled up, created once in a temp dir and removed on exit
+const std::string& tslog(){
+    static char dir[] = "/tmp/pzbenchXXXXXX";
+    static std::string path;
+    if (!path.empty() || !mkdtemp(dir))
+        return path;
+    path = std::string(dir) + "/tslog";
+    TSContainer<pz004::metrics> c;
+    tiers(c);
+    TSPersist<pz004::metrics> p(c, path.c_str(), TSLOG_SEG_SIZE);
+    p.begin();
+    for (uint32_t i = 1; i <= 300000; ++i){
+        c.push(sample(i), i);
+        p.sync();
+    }
+    p.end();
+    atexit([](){
+        for (uint8_t i = 0; i != TSPERSIST_SEGMENTS; ++i)
+            remove(tspersist::segname(path, i).c_str());
+        rmdir(dir);
+    });
+    return path;
+}
+
+void parse_args(int argc, char *argv[]){
+    for (int i = 1; i < argc; ++i){
+        if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+            opt.filter = argv[++i];
+        else if (!strcmp(argv[i], "--min-time") && i + 1 < argc)
+            opt.min_time_ms = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--repeat") && i + 1 < argc)
+            opt.repeat = std::max(1, atoi(argv[++i]));
+        else {
+            fprintf(stderr, "usage: %s [--filter <substr>] [--min-time <ms>] [--repeat <n>]\n", argv[0]);
+            exit(1);
+        }
+    }
+}
+
+void print_json(){
+    printf("{\"suite\":\"pzem-edl\",\"build\":{\"static_alloc\":%s,\"trace\":%s,\"compiler\":\"%s\"},\"min_time_ms\":%g,\"repeat\":%u,\"benchmarks\":[",
+#ifdef PZEM_EDL_STATIC_ALLOC
+        "true",
+#else
+        "false",
+#endif
+#ifdef PZEM_EDL_TRACE
+        "true",
+#else
+        "false",
+#endif
+        __VERSION__, opt.min_time_ms, opt.repeat);
+    for (size_t i = 0; i != results.size(); ++i){
+        const auto &r = results[i];
+        printf("%s\n{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.3f,\"ns_per_op_min\":%.3f}", i ? "," : "",
+            r.name.c_str(), static_cast<unsigned long long>(r.iterations), r.ns_op, r.ns_op_min);
+    }
+    printf("\n]}\n");
+}
+
+}   // namespace
+
+
+int main(int argc, char *argv[]){
+    parse_args(argc, argv);
+
+    // === MODBUS framing ===
+    bench("crc16/8", [](uint64_t n){
+        uint8_t frame[8] = {0xf8, 0x04, 0x00, 0x00, 0x00, 0x0a, 0, 0};
+        for (uint64_t i = 0; i != n; ++i){
+            frame[5] = static_cast<uint8_t>(i);
+            uint16_t c = modbus::crc16(frame, 6);
+            keep(c);
+        }
+        return n;
+    });
+
+    bench("crc16/25", [](uint64_t n){
+        auto f = pz004_reply(0x01);
+        for (uint64_t i = 0; i != n; ++i){
+            f[4] = static_cast<uint8_t>(i);
+            uint16_t c = modbus::crc16(f.data(), f.size() - 2);
+            keep(c);
+        }
+        return n;
+    });
+
+    bench("create_msg", [](uint64_t n){
+        for (uint64_t i = 0; i != n; ++i){
+            TX_msg *m = pzmbus::create_msg(CMD_RIR, 0, PZ004_RIR_DATA_LEN, 0x01);
+            keep(m);
+            delete m;
+        }
+        return n;
+    });
+
+    bench("pz004/metrics_parse", [](uint64_t n){
+        RX_msg *rx = make_rx(pz004_reply(0x01));
+        pz004::metrics m;
+        for (uint64_t i = 0; i != n; ++i){
+            bool ok = m.parse_rx_msg(rx);
+            keep(ok);
+            keep(m);
+        }
+        delete rx;
+        return n;
+    });
+
+    bench("pz003/metrics_parse", [](uint64_t n){
+        RX_msg *rx = make_rx(pz003_reply(0x01));
+        pz003::metrics m;
+        for (uint64_t i = 0; i != n; ++i){
+            bool ok = m.parse_rx_msg(rx);
+            keep(ok);
+            keep(m);
+        }
+        delete rx;
+        return n;
+    });
+
+    bench("pz004/state_parse", [](uint64_t n){
+        RX_msg *rx = make_rx(pz004_reply(0x01));
+        pz004::state s;
+        s.addr = 0x01;
+        for (uint64_t i = 0; i != n; ++i){
+            bool ok = s.parse_rx_mgs(rx);
+            keep(ok);
+        }
+        delete rx;
+        return n;
+    });
+
+    bench("pz004/rx_msg_crc_parse", [](uint64_t n){
+        // the whole RX path for a frame: buffer alloc, CRC check, parse, release
+        const auto f = pz004_reply(0x01);
+        pz004::state s;
+        s.addr = 0x01;
+        for (uint64_t i = 0; i != n; ++i){
+            RX_msg *rx = make_rx(f);
+            bool ok = s.parse_rx_mgs(rx);
+            keep(ok);
+            delete rx;
+        }
+        return n;
+    });
+
+    // === TimeSeries ===
+    bench("ringbuff/push_back", [](uint64_t n){
+        RingBuff<pz004::metrics> rb(1024);
+        const auto m = sample(1);
+        for (uint64_t i = 0; i != n; ++i)
+            rb.push_back(m);
+        keep(rb);
+        return n;
+    });
+
+    bench("ringbuff/iterate", [](uint64_t n){
+        RingBuff<pz004::metrics> rb(1024);
+        for (uint32_t i = 0; i != 1500; ++i)
+            rb.push_back(sample(i));
+        uint64_t ops = 0;
+        uint64_t sum = 0;
+        while (ops < n){
+            for (auto i = rb.cbegin(); i != rb.cend(); ++i)
+                sum += i->voltage;
+            ops += rb.getSize();
+        }
+        keep(sum);
+        return ops;
+    });
+
+    bench("timeseries/push_avg", [](uint64_t n){
+        TimeSeries<pz004::metrics> ts(1, 1000, 0, 10);
+        ts.setAverager(std::unique_ptr<AveragingFunction<pz004::metrics>>(new MeanAverage<pz004::metrics>()));
+        for (uint64_t i = 0; i != n; ++i)
+            ts.push(sample(i), static_cast<uint32_t>(i));
+        keep(ts);
+        return n;
+    });
+
+    bench("tscontainer/push_3tiers", [](uint64_t n){
+        TSContainer<pz004::metrics> c;
+        c.setAverager(c.addTS(900, 0, 1, "Tier 1"), std::unique_ptr<AveragingFunction<pz004::metrics>>(new MeanAverage<pz004::metrics>()));
+        c.setAverager(c.addTS(1000, 0, 15, "Tier 2"), std::unique_ptr<AveragingFunction<pz004::metrics>>(new MeanAverage<pz004::metrics>()));
+        c.setAverager(c.addTS(1000, 0, 300, "Tier 3"), std::unique_ptr<AveragingFunction<pz004::metrics>>(new MeanAverage<pz004::metrics>()));
+        for (uint64_t i = 0; i != n; ++i)
+            c.push(sample(i), static_cast<uint32_t>(i));
+        keep(c);
+        return n;
+    });
+
+    // === persistence ===
+    if (selected("tspersist/restore_3tiers"))
+        tslog();        // log is made outside of timed runs
+    bench("tspersist/restore_3tiers", [](uint64_t n){
+        // default espem tiers filled up, restore and log reopen after reboot
+        const std::string &path = tslog();
+        for (uint64_t i = 0; i != n; ++i){
+            TSContainer<pz004::metrics> c;
+            tiers(c);
+            TSPersist<pz004::metrics> p(c, path.c_str(), TSLOG_SEG_SIZE);
+            bool ok = p.begin();
+            keep(ok);
+        }
+        return n;
+    });
+
+    // === archive export ===
+    bench("tsarchive/write", [](uint64_t n){
+        // /archive.bin response filler for default espem tiers, 1436 bytes per chunk as with TCP MSS
+        TSContainer<pz004::metrics> c;
+        tiers(c);
+        for (uint32_t i = 1; i <= 300000; i += 15)
+            c.push(sample(i), i);
+        uint8_t buff[1436];
+        uint64_t ops = 0;
+        while (ops < n){
+            tsarchive::Writer<pz004::metrics> w;
+            c.foreach([&w](TimeSeries<pz004::metrics> &ts){ w.add(&ts); });
+            size_t len, index = 0;
+            while ((len = w.read(buff, sizeof(buff), index))){
+                keep(buff);
+                index += len;
+            }
+            ops += index / sizeof(tsarchive::record);
+        }
+        return ops;
+    });
+
+    bench("tsarchive/scan", [](uint64_t n){
+        // host side reader, power values of all tiers
+        TSContainer<pz004::metrics> c;
+        tiers(c);
+        for (uint32_t i = 1; i <= 300000; i += 15)
+            c.push(sample(i), i);
+        tsarchive::Writer<pz004::metrics> w;
+        c.foreach([&w](TimeSeries<pz004::metrics> &ts){ w.add(&ts); });
+        std::vector<uint64_t> file(w.size() / sizeof(uint64_t));
+        w.read(reinterpret_cast<uint8_t*>(file.data()), w.size(), 0);
+        tsarchive::Reader a;
+        a.open(file.data(), w.size());
+        uint64_t ops = 0;
+        float sum = 0;
+        while (ops < n){
+            for (uint8_t t = 0; t != a.tiers(); ++t){
+                tsarchive::TierView tier = a.tier(t);
+                for (const tsarchive::record &r : tier)
+                    sum += tier.value(r, tsarchive::field_t::power);
+                ops += tier.size();
+            }
+        }
+        keep(sum);
+        return ops;
+    });
+
+    // === export ===
+    bench("json/sample", [](uint64_t n){
+        // per-sample json formatting as done by espem /samples.json export
+        TimeSeries<pz004::metrics> ts(1, 1000, 0, 1);
+        for (uint32_t i = 0; i != 1000; ++i)
+            ts.push(sample(i), i);
+        char buff[128];
+        uint64_t ops = 0;
+        size_t len = 0;
+        while (ops < n){
+            uint32_t first = ts.getSeq() - ts.getSize();
+            for (uint32_t seq = first; seq != ts.getSeq(); ++seq){
+                const pz004::metrics m = *ts.at(seq - first);
+                len += snprintf(buff, sizeof(buff), smpljsontpl
+                    , static_cast<unsigned>(ts.getTstamp() - (ts.getSeq() - seq) * ts.getInterval())
+                    , m.asFloat(meter_t::vol)
+                    , m.asFloat(meter_t::cur)
+                    , m.asFloat(meter_t::pwr)
+                    , m.asFloat(meter_t::enrg)
+                    , m.asFloat(meter_t::frq)
+                    , m.asFloat(meter_t::pf));
+                keep(buff);
+            }
+            ops += ts.getSize();
+        }
+        keep(len);
+        return ops;
+    });
+
+    print_json();
+    return 0;
+}
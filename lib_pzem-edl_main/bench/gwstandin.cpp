@@ -0,0 +1,366 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    RS485-to-Ethernet gateway stand-in, host build only
+
+    Listens for TCP connections and serves N emulated PZEM004 slaves on a single virtual RS485 bus behind it,
+    either as Modbus TCP (MBAP) or as raw RTU-over-TCP gateway. Requests of all the clients share the bus,
+    so transactions are served one at a time with 9600 baud framing time, slave reply latency and request loss.
+    Connections could be dropped every N requests to check client's reconnect. Runs in real time.
+
+    usage: pzem_gwstandin [options], see usage() below
+*/
+
+#include "pzem_modbus.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GW_BYTE_US      (10 * 1000000 / PZEM_BAUD_RATE)     // one byte on the wire (8N1), us
+
+namespace {
+
+struct options {
+    unsigned listen = 5020;         // TCP port
+    bool rtu = false;               // RTU-over-TCP instead of Modbus TCP
+    unsigned devices = 8;           // slaves at addresses 1..N
+    double latency = 20;            // slave reply delay, ms
+    double jitter = 5;              // reply delay spread (+/-), ms
+    double loss = 0;                // requests left without reply, %
+    unsigned close_every = 0;       // drop client connection after N requests, 0 - never
+    unsigned seed = 1;
+};
+
+options opt;
+volatile sig_atomic_t quit = 0;
+
+int64_t now_us(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct client {
+    std::vector<uint8_t> rx;
+    unsigned requests = 0;
+};
+
+struct reply {
+    int fd;
+    std::vector<uint8_t> data;
+};
+
+struct counters {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t replies = 0;
+    uint64_t lost = 0;
+    uint64_t unknown = 0;           // requests to absent slaves or unsupported commands
+    uint64_t dropped = 0;           // connections closed on purpose
+};
+
+std::map<int, client> clients;
+std::multimap<int64_t, reply> pending;     // replies by send time, us
+int64_t bus_busy = 0;               // RS485 line is busy until, us
+std::mt19937 rnd;
+counters cnt;
+uint16_t alarm_thr[ADDR_MAX + 1];
+uint32_t energy[ADDR_MAX + 1];
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [options]\n"
+        "  --listen PORT       TCP port (%u)\n"
+        "  --proto mbap|rtu    Modbus TCP or RTU-over-TCP (mbap)\n"
+        "  --devices N         slaves at addresses 1..N (%u)\n"
+        "  --latency MS        slave reply delay (%g)\n"
+        "  --jitter MS         reply delay spread +/- (%g)\n"
+        "  --loss PCT          requests left without reply (%g)\n"
+        "  --close-every N     drop client connection after N requests, 0 - never (%u)\n"
+        "  --seed N            random seed (%u)\n",
+        name, opt.listen, opt.devices, opt.latency, opt.jitter, opt.loss, opt.close_every, opt.seed);
+    exit(1);
+}
+
+void parse_args(int argc, char *argv[]){
+    for (int i = 1; i < argc; ++i){
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        const char *a = argv[i], *v = argv[++i];
+        if (!strcmp(a, "--listen")) opt.listen = atoi(v);
+        else if (!strcmp(a, "--proto")) opt.rtu = !strcmp(v, "rtu");
+        else if (!strcmp(a, "--devices")) opt.devices = atoi(v);
+        else if (!strcmp(a, "--latency")) opt.latency = atof(v);
+        else if (!strcmp(a, "--jitter")) opt.jitter = atof(v);
+        else if (!strcmp(a, "--loss")) opt.loss = atof(v);
+        else if (!strcmp(a, "--close-every")) opt.close_every = atoi(v);
+        else if (!strcmp(a, "--seed")) opt.seed = atoi(v);
+        else usage(argv[0]);
+    }
+    if (!opt.listen || opt.listen > 65535 || !opt.devices || opt.devices > ADDR_MAX)
+        usage(argv[0]);
+}
+
+void put16(std::vector<uint8_t> &f, uint16_t v){
+    f.push_back(v >> 8);
+    f.push_back(v & 0xff);
+}
+
+/**
+ * @brief PZEM004 slave reply to an RTU request, without CRC
+ * @return empty frame if slave does not reply
+ */
+std::vector<uint8_t> slave(const uint8_t *req, size_t len){
+    std::vector<uint8_t> f;
+    uint8_t addr = req[0], fc = req[1];
+    if (addr < ADDR_MIN || addr > opt.devices)
+        return f;
+
+    f.push_back(addr);
+    f.push_back(fc);
+    uint16_t reg = len >= 6 ? req[2] << 8 | req[3] : 0;
+    uint16_t val = len >= 6 ? req[4] << 8 | req[5] : 0;
+    switch (fc){
+        case CMD_RIR : {
+            if (reg + val > PZ004_RIR_DATA_LEN || !val){
+                f[1] |= 0x80;
+                f.push_back(ERR_ADDR);
+                break;
+            }
+            energy[addr] += rnd() % 3;
+            const uint16_t regs[PZ004_RIR_DATA_LEN] = {static_cast<uint16_t>(2200 + rnd() % 200), static_cast<uint16_t>(rnd() % 10000), 0,
+                                     static_cast<uint16_t>(rnd() % 20000), 0, static_cast<uint16_t>(energy[addr] & 0xffff),
+                                     static_cast<uint16_t>(energy[addr] >> 16), 500, 90, 0};
+            f.push_back(val * 2);
+            for (uint16_t i = reg; i != reg + val; ++i)
+                put16(f, regs[i]);
+            break;
+        }
+        case CMD_RHR : {
+            if (reg < PZ004_RHR_BEGIN || reg + val > PZ004_RHR_BEGIN + PZ004_RHR_LEN || !val){
+                f[1] |= 0x80;
+                f.push_back(ERR_ADDR);
+                break;
+            }
+            const uint16_t regs[] = {alarm_thr[addr], addr};
+            f.push_back(val * 2);
+            for (uint16_t i = reg; i != reg + val; ++i)
+                put16(f, regs[i - PZ004_RHR_BEGIN]);
+            break;
+        }
+        case CMD_WSR : {
+            if (reg == PZ004_RHR_ALARM_THR)
+                alarm_thr[addr] = val;
+            f.assign(req, req + 6);       // echo, address change is not emulated
+            break;
+        }
+        case CMD_RST_ENRG :
+            energy[addr] = 0;
+            break;
+        default:
+            ++cnt.unknown;
+            f.clear();
+    }
+    return f;
+}
+
+void close_client(int fd){
+    close(fd);
+    clients.erase(fd);
+    for (auto i = pending.begin(); i != pending.end(); ){
+        if (i->second.fd == fd)
+            i = pending.erase(i);
+        else
+            ++i;
+    }
+}
+
+/**
+ * @brief put request on the bus and schedule the reply
+ *
+ * @param rtu - RTU request frame with CRC
+ * @param mbap - MBAP header of the request, nullptr for RTU-over-TCP
+ */
+void transact(int fd, const uint8_t *rtu, size_t len, const uint8_t *mbap){
+    ++cnt.requests;
+    int64_t now = now_us();
+    int64_t rx_end = std::max(now, bus_busy) + len * GW_BYTE_US;
+    bus_busy = rx_end;
+
+    auto r = slave(rtu, len);
+    if (r.empty()){
+        ++cnt.unknown;
+        return;
+    }
+    if (std::uniform_real_distribution<double>(0, 100)(rnd) < opt.loss){
+        ++cnt.lost;
+        return;
+    }
+
+    r.resize(r.size() + 2);
+    modbus::setcrc16(r.data(), r.size());
+    double delay = opt.latency + std::uniform_real_distribution<double>(-opt.jitter, opt.jitter)(rnd);
+    int64_t tx_end = rx_end + static_cast<int64_t>(std::max(0.0, delay) * 1000) + r.size() * GW_BYTE_US;
+    bus_busy = tx_end;
+
+    reply rep{fd, {}};
+    if (mbap){
+        // CRC is stripped, length covers unit id and PDU
+        rep.data.assign(mbap, mbap + 4);
+        put16(rep.data, r.size() - 2);
+        rep.data.insert(rep.data.end(), r.begin(), r.end() - 2);
+    } else
+        rep.data = std::move(r);
+    pending.emplace(tx_end, std::move(rep));
+}
+
+// handle complete requests in client's buffer, returns false if connection should be closed
+bool serve(int fd, client &c){
+    auto &b = c.rx;
+    for (;;){
+        size_t flen;
+        if (opt.rtu){
+            if (b.size() < 2)
+                return true;
+            flen = b[1] == CMD_RST_ENRG ? ENERGY_RST_MSG_SIZE : GENERIC_MSG_SIZE;
+            if (b.size() < flen)
+                return true;
+            if (modbus::checkcrc16(b.data(), flen))
+                transact(fd, b.data(), flen, nullptr);
+            else
+                ++cnt.unknown;
+        } else {
+            if (b.size() < 7)
+                return true;
+            uint16_t len = b[4] << 8 | b[5];
+            if (b[2] || b[3] || len < 2 || len > 254)
+                return false;
+            flen = len + 6;
+            if (b.size() < flen)
+                return true;
+            std::vector<uint8_t> rtu(b.begin() + 6, b.begin() + flen);
+            rtu.resize(rtu.size() + 2);
+            modbus::setcrc16(rtu.data(), rtu.size());
+            transact(fd, rtu.data(), rtu.size(), b.data());
+        }
+        b.erase(b.begin(), b.begin() + flen);
+
+        if (opt.close_every && ++c.requests >= opt.close_every){
+            ++cnt.dropped;
+            return false;
+        }
+    }
+}
+
+void print_stats(){
+    fprintf(stderr, "{\"connections\":%llu,\"clients\":%zu,\"requests\":%llu,\"replies\":%llu,\"lost\":%llu,\"unknown\":%llu,\"dropped\":%llu}\n",
+        static_cast<unsigned long long>(cnt.connections), clients.size(), static_cast<unsigned long long>(cnt.requests),
+        static_cast<unsigned long long>(cnt.replies), static_cast<unsigned long long>(cnt.lost),
+        static_cast<unsigned long long>(cnt.unknown), static_cast<unsigned long long>(cnt.dropped));
+}
+
+}   // namespace
+
+
+int main(int argc, char *argv[]){
+    parse_args(argc, argv);
+    rnd.seed(opt.seed);
+    signal(SIGINT, [](int){ quit = 1; });
+    signal(SIGTERM, [](int){ quit = 1; });
+    signal(SIGPIPE, SIG_IGN);
+
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(opt.listen);
+    if (ls < 0 || bind(ls, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) || listen(ls, 16)){
+        perror("listen");
+        return 1;
+    }
+    fprintf(stderr, "gateway stand-in: %s on 127.0.0.1:%u, %u slaves\n", opt.rtu ? "RTU-over-TCP" : "Modbus TCP", opt.listen, opt.devices);
+
+    int64_t next_stats = now_us() + 10000000;
+    while (!quit){
+        std::vector<pollfd> fds{{ls, POLLIN, 0}};
+        for (const auto &c : clients)
+            fds.push_back({c.first, POLLIN, 0});
+
+        int64_t now = now_us();
+        int timeout = 100;
+        if (!pending.empty())
+            timeout = std::max<int64_t>(0, (pending.begin()->first - now + 999) / 1000);
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents & POLLIN){
+            int fd = accept(ls, nullptr, nullptr);
+            if (fd >= 0){
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                clients[fd];
+                ++cnt.connections;
+            }
+        }
+
+        for (size_t i = 1; i != fds.size(); ++i){
+            if (!fds[i].revents)
+                continue;
+            int fd = fds[i].fd;
+            uint8_t buf[512];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0){
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    close_client(fd);
+                continue;
+            }
+            auto &c = clients[fd];
+            c.rx.insert(c.rx.end(), buf, buf + n);
+            if (!serve(fd, c))
+                close_client(fd);
+        }
+
+        // send replies that are due
+        now = now_us();
+        while (!pending.empty() && pending.begin()->first <= now){
+            const auto &r = pending.begin()->second;
+            if (send(r.fd, r.data.data(), r.data.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(r.data.size()))
+                ++cnt.replies;
+            pending.erase(pending.begin());
+        }
+
+        if (now > next_stats){
+            print_stats();
+            next_stats = now + 10000000;
+        }
+    }
+
+    print_stats();
+    for (auto &c : clients)
+        close(c.first);
+    close(ls);
+    return 0;
+}
@@ -0,0 +1,620 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    End-to-end bus throughput and soak harness, host build only
+
+    PZPool polls N virtual PZEM004 slaves over emulated UART ports. Slaves reply with a configurable latency,
+    request loss and reply corruption rate, bus time is accounted for 9600 baud framing.
+    Harness runs in accelerated virtual time and reports achieved poll rate, per-device poll period jitter,
+    reply latency percentiles, drop causes and heap/allocation counters over time as json to stdout.
+    With --discover devices are not registered by hand, pool finds them with a bus sweep of each port first,
+    some of the slaves could be PZEM003 and an address could be shared by two slaves to check model detection and collisions.
+    Dead slaves (--dead) never reply or come back after a while (--revive), to check pool's backoff and recovery of unresponsive devices.
+    UART tasks could be pinned to a core (--core) while busy threads load core 0 (--load), to compare poll-to-reply jitter
+    with tasks sharing the core with network stack load and pinned away from it.
+
+    usage: pzem_edl_soak [options], see usage() below
+*/
+
+#include "pzem_edl.hpp"
+#include "modbus_crc16.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <malloc.h>
+
+#define SOAK_BAUD_BYTE_US   (10 * 1000000 / PZEM_BAUD_RATE)     // one byte on the wire (8N1), us
+#define SOAK_MAX_PORTS      UART_NUM_MAX
+
+
+// === allocation counters ===
+
+namespace {
+std::atomic<uint64_t> n_allocs{0};
+std::atomic<uint64_t> n_frees{0};
+}
+
+void* operator new(size_t size){
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    n_allocs.fetch_add(1, std::memory_order_relaxed);
+    return p;
+}
+void* operator new[](size_t size){ return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    void *p = malloc(size ? size : 1);
+    if (p)
+        n_allocs.fetch_add(1, std::memory_order_relaxed);
+    return p;
+}
+void* operator new[](size_t size, const std::nothrow_t &t) noexcept { return operator new(size, t); }
+void operator delete(void *p) noexcept {
+    if (!p)
+        return;
+    n_frees.fetch_add(1, std::memory_order_relaxed);
+    free(p);
+}
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+
+namespace {
+
+struct options {
+    unsigned devices = 8;           // number of virtual slaves
+    unsigned ports = 1;             // number of emulated ports, devices are spread round-robin
+    unsigned duration = 3600;       // test duration, s of virtual time
+    double scale = 60;              // virtual time acceleration
+    unsigned pollrate = 1000;       // poll period, ms
+    double latency = 20;            // slave reply delay after the request has been received, ms
+    double jitter = 5;              // reply delay spread (+/-), ms
+    double loss = 0;                // requests left without reply, %
+    double corrupt = 0;             // replies with a broken byte, %
+    unsigned report = 60;           // report interval, s of virtual time
+    unsigned seed = 1;
+    bool discover = false;          // register devices found with a bus sweep
+    unsigned pz003 = 0;             // the last N slaves are PZEM003
+    unsigned collide = 0;           // address shared by two slaves, their replies are garbled
+    unsigned dead = 0;              // the first N slaves do not reply
+    unsigned revive = 0;            // dead slaves come back after S seconds of virtual time, 0 - never
+    unsigned backoff = PZHEALTH_THRESHOLD;  // pool's failed polls before backoff, 0 - disabled
+    unsigned gateway = 0;           // TCP port of pzem_gwstandin on localhost
+    bool rtu = false;               // RTU-over-TCP instead of Modbus TCP
+    unsigned tcp_ports = 0;         // the last N ports talk to the gateway
+    int core = tskNO_AFFINITY;      // UART tasks core
+    unsigned load = 0;              // busy threads on core 0, emulate WiFi/TCP stack load
+};
+
+options opt;
+int64_t revive_us = INT64_MAX;      // virtual time dead slaves come back at
+
+/**
+ * @brief fixed 1 ms resolution histogram with an overflow bucket
+ */
+struct ms_histogram {
+    static constexpr size_t size = 2000;
+    uint64_t cnt[size + 1] = {};
+    uint64_t total = 0;
+    double max = 0;
+
+    void add(double ms){
+        size_t i = ms < 0 ? 0 : static_cast<size_t>(ms);
+        ++cnt[i < size ? i : size];
+        ++total;
+        if (ms > max)
+            max = ms;
+    }
+
+    // upper bound of the bucket containing p-th percentile, ms
+    double percentile(double p) const {
+        if (!total)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(total * p / 100.0 + 0.999999);
+        uint64_t acc = 0;
+        for (size_t i = 0; i != size; ++i){
+            acc += cnt[i];
+            if (acc >= rank)
+                return i + 1;
+        }
+        return max;
+    }
+};
+
+// === virtual slaves on emulated bus ===
+
+struct frame {
+    int port;
+    std::vector<uint8_t> data;
+};
+
+class VirtualBus {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::multimap<int64_t, frame> pending;      // replies by delivery time, us
+    int64_t busy_until[SOAK_MAX_PORTS] = {};    // line is busy transmitting until, us
+    std::mt19937 rnd;
+    std::thread worker;
+    bool quit = false;
+
+public:
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> replies{0};
+    std::atomic<uint64_t> lost{0};
+    std::atomic<uint64_t> corrupted{0};
+    std::atomic<uint64_t> unknown{0};       // requests to a non-existing slave or command
+    std::atomic<uint64_t> silent{0};        // requests to dead slaves
+
+    explicit VirtualBus(unsigned seed) : rnd(seed) {
+        worker = std::thread([this]{ run(); });
+    }
+
+    ~VirtualBus(){
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            quit = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // TX hook, called from port's TX task
+    void request(int port, const uint8_t *data, size_t len){
+        ++requests;
+        // slaves are spread round-robin over the ports
+        if (len < 8 || !modbus::checkcrc16(data, len) || data[1] != CMD_RIR || data[0] < ADDR_MIN || data[0] > opt.devices ||
+            static_cast<unsigned>(port) != (data[0] - 1u) % opt.ports){
+            ++unknown;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lk(mtx);
+        int64_t now = pzhost::now_us();
+        if (data[0] <= opt.dead && now < revive_us){
+            ++silent;
+            return;
+        }
+        int64_t rx_end = std::max(now, busy_until[port]) + len * SOAK_BAUD_BYTE_US;
+        busy_until[port] = rx_end;
+
+        if (std::uniform_real_distribution<double>(0, 100)(rnd) < opt.loss){
+            ++lost;
+            return;
+        }
+
+        frame f{port, data[0] > opt.devices - opt.pz003 ? reply003(data[0], data[5]) : reply(data[0])};
+        // replies of two slaves with the same address overlap on the wire
+        if (data[0] == opt.collide || std::uniform_real_distribution<double>(0, 100)(rnd) < opt.corrupt){
+            f.data[3 + rnd() % (f.data.size() - 5)] ^= 0x5a;
+            ++corrupted;
+        }
+
+        double delay = opt.latency + std::uniform_real_distribution<double>(-opt.jitter, opt.jitter)(rnd);
+        int64_t tx_start = rx_end + static_cast<int64_t>(std::max(0.0, delay) * 1000);
+        int64_t tx_end = tx_start + f.data.size() * SOAK_BAUD_BYTE_US;
+        busy_until[port] = tx_end;
+        pending.emplace(tx_end, std::move(f));
+        cv.notify_all();
+    }
+
+private:
+    // PZEM004 metrics reply with slightly varying values
+    std::vector<uint8_t> reply(uint8_t addr){
+        std::vector<uint8_t> f(PZ004_RIR_RESP_LEN + 5);
+        f[0] = addr;
+        f[1] = CMD_RIR;
+        f[2] = PZ004_RIR_RESP_LEN;
+        const uint16_t regs[] = {static_cast<uint16_t>(2200 + rnd() % 200), static_cast<uint16_t>(rnd() % 10000), 0,
+                                 static_cast<uint16_t>(rnd() % 20000), 0, static_cast<uint16_t>(requests & 0xffff), 0, 500, 90, 0};
+        for (size_t i = 0; i != sizeof(regs) / sizeof(regs[0]); ++i){
+            f[3 + i * 2] = regs[i] >> 8;
+            f[4 + i * 2] = regs[i] & 0xff;
+        }
+        modbus::setcrc16(f.data(), f.size());
+        return f;
+    }
+
+    // PZEM003 metrics reply, reading registers past the last one is an illegal address
+    std::vector<uint8_t> reply003(uint8_t addr, uint8_t count){
+        if (count > PZ003_RIR_DATA_LEN){
+            std::vector<uint8_t> f{addr, CMD_RERR, ERR_ADDR, 0, 0};
+            modbus::setcrc16(f.data(), f.size());
+            return f;
+        }
+        std::vector<uint8_t> f(PZ003_RIR_RESP_LEN + 5);
+        f[0] = addr;
+        f[1] = CMD_RIR;
+        f[2] = PZ003_RIR_RESP_LEN;
+        const uint16_t regs[] = {static_cast<uint16_t>(1200 + rnd() % 200), static_cast<uint16_t>(rnd() % 1000),
+                                 static_cast<uint16_t>(rnd() % 20000), 0, static_cast<uint16_t>(requests & 0xffff), 0, 0, 0};
+        for (size_t i = 0; i != sizeof(regs) / sizeof(regs[0]); ++i){
+            f[3 + i * 2] = regs[i] >> 8;
+            f[4 + i * 2] = regs[i] & 0xff;
+        }
+        modbus::setcrc16(f.data(), f.size());
+        return f;
+    }
+
+    // deliver replies to the emulated ports on time
+    void run(){
+        std::unique_lock<std::mutex> lk(mtx);
+        while (!quit){
+            if (pending.empty()){
+                cv.wait(lk);
+                continue;
+            }
+            int64_t wait = pending.begin()->first - pzhost::now_us();
+            if (wait > 0){
+                cv.wait_for(lk, std::chrono::nanoseconds(static_cast<int64_t>(wait * 1000 / opt.scale)));
+                continue;
+            }
+            frame f = std::move(pending.begin()->second);
+            pending.erase(pending.begin());
+            lk.unlock();
+            pzhost::uart_inject_rx(f.port, f.data.data(), f.data.size());
+            ++replies;
+            lk.lock();
+        }
+    }
+};
+
+// === per-device observations ===
+
+struct device_stats {
+    int64_t last_update = 0;
+    uint64_t updates = 0;
+};
+
+std::mutex obs_mtx;
+std::vector<device_stats> devs;
+ms_histogram period_dev;        // |actual update period - poll period|, ms
+ms_histogram latency;           // poll-to-reply time, ms
+
+void on_rx(uint8_t id, const RX_msg *m, const PZPool &pool){
+    (void)m;
+    const auto *s = pool.getState(id);
+    if (!s)
+        return;
+    std::lock_guard<std::mutex> lk(obs_mtx);
+    auto &d = devs[id];
+    if (s->update_us == d.last_update)
+        return;                 // reply has not been accepted
+    if (d.last_update)
+        period_dev.add(std::abs((s->update_us - d.last_update) / 1000.0 - opt.pollrate));
+    d.last_update = s->update_us;
+    ++d.updates;
+    latency.add(s->rtt_us / 1000.0);
+}
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [options]\n"
+        "  --devices N     virtual slaves (%u)\n"
+        "  --ports N       emulated ports, max %d (%u)\n"
+        "  --duration S    test duration, s of virtual time (%u)\n"
+        "  --scale X       virtual time acceleration (%g)\n"
+        "  --pollrate MS   poll period (%u)\n"
+        "  --latency MS    slave reply delay (%g)\n"
+        "  --jitter MS     reply delay spread +/- (%g)\n"
+        "  --loss PCT      requests left without reply (%g)\n"
+        "  --corrupt PCT   replies with a broken byte (%g)\n"
+        "  --report S      report interval, s of virtual time (%u)\n"
+        "  --seed N        random seed (%u)\n"
+        "  --discover      find devices with a bus sweep instead of registering them\n"
+        "  --pz003 N       the last N slaves are PZEM003 (%u)\n"
+        "  --collide ADDR  two slaves share the address (none)\n"
+        "  --dead N        the first N slaves do not reply (%u)\n"
+        "  --revive S      dead slaves come back after S seconds, 0 - never (%u)\n"
+        "  --backoff N     failed polls before device is backed off, 0 - disabled (%u)\n"
+        "  --gateway PORT  pzem_gwstandin TCP port on localhost, requires --scale 1\n"
+        "  --proto P       gateway protocol, mbap|rtu (mbap)\n"
+        "  --tcp-ports N   the last N ports talk to the gateway (%u)\n"
+        "  --core N        pin UART tasks to core N (any)\n"
+        "  --load N        busy threads pinned to core 0, requires --scale 1 (%u)\n",
+        name, opt.devices, SOAK_MAX_PORTS, opt.ports, opt.duration, opt.scale, opt.pollrate, opt.latency, opt.jitter,
+        opt.loss, opt.corrupt, opt.report, opt.seed, opt.pz003, opt.dead, opt.revive, opt.backoff, opt.tcp_ports, opt.load);
+    exit(1);
+}
+
+void parse_args(int argc, char *argv[]){
+    for (int i = 1; i < argc; ++i){
+        if (!strcmp(argv[i], "--discover")){
+            opt.discover = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        const char *a = argv[i], *v = argv[++i];
+        if (!strcmp(a, "--devices")) opt.devices = atoi(v);
+        else if (!strcmp(a, "--ports")) opt.ports = atoi(v);
+        else if (!strcmp(a, "--duration")) opt.duration = atoi(v);
+        else if (!strcmp(a, "--scale")) opt.scale = atof(v);
+        else if (!strcmp(a, "--pollrate")) opt.pollrate = atoi(v);
+        else if (!strcmp(a, "--latency")) opt.latency = atof(v);
+        else if (!strcmp(a, "--jitter")) opt.jitter = atof(v);
+        else if (!strcmp(a, "--loss")) opt.loss = atof(v);
+        else if (!strcmp(a, "--corrupt")) opt.corrupt = atof(v);
+        else if (!strcmp(a, "--report")) opt.report = atoi(v);
+        else if (!strcmp(a, "--seed")) opt.seed = atoi(v);
+        else if (!strcmp(a, "--pz003")) opt.pz003 = atoi(v);
+        else if (!strcmp(a, "--collide")) opt.collide = atoi(v);
+        else if (!strcmp(a, "--dead")) opt.dead = atoi(v);
+        else if (!strcmp(a, "--revive")) opt.revive = atoi(v);
+        else if (!strcmp(a, "--backoff")) opt.backoff = atoi(v);
+        else if (!strcmp(a, "--gateway")) opt.gateway = atoi(v);
+        else if (!strcmp(a, "--proto")) opt.rtu = !strcmp(v, "rtu");
+        else if (!strcmp(a, "--tcp-ports")) opt.tcp_ports = atoi(v);
+        else if (!strcmp(a, "--core")) opt.core = atoi(v);
+        else if (!strcmp(a, "--load")) opt.load = atoi(v);
+        else usage(argv[0]);
+    }
+    if (!opt.devices || opt.devices > ADDR_MAX || !opt.ports || opt.ports > SOAK_MAX_PORTS || !opt.report || opt.scale < 1 || opt.pz003 > opt.devices ||
+        opt.tcp_ports > opt.ports || (opt.tcp_ports && (!opt.gateway || opt.scale != 1)))
+        usage(argv[0]);
+}
+
+// print heap and counters snapshot as json object
+void print_sample(int64_t t, const PZPool &pool, const VirtualBus &bus){
+    uint64_t polls = 0, replies = 0, timeouts = 0;
+    for (unsigned id = 1; id <= opt.devices; ++id){
+        const auto *s = pool.getState(id);
+        if (!s)
+            continue;
+        polls += s->polls;
+        replies += s->replies;
+        timeouts += s->timeouts;
+    }
+    auto mi = mallinfo2();
+    uint64_t a = n_allocs.load(), f = n_frees.load();
+    printf("{\"t\":%lld,\"polls\":%llu,\"replies\":%llu,\"timeouts\":%llu,\"bus_lost\":%llu,\"heap_used\":%zu,\"allocs\":%llu,\"frees\":%llu,\"live_allocs\":%lld}",
+        static_cast<long long>(t), static_cast<unsigned long long>(polls), static_cast<unsigned long long>(replies),
+        static_cast<unsigned long long>(timeouts), static_cast<unsigned long long>(bus.lost.load()), mi.uordblks,
+        static_cast<unsigned long long>(a), static_cast<unsigned long long>(f), static_cast<long long>(a - f));
+}
+
+void print_histogram(const char *name, const ms_histogram &h){
+    printf("\"%s\":{\"count\":%llu,\"p50\":%g,\"p90\":%g,\"p99\":%g,\"p999\":%g,\"max\":%.3f}", name,
+        static_cast<unsigned long long>(h.total), h.percentile(50), h.percentile(90), h.percentile(99), h.percentile(99.9), h.max);
+}
+
+}   // namespace
+
+
+int main(int argc, char *argv[]){
+    parse_args(argc, argv);
+    pzhost::set_time_scale(opt.scale);
+    devs.resize(opt.devices + 1);
+
+    auto bus = std::unique_ptr<VirtualBus>(new VirtualBus(opt.seed));
+    auto pool = std::unique_ptr<PZPool>(new PZPool());
+
+    // gateway runs in real time, it's ports are the last ones
+    std::vector<TcpQ*> gw;
+    for (unsigned p = opt.ports - opt.tcp_ports; p != opt.ports; ++p){
+        TCP_cfg cfg("127.0.0.1", opt.gateway, opt.rtu ? tcpproto_t::rtu : tcpproto_t::mbap);
+        gw.push_back(new TcpQ(cfg));
+        if (!pool->addPort(std::make_shared<PZPort>(p, gw.back(), "gateway"))){
+            fprintf(stderr, "can't add gateway port %u\n", p);
+            return 1;
+        }
+    }
+
+    for (unsigned p = 0; p != opt.ports - opt.tcp_ports; ++p){
+        pzhost::uart_set_tx_hook(p, [&bus](int port, const uint8_t *data, size_t len){ bus->request(port, data, len); });
+        UART_cfg cfg(static_cast<uart_port_t>(p));
+        cfg.tasks.core = opt.core;
+        if (!pool->addPort(p, cfg)){
+            fprintf(stderr, "can't add port %u\n", p);
+            return 1;
+        }
+    }
+
+    unsigned added = 0;
+    unsigned expected = opt.devices - (opt.collide >= ADDR_MIN && opt.collide <= opt.devices);
+    PZDiscovery_result sweep;       // totals of all ports
+    if (opt.discover){
+        // one port at a time, devices are registered by the pool
+        for (unsigned p = 0; p != opt.ports; ++p){
+            if (!pool->discover(p)){
+                fprintf(stderr, "can't start bus sweep on port %u\n", p);
+                return 1;
+            }
+            while (pool->discovering())
+                pzhost::sleep_us(10000);
+            const auto *r = pool->getDiscovery();
+            sweep.probes += r->probes;
+            sweep.duration_ms += r->duration_ms;
+            sweep.found += r->found;
+            sweep.collisions += r->collisions;
+            for (unsigned a = ADDR_MIN; a <= ADDR_MAX; ++a){
+                if (r->state[a] == pzdisc_t::unknown)
+                    fprintf(stderr, "port %u addr %u: unknown device\n", p, a);
+                // check model detection
+                auto model = a > opt.devices - opt.pz003 ? pzmbus::pzmodel_t::pzem003 : pzmbus::pzmodel_t::pzem004v3;
+                if (r->state[a] == pzdisc_t::found && r->model[a] != model)
+                    fprintf(stderr, "port %u addr %u: wrong model %u\n", p, a, static_cast<unsigned>(r->model[a]));
+            }
+            fprintf(stderr, "sweep port %u: %u ms, %u probes, found %u, collisions %u\n", p, r->duration_ms, r->probes, r->found, r->collisions);
+        }
+        for (unsigned id = 1; id <= opt.devices; ++id)
+            added += pool->getState(id) != nullptr;
+    } else {
+        for (unsigned id = 1; id <= opt.devices; ++id){
+            auto model = id > opt.devices - opt.pz003 ? pzmbus::pzmodel_t::pzem003 : pzmbus::pzmodel_t::pzem004v3;
+            if (id != opt.collide && pool->addPZEM((id - 1) % opt.ports, id, id, model))
+                ++added;
+        }
+    }
+    if (added != expected)
+        fprintf(stderr, "only %u of %u devices added to the pool\n", added, expected);
+
+    const PZPool &cpool = *pool;
+    pool->attach_rx_callback([&cpool](uint8_t id, const RX_msg *m){ on_rx(id, m, cpool); });
+    pool->setPollrate(opt.pollrate);
+    pool->setBackoff(opt.backoff);
+    if (!pool->autopoll(true)){
+        fprintf(stderr, "can't start poller\n");
+        return 1;
+    }
+
+    // network stack stand-in, spins on core 0 competing with the tasks that are not pinned away from it
+    std::atomic<bool> load_quit{false};
+    std::vector<std::thread> load;
+    for (unsigned i = 0; i != opt.load; ++i)
+        load.emplace_back([&load_quit](){
+            pzhost::set_affinity(0);
+            while (!load_quit.load(std::memory_order_relaxed)) {}
+        });
+
+    fprintf(stderr, "soak: %u devices on %u port(s), %u s at x%g\n", added, opt.ports, opt.duration, opt.scale);
+
+    // timeline
+    const int64_t start = pzhost::now_us();
+    if (opt.revive)
+        revive_us = start + static_cast<int64_t>(opt.revive) * 1000000;
+    printf("{\"timeline\":[\n");
+    for (unsigned t = 0; t < opt.duration; ){
+        unsigned step = std::min(opt.report, opt.duration - t);
+        int64_t due = start + static_cast<int64_t>(t + step) * 1000000;
+        int64_t now = pzhost::now_us();
+        if (due > now)
+            pzhost::sleep_us(due - now);
+        t += step;
+        if (t != step)
+            printf(",\n");
+        print_sample((pzhost::now_us() - start) / 1000000, cpool, *bus);
+        fflush(stdout);
+    }
+    pool->autopoll(false);
+    double elapsed = (pzhost::now_us() - start) / 1e6;
+    load_quit = true;
+    for (auto &t : load)
+        t.join();
+    pzhost::sleep_us(200000);     // let the last replies come in
+
+    // summary
+    uint64_t polls = 0, replies = 0, timeouts = 0, errors = 0, stray = 0;
+    uint64_t min_upd = UINT64_MAX, max_upd = 0, min_live = UINT64_MAX;
+    unsigned h_backoff = 0, h_quarantine = 0;
+    uint64_t jitter_sum = 0;
+    uint32_t jitter_max = 0, rtt_max = 0;
+    unsigned jitter_n = 0;
+    uint64_t h_skipped = 0, h_quarantines = 0, h_recoveries = 0;
+    for (unsigned id = 1; id <= opt.devices; ++id){
+        const auto *s = cpool.getState(id);
+        if (!s)
+            continue;
+        PZHealth h;
+        if (cpool.getHealth(id, h)){
+            h_backoff += h.state == pzhealth_t::backoff;
+            h_quarantine += h.state == pzhealth_t::quarantine;
+            h_skipped += h.skipped;
+            h_quarantines += h.quarantines;
+            h_recoveries += h.recoveries;
+        }
+        if (id > opt.dead)
+            min_live = std::min<uint64_t>(min_live, devs[id].updates);
+        if (s->replies){
+            jitter_sum += s->jitter_us;
+            jitter_max = std::max(jitter_max, s->jitter_us);
+            rtt_max = std::max(rtt_max, s->rtt_max_us);
+            ++jitter_n;
+        }
+        polls += s->polls;
+        replies += s->replies;
+        timeouts += s->timeouts;
+        errors += s->errors;
+        stray += s->stray;
+        min_upd = std::min<uint64_t>(min_upd, devs[id].updates);
+        max_upd = std::max<uint64_t>(max_upd, devs[id].updates);
+    }
+
+    printf("\n],\n\"summary\":{\"devices\":%u,\"ports\":%u,\"duration_s\":%.1f,\"scale\":%g,\"pollrate_ms\":%u,"
+           "\"latency_ms\":%g,\"jitter_ms\":%g,\"loss_pct\":%g,\"corrupt_pct\":%g,\n",
+        added, opt.ports, elapsed, opt.scale, opt.pollrate, opt.latency, opt.jitter, opt.loss, opt.corrupt);
+    printf("\"polls\":%llu,\"replies\":%llu,\"polls_per_s\":%.2f,\"replies_per_s\":%.2f,\"target_polls_per_s\":%.2f,"
+           "\"device_updates_min\":%llu,\"device_updates_max\":%llu,\"live_device_updates_min\":%llu,\n",
+        static_cast<unsigned long long>(polls), static_cast<unsigned long long>(replies), polls / elapsed, replies / elapsed,
+        added * 1000.0 / opt.pollrate, static_cast<unsigned long long>(added ? min_upd : 0), static_cast<unsigned long long>(max_upd),
+        static_cast<unsigned long long>(min_live != UINT64_MAX ? min_live : 0));
+    printf("\"core\":%d,\"load\":%u,\"rtt_jitter_ms_avg\":%.3f,\"rtt_jitter_ms_max\":%.3f,\"rtt_max_ms\":%.3f,\n",
+        opt.core == tskNO_AFFINITY ? -1 : opt.core, opt.load, jitter_n ? jitter_sum / 1000.0 / jitter_n : 0, jitter_max / 1000.0, rtt_max / 1000.0);
+    printf("\"health\":{\"backoff\":%u,\"quarantine\":%u,\"skipped\":%llu,\"quarantines\":%llu,\"recoveries\":%llu},\n",
+        h_backoff, h_quarantine, static_cast<unsigned long long>(h_skipped), static_cast<unsigned long long>(h_quarantines),
+        static_cast<unsigned long long>(h_recoveries));
+    {
+        std::lock_guard<std::mutex> lk(obs_mtx);
+        print_histogram("period_deviation_ms", period_dev);
+        printf(",\n");
+        print_histogram("reply_latency_ms", latency);
+    }
+
+    // drop causes
+    printf(",\n\"drops\":{\"device_timeouts\":%llu,\"device_errors\":%llu,\"device_stray\":%llu,\"bus_lost\":%llu,\"bus_corrupted\":%llu,\"bus_unknown\":%llu,\"bus_silent\":%llu",
+        static_cast<unsigned long long>(timeouts), static_cast<unsigned long long>(errors), static_cast<unsigned long long>(stray),
+        static_cast<unsigned long long>(bus->lost.load()), static_cast<unsigned long long>(bus->corrupted.load()),
+        static_cast<unsigned long long>(bus->unknown.load()), static_cast<unsigned long long>(bus->silent.load()));
+    uint64_t tx_drops = 0, rx_drops = 0, rx_crc = 0, rx_ovf = 0, rx_timeouts = 0, rx_stray = 0;
+    for (unsigned p = 0; p != opt.ports; ++p){
+        PZPort_stats ps;
+        if (!cpool.getPortStats(p, ps))
+            continue;
+        tx_drops += ps.q.tx_drops;
+        rx_drops += ps.q.rx_drops;
+        rx_crc += ps.q.rx_crc_err;
+        rx_ovf += ps.q.rx_ovf;
+        rx_timeouts += ps.q.rx_timeouts;
+        rx_stray += ps.rx_stray;
+    }
+    printf(",\"port_tx_drops\":%llu,\"port_rx_drops\":%llu,\"port_rx_crc_err\":%llu,\"port_rx_ovf\":%llu,\"port_rx_timeouts\":%llu,\"port_rx_stray\":%llu},\n",
+        static_cast<unsigned long long>(tx_drops), static_cast<unsigned long long>(rx_drops), static_cast<unsigned long long>(rx_crc),
+        static_cast<unsigned long long>(rx_ovf), static_cast<unsigned long long>(rx_timeouts), static_cast<unsigned long long>(rx_stray));
+
+    if (opt.tcp_ports){
+        TcpQ_stats ts;
+        for (const auto *q : gw){
+            const auto &s = q->getTcpStats();
+            ts.connects += s.connects;
+            ts.conn_fails += s.conn_fails;
+            ts.disconnects += s.disconnects;
+            ts.proto_errors += s.proto_errors;
+            ts.inflight_max = std::max(ts.inflight_max, s.inflight_max);
+        }
+        printf("\"gateway\":{\"ports\":%u,\"proto\":\"%s\",\"connects\":%u,\"conn_fails\":%u,\"disconnects\":%u,\"proto_errors\":%u,\"inflight_max\":%u},\n",
+            opt.tcp_ports, opt.rtu ? "rtu" : "mbap", ts.connects, ts.conn_fails, ts.disconnects, ts.proto_errors, ts.inflight_max);
+    }
+
+    if (opt.discover)
+        printf("\"discovery\":{\"duration_ms\":%u,\"probes\":%u,\"found\":%u,\"collisions\":%u},\n",
+            static_cast<unsigned>(sweep.duration_ms), sweep.probes, sweep.found, sweep.collisions);
+
+    printf("\"final\":");
+    print_sample(static_cast<int64_t>(elapsed), cpool, *bus);
+    printf("}}\n");
+
+    pool.reset();
+    bus.reset();
+    return 0;
+}
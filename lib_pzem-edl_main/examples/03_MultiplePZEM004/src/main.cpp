@@ -76,6 +76,12 @@ void setup(){
                                 RX_PIN,             // rx pin remapped
                                 TX_PIN);            // tx pin remapped
 
+    // (optional) pin port's RX/TX tasks to core 1, WiFi and TCP stack run on core 0,
+    // so poll-to-reply latency will not jitter with the network load
+    #if portNUM_PROCESSORS > 1
+    port1_cfg.tasks.core = 1;
+    #endif
+
     // Ask PZPool object to create a PortQ object based on config provided
     // it will automatically start event queues for the port and makes it available for PZEM assignment
     if (meters->addPort(PORT_1_ID,          // some unique port id
@@ -171,6 +177,10 @@ void mycallback(uint8_t id, const RX_msg* m){
     // Here I can get the id of PZEM (might get handy if have more than one attached)
     Serial.printf("\nTime: %ld - Callback triggered for PZEM ID: %d, name: %s\n", millis(), id,  meters->getDescr(id));
 
+    // poll-to-reply latency and it's jitter
+    auto st = meters->getState(id);
+    Serial.printf("Reply latency: %u us, min/max: %u/%u us, jitter: %u us\n", st->rtt_us, st->rtt_min_us, st->rtt_max_us, st->jitter_us);
+
 /*
     //So now we have a notification that pzem device with ID 'id' has been updated, we can print (or send somewhere new data)
 
@@ -34,6 +34,7 @@ using namespace pz004;
 
 // first we need a UartQ object to handle RX/TX message queues
 UartQ *qport;   // portQ object ref
+PZDiscovery *scan;  // bus sweep, finds all devices on the port
 
 
 void setup(){
@@ -44,7 +45,15 @@ void setup(){
 
     qport = new UartQ(PZEM_UART_PORT, RX_PIN, TX_PIN);      // or use custom pins
     qport->startQueues();                                   // start queues tasks
-    qport->attach_RX_hndlr([](RX_msg *msg){ rx_handler(msg); delete msg; });        // attach call-back function to process pzem replies
+    scan = new PZDiscovery(qport);
+    qport->attach_RX_hndlr([](RX_msg *msg){
+            // while bus sweep is running all replies belong to it
+            if (scan->active())
+                scan->rx_sink(msg);
+            else
+                rx_handler(msg);
+            delete msg;
+        });        // attach call-back function to process pzem replies
 
     // now we are ready to exchange messages
 }
@@ -77,6 +86,7 @@ void menu(){
     Serial.println("4 - Reset energy counter");
     Serial.println("5 - Get power alarm threshold");
     Serial.println("6 - Set power alarm threshold");
+    Serial.println("7 - Scan bus for devices (any number of devices could be connected)");
     Serial.println();
 
     WAIT4SERIAL; // this is just good-old blocking loop method :)
@@ -101,6 +111,9 @@ void menu(){
         case 6 :
             set_alrm_thr();
             break;
+        case 7 :
+            scan_bus();
+            break;
         default:
             break;
     }
@@ -172,6 +185,32 @@ void set_alrm_thr(){
     }
 }
 
+void scan_bus(){
+    Serial.println("Scanning addresses 1-247, it takes about 20 seconds...");
+    if (!scan->start())
+        return;
+    while (scan->active())
+        delay(500);
+
+    const auto &r = scan->result();
+    for (int a = ADDR_MIN; a <= ADDR_MAX; ++a){
+        switch (r.state[a]){
+            case pzdisc_t::found :
+                Serial.printf("addr %d: %s\n", a, r.model[a] == pzmbus::pzmodel_t::pzem004v3 ? "PZEM004v3" : "PZEM003/017");
+                break;
+            case pzdisc_t::collision :
+                Serial.printf("addr %d: several devices share this address!\n", a);
+                break;
+            case pzdisc_t::unknown :
+                Serial.printf("addr %d: unknown MODBUS device\n", a);
+                break;
+            default:
+                break;
+        }
+    }
+    Serial.printf("Found %u device(s), %u collision(s) in %u ms\n", r.found, r.collisions, (unsigned)r.duration_ms);
+}
+
 
 /**
  * @brief this is our call-back routine
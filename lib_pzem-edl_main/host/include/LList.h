@@ -0,0 +1,42 @@
+/*
+    Host (Linux) stand-in for https://github.com/vortigont/LinkedList
+    implements only the subset of LList<T> API used by pzem-edl on top of std::list
+*/
+#pragma once
+#include <list>
+#include <iterator>
+
+template <typename T>
+class LList {
+    std::list<T> _l;
+
+public:
+    using iterator = typename std::list<T>::iterator;
+    using const_iterator = typename std::list<T>::const_iterator;
+
+    int size() const { return static_cast<int>(_l.size()); }
+
+    bool add(const T &val){ _l.push_back(val); return true; }
+    bool add(T &&val){ _l.push_back(std::move(val)); return true; }
+
+    T& operator[](int index){ auto i = _l.begin(); std::advance(i, index); return *i; }
+    T get(int index){ return (*this)[index]; }
+
+    bool unlink(int index){
+        if (index < 0 || index >= size()) return false;
+        auto i = _l.begin(); std::advance(i, index);
+        _l.erase(i);
+        return true;
+    }
+
+    T remove(int index){ T v = (*this)[index]; unlink(index); return v; }
+
+    void clear(){ _l.clear(); }
+
+    iterator begin(){ return _l.begin(); }
+    iterator end(){ return _l.end(); }
+    const_iterator begin() const { return _l.cbegin(); }
+    const_iterator end() const { return _l.cend(); }
+    const_iterator cbegin() const { return _l.cbegin(); }
+    const_iterator cend() const { return _l.cend(); }
+};
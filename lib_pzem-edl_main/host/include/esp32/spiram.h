@@ -0,0 +1,4 @@
+/*
+    Host (Linux) portability layer for pzem-edl, no SPI-RAM on host
+*/
+#pragma once
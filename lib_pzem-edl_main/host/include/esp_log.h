@@ -0,0 +1,20 @@
+/*
+    Host (Linux) portability layer for pzem-edl, logging macro's go to stderr
+    verbosity is set at build time via PZEM_HOST_LOG_LEVEL (0 - none ... 5 - verbose), default is 2 (warnings)
+*/
+#pragma once
+#include <stdio.h>
+#include "esp_timer.h"
+
+#ifndef PZEM_HOST_LOG_LEVEL
+#define PZEM_HOST_LOG_LEVEL 2
+#endif
+
+#define HOST_LOG_(lvl, letter, tag, format, ...) do { if (PZEM_HOST_LOG_LEVEL >= lvl) \
+        fprintf(stderr, letter " (%lld) %s: " format "\n", (long long)(esp_timer_get_time()/1000), tag, ##__VA_ARGS__); } while(0)
+
+#define ESP_LOGE(tag, format, ...)  HOST_LOG_(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  HOST_LOG_(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  HOST_LOG_(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  HOST_LOG_(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)  HOST_LOG_(5, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,7 @@
+/*
+    Host (Linux) portability layer for pzem-edl, monotonic clock
+*/
+#pragma once
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,55 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    Host (Linux) portability layer - a thin subset of FreeRTOS API implemented on top of
+    std::thread / std::chrono, just enough to build and run pzem-edl on a workstation.
+    It is NOT a scheduler emulation, tasks are plain threads, priorities are ignored
+*/
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t    TickType_t;
+typedef int         BaseType_t;
+typedef unsigned    UBaseType_t;
+typedef uint8_t     StackType_t;        // ESP-IDF counts stack in bytes
+
+#define portTickType            TickType_t
+#define pdFALSE                 ( ( BaseType_t ) 0 )
+#define pdTRUE                  ( ( BaseType_t ) 1 )
+#define pdPASS                  ( pdTRUE )
+#define pdFAIL                  ( pdFALSE )
+#define errQUEUE_FULL           ( ( BaseType_t ) 0 )
+
+#define portMAX_DELAY           ( TickType_t ) 0xffffffffUL
+#define configTICK_RATE_HZ      1000
+#define portTICK_PERIOD_MS      ( ( TickType_t ) 1000 / configTICK_RATE_HZ )
+#define portNUM_PROCESSORS      2
+#define tskNO_AFFINITY          0x7FFFFFFF
+#define configMINIMAL_STACK_SIZE 768
+
+#ifndef pdMS_TO_TICKS
+#define pdMS_TO_TICKS( xTimeInMs )    ( ( TickType_t ) ( ( ( TickType_t ) ( xTimeInMs ) * ( TickType_t ) configTICK_RATE_HZ ) / ( TickType_t ) 1000U ) )
+#endif
+#ifndef pdTICKS_TO_MS
+#define pdTICKS_TO_MS( xTicks )       ( ( TickType_t ) ( ( uint64_t ) ( xTicks ) * 1000 / configTICK_RATE_HZ ) )
+#endif
+
+// storage placeholders for *Static() API variants, host shim allocates objects internally
+typedef struct { void *dummy[8]; } StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct { void *dummy[16]; } StaticTask_t;
+typedef struct { void *dummy[12]; } StaticTimer_t;
+
+#include "pzem_host.h"
@@ -0,0 +1,36 @@
+/*
+    Host (Linux) portability layer for pzem-edl, FreeRTOS task API subset
+*/
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, const uint32_t usStackDepth, void *pvParameters,
+                                   UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, const BaseType_t xCoreID);
+
+static inline BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName, const uint32_t usStackDepth, void *pvParameters,
+                                     UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask){
+    return xTaskCreatePinnedToCore(pvTaskCode, pcName, usStackDepth, pvParameters, uxPriority, pvCreatedTask, tskNO_AFFINITY);
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, const uint32_t ulStackDepth, void *pvParameters,
+                                           UBaseType_t uxPriority, StackType_t *pxStackBuffer, StaticTask_t *pxTaskBuffer, const BaseType_t xCoreID);
+
+static inline TaskHandle_t xTaskCreateStatic(TaskFunction_t pvTaskCode, const char *pcName, const uint32_t ulStackDepth, void *pvParameters,
+                                             UBaseType_t uxPriority, StackType_t *pxStackBuffer, StaticTask_t *pxTaskBuffer){
+    return xTaskCreateStaticPinnedToCore(pvTaskCode, pcName, ulStackDepth, pvParameters, uxPriority, pxStackBuffer, pxTaskBuffer, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t xTask);
+void vTaskDelay(const TickType_t xTicksToDelay);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+BaseType_t xTaskGetAffinity(TaskHandle_t xTask);
+BaseType_t xPortGetCoreID(void);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t xTask);
+
+// direct to task notifications (counting semaphore flavour only)
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify);
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait);
@@ -0,0 +1,64 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    Host build controls that have no counterpart on ESP32.
+    Used by host tools/benchmarks to drive the emulated environment
+*/
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+namespace pzhost {
+
+/**
+ * @brief set virtual clock acceleration factor
+ * all FreeRTOS ticks, timers, delays and esp_timer_get_time() run 'scale' times faster than wall clock
+ * i.e. with scale=60 one minute of device time passes each second. Must be set before any tasks/timers are started
+ *
+ * @param scale - acceleration factor, >= 1.0
+ */
+void set_time_scale(double scale);
+double get_time_scale();
+
+/**
+ * @brief virtual monotonic clock, microseconds since process start
+ * esp_timer_get_time() returns the same value
+ */
+int64_t now_us();
+
+/**
+ * @brief sleep calling thread for the amount of virtual time
+ */
+void sleep_us(int64_t us);
+
+/**
+ * @brief pin calling thread to a host CPU, tasks created with a core id are pinned the same way
+ * @param core - core id, mapped to host CPU modulo number of CPUs
+ */
+void set_affinity(int core);
+
+// UART port emulation
+using uart_tx_hook_t = std::function<void (int port, const uint8_t *data, size_t len)>;
+
+/**
+ * @brief attach a consumer for all data written to the emulated uart port via uart_write_bytes()
+ * hook is called synchronously from the writer's thread
+ */
+void uart_set_tx_hook(int port, uart_tx_hook_t hook);
+
+/**
+ * @brief feed data into emulated uart RX buffer
+ * generates UART_DATA event (or UART_BUFFER_FULL if RX buffer would overflow) for the port's event queue
+ */
+void uart_inject_rx(int port, const uint8_t *data, size_t len);
+
+}   // namespace pzhost
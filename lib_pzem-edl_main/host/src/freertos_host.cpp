@@ -0,0 +1,687 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    Host (Linux) portability layer - FreeRTOS/ESP-IDF API subset implemented on std::thread and std::chrono
+
+    - tasks are detached threads, priorities are recorded but not enforced,
+      core affinity is applied as host CPU affinity (core modulo number of CPUs)
+    - blocking calls wait in short slices, so a task deleted from another task
+      terminates on it's next blocking call (the same point it would be preempted on a real RTOS)
+    - all time is virtual and could be accelerated via pzhost::set_time_scale()
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "driver/uart.h"
+#include "esp_heap_caps.h"
+#include "pzem_host.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <malloc.h>
+#include <pthread.h>
+
+using clk = std::chrono::steady_clock;
+
+// real time wait slice, a deleted task is noticed within this period
+#define HOST_WAIT_SLICE std::chrono::milliseconds(2)
+
+namespace {
+
+const clk::time_point t_start = clk::now();
+std::atomic<double> time_scale{1.0};
+
+// an exception used to unwind a deleted task's thread
+struct task_deleted {};
+
+}   // namespace
+
+
+// ===  Clock  ===
+
+namespace pzhost {
+
+void set_time_scale(double scale){ time_scale.store(scale < 1.0 ? 1.0 : scale); }
+
+double get_time_scale(){ return time_scale.load(); }
+
+void set_affinity(int core){
+    unsigned ncpu = std::thread::hardware_concurrency();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(ncpu ? core % ncpu : 0, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int64_t now_us(){
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now() - t_start).count();
+    return static_cast<int64_t>(ns * time_scale.load() / 1000);
+}
+
+}   // namespace pzhost
+
+int64_t esp_timer_get_time(void){ return pzhost::now_us(); }
+
+namespace {
+
+// convert virtual ticks into a real time deadline
+clk::time_point deadline(TickType_t ticks){
+    auto ns = static_cast<int64_t>(static_cast<double>(ticks) * (1000000000 / configTICK_RATE_HZ) / time_scale.load());
+    return clk::now() + std::chrono::nanoseconds(ns);
+}
+
+}   // namespace
+
+
+// ===  Tasks  ===
+
+struct host_task {
+    std::string name;
+    TaskFunction_t fn = nullptr;
+    void *arg = nullptr;
+    UBaseType_t prio = 0;
+    BaseType_t core = tskNO_AFFINITY;
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> dead{false};
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t notify = 0;
+};
+
+namespace {
+
+std::mutex& registry_mtx(){ static auto *m = new std::mutex(); return *m; }
+std::map<host_task*, std::shared_ptr<host_task>>& registry(){ static auto *r = new std::map<host_task*, std::shared_ptr<host_task>>(); return *r; }
+
+thread_local host_task *cur_task = nullptr;
+
+std::shared_ptr<host_task> task_lookup(host_task *t){
+    std::lock_guard<std::mutex> lk(registry_mtx());
+    auto i = registry().find(t);
+    return i == registry().end() ? nullptr : i->second;
+}
+
+// adopt a non-shim thread (i.e. main()) as a task, so it could take notifications, etc...
+host_task* current_task(){
+    if (!cur_task){
+        auto t = std::make_shared<host_task>();
+        t->name = "main";
+        cur_task = t.get();
+        std::lock_guard<std::mutex> lk(registry_mtx());
+        registry()[t.get()] = t;
+    }
+    return cur_task;
+}
+
+inline void check_cancel(){
+    if (cur_task && cur_task->cancel.load())
+        throw task_deleted();
+}
+
+/**
+ * @brief wait on a condition for the amount of virtual ticks
+ * cancellation point for the calling task
+ * @return true if predicate is satisfied, false on timeout
+ */
+template <class Pred>
+bool wait_ticks(std::unique_lock<std::mutex> &lk, std::condition_variable &cv, TickType_t ticks, Pred pred){
+    if (pred())
+        return true;
+    if (!ticks)
+        return false;
+
+    bool forever = (ticks == portMAX_DELAY);
+    auto until = forever ? clk::time_point::max() : deadline(ticks);
+    for (;;){
+        auto slice = clk::now() + HOST_WAIT_SLICE;
+        cv.wait_until(lk, slice < until ? slice : until);
+        if (pred())
+            return true;
+        if (cur_task && cur_task->cancel.load()){
+            lk.unlock();
+            throw task_deleted();
+        }
+        if (!forever && clk::now() >= until)
+            return pred();
+    }
+}
+
+void task_runner(std::shared_ptr<host_task> t){
+    cur_task = t.get();
+    pthread_setname_np(pthread_self(), t->name.substr(0, 15).c_str());
+    if (t->core != tskNO_AFFINITY)
+        pzhost::set_affinity(t->core);
+    try {
+        t->fn(t->arg);
+    } catch (const task_deleted&) {
+        // task has been deleted, just quit the thread
+    }
+    t->dead = true;
+    std::lock_guard<std::mutex> lk(registry_mtx());
+    registry().erase(t.get());
+}
+
+}   // namespace
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, const uint32_t usStackDepth, void *pvParameters,
+                                   UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, const BaseType_t xCoreID){
+    (void)usStackDepth;
+    auto t = std::make_shared<host_task>();
+    t->name = pcName ? pcName : "";
+    t->fn = pvTaskCode;
+    t->arg = pvParameters;
+    t->prio = uxPriority;
+    t->core = xCoreID;
+
+    {
+        std::lock_guard<std::mutex> lk(registry_mtx());
+        registry()[t.get()] = t;
+    }
+    // handle must be valid before the task starts running
+    if (pvCreatedTask)
+        *pvCreatedTask = t.get();
+
+    std::thread(task_runner, t).detach();
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, const uint32_t ulStackDepth, void *pvParameters,
+                                           UBaseType_t uxPriority, StackType_t *pxStackBuffer, StaticTask_t *pxTaskBuffer, const BaseType_t xCoreID){
+    (void)pxStackBuffer; (void)pxTaskBuffer;
+    TaskHandle_t h = nullptr;
+    xTaskCreatePinnedToCore(pvTaskCode, pcName, ulStackDepth, pvParameters, uxPriority, &h, xCoreID);
+    return h;
+}
+
+void vTaskDelete(TaskHandle_t xTask){
+    if (!xTask || xTask == cur_task){
+        if (cur_task)
+            throw task_deleted();
+        return;
+    }
+
+    auto t = task_lookup(xTask);
+    if (!t)
+        return;
+
+    t->cancel = true;
+    t->cv.notify_all();
+    // FreeRTOS guarantees deleted task won't run anymore once vTaskDelete() returns
+    while (!t->dead.load())
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay){
+    std::mutex m;
+    std::condition_variable cv;
+    std::unique_lock<std::mutex> lk(m);
+    wait_ticks(lk, cv, xTicksToDelay, [](){ return false; });
+}
+
+TickType_t xTaskGetTickCount(void){ return static_cast<TickType_t>(pzhost::now_us() / (1000000 / configTICK_RATE_HZ)); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void){ return current_task(); }
+
+BaseType_t xTaskGetAffinity(TaskHandle_t xTask){
+    auto t = xTask ? xTask : current_task();
+    return t->core;
+}
+
+BaseType_t xPortGetCoreID(void){
+    auto c = current_task()->core;
+    return c == tskNO_AFFINITY ? 0 : c;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t xTask){
+    auto t = xTask ? xTask : current_task();
+    return t->prio;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify){
+    auto t = task_lookup(xTaskToNotify);
+    if (!t)
+        return pdFAIL;
+    {
+        std::lock_guard<std::mutex> lk(t->m);
+        ++t->notify;
+    }
+    t->cv.notify_all();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait){
+    auto t = current_task();
+    std::unique_lock<std::mutex> lk(t->m);
+    wait_ticks(lk, t->cv, xTicksToWait, [t](){ return t->notify != 0; });
+    uint32_t v = t->notify;
+    if (v)
+        t->notify = xClearCountOnExit ? 0 : v - 1;
+    return v;
+}
+
+
+// ===  Queues  ===
+
+struct host_queue {
+    std::mutex m;
+    std::condition_variable cv;
+    size_t length;
+    size_t isize;
+    std::deque<std::vector<uint8_t>> items;
+
+    host_queue(size_t l, size_t s) : length(l), isize(s) {}
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize){
+    if (!uxQueueLength)
+        return nullptr;
+    return new host_queue(uxQueueLength, uxItemSize);
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t uxQueueLength, UBaseType_t uxItemSize, uint8_t *pucQueueStorageBuffer, StaticQueue_t *pxQueueBuffer){
+    (void)pucQueueStorageBuffer; (void)pxQueueBuffer;
+    return xQueueCreate(uxQueueLength, uxItemSize);
+}
+
+void vQueueDelete(QueueHandle_t xQueue){ delete xQueue; }
+
+namespace {
+
+BaseType_t queue_send(QueueHandle_t q, const void *item, TickType_t ticks, bool front){
+    if (!q)
+        return pdFAIL;
+    std::unique_lock<std::mutex> lk(q->m);
+    if (!wait_ticks(lk, q->cv, ticks, [q](){ return q->items.size() < q->length; }))
+        return errQUEUE_FULL;
+
+    std::vector<uint8_t> v(q->isize);
+    if (q->isize)
+        memcpy(v.data(), item, q->isize);
+    if (front)
+        q->items.emplace_front(std::move(v));
+    else
+        q->items.emplace_back(std::move(v));
+    lk.unlock();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+BaseType_t queue_recv(QueueHandle_t q, void *buff, TickType_t ticks, bool peek){
+    if (!q)
+        return pdFAIL;
+    std::unique_lock<std::mutex> lk(q->m);
+    if (!wait_ticks(lk, q->cv, ticks, [q](){ return !q->items.empty(); }))
+        return pdFAIL;
+
+    if (q->isize)
+        memcpy(buff, q->items.front().data(), q->isize);
+    if (!peek)
+        q->items.pop_front();
+    lk.unlock();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+}   // namespace
+
+BaseType_t xQueueSendToBack(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait){ return queue_send(xQueue, pvItemToQueue, xTicksToWait, false); }
+
+BaseType_t xQueueSendToFront(QueueHandle_t xQueue, const void *pvItemToQueue, TickType_t xTicksToWait){ return queue_send(xQueue, pvItemToQueue, xTicksToWait, true); }
+
+BaseType_t xQueueOverwrite(QueueHandle_t xQueue, const void *pvItemToQueue){
+    if (!xQueue)
+        return pdFAIL;
+    {
+        std::lock_guard<std::mutex> lk(xQueue->m);
+        xQueue->items.clear();
+        std::vector<uint8_t> v(xQueue->isize);
+        if (xQueue->isize)
+            memcpy(v.data(), pvItemToQueue, xQueue->isize);
+        xQueue->items.emplace_back(std::move(v));
+    }
+    xQueue->cv.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait){ return queue_recv(xQueue, pvBuffer, xTicksToWait, false); }
+
+BaseType_t xQueuePeek(QueueHandle_t xQueue, void *pvBuffer, TickType_t xTicksToWait){ return queue_recv(xQueue, pvBuffer, xTicksToWait, true); }
+
+BaseType_t xQueueReset(QueueHandle_t xQueue){
+    if (!xQueue)
+        return pdFAIL;
+    {
+        std::lock_guard<std::mutex> lk(xQueue->m);
+        xQueue->items.clear();
+    }
+    xQueue->cv.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t xQueue){
+    std::lock_guard<std::mutex> lk(xQueue->m);
+    return xQueue->items.size();
+}
+
+UBaseType_t uxQueueSpacesAvailable(const QueueHandle_t xQueue){
+    std::lock_guard<std::mutex> lk(xQueue->m);
+    return xQueue->length - xQueue->items.size();
+}
+
+
+// ===  Semaphores  ===
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void){ return xQueueCreate(1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *pxSemaphoreBuffer){ (void)pxSemaphoreBuffer; return xSemaphoreCreateBinary(); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+    auto s = xSemaphoreCreateBinary();
+    xSemaphoreGive(s);
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *pxMutexBuffer){ (void)pxMutexBuffer; return xSemaphoreCreateMutex(); }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime){ return queue_recv(xSemaphore, nullptr, xBlockTime, false); }
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore){ return queue_send(xSemaphore, nullptr, 0, false); }
+
+
+// ===  Software timers  ===
+
+struct host_timer {
+    std::string name;
+    TickType_t period;
+    bool autoreload;
+    void *id;
+    TimerCallbackFunction_t cb;
+    bool active = false;
+    bool deleted = false;
+    int64_t due_us = 0;
+};
+
+namespace {
+
+class TimerSvc {
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<host_timer*> timers;
+
+    TimerSvc(){ std::thread(&TimerSvc::run, this).detach(); }
+
+    void run(){
+        pthread_setname_np(pthread_self(), "Tmr Svc");
+        std::unique_lock<std::mutex> lk(m);
+        for (;;){
+            // release deleted timers
+            for (auto i = timers.begin(); i != timers.end();){
+                if ((*i)->deleted){ delete *i; i = timers.erase(i); }
+                else ++i;
+            }
+
+            host_timer *next = nullptr;
+            for (auto t : timers)
+                if (t->active && (!next || t->due_us < next->due_us))
+                    next = t;
+
+            int64_t now = pzhost::now_us();
+            if (!next || next->due_us > now){
+                auto wait = next ? std::chrono::nanoseconds(static_cast<int64_t>((next->due_us - now) * 1000 / time_scale.load())) : std::chrono::nanoseconds(HOST_WAIT_SLICE);
+                cv.wait_for(lk, wait < HOST_WAIT_SLICE ? wait : std::chrono::nanoseconds(HOST_WAIT_SLICE));
+                continue;
+            }
+
+            if (next->autoreload)
+                next->due_us += static_cast<int64_t>(next->period) * (1000000 / configTICK_RATE_HZ);
+            else
+                next->active = false;
+
+            lk.unlock();
+            next->cb(next);
+            lk.lock();
+        }
+    }
+
+public:
+    static TimerSvc& get(){ static auto *svc = new TimerSvc(); return *svc; }
+
+    host_timer* create(const char *name, TickType_t period, bool autoreload, void *id, TimerCallbackFunction_t cb){
+        auto t = new host_timer{ name ? name : "", period, autoreload, id, cb };
+        std::lock_guard<std::mutex> lk(m);
+        timers.push_back(t);
+        return t;
+    }
+
+    template <class F>
+    BaseType_t apply(host_timer *t, F f){
+        if (!t)
+            return pdFAIL;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (t->deleted)
+                return pdFAIL;
+            f(t);
+        }
+        cv.notify_all();
+        return pdPASS;
+    }
+};
+
+}   // namespace
+
+TimerHandle_t xTimerCreate(const char * const pcTimerName, const TickType_t xTimerPeriodInTicks, const UBaseType_t uxAutoReload,
+                           void * const pvTimerID, TimerCallbackFunction_t pxCallbackFunction){
+    if (!xTimerPeriodInTicks || !pxCallbackFunction)
+        return nullptr;
+    return TimerSvc::get().create(pcTimerName, xTimerPeriodInTicks, uxAutoReload, pvTimerID, pxCallbackFunction);
+}
+
+TimerHandle_t xTimerCreateStatic(const char * const pcTimerName, const TickType_t xTimerPeriodInTicks, const UBaseType_t uxAutoReload,
+                                 void * const pvTimerID, TimerCallbackFunction_t pxCallbackFunction, StaticTimer_t *pxTimerBuffer){
+    (void)pxTimerBuffer;
+    return xTimerCreate(pcTimerName, xTimerPeriodInTicks, uxAutoReload, pvTimerID, pxCallbackFunction);
+}
+
+BaseType_t xTimerStart(TimerHandle_t xTimer, TickType_t xTicksToWait){
+    (void)xTicksToWait;
+    return TimerSvc::get().apply(xTimer, [](host_timer *t){
+        t->active = true;
+        t->due_us = pzhost::now_us() + static_cast<int64_t>(t->period) * (1000000 / configTICK_RATE_HZ);
+    });
+}
+
+BaseType_t xTimerStop(TimerHandle_t xTimer, TickType_t xTicksToWait){
+    (void)xTicksToWait;
+    return TimerSvc::get().apply(xTimer, [](host_timer *t){ t->active = false; });
+}
+
+BaseType_t xTimerDelete(TimerHandle_t xTimer, TickType_t xTicksToWait){
+    (void)xTicksToWait;
+    return TimerSvc::get().apply(xTimer, [](host_timer *t){ t->active = false; t->deleted = true; });
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t xTimer, TickType_t xNewPeriod, TickType_t xTicksToWait){
+    (void)xTicksToWait;
+    if (!xNewPeriod)
+        return pdFAIL;
+    return TimerSvc::get().apply(xTimer, [xNewPeriod](host_timer *t){
+        t->period = xNewPeriod;
+        t->active = true;
+        t->due_us = pzhost::now_us() + static_cast<int64_t>(xNewPeriod) * (1000000 / configTICK_RATE_HZ);
+    });
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t xTimer){
+    bool a = false;
+    TimerSvc::get().apply(xTimer, [&a](host_timer *t){ a = t->active; });
+    return a ? pdTRUE : pdFALSE;
+}
+
+TickType_t xTimerGetPeriod(TimerHandle_t xTimer){
+    TickType_t p = 0;
+    TimerSvc::get().apply(xTimer, [&p](host_timer *t){ p = t->period; });
+    return p;
+}
+
+void *pvTimerGetTimerID(const TimerHandle_t xTimer){ return xTimer ? xTimer->id : nullptr; }
+
+
+// ===  Heap  ===
+
+size_t heap_caps_get_free_size(uint32_t caps){ (void)caps; return mallinfo2().fordblks; }
+
+size_t heap_caps_get_largest_free_block(uint32_t caps){ (void)caps; return mallinfo2().fordblks; }
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps){ (void)caps; return mallinfo2().fordblks; }
+
+
+// ===  UART  ===
+
+namespace {
+
+struct uart_emu {
+    std::mutex m;
+    bool installed = false;
+    QueueHandle_t evq = nullptr;
+    size_t rxcap = 0;
+    std::vector<uint8_t> rx;
+    pzhost::uart_tx_hook_t hook;
+};
+
+uart_emu& uart(uart_port_t p){
+    static auto *ports = new uart_emu[UART_NUM_MAX];
+    return ports[p < UART_NUM_MAX ? p : 0];
+}
+
+}   // namespace
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config){
+    (void)uart_config;
+    return uart_num < UART_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num){
+    (void)tx_io_num; (void)rx_io_num; (void)rts_io_num; (void)cts_io_num;
+    return uart_num < UART_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags){
+    (void)tx_buffer_size; (void)intr_alloc_flags;
+    if (uart_num >= UART_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    auto &u = uart(uart_num);
+    std::lock_guard<std::mutex> lk(u.m);
+    if (u.installed)
+        return ESP_FAIL;
+    u.installed = true;
+    u.rxcap = rx_buffer_size;
+    u.rx.clear();
+    u.evq = queue_size ? xQueueCreate(queue_size, sizeof(uart_event_t)) : nullptr;
+    if (uart_queue)
+        *uart_queue = u.evq;
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t uart_num){
+    auto &u = uart(uart_num);
+    std::lock_guard<std::mutex> lk(u.m);
+    if (!u.installed)
+        return ESP_FAIL;
+    u.installed = false;
+    if (u.evq)
+        vQueueDelete(u.evq);
+    u.evq = nullptr;
+    u.rx.clear();
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num){
+    auto &u = uart(uart_num);
+    std::lock_guard<std::mutex> lk(u.m);
+    u.rx.clear();
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size){
+    auto &u = uart(uart_num);
+    std::lock_guard<std::mutex> lk(u.m);
+    *size = u.rx.size();
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait){
+    (void)ticks_to_wait;
+    auto &u = uart(uart_num);
+    std::lock_guard<std::mutex> lk(u.m);
+    size_t n = length < u.rx.size() ? length : u.rx.size();
+    memcpy(buf, u.rx.data(), n);
+    u.rx.erase(u.rx.begin(), u.rx.begin() + n);
+    return static_cast<int>(n);
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size){
+    auto &u = uart(uart_num);
+    pzhost::uart_tx_hook_t hook;
+    {
+        std::lock_guard<std::mutex> lk(u.m);
+        if (!u.installed)
+            return -1;
+        hook = u.hook;
+    }
+    if (hook)
+        hook(uart_num, static_cast<const uint8_t*>(src), size);
+    return static_cast<int>(size);
+}
+
+namespace pzhost {
+
+void uart_set_tx_hook(int port, uart_tx_hook_t hook){
+    auto &u = uart(static_cast<uart_port_t>(port));
+    std::lock_guard<std::mutex> lk(u.m);
+    u.hook = std::move(hook);
+}
+
+void uart_inject_rx(int port, const uint8_t *data, size_t len){
+    auto &u = uart(static_cast<uart_port_t>(port));
+    std::lock_guard<std::mutex> lk(u.m);
+    if (!u.installed)
+        return;
+
+    uart_event_t evt{};
+    if (u.rx.size() + len > u.rxcap){
+        len = u.rxcap - u.rx.size();
+        evt.type = UART_BUFFER_FULL;
+    } else
+        evt.type = UART_DATA;
+
+    u.rx.insert(u.rx.end(), data, data + len);
+    evt.size = len;
+    if (u.evq)
+        xQueueSendToBack(u.evq, &evt, 0);
+}
+
+void sleep_us(int64_t us){
+    std::this_thread::sleep_for(std::chrono::nanoseconds(static_cast<int64_t>(us * 1000 / time_scale.load())));
+}
+
+}   // namespace pzhost
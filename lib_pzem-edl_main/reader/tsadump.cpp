@@ -0,0 +1,86 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    TimeSeries archive dump tool, host build only
+
+    usage: tsadump file.pzta               - print archive summary
+           tsadump file.pzta <tsid>        - print tier samples as CSV
+           curl -s http://espem/archive.bin?tsid=2 -o t2.pzta && tsadump t2.pzta 2 > t2.csv
+*/
+
+#include "tsareader.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+using namespace tsarchive;
+
+static const char* const model_name[] = { "none", "pzem004v3", "pzem003", "pzem017" };
+
+static void summary(const Reader &a){
+    const file_hdr &h = a.header();
+    time_t t = h.created;
+    char created[32];
+    strftime(created, sizeof(created), "%F %T", gmtime(&t));
+    printf("meter: %s, created: %s UTC, energy offset: %d Wh, size: %llu bytes, tiers: %u\n",
+        h.model < sizeof(model_name)/sizeof(model_name[0]) ? model_name[h.model] : "unknown", created,
+        h.energy_offset, static_cast<unsigned long long>(h.size), h.ntiers);
+
+    for (uint8_t i = 0; i != a.tiers(); ++i){
+        TierView tier = a.tier(i);
+        uint32_t valid = 0;
+        for (const record &r : tier)
+            valid += (r.flags & TSA_VALID) != 0;
+        printf("tier %u '%s': interval %u s, records %u/%u (valid %u), seq %u..%u, time %u..%u\n",
+            tier.id(), tier.descr(), tier.interval(), tier.size(), tier.header().capacity, valid,
+            tier.seq(0), tier.seq(tier.size()) - 1, tier.timestamp(0), tier.size() ? tier.timestamp(tier.size() - 1) : tier.timestamp(0));
+    }
+}
+
+static void csv(const TierView &tier){
+    printf("time,seq,voltage,current,power,energy,freq,pf\n");
+    for (uint32_t i = 0; i != tier.size(); ++i){
+        const record &r = tier[i];
+        if (!(r.flags & TSA_VALID))
+            continue;
+        printf("%u,%u,%.2f,%.3f,%.1f,%.0f,%.1f,%.2f\n", tier.timestamp(i), tier.seq(i),
+            tier.value(r, field_t::voltage), tier.value(r, field_t::current), tier.value(r, field_t::power),
+            tier.value(r, field_t::energy), tier.value(r, field_t::freq), tier.value(r, field_t::pf));
+    }
+}
+
+int main(int argc, char **argv){
+    if (argc < 2){
+        fprintf(stderr, "usage: %s <archive> [tsid]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Reader a(argv[1]);
+    if (!a.valid()){
+        fprintf(stderr, "%s: %s\n", argv[1], a.error().c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (argc < 3){
+        summary(a);
+        return EXIT_SUCCESS;
+    }
+
+    int idx = a.find(atoi(argv[2]));
+    if (idx < 0){
+        fprintf(stderr, "tier %s not found\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    csv(a.tier(idx));
+    return EXIT_SUCCESS;
+}
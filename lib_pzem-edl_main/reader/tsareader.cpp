@@ -0,0 +1,105 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "tsareader.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tsarchive {
+
+bool Reader::fail(const char *msg){
+    close();
+    err = msg;
+    return false;
+}
+
+bool Reader::open(const char *path){
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return fail(strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(file_hdr))){
+        ::close(fd);
+        return fail("file is too short");
+    }
+
+    void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);    // mapping stays valid
+    if (m == MAP_FAILED)
+        return fail(strerror(errno));
+
+    if (!open(m, st.st_size)){
+        munmap(m, st.st_size);
+        return false;
+    }
+    mapped = true;
+    return true;
+}
+
+bool Reader::open(const void *data, size_t size){
+    if (base)
+        close();
+    err.clear();
+    if (!data || size < sizeof(file_hdr))
+        return fail("file is too short");
+    if (reinterpret_cast<uintptr_t>(data) % TSA_ALIGN)
+        return fail("buffer is not aligned");
+
+    const file_hdr *fh = static_cast<const file_hdr*>(data);
+    if (fh->magic != TSA_MAGIC)
+        return fail("not an archive file");
+    if (fh->ver != TSA_VERSION || fh->hdr_size != sizeof(file_hdr) || fh->tier_size != sizeof(tier_hdr) || fh->rec_size != sizeof(record))
+        return fail("unsupported archive version");
+    if (fh->size != size)
+        return fail("archive size mismatch, file is truncated");
+    if (data_offset(fh->ntiers) > size)
+        return fail("tier headers are truncated");
+
+    // tier data must be aligned and fit the file
+    const tier_hdr *th = reinterpret_cast<const tier_hdr*>(fh + 1);
+    for (uint8_t i = 0; i != fh->ntiers; ++i){
+        if (th[i].offset % TSA_ALIGN || th[i].offset < data_offset(fh->ntiers) || next_offset(th[i].offset, th[i].count) > size)
+            return fail("tier data is out of file bounds");
+    }
+
+    base = static_cast<const uint8_t*>(data);
+    len = size;
+    return true;
+}
+
+void Reader::close(){
+    if (mapped && base)
+        munmap(const_cast<uint8_t*>(base), len);
+    base = nullptr;
+    len = 0;
+    mapped = false;
+}
+
+TierView Reader::tier(uint8_t idx) const {
+    const tier_hdr *th = reinterpret_cast<const tier_hdr*>(base + sizeof(file_hdr)) + idx;
+    return TierView(th, reinterpret_cast<const record*>(base + th->offset));
+}
+
+int Reader::find(uint8_t id) const {
+    for (uint8_t i = 0; i != tiers(); ++i)
+        if (tier(i).id() == id)
+            return i;
+    return -1;
+}
+
+} // namespace tsarchive
@@ -0,0 +1,113 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    TimeSeries archive reader for Linux/macOS hosts
+    archive file is mapped to memory read-only, headers are validated once on open,
+    after that records are accessed in place, no parsing or copying is done
+*/
+
+#pragma once
+#include "tsarchive.h"
+#include <string>
+
+namespace tsarchive {
+
+/**
+ * @brief a view of a single tier in archive
+ */
+class TierView {
+    const tier_hdr *h;
+    const record *r;
+
+public:
+    TierView(const tier_hdr *hdr, const record *rec) : h(hdr), r(rec) {}
+
+    const tier_hdr &header() const { return *h; }
+    uint8_t id() const { return h->id; }
+    uint32_t interval() const { return h->interval; }
+    const char *descr() const { return h->descr; }
+
+    // number of records
+    uint32_t size() const { return h->count; }
+
+    // records array, oldest first
+    const record *begin() const { return r; }
+    const record *end() const { return r + h->count; }
+    const record &operator[](uint32_t i) const { return r[i]; }
+
+    // timestamp of record 'i'
+    uint32_t timestamp(uint32_t i) const { return h->base_time + i * h->interval; }
+
+    // TimeSeries sequence number of record 'i'
+    uint32_t seq(uint32_t i) const { return h->first_seq + i; }
+
+    // record field value in SI units, energy is in Wh
+    float value(const record &rec, field_t f) const { return rec.raw(f) * h->scale[f]; }
+
+    // field is provided by the meter
+    bool has(field_t f) const { return h->scale[f] != 0; }
+};
+
+/**
+ * @brief memory mapped archive file
+ */
+class Reader {
+    const uint8_t *base{nullptr};
+    size_t len{0};
+    bool mapped{false};     // base is a file mapping owned by the Reader
+    std::string err;
+
+    bool fail(const char *msg);
+
+public:
+    Reader() = default;
+    explicit Reader(const char *path){ open(path); }
+    ~Reader(){ close(); }
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    /**
+     * @brief map archive file and validate it's headers
+     *
+     * @param path - file name
+     * @return true on success, otherwise check error()
+     */
+    bool open(const char *path);
+
+    /**
+     * @brief use archive that is already in memory, i.e. received over network
+     * buffer must outlive the Reader and be at least 8 byte aligned
+     */
+    bool open(const void *data, size_t size);
+
+    void close();
+
+    bool valid() const { return base; }
+    const std::string &error() const { return err; }
+
+    const file_hdr &header() const { return *reinterpret_cast<const file_hdr*>(base); }
+
+    // number of tiers
+    uint8_t tiers() const { return base ? header().ntiers : 0; }
+
+    // tier by index, [0, tiers())
+    TierView tier(uint8_t idx) const;
+
+    /**
+     * @brief find tier by TimeSeries id
+     * @return tier index or -1 if not found
+     */
+    int find(uint8_t id) const;
+};
+
+} // namespace tsarchive
@@ -40,7 +40,7 @@ void MeanAverage<T>::push(const T& m) {
 
 // 템플릿 특수화 push 구현
 template <>
-void MeanAverage<pz004::metrics>::push(const pz004::metrics& m) {
+inline void MeanAverage<pz004::metrics>::push(const pz004::metrics& m) {
     v += m.voltage;
     c += m.current;
     p += m.power;
@@ -62,7 +62,7 @@ T MeanAverage<T>::get() {
 
 // 템플릿 특수화 get 구현
 template <>
-pz004::metrics MeanAverage<pz004::metrics>::get() {
+inline pz004::metrics MeanAverage<pz004::metrics>::get() {
     pz004::metrics _m;
     _m.voltage = v / _cnt;
     _m.current = c / _cnt;
@@ -80,7 +80,7 @@ void MeanAverage<T>::reset() {
 
 // 템플릿 특수화 reset 구현
 template <>
-void MeanAverage<pz004::metrics>::reset() {
+inline void MeanAverage<pz004::metrics>::reset() {
     v = c = p = e = f = pf = _cnt = 0;
 }
 
@@ -184,6 +184,27 @@ public:
 
     void push_back(T const &val);
 
+    /**
+     * @brief direct access to buffer storage, i.e. to bulk-load elements from a file
+     * element with offset 'i' from head is located at storage()[(head + i) % capacity]
+     * 
+     * @return T* - storage of 'capacity' elements, nullptr if memory allocation has failed
+     */
+    T *storage() const { return data.get(); }
+
+    /**
+     * @brief set buffer state after elements were placed into storage() directly
+     * 
+     * @param _head - storage index of the oldest element
+     * @param _size - number of elements
+     */
+    void assign(int _head, int _size){
+        if (!data || _head < 0 || _size < 0 || _head >= static_cast<int>(capacity) || _size > static_cast<int>(capacity))
+            return clear();
+        head = _head;
+        size = _size;
+    }
+
     //T* pop_front(){};
 
     // Const iterator methods
@@ -219,7 +240,7 @@ void RingBuff<T>::push_back(const T& val) {
 
 // Unary predicate for ID match
 template <class T>
-class MatchID : public std::unary_function<T, bool>{
+class MatchID {
     uint8_t _id;
 public:
     explicit MatchID(uint8_t id) : _id(id) {}
@@ -0,0 +1,293 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "evbus.hpp"
+#include "esp_timer.h"
+#include <cstring>
+#include <vector>
+
+#define PZEVT_TASK_NAME     "PZ_EVT"
+
+using namespace pzevt;
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+// subscriber slots, a slot holds subscriber object along with shared_ptr control block
+#define PZEVT_SUB_SLOT      (sizeof(PZSubscriber) + 8 * sizeof(void*))
+static BlockPool<PZEVT_SUB_SLOT, PZEVT_MAX_SUBS> sub_pool;
+
+/**
+ * @brief allocator for std::allocate_shared() handing out a slot reserved beforehand,
+ * so that allocation can't fail within allocate_shared()
+ */
+template <class T>
+struct slot_alloc {
+    using value_type = T;
+    void *slot;
+
+    explicit slot_alloc(void *s) : slot(s) {}
+    template <class U> slot_alloc(const slot_alloc<U> &a) : slot(a.slot) {}
+
+    T* allocate(size_t n){
+        static_assert(sizeof(T) <= PZEVT_SUB_SLOT, "subscriber slot is too small");
+        (void)n;
+        return static_cast<T*>(slot);
+    }
+    void deallocate(T *p, size_t){ sub_pool.free(p); }
+};
+template <class T, class U> bool operator==(const slot_alloc<T> &a, const slot_alloc<U> &b){ return a.slot == b.slot; }
+template <class T, class U> bool operator!=(const slot_alloc<T> &a, const slot_alloc<U> &b){ return a.slot != b.slot; }
+#endif
+
+
+/*   === PZSubscriber immplementation ===   */
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+PZSubscriber::PZSubscriber(const char *_name, int16_t id, uint8_t evmask, size_t _depth, policy_t p) :
+    fid(id), fmask(evmask), policy(p), depth(_depth ? (_depth < PZEVT_QUEUE_DEPTH ? _depth : PZEVT_QUEUE_DEPTH) : 1) {
+#else
+PZSubscriber::PZSubscriber(const char *_name, int16_t id, uint8_t evmask, size_t _depth, policy_t p) :
+    fid(id), fmask(evmask), policy(p), q(new event[_depth ? _depth : 1]), depth(_depth ? _depth : 1) {
+#endif
+    strncpy(name, _name ? _name : "", sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+#ifdef PZEM_EDL_STATIC_ALLOC
+    lock = xSemaphoreCreateMutexStatic(&lock_buff);
+    avail = xSemaphoreCreateBinaryStatic(&avail_buff);
+#else
+    lock = xSemaphoreCreateMutex();
+    avail = xSemaphoreCreateBinary();
+#endif
+}
+
+PZSubscriber::~PZSubscriber(){
+    stop();
+    if (avail)
+        vSemaphoreDelete(avail);
+    if (lock)
+        vSemaphoreDelete(lock);
+}
+
+void PZSubscriber::offer(const event &e){
+    if (!lock || xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+        return;
+
+    bool placed = false;
+    if (policy == policy_t::coalesce_latest){
+        // replace pending event from the same device/type, if any
+        for (size_t i = 0; i != cnt; ++i){
+            event &p = q[(head + i) % depth];
+            if (p.id == e.id && p.type == e.type){
+                p = e;
+                ++stats.coalesced;
+                placed = true;
+                break;
+            }
+        }
+    }
+
+    if (!placed){
+        if (cnt == depth){
+            // queue is full, discard the oldest event
+            head = (head + 1) % depth;
+            --cnt;
+            ++stats.dropped;
+        }
+        q[(head + cnt) % depth] = e;
+        ++cnt;
+        if (cnt > stats.maxpending)
+            stats.maxpending = cnt;
+    }
+
+    xSemaphoreGive(lock);
+    xSemaphoreGive(avail);
+}
+
+bool PZSubscriber::pop(event &e, TickType_t wait){
+    if (!lock)
+        return false;
+
+    for (;;){
+        if (xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+            return false;
+        bool ok = cnt;
+        if (ok){
+            e = q[head];
+            head = (head + 1) % depth;
+            --cnt;
+            ++stats.delivered;
+        }
+        xSemaphoreGive(lock);
+
+        if (ok)
+            return true;
+        if (!wait || quit || xSemaphoreTake(avail, wait) != pdTRUE || quit)
+            return false;
+    }
+}
+
+pzevt::sub_stats PZSubscriber::getStats() const {
+    sub_stats s{};
+    if (!lock || xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+        return s;
+    s = stats;
+    s.pending = cnt;
+    s.lag_us = cnt ? esp_timer_get_time() - q[head].us : 0;
+    xSemaphoreGive(lock);
+    return s;
+}
+
+bool PZSubscriber::run(handler_t f, UBaseType_t prio, uint32_t stack){
+    if (!f || t_hndlr)
+        return false;
+
+    handler = std::move(f);
+#ifdef PZEM_EDL_STATIC_ALLOC
+    (void)stack;
+    t_hndlr = xTaskCreateStatic(PZSubscriber::hndlrTask, PZEVT_TASK_NAME, PZEVT_TASK_STACK, reinterpret_cast<void *>(this), prio, t_hndlr_stack, &t_hndlr_buff);
+    return t_hndlr;
+#else
+    TaskHandle_t h = nullptr;
+    if (xTaskCreate(PZSubscriber::hndlrTask, PZEVT_TASK_NAME, stack, reinterpret_cast<void *>(this), prio, &h) != pdPASS)
+        return false;
+    t_hndlr = h;
+    return true;
+#endif
+}
+
+void PZSubscriber::stop(){
+    if (!t_hndlr)
+        return;
+    quit = true;
+    xSemaphoreGive(avail);
+#ifdef PZEM_EDL_STATIC_ALLOC
+    while (!parked)
+        vTaskDelay(1);
+    TaskHandle_t h = t_hndlr;
+    t_hndlr = nullptr;
+    vTaskDelete(h);
+    parked = false;
+#else
+    while (t_hndlr)
+        vTaskDelay(1);
+#endif
+    quit = false;
+}
+
+void PZSubscriber::hndlrLoop(){
+    event e;
+    while (!quit){
+        if (pop(e, portMAX_DELAY))
+            handler(e);
+    }
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // signal stop() that handler is not running anymore and wait to be deleted
+    parked = true;
+    for (;;)
+        vTaskDelay(portMAX_DELAY);
+#else
+    // signal stop() that handler is not running anymore
+    t_hndlr = nullptr;
+    vTaskDelete(NULL);
+#endif
+}
+
+
+/*   === PZEventBus immplementation ===   */
+
+PZEventBus::PZEventBus(){
+#ifdef PZEM_EDL_STATIC_ALLOC
+    lock = xSemaphoreCreateMutexStatic(&lock_buff);
+#else
+    lock = xSemaphoreCreateMutex();
+#endif
+}
+
+PZEventBus::~PZEventBus(){
+    subs.clear();
+    if (lock)
+        vSemaphoreDelete(lock);
+}
+
+std::shared_ptr<PZSubscriber> PZEventBus::subscribe(const char *name, int16_t id, uint8_t evmask, size_t depth, policy_t policy){
+    if (!lock)
+        return nullptr;
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+    void *slot = sub_pool.alloc();
+    if (!slot)
+        return nullptr;     // no free slots
+    auto s = std::allocate_shared<PZSubscriber>(slot_alloc<PZSubscriber>(slot), name, id, evmask, depth, policy);
+#else
+    auto s = std::make_shared<PZSubscriber>(name, id, evmask, depth, policy);
+#endif
+    if (xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+        return nullptr;
+    bool ok = subs.add(s);
+    xSemaphoreGive(lock);
+    return ok ? s : nullptr;
+}
+
+bool PZEventBus::unsubscribe(const std::shared_ptr<PZSubscriber> &s){
+    if (!lock || xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+        return false;
+
+    bool found = false;
+    for (int i = 0; i != subs.size(); ++i){
+        if (subs[i] == s){
+            subs.unlink(i);
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    return found;
+}
+
+void PZEventBus::publish(uint8_t id, evt_t type){
+    if (!lock)
+        return;
+
+    event e{id, type, esp_timer_get_time()};
+    if (xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+        return;
+    for (auto &s : subs){
+        if (s->match(e))
+            s->offer(e);
+    }
+    xSemaphoreGive(lock);
+}
+
+void PZEventBus::foreach(std::function<void (const PZSubscriber &s)> f){
+    if (!f || !lock || xSemaphoreTake(lock, portMAX_DELAY) != pdTRUE)
+        return;
+
+    // take a copy of the list, so that the publisher is not blocked while f() runs
+#ifdef PZEM_EDL_STATIC_ALLOC
+    std::shared_ptr<PZSubscriber> l[PZEVT_MAX_SUBS];
+    size_t n = 0;
+    for (auto &s : subs)
+        l[n++] = s;
+    xSemaphoreGive(lock);
+
+    for (size_t i = 0; i != n; ++i)
+        f(*l[i]);
+#else
+    std::vector<std::shared_ptr<PZSubscriber>> l;
+    l.reserve(subs.size());
+    for (auto &s : subs)
+        l.push_back(s);
+    xSemaphoreGive(lock);
+
+    for (auto &s : l)
+        f(*s);
+#endif
+}
@@ -0,0 +1,254 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "LList.h"
+
+#ifndef PZEVT_QUEUE_DEPTH
+#define PZEVT_QUEUE_DEPTH       8               // default subscriber queue depth, max depth in static allocation mode
+#endif
+#define PZEVT_TASK_PRIO         2               // default subscriber handler task priority, lower than UART RX task
+#ifndef PZEVT_TASK_STACK
+#define PZEVT_TASK_STACK        3072            // default subscriber handler task stack size, fixed in static allocation mode
+#endif
+#define PZEVT_SUB_NAME_LEN      16
+
+/*
+ In static allocation mode subscribers are placed in fixed slots along with their queues and handler task stacks,
+ so subscribing/unsubscribing at run time does not touch the heap
+*/
+#ifdef PZEM_EDL_STATIC_ALLOC
+#include "mempool.hpp"
+#ifndef PZEVT_MAX_SUBS
+#define PZEVT_MAX_SUBS          8               // max number of subscribers, shared by all buses
+#endif
+#endif
+
+namespace pzevt {
+
+/**
+ * @brief device event types, could be combined into a bitmask for subscriber filter
+ */
+enum class evt_t : uint8_t {
+    update  = 0x01,     // new metrics data has been received and parsed
+    error   = 0x02,     // device replied with an error or unparsable message
+    timeout = 0x04      // device did not reply to a poll request
+};
+
+static constexpr uint8_t evt_any = 0xff;        // filter mask matching any event type
+static constexpr int16_t id_any = -1;           // filter matching any device id
+
+/**
+ * @brief subscriber queue overflow policy
+ */
+enum class policy_t : uint8_t {
+    drop_oldest = 0,    // full queue discards it's oldest event to accept a new one
+    coalesce_latest     // a pending event of the same device/type is replaced with a newer one, drops oldest if there is no such event
+};
+
+/**
+ * @brief an event for subscribers
+ * event carries no metrics data, subscriber should take a snapshot of the device's metrics if needed
+ */
+struct event {
+    uint8_t id;         // device id
+    evt_t type;
+    int64_t us;         // event time, esp_timer_get_time()
+};
+
+/**
+ * @brief subscriber counters
+ */
+struct sub_stats {
+    uint32_t delivered;     // events taken from the queue by subscriber
+    uint32_t dropped;       // events lost due to queue overflow
+    uint32_t coalesced;     // events replaced with a newer one
+    uint32_t pending;       // events waiting in the queue
+    uint32_t maxpending;    // max queue depth ever observed
+    int64_t  lag_us;        // age of the oldest pending event, 0 if queue is empty
+};
+
+inline uint8_t mask(evt_t t){ return static_cast<uint8_t>(t); }
+
+} // namespace pzevt
+
+/**
+ * @brief event bus subscriber
+ * Each subscriber has it's own bounded queue, so a slow consumer never stalls the publisher or other subscribers,
+ * it just looses (or coalesces) it's own events. Events are either fetched with pop() from any task or
+ * delivered to a handler function running in subscriber's own task.
+ */
+class PZSubscriber {
+public:
+    using handler_t = std::function<void (const pzevt::event &e)>;
+
+    /**
+     * @brief Construct a new subscriber
+     *
+     * @param name - mnemonic name, used for reporting
+     * @param id - device id to receive events for, pzevt::id_any - any device
+     * @param evmask - bitmask of pzevt::evt_t event types to receive
+     * @param depth - queue depth, up to PZEVT_QUEUE_DEPTH in static allocation mode
+     * @param policy - queue overflow policy
+     */
+    PZSubscriber(const char *name, int16_t id, uint8_t evmask, size_t depth, pzevt::policy_t policy);
+    ~PZSubscriber();
+
+    // Copy semantics : forbidden
+    PZSubscriber(const PZSubscriber&) = delete;
+    PZSubscriber& operator=(const PZSubscriber&) = delete;
+
+    /**
+     * @brief check if event passes subscriber's filter
+     */
+    bool match(const pzevt::event &e) const { return (fid == pzevt::id_any || fid == e.id) && (fmask & pzevt::mask(e.type)); }
+
+    /**
+     * @brief put event into subscriber's queue
+     * never blocks for longer than it takes to copy an event, applies overflow policy if queue is full
+     */
+    void offer(const pzevt::event &e);
+
+    /**
+     * @brief fetch the oldest event from the queue
+     *
+     * @param e - event to fill
+     * @param wait - ticks to wait for an event if queue is empty
+     * @return true if event has been fetched
+     */
+    bool pop(pzevt::event &e, TickType_t wait = 0);
+
+    /**
+     * @brief run a handler function in subscriber's own task, handler is called for every event fetched from the queue
+     * subscriber must not be pop()'ed from elsewhere while handler is running,
+     * stack size is fixed at build time with PZEVT_TASK_STACK in static allocation mode
+     *
+     * @param f - handler function
+     * @return true on success
+     */
+    bool run(handler_t f, UBaseType_t prio = PZEVT_TASK_PRIO, uint32_t stack = PZEVT_TASK_STACK);
+
+    /**
+     * @brief stop handler task (if any)
+     */
+    void stop();
+
+    pzevt::sub_stats getStats() const;
+
+    const char *getName() const { return name; }
+
+private:
+    char name[PZEVT_SUB_NAME_LEN];
+    const int16_t fid;
+    const uint8_t fmask;
+    const pzevt::policy_t policy;
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+    pzevt::event q[PZEVT_QUEUE_DEPTH];
+#else
+    std::unique_ptr<pzevt::event[]> q;
+#endif
+    const size_t depth;
+    size_t head = 0;                        // oldest event index
+    size_t cnt = 0;                         // number of queued events
+
+    pzevt::sub_stats stats{};
+
+    SemaphoreHandle_t lock = nullptr;       // queue access mutex
+    SemaphoreHandle_t avail = nullptr;      // signals new events to the waiting consumer
+#ifdef PZEM_EDL_STATIC_ALLOC
+    StaticSemaphore_t lock_buff;
+    StaticSemaphore_t avail_buff;
+#endif
+
+    handler_t handler;
+    volatile TaskHandle_t t_hndlr = nullptr;
+    std::atomic<bool> quit{false};
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // static task does not delete itself, it's buffers could be reused only after stop() has deleted it
+    std::atomic<bool> parked{false};
+    StaticTask_t t_hndlr_buff;
+    StackType_t t_hndlr_stack[PZEVT_TASK_STACK];
+#endif
+
+    static void hndlrTask(void *arg){ static_cast<PZSubscriber*>(arg)->hndlrLoop(); }
+    void hndlrLoop();
+};
+
+/**
+ * @brief publish/subscribe hub for device events
+ * publisher is usually an RX task, so publish() only copies an event into the queues of matching subscribers
+ * and never waits for the subscribers to process it
+ */
+class PZEventBus {
+public:
+    PZEventBus();
+    ~PZEventBus();
+
+    // Copy semantics : forbidden
+    PZEventBus(const PZEventBus&) = delete;
+    PZEventBus& operator=(const PZEventBus&) = delete;
+
+    /**
+     * @brief register new subscriber
+     *
+     * @param name - mnemonic name
+     * @param id - device id to receive events for, pzevt::id_any - any device
+     * @param evmask - bitmask of pzevt::evt_t event types to receive
+     * @param depth - queue depth
+     * @param policy - queue overflow policy
+     * @return std::shared_ptr<PZSubscriber> - subscriber object, nullptr on error or if there are no free slots in static allocation mode
+     */
+    std::shared_ptr<PZSubscriber> subscribe(const char *name, int16_t id = pzevt::id_any, uint8_t evmask = pzevt::evt_any,
+                                            size_t depth = PZEVT_QUEUE_DEPTH, pzevt::policy_t policy = pzevt::policy_t::drop_oldest);
+
+    /**
+     * @brief remove subscriber from the bus
+     * it stops receiving new events, but could still be used to fetch pending ones
+     */
+    bool unsubscribe(const std::shared_ptr<PZSubscriber> &s);
+
+    /**
+     * @brief publish device event to all matching subscribers
+     *
+     * @param id - device id
+     * @param type - event type
+     */
+    void publish(uint8_t id, pzevt::evt_t type);
+
+    /**
+     * @brief run a function for each registered subscriber, i.e. to collect stats
+     * f() is called on a copy of the subscribers list outside of the bus lock, so it does not block publish()
+     */
+    void foreach(std::function<void (const PZSubscriber &s)> f);
+
+    /**
+     * @brief number of registered subscribers
+     */
+    int size() const { return subs.size(); }
+
+private:
+#ifdef PZEM_EDL_STATIC_ALLOC
+    FixedList<std::shared_ptr<PZSubscriber>, PZEVT_MAX_SUBS> subs;
+    StaticSemaphore_t lock_buff;
+#else
+    LList<std::shared_ptr<PZSubscriber>> subs;
+#endif
+    SemaphoreHandle_t lock = nullptr;       // subscribers list mutex
+};
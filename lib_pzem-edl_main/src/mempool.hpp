@@ -0,0 +1,147 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/**
+ * @brief lock-free pool of fixed-size memory blocks with a compile-time capacity
+ * Storage is allocated statically within the object, blocks could be taken and released
+ * from any task without locking, allocation never blocks and fails if the pool is exhausted.
+ *
+ * @tparam BlockSize - block size, bytes
+ * @tparam Count - number of blocks, 32 max
+ */
+template <size_t BlockSize, size_t Count>
+class BlockPool {
+    static_assert(Count && Count <= 32, "BlockPool supports up to 32 blocks");
+    static constexpr size_t bsize = (BlockSize + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    alignas(std::max_align_t) uint8_t mem[bsize * Count];
+    std::atomic<uint32_t> busy{0};          // bitmap of allocated blocks
+    std::atomic<uint32_t> _fails{0};        // allocation requests failed due to pool exhaustion
+
+public:
+    BlockPool() = default;
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+
+    /**
+     * @brief take a block from the pool
+     * @param size - requested size, must not exceed BlockSize
+     * @return void* pointer to a block, nullptr if pool is exhausted or size is too big
+     */
+    void* alloc(size_t size = BlockSize){
+        if (size > BlockSize){
+            _fails.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        uint32_t b = busy.load(std::memory_order_relaxed);
+        for (;;){
+            uint32_t free = ~b & (Count == 32 ? 0xffffffff : ((1U << Count) - 1));
+            if (!free){
+                _fails.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            uint32_t bit = free & (~free + 1);      // lowest free block
+            if (busy.compare_exchange_weak(b, b | bit, std::memory_order_acquire, std::memory_order_relaxed))
+                return mem + bsize * __builtin_ctz(bit);
+        }
+    }
+
+    /**
+     * @brief return a block to the pool
+     * @param p - pointer obtained with alloc()
+     */
+    void free(void *p){
+        if (!owns(p))
+            return;
+        size_t idx = (static_cast<uint8_t*>(p) - mem) / bsize;
+        busy.fetch_and(~(1U << idx), std::memory_order_release);
+    }
+
+    // check if pointer belongs to this pool
+    bool owns(const void *p) const { return p >= mem && p < mem + sizeof(mem); }
+
+    // number of blocks in use
+    size_t used() const { return __builtin_popcount(busy.load(std::memory_order_relaxed)); }
+
+    // number of failed allocation requests
+    uint32_t fails() const { return _fails.load(std::memory_order_relaxed); }
+
+    static constexpr size_t capacity() { return Count; }
+};
+
+
+/**
+ * @brief a fixed-capacity replacement for LList container, no heap allocations
+ * provides the subset of LList API used by the library
+ *
+ * @tparam T - item type
+ * @tparam N - max number of items
+ */
+template <class T, size_t N>
+class FixedList {
+    T items[N];
+    int cnt = 0;
+
+public:
+    int size() const { return cnt; }
+
+    /**
+     * @brief append an item
+     * @return false if list is full
+     */
+    bool add(const T &val){
+        if (cnt == static_cast<int>(N))
+            return false;
+        items[cnt++] = val;
+        return true;
+    }
+
+    bool add(T &&val){
+        if (cnt == static_cast<int>(N))
+            return false;
+        items[cnt++] = std::move(val);
+        return true;
+    }
+
+    T& operator[](int index){ return items[index]; }
+    const T& operator[](int index) const { return items[index]; }
+
+    /**
+     * @brief remove an item, order of the remaining items is preserved
+     */
+    bool unlink(int index){
+        if (index < 0 || index >= cnt)
+            return false;
+        for (int i = index; i < cnt - 1; ++i)
+            items[i] = std::move(items[i + 1]);
+        items[--cnt] = T();
+        return true;
+    }
+
+    void clear(){
+        while (cnt)
+            items[--cnt] = T();
+    }
+
+    T* begin(){ return items; }
+    T* end(){ return items + cnt; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + cnt; }
+    const T* cbegin() const { return items; }
+    const T* cend() const { return items + cnt; }
+};
@@ -39,11 +39,10 @@ static const uint16_t CRC16_MODBUS_TABLE[] = {
 0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641, 0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040};
 
 uint16_t crc16(const uint8_t *data, uint16_t size){
-    uint16_t crc = 0xffff;  // Default value
-
-    if (!size)              // return default CRC16 for 0x00 len data
-        return crc;
+    return crc16(data, size, 0xffff);   // Default value, returned for 0x00 len data
+}
 
+uint16_t crc16(const uint8_t *data, uint16_t size, uint16_t crc){
     while (size--){
         crc = *(uint16_t*)&CRC16_MODBUS_TABLE[(*data++ ^ crc) & 0xff] ^ (crc >>8);
     }
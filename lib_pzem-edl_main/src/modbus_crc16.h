@@ -25,6 +25,16 @@ namespace modbus {
  */
 uint16_t crc16(const uint8_t *data, uint16_t size);
 
+/**
+ * @brief continue crc16 calculation over the next chunk of data
+ * 
+ * @param data - byte array
+ * @param size - array size
+ * @param crc - crc16 of the previous chunks
+ * @return uint16_t CRC16
+ */
+uint16_t crc16(const uint8_t *data, uint16_t size, uint16_t crc);
+
 // Check MODBUS CRC16 over provided data vector
 bool checkcrc16(const uint8_t *buf, uint16_t len);
 
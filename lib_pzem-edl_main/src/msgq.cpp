@@ -12,6 +12,25 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 #include "msgq.hpp"
 
+#ifdef PZEM_EDL_STATIC_ALLOC
+// message pools
+static BlockPool<sizeof(TX_msg), PZEM_TX_MSG_POOL> tx_pool;
+static BlockPool<sizeof(RX_msg), PZEM_RX_MSG_POOL> rx_pool;
+static BlockPool<PZEM_RX_FRAME_MAX, PZEM_RX_MSG_POOL> rx_buff_pool;
+
+void* TX_msg::operator new(size_t size) noexcept { return tx_pool.alloc(size); }
+void TX_msg::operator delete(void *p) noexcept { tx_pool.free(p); }
+
+void* RX_msg::operator new(size_t size) noexcept { return rx_pool.alloc(size); }
+void RX_msg::operator delete(void *p) noexcept { rx_pool.free(p); }
+
+uint8_t* RX_msg::buff_alloc(size_t size){ return static_cast<uint8_t*>(rx_buff_pool.alloc(size)); }
+void RX_msg::buff_free(uint8_t *b){ rx_buff_pool.free(b); }
+#else
+uint8_t* RX_msg::buff_alloc(size_t size){ return new(std::nothrow) uint8_t[size]; }
+void RX_msg::buff_free(uint8_t *b){ delete[] b; }
+#endif
+
 
 void MsgQ::attach_RX_hndlr(rxdatahandler_t f){
     if (!f)
@@ -76,7 +95,11 @@ void UartQ::init(const uart_config_t &uartcfg, int gpio_rx, int gpio_tx){
     uart_param_config(port, &uartcfg);
     uart_set_pin(port, gpio_tx, gpio_rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
     uart_driver_install(port, RX_BUF_SIZE, TX_BUF_SIZE, rx_msg_q_DEPTH, &rx_msg_q, 0);
+#ifdef PZEM_EDL_STATIC_ALLOC
+    rts_sem = xSemaphoreCreateBinaryStatic(&rts_sem_buff);
+#else
     rts_sem = xSemaphoreCreateBinary();     // Ready-To-Send-next semaphore
+#endif
 }
 
 
@@ -119,6 +142,7 @@ bool UartQ::txenqueue(TX_msg *msg){
 
     // check if q is present
     if (!tx_msg_q){
+        ++stats.tx_drops;
         delete msg;     // пакет надо удалять сразу, иначе, не попав в очередь, он останется потерян в памяти
         return false;
     }
@@ -127,9 +151,11 @@ bool UartQ::txenqueue(TX_msg *msg){
         ESP_LOGD(TAG, "TX packet enque, t: %ld", esp_timer_get_time()/1000);
     #endif
 
+    PZTRACE_INSTANT(txenqueue, msg->data[0]);
     if (xQueueSendToBack(tx_msg_q, (void *) &msg, (TickType_t)0) == pdTRUE)
         return true;
     else {
+        ++stats.tx_drops;
         delete msg;     // пакет надо удалять сразу, иначе, не попав в очередь, он останется потерян в памяти
         return false;
     }
@@ -188,19 +214,26 @@ bool NullQ::txenqueue(TX_msg *msg){
     bool status = false;
     if (tx_callback){
         tx_callback(msg);
+        ++stats.tx_frames;
         status = true;
-    }
+    } else
+        ++stats.tx_drops;
 
     delete msg;
     return status;
 }
 
 bool NullQ::rxenqueue(RX_msg *msg){
+    ++stats.rx_frames;
+    if (!msg->valid)
+        ++stats.rx_crc_err;
+
     if (rx_callback){
         rx_callback(msg);
         return true;
     }
 
+    ++stats.rx_drops;
     delete msg;
     return false;
 }
@@ -212,7 +245,16 @@ NullCable::NullCable(){
 }
 
 void NullCable::tx_rx(TX_msg *tm, bool atob){
-    auto *rmsg = new RX_msg(tm->data, tm->len);
+    // TX message is destroyed by the sender, so RX message needs it's own copy of the data
+    uint8_t *buff = RX_msg::buff_alloc(tm->len);
+    if (!buff)
+        return;
+    memcpy(buff, tm->data, tm->len);
+    auto *rmsg = new RX_msg(buff, tm->len);
+    if (!rmsg){
+        RX_msg::buff_free(buff);
+        return;
+    }
     atob ? portB.rxenqueue(rmsg) : portA.rxenqueue(rmsg);
     // receiver call will destroy dynamically allocated object
 }
@@ -15,7 +15,9 @@ GitHub: https://github.com/vortigont/pzem-edl
 #include <functional>
 #include <memory>
 #include "modbus_crc16.h"
+#include "trace.hpp"
 #include <string.h>
+#include <new>
 
 #ifdef ARDUINO
 #include "esp32-hal-log.h"
@@ -33,16 +35,51 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 // RX
 #define rx_msg_q_DEPTH          10
+#ifndef EVT_TASK_PRIO
 #define EVT_TASK_PRIO           4
+#endif
+#ifndef EVT_TASK_STACK
 #define EVT_TASK_STACK          3072
+#endif
 #define EVT_TASK_NAME           "UART_EVQ"
 
 // TX
 #define tx_msg_q_DEPTH          8
+#ifndef TXQ_TASK_PRIO
 #define TXQ_TASK_PRIO           2
+#endif
+#ifndef TXQ_TASK_STACK
 #define TXQ_TASK_STACK          2048
+#endif
 #define TXQ_TASK_NAME           "UART_TXQ"
 
+// CPU core to pin RX/TX tasks to
+#ifndef UARTQ_TASK_CORE
+#define UARTQ_TASK_CORE         tskNO_AFFINITY
+#endif
+
+/*
+ Static allocation mode
+ When PZEM_EDL_STATIC_ALLOC is defined, library objects use FreeRTOS *Static API and preallocated storage,
+ messages are taken from fixed-size pools, so nothing is allocated on heap while PZEMs are being polled
+*/
+#ifdef PZEM_EDL_STATIC_ALLOC
+#include "mempool.hpp"
+#ifndef PZPOOL_MAX_PORTS
+#define PZPOOL_MAX_PORTS        2                       // max number of ports in a pool
+#endif
+#ifndef PZEM_TX_MSG_POOL
+#define PZEM_TX_MSG_POOL        (PZPOOL_MAX_PORTS * tx_msg_q_DEPTH + 4)    // number of TX messages in the pool, shared by all ports
+#endif
+#ifndef PZEM_RX_MSG_POOL
+#define PZEM_RX_MSG_POOL        4                       // number of RX messages in the pool
+#endif
+#ifndef PZEM_RX_FRAME_MAX
+#define PZEM_RX_FRAME_MAX       RX_BUF_SIZE             // max RX frame size, bytes, longer data is discarded
+#endif
+#define PZEM_TX_FRAME_MAX       8                       // max TX frame size, bytes
+#endif
+
 // ESP32 log tag
 static const char *TAG __attribute__((unused)) = "UartQ";
 
@@ -72,11 +109,23 @@ struct TX_msg {
     uint8_t* data;          // data pointer
     bool w4rx;              // 'wait for reply' - a reply for message expected, should block TX queue handler
 
+#ifdef PZEM_EDL_STATIC_ALLOC
+    explicit TX_msg(size_t size, bool rxreq = true) : len(size > PZEM_TX_FRAME_MAX ? PZEM_TX_FRAME_MAX : size), data(buff), w4rx(rxreq) {}
+    ~TX_msg(){}
+
+    // messages are taken from a static pool, 'new' returns nullptr if pool is exhausted
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void *p) noexcept;
+
+private:
+    uint8_t buff[PZEM_TX_FRAME_MAX];
+#else
     explicit TX_msg(size_t size, bool rxreq = true) : len(size), w4rx(rxreq) {
         data = new uint8_t[len];
         //memcpy(data, srcdata, len);
     }
     ~TX_msg(){ delete[] data; data = nullptr; }
+#endif
 };
 
 
@@ -91,11 +140,47 @@ struct RX_msg {
     const uint8_t addr = rawdata[0];                // slave address
     const uint8_t cmd =  rawdata[1];                // modbus command code
 
+    /**
+     * @brief Construct a new rx msg object
+     * 
+     * @param data - raw data buffer, must be allocated with RX_msg::buff_alloc(), RX_msg takes ownership on it
+     * @param size - data length
+     */
     RX_msg(uint8_t *data, const size_t size) : rawdata(data), len(size), valid(modbus::checkcrc16(data, size)) {}
-    ~RX_msg(){ delete[] rawdata; rawdata = nullptr; }
+    ~RX_msg(){ buff_free(rawdata); rawdata = nullptr; }
+
+    /**
+     * @brief allocate raw data buffer for RX message
+     * @return uint8_t* - buffer or nullptr on error
+     */
+    static uint8_t* buff_alloc(size_t size);
+
+    // release raw data buffer
+    static void buff_free(uint8_t *b);
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // messages are taken from a static pool, 'new' returns nullptr if pool is exhausted
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void *p) noexcept;
+#endif
 };
 
 
+/**
+ * @brief message queue counters
+ * monotonic, never reset while queue object exists
+ */
+struct MsgQ_stats {
+    uint32_t tx_frames = 0;     // frames sent to the line
+    uint32_t tx_drops = 0;      // frames dropped on enqueue (Q full or not running)
+    uint32_t rx_frames = 0;     // frames received from the line
+    uint32_t rx_crc_err = 0;    // received frames with bad CRC
+    uint32_t rx_ovf = 0;        // RX FIFO/ring buffer overflows
+    uint32_t rx_errors = 0;     // line errors (break, framing)
+    uint32_t rx_drops = 0;      // received data discarded (no handler, no mem, read failure)
+    uint32_t rx_timeouts = 0;   // reply wait timeouts (next TX frame sent without a reply to previous one)
+};
+
 class MsgQ {
 
 public:
@@ -162,10 +247,32 @@ public:
      */
     virtual void stopQueues(){};
 
+    /**
+     * @brief get queue counters
+     * 
+     * @return const MsgQ_stats& 
+     */
+    const MsgQ_stats& getStats() const { return stats; }
+
 protected:
 
     rxdatahandler_t   rx_callback = nullptr;    // RX data callback
 
+    MsgQ_stats  stats;                          // queue counters
+
+};
+
+/**
+ * @brief UartQ RX/TX tasks options
+ * on dual-core chips RX/TX tasks could be pinned to the core not used by WiFi/TCP stack
+ * to reduce poll-to-reply latency jitter
+ */
+struct UartQ_tasks {
+    UBaseType_t rx_prio = EVT_TASK_PRIO;
+    uint32_t    rx_stack = EVT_TASK_STACK;
+    UBaseType_t tx_prio = TXQ_TASK_PRIO;
+    uint32_t    tx_stack = TXQ_TASK_STACK;
+    BaseType_t  core = UARTQ_TASK_CORE;     // CPU core for both tasks, tskNO_AFFINITY - any core
 };
 
 /**
@@ -178,6 +285,7 @@ struct UART_cfg {
     int gpio_rx;
     int gpio_tx;
     uart_config_t uartcfg;              // could be used to change uart properties for other modbus devices
+    UartQ_tasks tasks;                  // RX/TX tasks priority, stack and core affinity
 
     UART_cfg (uart_port_t _p = PZEM_UART, int _rx = UART_PIN_NO_CHANGE, int _tx = UART_PIN_NO_CHANGE,
                 uart_config_t ucfg =  {     // default values for PZEM004tv30
@@ -212,9 +320,11 @@ class UartQ : public MsgQ {
     void init(const uart_config_t &uartcfg, int gpio_rx, int gpio_tx);
 
 public:
-    UartQ(const uart_port_t p, const uart_config_t cfg, int gpio_rx = UART_PIN_NO_CHANGE, int gpio_tx = UART_PIN_NO_CHANGE) : port(p){ init(cfg, gpio_rx, gpio_tx); }
+    UartQ(const uart_port_t p, const uart_config_t cfg, int gpio_rx = UART_PIN_NO_CHANGE, int gpio_tx = UART_PIN_NO_CHANGE,
+            const UartQ_tasks &tasks = UartQ_tasks()) : port(p), tcfg(tasks) { init(cfg, gpio_rx, gpio_tx); }
 
-    UartQ(const uart_port_t p, int gpio_rx = UART_PIN_NO_CHANGE, int gpio_tx = UART_PIN_NO_CHANGE) : port(p){
+    UartQ(const uart_port_t p, int gpio_rx = UART_PIN_NO_CHANGE, int gpio_tx = UART_PIN_NO_CHANGE,
+            const UartQ_tasks &tasks = UartQ_tasks()) : port(p), tcfg(tasks) {
         uart_config_t uartcfg = {     // default values for PZEM004v30
             .baud_rate = PZEM_BAUD_RATE,
             .data_bits = UART_DATA_8_BITS,
@@ -264,12 +374,30 @@ public:
 
     void attach_RX_hndlr(rxdatahandler_t f) override;
 
+    /**
+     * @brief set RX/TX tasks priority, stack size and core affinity
+     * new options take effect on next startQueues() call
+     */
+    void setTasks(const UartQ_tasks &tasks){ tcfg = tasks; }
+
+    const UartQ_tasks& getTasks() const { return tcfg; }
+
     void detach_RX_hndlr() override;
 
 private:
+    UartQ_tasks     tcfg;                     // RX/TX tasks options
     TaskHandle_t    t_rxq = nullptr;          // RX Q servicing task
     TaskHandle_t    t_txq = nullptr;          // TX Q servicing task
     SemaphoreHandle_t rts_sem;              // 'ready to send next' Semaphore
+#ifdef PZEM_EDL_STATIC_ALLOC
+    StaticSemaphore_t rts_sem_buff;
+    StaticQueue_t   tx_msg_q_buff;
+    uint8_t         tx_msg_q_storage[tx_msg_q_DEPTH * sizeof(TX_msg*)];
+    StaticTask_t    t_rxq_buff;
+    StackType_t     t_rxq_stack[EVT_TASK_STACK];
+    StaticTask_t    t_txq_buff;
+    StackType_t     t_txq_stack[TXQ_TASK_STACK];
+#endif
 
     QueueHandle_t   rx_msg_q = nullptr;       // RX msg queue
     QueueHandle_t   tx_msg_q = nullptr;       // TX msg queue
@@ -283,10 +411,15 @@ private:
             return false;
 
         //Create a task to handle UART event from ISR
-        if (!t_rxq)
-            return xTaskCreate(UartQ::rxTask, EVT_TASK_NAME, EVT_TASK_STACK, reinterpret_cast<void *>(this), EVT_TASK_PRIO, &t_rxq) == pdPASS;
-        else
+        if (t_rxq)
             return true;
+#ifdef PZEM_EDL_STATIC_ALLOC
+        // stack size is fixed at build time with EVT_TASK_STACK
+        t_rxq = xTaskCreateStaticPinnedToCore(UartQ::rxTask, EVT_TASK_NAME, EVT_TASK_STACK, reinterpret_cast<void *>(this), tcfg.rx_prio, t_rxq_stack, &t_rxq_buff, tcfg.core);
+        return t_rxq;
+#else
+        return xTaskCreatePinnedToCore(UartQ::rxTask, EVT_TASK_NAME, tcfg.rx_stack, reinterpret_cast<void *>(this), tcfg.rx_prio, &t_rxq, tcfg.core) == pdPASS;
+#endif
     }
 
     /**
@@ -303,16 +436,25 @@ private:
         if (tx_msg_q)           // queue already exist
             return true;
 
+#ifdef PZEM_EDL_STATIC_ALLOC
+        tx_msg_q = xQueueCreateStatic( tx_msg_q_DEPTH, sizeof(TX_msg*), tx_msg_q_storage, &tx_msg_q_buff );
+#else
         tx_msg_q = xQueueCreate( tx_msg_q_DEPTH, sizeof(TX_msg*) ); // make q for MSG struct pointers
+#endif
 
         if (!tx_msg_q)
             return false;
 
         //Create a task to handle UART event from ISR
-        if (!t_txq)
-            return xTaskCreate(UartQ::txTask, TXQ_TASK_NAME, TXQ_TASK_STACK, reinterpret_cast<void *>(this), TXQ_TASK_PRIO, &t_txq) == pdPASS;
-        else
+        if (t_txq)
             return true;
+#ifdef PZEM_EDL_STATIC_ALLOC
+        // stack size is fixed at build time with TXQ_TASK_STACK
+        t_txq = xTaskCreateStaticPinnedToCore(UartQ::txTask, TXQ_TASK_NAME, TXQ_TASK_STACK, reinterpret_cast<void *>(this), tcfg.tx_prio, t_txq_stack, &t_txq_buff, tcfg.core);
+        return t_txq;
+#else
+        return xTaskCreatePinnedToCore(UartQ::txTask, TXQ_TASK_NAME, tcfg.tx_stack, reinterpret_cast<void *>(this), tcfg.tx_prio, &t_txq, tcfg.core) == pdPASS;
+#endif
     }
 
     /**
@@ -346,11 +488,13 @@ private:
 
             // 'xQueueReceive' will "sleep" untill an event messages arrives from the RX event queue
             if(xQueueReceive(rx_msg_q, reinterpret_cast<void*>(&event), (portTickType)portMAX_DELAY)) {
+                PZTRACE_BEGIN(rx_event, event.type);
 
                 //Handle received event
                 switch(event.type) {
                     case UART_DATA: {
                         if (!rx_callback){              // if there is no RX handler, than discard all RX
+                            ++stats.rx_drops;
                             uart_flush_input(port);
                             xQueueReset(rx_msg_q);
                             break;
@@ -360,6 +504,7 @@ private:
                         ESP_ERROR_CHECK(uart_get_buffered_data_len(port, &datalen));
                         if (0 == datalen){
                             ESP_LOGD(TAG, "can't retreive RX data from buffer, t: %lld", esp_timer_get_time()/1000);
+                            ++stats.rx_drops;
                             uart_flush_input(port);
                             xQueueReset(rx_msg_q);
                             break;
@@ -367,18 +512,36 @@ private:
 
                         ESP_LOGD(TAG, "RX buff has %u bytes data msg, t: %lld", datalen, esp_timer_get_time()/1000);
 
-                        uint8_t* buff = (uint8_t*) malloc(datalen);
+#ifdef PZEM_EDL_STATIC_ALLOC
+                        if (datalen > PZEM_RX_FRAME_MAX){
+                            ESP_LOGW(TAG, "RX frame is too long: %u", datalen);
+                            ++stats.rx_drops;
+                            uart_flush_input(port);
+                            xQueueReset(rx_msg_q);
+                            break;
+                        }
+#endif
+                        uint8_t* buff = RX_msg::buff_alloc(datalen);
                         if (buff){
                             datalen = uart_read_bytes(port, buff, datalen, PZEM_UART_RX_READ_TICKS);
                             if (!datalen){
                                 ESP_LOGD(TAG, "unable to read data from RX buff");
-                                delete[] buff;
+                                ++stats.rx_drops;
+                                RX_msg::buff_free(buff);
                                 uart_flush_input(port);
                                 xQueueReset(rx_msg_q);
                                 break;
                             }
 
                             RX_msg *msg = new RX_msg(buff, datalen);
+                            if (!msg){
+                                RX_msg::buff_free(buff);
+                                ++stats.rx_drops;
+                                break;
+                            }
+                            ++stats.rx_frames;
+                            if (!msg->valid)
+                                ++stats.rx_crc_err;
 
                             #ifdef PZEM_EDL_DEBUG
                                 ESP_LOGD(TAG, "got RX data packet from buff, len: %d, t: %ld", datalen, esp_timer_get_time()/1000);
@@ -386,27 +549,33 @@ private:
                             #endif
 
                             rx_callback(msg);                   // call external function to process PZEM message
-                        } else
+                        } else {
+                            ++stats.rx_drops;
                             uart_flush_input(port);             // если маллок не выдал память - очищаем весь инпут
+                        }
 
                         break;
                     }
                     case UART_FIFO_OVF:
                         ESP_LOGW(TAG, "UART RX fifo overflow!");
+                        ++stats.rx_ovf;
                         xQueueReset(rx_msg_q);
                         break;
                     case UART_BUFFER_FULL:
                         ESP_LOGW(TAG, "UART RX ringbuff full");
+                        ++stats.rx_ovf;
                         uart_flush_input(port);
                         xQueueReset(rx_msg_q);
                         break;
                     case UART_BREAK:
                     case UART_FRAME_ERR:
                         ESP_LOGW(TAG, "UART RX err");
+                        ++stats.rx_errors;
                         break;
                     default:
                         break;
                 }
+                PZTRACE_END(rx_event, event.type);
             }
 
         }
@@ -431,14 +600,20 @@ private:
                 // if smg would expect a reply than I need to grab a semaphore from the RX queue task
                 if (msg->w4rx){
                     ESP_LOGD(TAG, "Wait for tx semaphore, t: %lld", esp_timer_get_time()/1000);
-                    xSemaphoreTake(rts_sem, pdMS_TO_TICKS(PZEM_UART_TIMEOUT));
+                    PZTRACE_BEGIN(rts_wait, msg->data[0]);
+                    if (xSemaphoreTake(rts_sem, pdMS_TO_TICKS(PZEM_UART_TIMEOUT)) != pdTRUE)
+                        ++stats.rx_timeouts;
+                    PZTRACE_END(rts_wait, msg->data[0]);
                     // an old reply migh be still in the rx queue while I'm handling this one
                     //uart_flush_input(port);     // input should be cleared from any leftovers if I expect a reply (in case of a timeout only)
                     //xQueueReset(rx_msg_q);
                 }
 
                 // Send message data to the UART TX FIFO
+                PZTRACE_BEGIN(uart_write, msg->data[0]);
                 uart_write_bytes(port, (const char*)msg->data, msg->len);
+                PZTRACE_END(uart_write, msg->data[0]);
+                ++stats.tx_frames;
 
                 #ifdef PZEM_EDL_DEBUG
                     ESP_LOGD(TAG, "TX - packet sent to uart FIFO, t: %ld", esp_timer_get_time()/1000);
@@ -458,6 +633,14 @@ private:
 
 
 
+/**
+ * @brief port transport counters
+ */
+struct PZPort_stats {
+    MsgQ_stats q;               // queue/line counters
+    uint32_t rx_stray = 0;      // valid frames that did not match any device on the port
+};
+
 /**
  * @brief port object is a wrapper for MsgQ or it's derivates
  * 
@@ -474,6 +657,15 @@ public:
     bool active() const {return qrun;}
     bool active(bool newstate);
     std::unique_ptr<MsgQ> q = nullptr;
+    uint32_t rx_stray = 0;      // valid frames that did not match any device, counted by a frames dispatcher
+
+    PZPort_stats getStats() const {
+        PZPort_stats s;
+        if (q)
+            s.q = q->getStats();
+        s.rx_stray = rx_stray;
+        return s;
+    }
 
     // Construct from generic MgsQ object
     PZPort (uint8_t _id, MsgQ *mq, const char *_name = nullptr) : id(_id) {
@@ -485,7 +677,7 @@ public:
 
     // Construct a new UART port
     PZPort (uint8_t _id, UART_cfg &cfg, const char *_name = nullptr) : id(_id) {
-        UartQ *_q = new UartQ(cfg.p, cfg.uartcfg, cfg.gpio_rx, cfg.gpio_tx);
+        UartQ *_q = new UartQ(cfg.p, cfg.uartcfg, cfg.gpio_rx, cfg.gpio_tx, cfg.tasks);
         q.reset(_q);
         setdescr(_name);
         qrun = q->startQueues();
@@ -0,0 +1,229 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "pzdiscovery.hpp"
+#include "esp_timer.h"
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+#define PZDISC_BITS_PER_BYTE    10      // 8N1 framing
+
+// ms to transfer a number of bytes, rounded up
+static uint32_t xfer_ms(uint32_t baud, size_t bytes){
+    return (bytes * PZDISC_BITS_PER_BYTE * 1000 + baud - 1) / baud;
+}
+
+uint32_t PZDiscovery::probe_timeout(uint32_t baud, uint32_t turnaround, size_t reply_size){
+    if (!baud)
+        baud = PZEM_BAUD_RATE;
+    // request goes out, slave thinks, reply comes in and UART waits for the line to become idle
+    return xfer_ms(baud, pz004::regmap::request_size + reply_size + PZDISC_RX_IDLE_BYTES) + turnaround;
+}
+
+bool PZDiscovery::start(const PZDiscovery_cfg &c, done_cb_t done){
+    if (active() || !q || c.addr_min < ADDR_MIN || c.addr_max > ADDR_MAX || c.addr_min > c.addr_max)
+        return false;
+
+    cfg = c;
+    done_cb = std::move(done);
+    uint8_t port = res.port_id;
+    res = PZDiscovery_result();
+    res.port_id = port;
+    for (auto &l : late)
+        l = false;
+    quit = false;
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+    if (t_disc)
+        reap();         // previous sweep has finished
+    t_disc = xTaskCreateStatic(PZDiscovery::sweepTask, PZDISC_TASK_NAME, PZDISC_TASK_STACK, reinterpret_cast<void *>(this), PZDISC_TASK_PRIO, t_disc_stack, &t_disc_buff);
+    return t_disc;
+#else
+    TaskHandle_t h = nullptr;
+    if (xTaskCreate(PZDiscovery::sweepTask, PZDISC_TASK_NAME, PZDISC_TASK_STACK, reinterpret_cast<void *>(this), PZDISC_TASK_PRIO, &h) != pdPASS)
+        return false;
+    t_disc = h;
+    return true;
+#endif
+}
+
+void PZDiscovery::stop(){
+    if (!t_disc)
+        return;
+    quit = true;
+    xTaskNotifyGive(t_disc);
+#ifdef PZEM_EDL_STATIC_ALLOC
+    while (!parked)
+        vTaskDelay(1);
+    reap();
+#else
+    while (t_disc)
+        vTaskDelay(1);
+#endif
+    quit = false;
+}
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+void PZDiscovery::reap(){
+    TaskHandle_t h = t_disc;
+    t_disc = nullptr;
+    vTaskDelete(h);
+    parked = false;
+}
+#endif
+
+void PZDiscovery::rx_sink(const RX_msg *msg){
+    TaskHandle_t t = t_disc;
+    uint8_t addr = s.addr;
+    if (!msg || !t)
+        return;
+
+    if (!msg->valid){
+        // address byte of a garbled frame can't be trusted, blame the probe in flight
+        if (addr){
+            ++s.garbled;
+            xTaskNotifyGive(t);
+        }
+        return;
+    }
+
+    if (msg->addr != addr){
+        // reply from a slow device that has been already given up on, it will be probed once more
+        if (msg->addr >= ADDR_MIN && msg->addr <= ADDR_MAX)
+            late[msg->addr] = true;
+        return;
+    }
+
+    if (!s.valid && msg->len <= sizeof(s.frame)){
+        memcpy(s.frame, msg->rawdata, msg->len);
+        s.len = msg->len;
+    }
+    ++s.valid;
+    xTaskNotifyGive(t);
+}
+
+PZDiscovery::reply_t PZDiscovery::probe(TX_msg *msg, uint8_t addr, uint32_t timeout){
+    if (!msg)
+        return reply_t::none;
+
+    ulTaskNotifyTake(pdTRUE, 0);        // drop notifications left by late frames
+    s.len = 0;
+    s.valid = 0;
+    s.garbled = 0;
+    s.addr = addr;
+    ++res.probes;
+
+    if (!q->txenqueue(msg)){
+        s.addr = 0;
+        return reply_t::none;
+    }
+
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout)) && !quit){
+        // colliding devices might reply as separate frames, give the line a moment to settle
+        vTaskDelay(pdMS_TO_TICKS(xfer_ms(cfg.baud, PZDISC_RX_IDLE_BYTES)) + 1);
+    }
+    s.addr = 0;
+
+    if (s.garbled || s.valid > 1)
+        return reply_t::garbled;
+    return s.valid ? reply_t::valid : reply_t::none;
+}
+
+pzdisc_t PZDiscovery::identify(uint8_t addr, uint32_t timeout){
+    const uint8_t *data = &s.frame[3];
+
+    if (s.frame[1] == CMD_RIR && s.len == pz004::regmap::reply_size && s.frame[2] == pz004::regmap::data_len){
+        pz004::metrics m;
+        pz004::regmap::decode(m, data);
+        // power factor can't exceed 1.00, alarm is a 0x0000/0xFFFF flag
+        if (m.pf > 100 || (m.alarm != ALARM_ABSENT && m.alarm != ALARM_PRESENT))
+            return pzdisc_t::unknown;
+        res.model[addr] = pzmbus::pzmodel_t::pzem004v3;
+        return pzdisc_t::found;
+    }
+
+    // PZEM003/017 has only 8 input registers, reading 10 is an illegal address
+    if (s.frame[1] == (CMD_RIR | 0x80) && s.len == 5){
+        if (probe(pz003::regmap::request(addr, false), addr, timeout) != reply_t::valid)
+            return pzdisc_t::unknown;
+    }
+
+    if (s.frame[1] == CMD_RIR && s.len == pz003::regmap::reply_size && s.frame[2] == pz003::regmap::data_len){
+        pz003::metrics m;
+        pz003::regmap::decode(m, data);
+        if ((m.alarmh != ALARM_ABSENT && m.alarmh != ALARM_PRESENT) || (m.alarml != ALARM_ABSENT && m.alarml != ALARM_PRESENT))
+            return pzdisc_t::unknown;
+        // PZEM-017 has the same input registers, it is handled as PZEM-003 anyway
+        res.model[addr] = pzmbus::pzmodel_t::pzem003;
+        return pzdisc_t::found;
+    }
+
+    return pzdisc_t::unknown;
+}
+
+pzdisc_t PZDiscovery::probe_addr(uint8_t addr, uint32_t timeout){
+    for (uint8_t i = 0; i <= cfg.retries && !quit; ++i){
+        switch (probe(pz004::regmap::request(addr, false), addr, timeout)){
+            case reply_t::none :
+                return pzdisc_t::absent;
+            case reply_t::valid :
+                return identify(addr, timeout);
+            default:
+                break;      // garbled, try once more
+        }
+    }
+    return pzdisc_t::collision;
+}
+
+void PZDiscovery::sweep(){
+    // handle is also set by start(), but the task might be running on the other core before that
+    t_disc = xTaskGetCurrentTaskHandle();
+    int64_t t = esp_timer_get_time();
+    uint32_t timeout = probe_timeout(cfg.baud, cfg.turnaround, pz004::regmap::reply_size);
+    ESP_LOGD(TAG, "bus sweep, port:%u addr:%u-%u timeout:%u ms", res.port_id, cfg.addr_min, cfg.addr_max, static_cast<unsigned>(timeout));
+
+    for (unsigned a = cfg.addr_min; a <= cfg.addr_max && !quit; ++a)
+        res.state[a] = probe_addr(a, timeout);
+
+    // second pass for the devices that replied too slow, with the regular UART timeout
+    for (unsigned a = cfg.addr_min; a <= cfg.addr_max && !quit; ++a){
+        if (late[a] && res.state[a] == pzdisc_t::absent)
+            res.state[a] = probe_addr(a, PZEM_UART_TIMEOUT);
+    }
+    res.complete = !quit;
+
+    for (unsigned a = cfg.addr_min; a <= cfg.addr_max; ++a){
+        if (res.state[a] == pzdisc_t::found)
+            ++res.found;
+        else if (res.state[a] == pzdisc_t::collision)
+            ++res.collisions;
+    }
+    res.duration_ms = (esp_timer_get_time() - t) / 1000;
+    ESP_LOGI(TAG, "bus sweep done, port:%u found:%u collisions:%u probes:%u, %u ms", res.port_id, res.found, res.collisions, res.probes, static_cast<unsigned>(res.duration_ms));
+
+    if (done_cb)
+        done_cb(res);
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // signal stop() that sweep is not running anymore and wait to be deleted
+    parked = true;
+    for (;;)
+        vTaskDelay(portMAX_DELAY);
+#else
+    // signal stop() that sweep is not running anymore
+    t_disc = nullptr;
+    vTaskDelete(NULL);
+#endif
+}
@@ -0,0 +1,204 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "pzem_modbus.hpp"
+#include <atomic>
+#include <functional>
+
+#define PZDISC_TURNAROUND       30              // ms, slave reply delay allowance on top of frames transfer time
+#define PZDISC_RX_IDLE_BYTES    10              // UART RX timeout, reply is delivered after line is idle for that many byte times
+#define PZDISC_RETRIES          1               // re-probes of an address that replied with a garbled frame
+#define PZDISC_TASK_PRIO        2               // sweep task priority, lower than UART RX task
+#ifndef PZDISC_TASK_STACK
+#define PZDISC_TASK_STACK       3072
+#endif
+#define PZDISC_TASK_NAME        "PZ_DISC"
+
+/**
+ * @brief discovered address state
+ */
+enum class pzdisc_t : uint8_t {
+    absent = 0,         // no reply
+    found,              // device replied and it's model was identified
+    collision,          // replies were garbled on every probe, more than one device has this address
+    unknown             // valid reply that does not match any known register layout
+};
+
+/**
+ * @brief bus sweep options
+ */
+struct PZDiscovery_cfg {
+    uint8_t addr_min = ADDR_MIN;                // address range to sweep
+    uint8_t addr_max = ADDR_MAX;
+    uint32_t baud = PZEM_BAUD_RATE;             // port baud rate, per-address timeout is derived from it
+    uint16_t turnaround = PZDISC_TURNAROUND;    // slave reply delay allowance, ms
+    uint8_t retries = PZDISC_RETRIES;           // re-probes of an address that replied with a garbled frame
+    // PZPool::discover() options
+    bool autoadd = true;                        // register found devices to the pool
+    uint8_t id_base = 1;                        // lowest pool id for the registered devices
+};
+
+/**
+ * @brief bus sweep results
+ */
+struct PZDiscovery_result {
+    uint8_t port_id = 0;
+    bool complete = false;                      // sweep was not stopped prematurely
+    uint8_t found = 0;                          // number of devices identified
+    uint8_t collisions = 0;                     // number of addresses with colliding devices
+    uint16_t probes = 0;                        // requests sent
+    uint32_t duration_ms = 0;                   // sweep time
+    pzdisc_t state[ADDR_MAX + 1] = {};          // per-address state
+    pzmbus::pzmodel_t model[ADDR_MAX + 1] = {}; // per-address model of the devices found
+};
+
+/**
+ * @brief MODBUS bus sweep, finds PZEM devices on a port and identifies their models
+ *
+ * Each address is probed with PZEM004 metrics request. RS485 is half-duplex, so probes can't overlap,
+ * instead they go back-to-back with no gaps: next probe is sent as soon as a reply has been received,
+ * an address that does not reply costs one tight timeout derived from the baud rate - request and reply frames
+ * transfer time, UART RX idle timeout and slave turnaround allowance, i.e. ~75 ms at 9600 baud
+ * instead of PZEM_UART_TIMEOUT plus poll period, full sweep of 247 addresses takes less than 20 seconds.
+ *
+ * Model is identified by reply length and register layout: PZEM004 replies with 10 registers,
+ * PZEM003/017 has only 8 input registers and replies with an 'illegal address' exception,
+ * so it is probed once more with it's own request. Register values must fit the model's layout,
+ * i.e. power factor and alarm flags. A garbled reply (bad CRC or length) is re-probed,
+ * if it's garbled every time the address is reported as a collision of several devices.
+ *
+ * Sweep runs in it's own task, frames received on the port must be fed to rx_sink() while sweep is active
+ * and nothing else should be sent to the port. PZPool::discover() does that for the pool's ports.
+ */
+class PZDiscovery {
+public:
+    typedef std::function<void (const PZDiscovery_result&)> done_cb_t;
+
+    /**
+     * @param mq - port queue to send probes to, must outlive discovery object
+     * @param port_id - port id to report in results
+     */
+    explicit PZDiscovery(MsgQ *mq, uint8_t port_id = 0) : q(mq) { res.port_id = port_id; }
+    ~PZDiscovery(){ stop(); }
+
+    // Copy semantics : forbidden
+    PZDiscovery(const PZDiscovery&) = delete;
+    PZDiscovery& operator=(const PZDiscovery&) = delete;
+
+    /**
+     * @brief switch to another port, results of the previous sweep are kept until next start()
+     *
+     * @return false if sweep is running
+     */
+    bool attach(MsgQ *mq, uint8_t port_id){
+        if (active())
+            return false;
+        q = mq;
+        res.port_id = port_id;
+        return true;
+    }
+
+    /**
+     * @brief start bus sweep
+     *
+     * @param cfg - sweep options
+     * @param done - callback to run from the sweep task once it's finished
+     * @return true if sweep task has been started
+     * @return false if sweep is already running or task can't be created
+     */
+    bool start(const PZDiscovery_cfg &cfg = PZDiscovery_cfg(), done_cb_t done = nullptr);
+
+    /**
+     * @brief stop sweep and wait for the task to quit, 'done' callback is run with incomplete results
+     * must not be called from the 'done' callback
+     */
+    void stop();
+
+    // sweep is running
+#ifdef PZEM_EDL_STATIC_ALLOC
+    bool active() const { return t_disc != nullptr && !parked; }
+#else
+    bool active() const { return t_disc != nullptr; }
+#endif
+
+    /**
+     * @brief feed a frame received on the port while sweep is active
+     * called from RX task, frame is not retained
+     */
+    void rx_sink(const RX_msg *msg);
+
+    /**
+     * @brief sweep results, valid once sweep is finished
+     */
+    const PZDiscovery_result& result() const { return res; }
+
+    uint8_t port_id() const { return res.port_id; }
+
+    /**
+     * @brief time to wait for a reply to a request, ms
+     *
+     * @param baud - port baud rate
+     * @param turnaround - slave reply delay allowance, ms
+     * @param reply_size - expected reply frame size, bytes
+     */
+    static uint32_t probe_timeout(uint32_t baud, uint32_t turnaround, size_t reply_size);
+
+private:
+    // reply to the probe in flight, written by RX task
+    struct slot {
+        std::atomic<uint8_t> addr{0};           // address being probed, 0 - no probe in flight
+        uint8_t frame[PZ004_RIR_RESP_LEN + 5];  // first valid reply, longest one is PZEM004 metrics
+        size_t len = 0;
+        std::atomic<uint8_t> valid{0};          // number of valid replies from probed address
+        std::atomic<uint8_t> garbled{0};        // number of frames with bad CRC
+    };
+
+    // outcome of a single probe
+    enum class reply_t : uint8_t { none, valid, garbled };
+
+    MsgQ *q;
+    PZDiscovery_cfg cfg;
+    PZDiscovery_result res;
+    done_cb_t done_cb;
+    volatile TaskHandle_t t_disc = nullptr;
+    std::atomic<bool> quit{false};
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // static task does not delete itself, it's buffers could be reused only after it has been deleted with reap()
+    std::atomic<bool> parked{false};
+    StaticTask_t t_disc_buff;
+    StackType_t t_disc_stack[PZDISC_TASK_STACK];
+
+    // delete finished sweep task
+    void reap();
+#endif
+    slot s;
+    std::atomic<bool> late[ADDR_MAX + 1];       // valid replies that came after it's probe timed out
+
+    static void sweepTask(void* pvParams){
+        (reinterpret_cast<PZDiscovery*>(pvParams))->sweep();
+    }
+
+    void sweep();
+
+    // probe an address, retrying garbled replies
+    pzdisc_t probe_addr(uint8_t addr, uint32_t timeout);
+
+    // send request and wait for a reply or timeout
+    reply_t probe(TX_msg *msg, uint8_t addr, uint32_t timeout);
+
+    // identify model by the reply in slot
+    pzdisc_t identify(uint8_t addr, uint32_t timeout);
+};
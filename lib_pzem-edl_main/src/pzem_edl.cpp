@@ -44,6 +44,8 @@ PZEM::~PZEM(){
     #endif
     if (sink_lock)
         detachMsgQ();
+    if (t_poller)
+        xTimerDelete(t_poller, TIMER_CMD_TIMEOUT);
 }
 
 void PZEM::attachMsgQ(MsgQ *mq, bool tx_only){
@@ -72,6 +74,16 @@ void PZEM::detachMsgQ(){
     sink_lock = false;
 }
 
+bool PZEM::send(TX_msg *msg){
+    if (!msg)
+        return false;
+    if (!q){
+        delete msg;
+        return false;
+    }
+    return q->txenqueue(msg);
+}
+
 void PZEM::attach_rx_callback(rx_callback_t f){
     if (!f)
         return;
@@ -89,21 +101,33 @@ bool PZEM::autopoll(bool newstate){
 
     if (newstate){
         if (!t_poller){ // create new timer if absent
+#ifdef PZEM_EDL_STATIC_ALLOC
+            t_poller = xTimerCreateStatic(POLLER_NAME, pdMS_TO_TICKS(poll_period), pdTRUE, reinterpret_cast<void *>(this), PZEM::timerRunner, &t_poller_buff);
+#else
             t_poller = xTimerCreate(POLLER_NAME, pdMS_TO_TICKS(poll_period), pdTRUE, reinterpret_cast<void *>(this), PZEM::timerRunner);
+#endif
             if (!t_poller)
                 return false;
         }
 
-        // try to (re)start timer if not active
+        // try to (re)start timer if not active, period might have been changed while it was stopped
         if( xTimerIsTimerActive( t_poller ) == pdFALSE )
-            return xTimerStart(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+            return xTimerChangePeriod(t_poller, pdMS_TO_TICKS(poll_period), TIMER_CMD_TIMEOUT) == pdPASS;
 
         return true;    // seems it's already up and running, quit
     }
 
     // disable timer otherwise
-    if (t_poller)
-        return xTimerDelete(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+    if (!t_poller)
+        return false;
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // static timer is kept, it's buffer can't be reused until timer task processes delete command
+    return xTimerStop(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+#else
+    TimerHandle_t t = t_poller;
+    t_poller = nullptr;
+    return xTimerDelete(t, TIMER_CMD_TIMEOUT) == pdPASS;
+#endif
 
     return false;   // last resort state
 }
@@ -119,10 +143,12 @@ bool PZEM::setPollrate(size_t t){
     if (t<POLLER_MIN_PERIOD)
         return false;
 
-    if( xTimerChangePeriod( t_poller, t / portTICK_PERIOD_MS, TIMER_CMD_TIMEOUT ) == pdPASS )
-        return true;
+    poll_period = t;
+    // stopped timer is not touched, changing period would restart it
+    if (t_poller && xTimerIsTimerActive(t_poller) != pdFALSE)
+        return xTimerChangePeriod( t_poller, pdMS_TO_TICKS(t), TIMER_CMD_TIMEOUT ) == pdPASS;
 
-return false;
+    return true;
 }
 
 
@@ -134,15 +160,27 @@ void PZ004::updateMetrics(){
 
     TX_msg* cmd = pz004::cmd_get_metrics(pz.addr);
 
+    PZTRACE_INSTANT(poll, id);
+    uint32_t t = pz.timeouts;
     pz.reset_poll_us();
+    if (pz.timeouts != t)
+        notify(pzevt::evt_t::timeout);      // previous poll was left without reply
     q->txenqueue(cmd);
 }
 
 void PZ004::rx_sink(const RX_msg *msg){
-    if (pz.parse_rx_mgs(msg)){          // update meter state with new packet data (if valid)
-        if (rx_callback)
-            rx_callback(id, msg);       // run external call-back function
-    }
+    uint32_t e = pz.errors;
+    PZTRACE_BEGIN(parse, id);
+    bool ok = pz.parse_rx_mgs(msg);     // update meter state with new packet data (if valid)
+    PZTRACE_END(parse, id);
+
+    if (pz.errors != e)
+        notify(pzevt::evt_t::error);    // error reply or unparsable data
+    else if (ok)
+        notify(pzevt::evt_t::update);
+
+    if (ok && rx_callback)
+        rx_callback(id, msg);           // run external call-back function
 };
 
 void PZ004::resetEnergyCounter(){
@@ -158,7 +196,11 @@ void PZ003::updateMetrics(){
 
     TX_msg* cmd = pz003::cmd_get_metrics(pz.addr);
 
+    PZTRACE_INSTANT(poll, id);
+    uint32_t t = pz.timeouts;
     pz.reset_poll_us();
+    if (pz.timeouts != t)
+        notify(pzevt::evt_t::timeout);      // previous poll was left without reply
     q->txenqueue(cmd);
 }
 
@@ -172,10 +214,18 @@ void PZ003::setShunt(pz003::shunt_t shunt){
 }
 
 void PZ003::rx_sink(const RX_msg *msg){
-    if (pz.parse_rx_mgs(msg)){          // update meter state with new packet data (if valid)
-        if (rx_callback)
-            rx_callback(id, msg);       // run external call-back function
-    }
+    uint32_t e = pz.errors;
+    PZTRACE_BEGIN(parse, id);
+    bool ok = pz.parse_rx_mgs(msg);     // update meter state with new packet data (if valid)
+    PZTRACE_END(parse, id);
+
+    if (pz.errors != e)
+        notify(pzevt::evt_t::error);    // error reply or unparsable data
+    else if (ok)
+        notify(pzevt::evt_t::update);
+
+    if (ok && rx_callback)
+        rx_callback(id, msg);           // run external call-back function
 };
 
 void PZ003::resetEnergyCounter(){
@@ -185,15 +235,65 @@ void PZ003::resetEnergyCounter(){
 
 
 
+/*   === PZHealth immplementation ===   */
+
+bool PZHealth::due(const pzmbus::state *s, int64_t now, uint32_t rate, uint8_t threshold, uint32_t quarantine){
+    // outcome of the last poll is known by the next pool cycle, reply timeout is shorter than min pool period
+    if (s->polls && s->poll_us != checked_us){
+        checked_us = s->poll_us;
+        if (s->update_us >= s->poll_us){
+            // valid reply, back to pool rate right away
+            if (state != pzhealth_t::ok)
+                ++recoveries;
+            state = pzhealth_t::ok;
+            fails = 0;
+            period = 0;
+        } else if (++fails >= threshold && threshold){
+            uint32_t p = quarantine;
+            unsigned shift = fails - threshold + 1;
+            if (shift < 16 && (static_cast<uint64_t>(rate) << shift) < quarantine)
+                p = rate << shift;
+            period = p;
+            if (p == quarantine && state != pzhealth_t::quarantine){
+                state = pzhealth_t::quarantine;
+                ++quarantines;
+            } else if (p != quarantine)
+                state = pzhealth_t::backoff;
+        }
+        next_us = s->poll_us + static_cast<int64_t>(period) * 1000;
+    }
+
+    // pool cycles might run a bit late or early, device is due on a cycle closest to it's time
+    if (state == pzhealth_t::ok || now + static_cast<int64_t>(rate) * 500 >= next_us)
+        return true;
+    ++skipped;
+    return false;
+}
+
+
 /*   === PZPool immplementation ===   */
 
+PZPool::PZPool(){
+#ifdef PZEM_EDL_STATIC_ALLOC
+    mlock = xSemaphoreCreateMutexStatic(&mlock_buff);
+#else
+    mlock = xSemaphoreCreateMutex();
+#endif
+}
+
 /**
  * @brief Destroy the PZPool::PZPool object
  * All registered devices and ports are destructed
  */
 PZPool::~PZPool(){
+    if (t_poller)
+        xTimerDelete(t_poller, TIMER_CMD_TIMEOUT);
+    if (disc)
+        disc->stop();
     meters.clear();
     ports.clear();
+    if (mlock)
+        vSemaphoreDelete(mlock);
 }
 
 bool PZPool::addPort(uint8_t _id, UART_cfg &portcfg, const char *descr){
@@ -204,6 +304,14 @@ bool PZPool::addPort(uint8_t _id, UART_cfg &portcfg, const char *descr){
     return addPort(p);
 }
 
+bool PZPool::addPort(uint8_t _id, const TCP_cfg &portcfg, const char *descr){
+    if (port_by_id(_id))
+        return false;       // port with such id already exist
+
+    auto p = std::make_shared<PZPort>(_id, new TcpQ(portcfg), descr);
+    return addPort(p);
+}
+
 bool PZPool::addPort(std::shared_ptr<PZPort> port){
     if (port_by_id(port->id))
         return false;       // port with such id already exist
@@ -230,7 +338,7 @@ bool PZPool::addPZEM(const uint8_t port_id, const uint8_t pzem_id, uint8_t modbu
     if (modbus_addr < ADDR_MIN || modbus_addr > ADDR_MAX)   // we do not want any broadcasters or wrong addresses in our pool
         return false;
 
-    if(!port_by_id(port_id) || pzem_by_id(pzem_id))
+    if(!port_by_id(port_id) || get_node(pzem_id))
         return false;       // either port is missing or pzem with this id already exist
 
     PZEM *pz;
@@ -240,7 +348,8 @@ bool PZPool::addPZEM(const uint8_t port_id, const uint8_t pzem_id, uint8_t modbu
             pz = new PZ004(pzem_id, modbus_addr, descr);     // create new PZEM004 object
             break;
         }
-        case pzmbus::pzmodel_t::pzem003 : {
+        case pzmbus::pzmodel_t::pzem003 :
+        case pzmbus::pzmodel_t::pzem017 : {
             pz = new PZ003(pzem_id, modbus_addr, descr);     // create new PZEM003 object
             break;
         }
@@ -268,6 +377,15 @@ bool PZPool::addPZEM(const uint8_t port_id, PZEM *pz){
     if (!p)             // reject non-existing ports
         return false;
 
+    if (!lock())
+        return false;
+
+    // reject duplicate ids, checked under the lock as bus sweep might be adding devices at the same time
+    if (node_by_id(pz->id)){
+        unlock();
+        return false;
+    }
+
     auto node = std::make_shared<PZNode>();
     node->port = p;
 
@@ -280,22 +398,41 @@ bool PZPool::addPZEM(const uint8_t port_id, PZEM *pz){
     // and attach our port  (TX-only!)
     pz->attachMsgQ(node->port.get()->q.get(), true);
 
+    if (bus)
+        pz->attach_bus(bus);
+
     node->pzem.reset(std::move(pz));
 
-    return meters.add(node);
+    bool ok = meters.add(node);
+    unlock();
+    if (!ok)
+        node->pzem.release();   // pool is full, object stays with the caller
+    return ok;
 }
 
 bool PZPool::removePZEM(const uint8_t pzem_id){
+    if (!lock())
+        return false;
+
+    bool found = false;
     for (int i = 0; i != meters.size(); ++i) {
         if (meters[i]->pzem->id == pzem_id){
             meters.unlink(i);
-            return true;
+            found = true;
+            break;
         }
     }
-    return false;
+    unlock();
+    return found;
 }
 
 void PZPool::rx_dispatcher(const RX_msg *msg, const uint8_t port_id){
+    // bus sweep owns the port, including garbled frames it counts as collisions
+    if (disc && disc->active() && disc->port_id() == port_id){
+        disc->rx_sink(msg);
+        return;
+    }
+
     // битые пакеты отбрасываем сразу
     if (!msg->valid){
         #ifdef PZEM_EDL_DEBUG
@@ -305,16 +442,33 @@ void PZPool::rx_dispatcher(const RX_msg *msg, const uint8_t port_id){
     }
     
     //  ищем объект совпадающий по паре порт/modbus_addr
+    // node is held by a shared pointer, so it is served outside the lock even if removed meanwhile
+    std::shared_ptr<PZNode> node;
+    if (!lock())
+        return;
     for (const auto& i : meters){
         if (i->pzem->getaddr() == msg->addr && i->port->id == port_id){
-            #ifdef PZEM_EDL_DEBUG
-            ESP_LOGD(TAG, "Got match PZEM Node for port:%d , addr:%d\n", port_id, msg->addr);
-            #endif
-            i->pzem->rx_sink(msg);
+            node = i;
+            break;
+        }
+    }
+    unlock();
 
-            if (rx_callback)
-                rx_callback(i->pzem->id, msg);       // run external call-back function (if set)
-            return;
+    if (node){
+        #ifdef PZEM_EDL_DEBUG
+        ESP_LOGD(TAG, "Got match PZEM Node for port:%d , addr:%d\n", port_id, msg->addr);
+        #endif
+        node->pzem->rx_sink(msg);
+
+        if (rx_callback)
+            rx_callback(node->pzem->id, msg);       // run external call-back function (if set)
+        return;
+    }
+
+    for (auto& p : ports){
+        if (p->id == port_id){
+            ++p->rx_stray;
+            break;
         }
     }
 #ifdef PZEM_EDL_DEBUG
@@ -323,8 +477,76 @@ void PZPool::rx_dispatcher(const RX_msg *msg, const uint8_t port_id){
 }
 
 void PZPool::updateMetrics(){
-    for (const auto& i : meters)
-       i->pzem->updateMetrics();
+    // devices on a port being swept are not polled, sweep waits for replies on it's own
+    int sweep_port = discovering() ? disc->port_id() : -1;
+    int64_t now = esp_timer_get_time();
+    if (!lock())
+        return;
+    for (const auto& i : meters){
+        if (i->port->id != sweep_port && i->health.due(i->pzem->getState(), now, poll_period, bo_threshold, bo_quarantine))
+            i->pzem->updateMetrics();
+    }
+    unlock();
+}
+
+bool PZPool::getHealth(uint8_t id, PZHealth &h) const {
+    if (!lock())
+        return false;
+    auto node = node_by_id(id);
+    if (node)
+        h = node->health;       // health is updated by poller under the lock
+    unlock();
+    return node != nullptr;
+}
+
+bool PZPool::discover(uint8_t port_id, const PZDiscovery_cfg &cfg, PZDiscovery::done_cb_t done){
+    auto p = port_by_id(port_id);
+    if (!p || !p->q)
+        return false;
+
+    if (!disc)
+        disc.reset(new PZDiscovery(p->q.get(), port_id));
+    else if (!disc->attach(p->q.get(), port_id))
+        return false;       // another sweep is running
+
+    bool autoadd = cfg.autoadd;
+    uint8_t id_base = cfg.id_base;
+    return disc->start(cfg, [this, autoadd, id_base, done](const PZDiscovery_result &r){
+        if (autoadd && r.complete)
+            discovered(r, id_base);
+        if (done)
+            done(r);
+    });
+}
+
+void PZPool::discovered(const PZDiscovery_result &r, uint8_t id_base){
+    uint8_t id = id_base;
+    for (unsigned a = ADDR_MIN; a <= ADDR_MAX; ++a){
+        if (r.state[a] != pzdisc_t::found)
+            continue;
+
+        // skip devices already in a pool, pick the lowest free id
+        if (!lock())
+            return;
+        bool known = false;
+        for (const auto& i : meters){
+            if (i->port->id == r.port_id && i->pzem->getaddr() == a){
+                known = true;
+                break;
+            }
+        }
+        while (!known && node_by_id(id) && id != UINT8_MAX)
+            ++id;
+        bool taken = node_by_id(id) != nullptr;
+        unlock();
+        if (known)
+            continue;
+
+        // addPZEM() checks the id again under the lock, it fails if the id has been taken meanwhile
+        if (taken || !addPZEM(r.port_id, id, a, r.model[a]))
+            return;     // out of ids or pool is full
+        ESP_LOGI(TAG, "added PZEM id:%u, port:%u addr:%u", id, r.port_id, a);
+    }
 }
 
 std::shared_ptr<PZPort> PZPool::port_by_id(uint8_t id){
@@ -336,21 +558,22 @@ std::shared_ptr<PZPort> PZPool::port_by_id(uint8_t id){
     return nullptr;
 }
 
-const PZEM* PZPool::pzem_by_id(uint8_t id) const {
+std::shared_ptr<PZPool::PZNode> PZPool::node_by_id(uint8_t id) const {
     for (auto i = meters.cbegin(); i != meters.cend(); ++i){
         if (i->get()->pzem->id == id)
-            return i->get()->pzem.get();
+            return *i;
     }
-
-/*
-    for (const auto &i : std::as_const(meters)){        // std::as_const req c++17
-        if (i->pzem->id == id)
-            return i->pzem.get();
-    }
-*/
     return nullptr;
 }
 
+std::shared_ptr<PZPool::PZNode> PZPool::get_node(uint8_t id) const {
+    if (!lock())
+        return nullptr;
+    auto node = node_by_id(id);
+    unlock();
+    return node;
+}
+
 
 bool PZPool::autopoll() const {
     if (t_poller && xTimerIsTimerActive(t_poller) != pdFALSE)
@@ -363,21 +586,33 @@ bool PZPool::autopoll(bool newstate){
 
     if (newstate){
         if (!t_poller){ // create new timer if absent
+#ifdef PZEM_EDL_STATIC_ALLOC
+            t_poller = xTimerCreateStatic(POOL_POLLER_NAME, pdMS_TO_TICKS(poll_period), pdTRUE, (void *)this, PZPool::timerRunner, &t_poller_buff);
+#else
             t_poller = xTimerCreate(POOL_POLLER_NAME, pdMS_TO_TICKS(poll_period), pdTRUE, (void *)this, PZPool::timerRunner);
+#endif
             if (!t_poller)
                 return false;
         }
 
-        // try to (re)start timer if not active
+        // try to (re)start timer if not active, period might have been changed while it was stopped
         if( xTimerIsTimerActive( t_poller ) == pdFALSE )
-            return xTimerStart(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+            return xTimerChangePeriod(t_poller, pdMS_TO_TICKS(poll_period), TIMER_CMD_TIMEOUT) == pdPASS;
 
         return true;    // seems it's already up and running, quit
     }
 
     // disable timer otherwise
-    if (t_poller)
-        return xTimerDelete(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+    if (!t_poller)
+        return false;
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // static timer is kept, it's buffer can't be reused until timer task processes delete command
+    return xTimerStop(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+#else
+    TimerHandle_t t = t_poller;
+    t_poller = nullptr;
+    return xTimerDelete(t, TIMER_CMD_TIMEOUT) == pdPASS;
+#endif
 
     return false;   // last resort state
 }
@@ -393,7 +628,12 @@ bool PZPool::setPollrate(size_t t){
     if (t < POLLER_MIN_PERIOD)
         return false;
 
-    return ( xTimerChangePeriod( t_poller, t / portTICK_PERIOD_MS, TIMER_CMD_TIMEOUT ) == pdPASS );
+    poll_period = t;
+    // stopped timer is not touched, changing period would restart it
+    if (t_poller && xTimerIsTimerActive(t_poller) != pdFALSE)
+        return xTimerChangePeriod( t_poller, pdMS_TO_TICKS(t), TIMER_CMD_TIMEOUT ) == pdPASS;
+
+    return true;
 }
 
 void PZPool::attach_rx_callback(rx_callback_t f){
@@ -402,40 +642,77 @@ void PZPool::attach_rx_callback(rx_callback_t f){
     rx_callback = std::move(f);
 }
 
+void PZPool::attach_bus(PZEventBus *b){
+    if (!lock())
+        return;
+    bus = b;
+    for (auto &i : meters)
+        i->pzem->attach_bus(b);
+    unlock();
+}
+
 const char* PZPool::getDescr(uint8_t id) const {
-    const PZEM* p = pzem_by_id(id);
-    if (p){
-        return p->getDescr();
+    auto node = get_node(id);
+    if (node){
+        return node->pzem->getDescr();
     }
     
     return nullptr;
 };
 
 const pzmbus::state* PZPool::getState(uint8_t id) const {
-    const auto *pz = pzem_by_id(id);
+    auto node = get_node(id);
 
-    if (pz)
-        return pz->getState();
+    if (node)
+        return node->pzem->getState();
 
     return nullptr;
 };
 
+bool PZPool::getPortStats(uint8_t port_id, PZPort_stats &s) const {
+    for (auto i = ports.cbegin(); i != ports.cend(); ++i){
+        if (i->get()->id == port_id){
+            s = i->get()->getStats();
+            return true;
+        }
+    }
+    return false;
+}
+
 const pzmbus::metrics* PZPool::getMetrics(uint8_t id) const {
-    const auto *pz = pzem_by_id(id);
+    auto node = get_node(id);
 
-    if (pz)
-        return pz->getMetrics();
+    if (node)
+        return node->pzem->getMetrics();
 
     return nullptr;
 }
 
+// node is kept alive till the snapshot is copied, even if it's removed from the pool meanwhile
+bool PZPool::getSnapshot(uint8_t id, pz004::snapshot &s) const {
+    auto node = get_node(id);
+
+    if (!node || node->pzem->getState()->model != pzmbus::pzmodel_t::pzem004v3)
+        return false;
+
+    s = static_cast<const PZ004*>(node->pzem.get())->getSnapshot();
+    return true;
+}
+
+bool PZPool::getSnapshot(uint8_t id, pz003::snapshot &s) const {
+    auto node = get_node(id);
+
+    if (!node || node->pzem->getState()->model != pzmbus::pzmodel_t::pzem003)
+        return false;
+
+    s = static_cast<const PZ003*>(node->pzem.get())->getSnapshot();
+    return true;
+}
+
 void PZPool::resetEnergyCounter(uint8_t pzem_id){
-    for (auto &i : meters){
-        if (i->pzem->id == pzem_id){
-            i->pzem->resetEnergyCounter();
-            return;
-        }
-    }
+    auto node = get_node(pzem_id);
+    if (node)
+        node->pzem->resetEnergyCounter();
 }
 
 
@@ -490,12 +767,16 @@ void FakeMeterPZ004::updnrg(pz004::metrics& m){
 // ****  Dummy PZEM004 Implementation  **** //
 
 void DummyPZ004::updateMetrics(){
+    pz.reset_poll_us();
     pz.update_us = esp_timer_get_time();
+    ++pz.replies;
     fm.randomize(pz.data);
     fm.updnrg(pz.data);
 
     pz.data.power = fm.mt.power;
     pz.data.energy = fm.mt.energy;
+    pz.publish();
+    notify(pzevt::evt_t::update);
 
     if (rx_callback)
         rx_callback(id, nullptr);           // run external call-back function with null data,
@@ -552,12 +833,16 @@ void FakeMeterPZ003::updnrg(pz003::metrics& m){
 // ****  Dummy PZEM004 Implementation  **** //
 
 void DummyPZ003::updateMetrics(){
+    pz.reset_poll_us();
     pz.update_us = esp_timer_get_time();
+    ++pz.replies;
     fm.randomize(pz.data);
     fm.updnrg(pz.data);
 
     pz.data.power = fm.mt.power;
     pz.data.energy = fm.mt.energy;
+    pz.publish();
+    notify(pzevt::evt_t::update);
 
     if (rx_callback)
         rx_callback(id, nullptr);           // run external call-back function with null data,
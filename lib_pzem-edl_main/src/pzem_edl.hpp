@@ -14,15 +14,66 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "pzem_modbus.hpp"
+#include "evbus.hpp"
+#include "pzdiscovery.hpp"
+#include "tcpq.hpp"
 #include "LList.h"
 
 #define POLLER_PERIOD       PZEM_REFRESH_PERIOD         // auto update period in ms
 #define POLLER_MIN_PERIOD   2*PZEM_UART_TIMEOUT         // minimal poller period
+#define PZHEALTH_THRESHOLD  3                           // consecutive failed polls before a device is backed off
+#define PZHEALTH_QUARANTINE 60000                       // ms, poll period of a device in quarantine
+
+#ifdef PZEM_EDL_STATIC_ALLOC
+// PZPOOL_MAX_PORTS is defined in msgq.hpp, TX messages pool is sized for it
+#ifndef PZPOOL_MAX_DEVICES
+#define PZPOOL_MAX_DEVICES  8                           // max number of PZEM devices in a pool
+#endif
+#endif
 
 
 typedef std::function<void (uint8_t id, const RX_msg*)> rx_callback_t;
 
+// pool device health
+enum class pzhealth_t : uint8_t {
+    ok = 0,             // polled at pool rate
+    backoff,            // failed polls in a row, poll period grows exponentially
+    quarantine          // polled once in a quarantine period to check if it's back
+};
+
+/**
+ * @brief poll health of a pool device
+ * A poll is failed if there was no valid metrics reply to it, i.e. timeout, CRC error or an error reply.
+ * Each poll that fails after 'threshold' failures in a row doubles device's poll period up to a quarantine period,
+ * so an unplugged meter does not take PZEM_UART_TIMEOUT of the bus every cycle. Any valid reply brings device back to pool rate
+ */
+struct PZHealth {
+    pzhealth_t state = pzhealth_t::ok;
+    uint16_t fails = 0;         // consecutive failed polls
+    uint32_t period = 0;        // current poll period, ms, 0 - pool rate
+    uint32_t skipped = 0;       // pool cycles the device was not polled at
+    uint32_t quarantines = 0;   // number of times device was quarantined
+    uint32_t recoveries = 0;    // number of times device was back to pool rate after a backoff
+    int64_t next_us = 0;        // next poll time in backoff, us since boot
+
+    /**
+     * @brief check outcome of the last poll and decide if device should be polled on this pool cycle
+     *
+     * @param s - device state
+     * @param now - current time, us
+     * @param rate - pool poll period, ms
+     * @param threshold - failed polls before backoff, 0 - never back off
+     * @param quarantine - max poll period, ms
+     * @return true if device should be polled
+     */
+    bool due(const pzmbus::state *s, int64_t now, uint32_t rate, uint8_t threshold, uint32_t quarantine);
+
+private:
+    int64_t checked_us = 0;     // poll time the outcome was checked for
+};
+
 /**
  * @brief - PowerMeter abstract instance class
  * Helds an object of one PZEM instance along with it's properties
@@ -34,6 +85,10 @@ class PZEM {
 protected:
     MsgQ *q = nullptr;                  // UartQ sink for TX messages
     rx_callback_t rx_callback = nullptr;          // external callback to trigger on RX data
+    PZEventBus *bus = nullptr;          // event bus to publish device events to
+
+    // publish event to the bus, if attached
+    void notify(pzevt::evt_t type){ if (bus) bus->publish(id, type); }
 
 
 public:
@@ -88,6 +143,16 @@ public:
      */
     void detachMsgQ();
 
+    /**
+     * @brief send a command message to the device via attached queue
+     * reply is handled by rx_sink() as usual, i.e. a write reply updates device state
+     * this method will take ownership on TX_msg object and 'delete' it
+     *
+     * @param msg - command message, i.e. pz004::cmd_set_alarm_thr(w, getaddr())
+     * @return false if there is no queue attached or enqueue failed
+     */
+    bool send(TX_msg *msg);
+
     /**
      * @brief external callback function
      * it is fed with a ref to every incoming message along with instance ID
@@ -101,6 +166,20 @@ public:
      */
     inline void detach_rx_callback(){rx_callback = nullptr;};
 
+    /**
+     * @brief attach event bus
+     * device publishes update/error/timeout events to the bus, so any number of subscribers
+     * could receive it via their own queues without running code in RX task
+     * 
+     * @param b - event bus object, must outlive PZEM object or be detached before destruction
+     */
+    inline void attach_bus(PZEventBus *b){ bus = b; };
+
+    /**
+     * @brief detach event bus
+     */
+    inline void detach_bus(){ bus = nullptr; };
+
     /**
      * @brief poll PZEM for metrics
      * on call a mesage with metrics request is send to PZEM device
@@ -173,6 +252,9 @@ public:
 
 private:
     TimerHandle_t t_poller = nullptr;
+#ifdef PZEM_EDL_STATIC_ALLOC
+    StaticTimer_t t_poller_buff;
+#endif
     size_t poll_period = POLLER_PERIOD;           // auto poll period in ms
 
     static void timerRunner(TimerHandle_t xTimer){
@@ -236,6 +318,14 @@ public:
     const pzmbus::metrics* getMetrics() const override { return &pz.data; }
     const pz004::metrics*  getMetricsPZ004() const { return &pz.data; }
 
+    /**
+     * @brief Get a consistent copy of the PZEM Metrics along with update time
+     * unlike getMetrics(), this is safe to be called from any task while PZEM is being polled,
+     * call never blocks and never returns a partially updated metrics
+     * @return pz004::snapshot
+     */
+    pz004::snapshot getSnapshot() const { return pz.getSnapshot(); }
+
     /**
      * @brief A sink for RX messages
      * should be set as a callback for UartQ or fed with messages in any other way
@@ -309,6 +399,14 @@ public:
     const pzmbus::metrics* getMetrics() const override { return &pz.data; }
     const pz003::metrics*  getMetricsPZ003() const { return &pz.data; }
 
+    /**
+     * @brief Get a consistent copy of the PZEM Metrics along with update time
+     * unlike getMetrics(), this is safe to be called from any task while PZEM is being polled,
+     * call never blocks and never returns a partially updated metrics
+     * @return pz003::snapshot
+     */
+    pz003::snapshot getSnapshot() const { return pz.getSnapshot(); }
+
     /**
      * @brief A sink for RX messages
      * should be set as a callback for UartQ or fed with messages in any other way
@@ -338,17 +436,22 @@ class PZPool {
     struct PZNode {
         std::shared_ptr<PZPort> port;
         std::unique_ptr<PZEM> pzem;
+        PZHealth health;
     };
 
 protected:
+#ifdef PZEM_EDL_STATIC_ALLOC
+    FixedList<std::shared_ptr<PZPort>, PZPOOL_MAX_PORTS> ports;     // list of registered ports
+    FixedList<std::shared_ptr<PZNode>, PZPOOL_MAX_DEVICES> meters;  // list of registered PZEM nodes
+#else
     LList<std::shared_ptr<PZPort>> ports;                           // list of registered ports
     LList<std::shared_ptr<PZNode>> meters;                          // list of registered PZEM nodes
+#endif
     std::shared_ptr<PZPort> port_by_id(uint8_t id);
-    const PZEM* pzem_by_id(uint8_t id) const;
 
 
 public:
-    PZPool(){}
+    PZPool();
     ~PZPool();
     // Copy semantics : not implemented
     PZPool(const PZPool&) = delete;
@@ -366,6 +469,17 @@ public:
      */
     bool addPort(uint8_t _id, UART_cfg &portcfg, const char *descr = nullptr);
 
+    /**
+     * @brief create and register TCP port to the Pool
+     * port talks to devices behind RS485-to-Ethernet gateway via Modbus TCP or RTU-over-TCP,
+     * it could be mixed with UART ports in the same pool
+     *
+     * @param portcfg - gateway address and protocol
+     * @return true - on success
+     * @return false - on any error
+     */
+    bool addPort(uint8_t _id, const TCP_cfg &portcfg, const char *descr = nullptr);
+
     /**
      * @brief attach an existing UART port object to the Pool
      * port will be detached from it's existing RX handler and redirected to Pool's dispatcher
@@ -379,6 +493,7 @@ public:
     /**
      * @brief Create and register new PZEM object
      * an already existing port id must be defined to which PZEM object will be attached to
+     * PZEM object is owned by the pool on success only, ids must be unique within a pool
      * 
      * @param port_id - an existing port id
      * @param pzem_id - id for the new PZEM object
@@ -406,7 +521,7 @@ public:
      * @return true 
      * @return false 
      */
-    bool existPZEM(uint8_t id){return pzem_by_id(id)== nullptr;}
+    bool existPZEM(uint8_t id){return get_node(id)== nullptr;}
 
     /**
      * @brief delete PZEM object from the pool
@@ -428,6 +543,18 @@ public:
      */
     inline void detach_rx_callback(){rx_callback = nullptr;}
 
+    /**
+     * @brief attach event bus to all PZEM devices in a pool, including the ones added later
+     * 
+     * @param b - event bus object, must outlive the pool or be detached before destruction
+     */
+    void attach_bus(PZEventBus *b);
+
+    /**
+     * @brief detach event bus from all PZEM devices in a pool
+     */
+    void detach_bus(){ attach_bus(nullptr); }
+
     /**
      * @brief get auto-poll timer state - active/disabled
      * 
@@ -465,10 +592,33 @@ public:
 
     /**
      * @brief update metrics for all PZEM Nodes in a pool
-     * 
+     * devices in backoff or quarantine are polled only when their own period is due
      */
     void updateMetrics();
 
+    /**
+     * @brief set backoff of unresponsive devices
+     * poll period of a device that failed 'threshold' polls in a row is doubled with every next failure
+     * up to 'quarantine' period, device keeps being polled at that period until it replies again
+     *
+     * @param threshold - consecutive failed polls before backoff, 0 - disable backoff
+     * @param quarantine - max poll period, ms
+     */
+    void setBackoff(uint8_t threshold = PZHEALTH_THRESHOLD, uint32_t quarantine = PZHEALTH_QUARANTINE){
+        bo_threshold = threshold;
+        bo_quarantine = quarantine;
+    }
+
+    /**
+     * @brief Get poll health of the PZEM with specific id
+     *
+     * @param id - PZEM id
+     * @param h - health struct to fill
+     * @return true on success
+     * @return false if there is no PZEM with such id
+     */
+    bool getHealth(uint8_t id, PZHealth &h) const;
+
 
     /**
      * @brief send a command to PZEM device in a pool with specific id to reset it's internal energy counter
@@ -485,6 +635,8 @@ public:
      * NOTE: It is an undefined behavior to call this method on a non-existing id!!!
      * use existPZEM() method to check if unsure
      * 
+     * NOTE: pointer is valid until PZEM is removed from the pool, use getSnapshot() from other tasks
+     * 
      * @return const pzmbus::state&, nullptr if PZEM with specified id does not exist
      */
     const pzmbus::state* getState(uint8_t id) const;
@@ -495,10 +647,61 @@ public:
      * WARN: It is an undefined behavior to call this method on a non-existing id!!!    (to be fixed)
      * use existPZEM() method to check if unsure
      * 
+     * NOTE: pointer is valid until PZEM is removed from the pool, use getSnapshot() from other tasks
+     * 
      * @return const pzmbus::metrics&, nullptr if PZEM with specified id does not exist
      */
     const pzmbus::metrics* getMetrics(uint8_t id) const;
 
+    /**
+     * @brief Get a consistent copy of the PZEM metrics for PZEM with specific id
+     * safe to be called from any task, never blocks
+     * 
+     * @param id - PZEM id
+     * @param s - snapshot struct to fill
+     * @return true on success
+     * @return false if there is no PZEM with such id or it is of a different model
+     */
+    bool getSnapshot(uint8_t id, pz004::snapshot &s) const;
+    bool getSnapshot(uint8_t id, pz003::snapshot &s) const;
+
+    /**
+     * @brief Get transport counters for the port with specific id
+     * 
+     * @param port_id - port id
+     * @param s - stats struct to fill
+     * @return true on success
+     * @return false if there is no port with such id
+     */
+    bool getPortStats(uint8_t port_id, PZPort_stats &s) const;
+
+    /**
+     * @brief sweep the bus of a port for PZEM devices
+     * devices already in a pool on this port are not polled while sweep is running,
+     * found devices that are not in a pool yet are added with the lowest free ids starting from cfg.id_base
+     * (unless cfg.autoadd is false) before 'done' callback is called from the sweep task.
+     * Only one port could be swept at a time
+     *
+     * @param port_id - an existing port id
+     * @param cfg - sweep options, baud rate must match the port's one
+     * @param done - callback with sweep results
+     * @return true if sweep has been started
+     * @return false if port does not exist or another sweep is running
+     */
+    bool discover(uint8_t port_id, const PZDiscovery_cfg &cfg = PZDiscovery_cfg(), PZDiscovery::done_cb_t done = nullptr);
+
+    /**
+     * @brief bus sweep is running
+     */
+    bool discovering() const { return disc && disc->active(); }
+
+    /**
+     * @brief results of the last bus sweep
+     *
+     * @return const PZDiscovery_result* - nullptr if there was no sweep yet
+     */
+    const PZDiscovery_result* getDiscovery() const { return disc ? &disc->result() : nullptr; }
+
     /**
      * @brief return description string as 'const char*'
      * 
@@ -509,8 +712,29 @@ public:
 
 private:
     TimerHandle_t t_poller = nullptr;
+#ifdef PZEM_EDL_STATIC_ALLOC
+    StaticTimer_t t_poller_buff;
+#endif
     size_t poll_period = POLLER_PERIOD;           // auto poll period in ms
     rx_callback_t rx_callback = nullptr;          // external callback to trigger on RX dat
+    PZEventBus *bus = nullptr;                    // event bus for pool members
+    std::unique_ptr<PZDiscovery> disc;            // bus sweep, created on first use and reused for any port
+    uint8_t bo_threshold = PZHEALTH_THRESHOLD;    // consecutive failed polls before backoff
+    uint32_t bo_quarantine = PZHEALTH_QUARANTINE; // max backed off poll period, ms
+#ifdef PZEM_EDL_STATIC_ALLOC
+    StaticSemaphore_t mlock_buff;
+#endif
+    SemaphoreHandle_t mlock = nullptr;            // meters list mutex, list is walked by poller timer and RX tasks, sweep task adds to it
+
+    // take/release meters list mutex
+    bool lock() const { return mlock && xSemaphoreTake(mlock, portMAX_DELAY) == pdTRUE; }
+    void unlock() const { xSemaphoreGive(mlock); }
+
+    // find PZEM node by id, meters list must be locked
+    std::shared_ptr<PZNode> node_by_id(uint8_t id) const;
+
+    // find PZEM node by id under the lock, node stays alive while returned pointer is held
+    std::shared_ptr<PZNode> get_node(uint8_t id) const;
 
     static void timerRunner(TimerHandle_t xTimer){
         if (!xTimer) return;
@@ -521,6 +745,9 @@ private:
 
     void rx_dispatcher(const RX_msg *msg, const uint8_t port_id);
 
+    // add devices found by a bus sweep
+    void discovered(const PZDiscovery_result &r, uint8_t id_base);
+
 };
 
 
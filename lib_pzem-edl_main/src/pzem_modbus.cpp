@@ -19,6 +19,12 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 namespace pzmbus {
 
+constexpr size_t rtt_buckets::size;
+const uint32_t rtt_buckets::bounds[rtt_buckets::size] = {30, 40, 50, 60, 80, 100, 150, 200, 300};
+
+constexpr size_t age_buckets::size;
+const uint32_t age_buckets::bounds[age_buckets::size] = {500, 1000, 1200, 1500, 2000, 3000, 5000, 10000, 30000};
+
 TX_msg* create_msg(uint8_t cmd, uint16_t reg_addr, uint16_t value, uint8_t slave_addr, bool w4r){
 
     TX_msg *msg = new TX_msg(GENERIC_MSG_SIZE);
@@ -47,6 +53,8 @@ TX_msg* cmd_set_modbus_addr(uint8_t new_addr, const uint8_t current_addr){
 TX_msg* cmd_energy_reset(const uint8_t addr){
 
     TX_msg *msg = new TX_msg(ENERGY_RST_MSG_SIZE);
+    if (!msg)
+        return nullptr;
 
     msg->data[0] = addr;
     msg->data[1] = CMD_RST_ENRG;
@@ -64,7 +72,7 @@ namespace pz004 {
 using namespace pzmbus;
 
 TX_msg* cmd_get_metrics(uint8_t addr){
-    return pzmbus::create_msg(static_cast<uint8_t>(pzemcmd_t::RIR), PZ004_RIR_DATA_BEGIN, PZ004_RIR_DATA_LEN, addr);
+    return regmap::request(addr);
 }
 
 TX_msg* cmd_get_opts(const uint8_t addr){
@@ -128,57 +136,21 @@ void rx_msg_prettyp(const RX_msg *m){
 }
 
 float metrics::asFloat(pzmbus::meter_t m) const {
-    switch (m)
-    {
-    case pzmbus::meter_t::vol :
-        return voltage / 10.0;
-        break;
-    case pzmbus::meter_t::cur :
-        return current / 1000.0;
-        break;
-    case pzmbus::meter_t::pwr :
-        return power / 10.0;
-        break;
-    case pzmbus::meter_t::enrg :
-        return static_cast< float >(energy);
-        break;
-    case pzmbus::meter_t::frq :
-        return freq / 10.0;
-        break;
-    case pzmbus::meter_t::pf :
-        return pf / 100.0;
-        break;
-    case pzmbus::meter_t::alrmh :
-        return alarm ? 1.0 : 0.0;
-        break;
-    default:
-        return NAN;
-    }
+    return regmap::asFloat(*this, m);
 }
 
 bool metrics::parse_rx_msg(const RX_msg *m) {
-    if (static_cast<pzmbus::pzemcmd_t>(m->cmd) != pzmbus::pzemcmd_t::RIR || m->rawdata[2] != PZ004_RIR_RESP_LEN)
-        return false;
-    ESP_LOGD(TAG, "PZ004 RXparser\n");
-
-    uint8_t const *value = &m->rawdata[3];
-
-    voltage = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_VOLTAGE*2]);
-    current = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_CURRENT_L*2]) | __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_CURRENT_H*2])  << 16;
-    power   = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_POWER_L*2])   | __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_POWER_H*2])    << 16;
-    energy  = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_ENERGY_L*2])  | __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_ENERGY_H*2])   << 16;
-    freq    = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_FREQUENCY*2]);
-    pf      = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_PF*2]);
-    alarm   = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_ALARM_H*2]);
-    return true;
+    return regmap::parse(*this, m);
 }
 
 bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
     if (!m->valid && skiponbad)          // check if message is valid before parsing it further
         return false;
 
-    if (m->addr != addr && skiponbad)    // this is not "my" packet
+    if (m->addr != addr && skiponbad){   // this is not "my" packet
+        ++stray;
         return false;
+    }
 
     switch (static_cast<pzmbus::pzemcmd_t>(m->cmd)){
         case pzmbus::pzemcmd_t::RIR : {
@@ -186,6 +158,7 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
                 break;
             else {
                 err = pzmbus::pzem_err_t::err_parse;
+                ++errors;
                 return false;
             }
         }
@@ -215,14 +188,16 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
         case pzmbus::pzemcmd_t::reset_err :
         case pzmbus::pzemcmd_t::calibrate_err :
             // стоит ли здесь инвалидировать метрики???
-            err = (pzmbus::pzem_err_t)m->rawdata[2];
+            set_exception(m->rawdata[2]);
             return true;
         default:
             break;
     }
 
     err = pzmbus::pzem_err_t::err_ok;
-    update_us = esp_timer_get_time();
+    set_updated();
+    ++replies;
+    publish();
     return true;
 }
 
@@ -236,7 +211,7 @@ using pzmbus::pzemcmd_t;
 using pzmbus::meter_t;
 
 TX_msg* cmd_get_metrics(uint8_t addr){
-    return pzmbus::create_msg(static_cast<uint8_t>(pzemcmd_t::RIR), PZ003_RIR_DATA_BEGIN, PZ003_RIR_DATA_LEN, addr);
+    return regmap::request(addr);
 }
 
 TX_msg* cmd_get_opts(const uint8_t addr){
@@ -319,51 +294,21 @@ void rx_msg_prettyp(const RX_msg *m){
 }
 
 float metrics::asFloat(pzmbus::meter_t m) const {
-    switch (m){
-    case pzmbus::meter_t::vol :
-        return voltage / 100.0;
-        break;
-    case pzmbus::meter_t::cur :
-        return current / 100.0;
-        break;
-    case pzmbus::meter_t::pwr :
-        return power / 10.0;
-        break;
-    case pzmbus::meter_t::enrg :
-        return static_cast< float >(energy);
-        break;
-    case pzmbus::meter_t::alrmh :
-        return alarmh ? 1.0 : 0.0;
-        break;
-    case pzmbus::meter_t::alrml :
-        return alarml ? 1.0 : 0.0;
-        break;
-    default:
-        return NAN;
-    }
+    return regmap::asFloat(*this, m);
 }
 
 bool metrics::parse_rx_msg(const RX_msg *m) {
-    if (static_cast<pzmbus::pzemcmd_t>(m->cmd) != pzmbus::pzemcmd_t::RIR || m->rawdata[2] != PZ003_RIR_RESP_LEN)
-        return false;
-
-    uint8_t const *value = &m->rawdata[3];
-
-    voltage = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_VOLTAGE*2]);
-    current = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_CURRENT*2]);
-    power   = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_POWER_L*2])   | __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_POWER_H*2])    << 16;
-    energy  = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_ENERGY_L*2])  | __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_ENERGY_H*2])   << 16;
-    alarmh  = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_ALARM_H*2]);
-    alarml  = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_ALARM_L*2]);
-    return true;
+    return regmap::parse(*this, m);
 }
 
 bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
     if (!m->valid && skiponbad)          // check if message is valid before parsing it further
         return false;
 
-    if (m->addr != addr && skiponbad)    // this is not "my" packet
+    if (m->addr != addr && skiponbad){   // this is not "my" packet
+        ++stray;
         return false;
+    }
 
     switch (static_cast<pzmbus::pzemcmd_t>(m->cmd)){
         case pzmbus::pzemcmd_t::RIR : {
@@ -371,6 +316,7 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
                 break;
             else {
                 err = pzmbus::pzem_err_t::err_parse;
+                ++errors;
                 return false;
             }
             break;
@@ -413,7 +359,7 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
         case pzmbus::pzemcmd_t::reset_err :
         case pzmbus::pzemcmd_t::calibrate_err :
             // стоит ли здесь инвалидировать метрики???
-            err = (pzmbus::pzem_err_t)m->rawdata[2];
+            set_exception(m->rawdata[2]);
             return true;
             break;
         default:
@@ -421,7 +367,9 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
     }
 
     err = pzmbus::pzem_err_t::err_ok;
-    update_us = esp_timer_get_time();
+    set_updated();
+    ++replies;
+    publish();
     return true;
 }
 
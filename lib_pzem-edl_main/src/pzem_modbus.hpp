@@ -12,6 +12,8 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 #pragma once
 #include "msgq.hpp"
+#include "regmap.hpp"
+#include "seqlatch.hpp"
 #include <cmath>
 
 // Read-Only 16-bit registers
@@ -105,8 +107,8 @@ GitHub: https://github.com/vortigont/pzem-edl
  */
 namespace pzmbus {
 
-// Enumeration of PZEM models supported
-enum class pzmodel_t:uint8_t { none, pzem004v3, pzem003 };
+// Enumeration of PZEM models supported, PZEM-017 has the same registers as PZEM-003
+enum class pzmodel_t:uint8_t { none, pzem004v3, pzem003, pzem017 };
 
 /**
  * @brief available modbus commands required to talk to pzem
@@ -124,9 +126,6 @@ enum class pzemcmd_t:uint8_t {
     reset_err = CMD_RSTERR
 };
 
-// Enumeration of available electricity metrics
-enum class meter_t:uint8_t { vol, cur, pwr, enrg, frq, pf, alrmh, alrml };
-
 // Some of the possible Error states
 enum class pzem_err_t:uint8_t {
     err_ok = 0,
@@ -145,12 +144,95 @@ struct metrics {
 };
 
 
+/**
+ * @brief fixed-bucket histogram with an overflow bucket
+ * bucket upper bounds are provided by a traits struct B with a static 'bounds' array of 'size' elements
+ * sorted in ascending order, values above the last bound are counted in the overflow bucket
+ *
+ * @tparam B - bucket bounds traits
+ */
+template <class B>
+struct histogram {
+    uint32_t cnt[B::size + 1] = {};     // per-bucket counters, last one is the overflow bucket
+    uint32_t total = 0;                 // number of values counted
+
+    void add(uint32_t v){
+        size_t i = 0;
+        while (i != B::size && v > B::bounds[i])
+            ++i;
+        ++cnt[i];
+        ++total;
+    }
+
+    /**
+     * @brief estimate a percentile value
+     *
+     * @param p - percentile, 1-100
+     * @return uint32_t - upper bound of the bucket containing p-th percentile, UINT32_MAX if it falls in overflow bucket, 0 if histogram is empty
+     */
+    uint32_t percentile(unsigned p) const {
+        if (!total)
+            return 0;
+        uint64_t rank = (static_cast<uint64_t>(total) * (p > 100 ? 100 : p) + 99) / 100;
+        uint64_t acc = 0;
+        for (size_t i = 0; i != B::size; ++i){
+            acc += cnt[i];
+            if (acc >= rank)
+                return B::bounds[i];
+        }
+        return UINT32_MAX;
+    }
+
+    // upper bound of a bucket, UINT32_MAX for overflow bucket
+    static uint32_t bound(size_t i){ return i < B::size ? B::bounds[i] : UINT32_MAX; }
+    static constexpr size_t buckets(){ return B::size + 1; }
+};
+
+// poll-to-reply time buckets, ms
+struct rtt_buckets {
+    static constexpr size_t size = 9;
+    static const uint32_t bounds[size];
+};
+
+// data age buckets, ms
+struct age_buckets {
+    static constexpr size_t size = 9;
+    static const uint32_t bounds[size];
+};
+
+// number of modbus exception code counters, [0] - unknown code, [1-4] - ERR_FUNC - ERR_SLAVE
+#define PZ_EXC_CODES    5
+
+/**
+ * @brief a consistent copy of PZEM metrics along with it's update time
+ * 
+ * @tparam M - metrics type
+ */
+template <class M>
+struct snapshot_t {
+    M data;
+    int64_t update_us = 0;   // metrics update time, us since boot
+};
+
+
 struct state {
     const pzmodel_t model;      // state struct relates to specific pzem mddel
     uint8_t addr = ADDR_ANY;
     pzmbus::pzem_err_t err;
     int64_t poll_us = 0;     // last poll request sent time, microseconds since boot
     int64_t update_us = 0;   // last succes update time, us since boot
+    uint32_t polls = 0;      // number of poll requests sent
+    uint32_t replies = 0;    // number of valid replies parsed
+    uint32_t timeouts = 0;   // number of polls left without a reply
+    uint32_t errors = 0;     // number of error/unparsable replies
+    uint32_t rtt_us = 0;     // last poll-to-reply time, us
+    uint32_t rtt_min_us = 0; // min poll-to-reply time, us
+    uint32_t rtt_max_us = 0; // max poll-to-reply time, us
+    uint32_t jitter_us = 0;  // poll-to-reply time variation, smoothed mean deviation (RFC 3550 estimator), us
+    uint32_t stray = 0;      // valid replies addressed to some other device
+    uint32_t exceptions[PZ_EXC_CODES] = {};  // modbus exception replies by exception code
+    histogram<rtt_buckets> rtt_hist;    // poll-to-reply time distribution, ms
+    histogram<age_buckets> age_hist;    // data age distribution, i.e. time between consecutive updates, ms
     metrics data;          // default metrics struct, does nothing actually
 
     // C-tor
@@ -167,9 +249,49 @@ struct state {
     /**
      * @brief update poll_us to current value
      * should be called on each request set to PZEM
-     * 
+     * if previous poll has not been replied so far, it is counted as a timeout
      */
-    void reset_poll_us(){ poll_us = esp_timer_get_time(); }
+    void reset_poll_us(){
+        if (polls && poll_us > update_us)
+            ++timeouts;
+        ++polls;
+        poll_us = esp_timer_get_time();
+    }
+
+    /**
+     * @brief mark state as updated with a reply just received
+     * if reply matches an outstanding poll, poll-to-reply time and it's jitter are updated
+     */
+    void set_updated(){
+        int64_t now = esp_timer_get_time();
+        if (poll_us && poll_us > update_us){
+            uint32_t r = now - poll_us;
+            uint32_t d = r > rtt_us ? r - rtt_us : rtt_us - r;
+            if (rtt_max_us){
+                jitter_us += (static_cast<int32_t>(d) - static_cast<int32_t>(jitter_us)) / 16;
+                if (r < rtt_min_us) rtt_min_us = r;
+                if (r > rtt_max_us) rtt_max_us = r;
+            } else
+                rtt_min_us = rtt_max_us = r;
+            rtt_us = r;
+            rtt_hist.add(r / 1000);
+        }
+        // previous data has aged up to now by the moment it gets replaced
+        if (update_us)
+            age_hist.add((now - update_us) / 1000);
+        update_us = now;
+    }
+
+    /**
+     * @brief account modbus exception reply
+     *
+     * @param code - exception code from the reply
+     */
+    void set_exception(uint8_t code){
+        err = static_cast<pzem_err_t>(code);
+        ++exceptions[code < PZ_EXC_CODES ? code : 0];
+        ++errors;
+    }
 
     /**
      * @brief data considered stale if last update time is more than 2*PZEM_REFRESH_PERIOD ms
@@ -251,6 +373,21 @@ struct metrics : pzmbus::metrics {
     bool parse_rx_msg(const RX_msg *m) override;
 };
 
+// input registers map, metrics request and reply decoder are generated from it
+using regmap = pzmbus::regmap<metrics, CMD_RIR, PZ004_RIR_DATA_BEGIN,
+    PZ_REG(metrics, voltage, vol,   PZ004_RIR_VOLTAGE,   1, lo_hi, -1, volt),
+    PZ_REG(metrics, current, cur,   PZ004_RIR_CURRENT_L, 2, lo_hi, -3, amp),
+    PZ_REG(metrics, power,   pwr,   PZ004_RIR_POWER_L,   2, lo_hi, -1, watt),
+    PZ_REG(metrics, energy,  enrg,  PZ004_RIR_ENERGY_L,  2, lo_hi,  0, watthour),
+    PZ_REG(metrics, freq,    frq,   PZ004_RIR_FREQUENCY, 1, lo_hi, -1, hertz),
+    PZ_REG(metrics, pf,      pf,    PZ004_RIR_PF,        1, lo_hi, -2, none),
+    PZ_REG(metrics, alarm,   alrmh, PZ004_RIR_ALARM_H,   1, lo_hi,  0, flag)
+>;
+static_assert(regmap::count == PZ004_RIR_DATA_LEN && regmap::data_len == PZ004_RIR_RESP_LEN, "PZEM004 register map mismatch");
+
+// metrics snapshot
+using snapshot = pzmbus::snapshot_t<metrics>;
+
 /**
  * @brief a structure that reflects PZEM004tv30 state/data values
  * 
@@ -259,11 +396,24 @@ struct state : pzmbus::state {
     metrics data;
     uint16_t alrm_thrsh = 0;
     bool alarm = false;
+    SeqLatch<snapshot> snap;      // metrics snapshot for cross-task readers
 
     // C-tor - specify pzem model to base struct
     state () : pzmbus::state(pzmbus::pzmodel_t::pzem004v3) {}
     virtual ~state(){};
 
+    /**
+     * @brief make a lock-free snapshot of current metrics available for other tasks
+     * should be called by the writer once metrics has been updated
+     */
+    void publish(){ snap.store(snapshot{data, update_us}); }
+
+    /**
+     * @brief get a consistent copy of the last published metrics
+     * could be called from any task, does not block the writer
+     */
+    snapshot getSnapshot() const { return snap.load(); }
+
     /**
      * @brief try to parse PZEM reply packet and update structure state
      * 
@@ -379,6 +529,20 @@ struct metrics : pzmbus::metrics {
     bool parse_rx_msg(const RX_msg *m) override;
 };
 
+// input registers map, metrics request and reply decoder are generated from it
+using regmap = pzmbus::regmap<metrics, CMD_RIR, PZ003_RIR_DATA_BEGIN,
+    PZ_REG(metrics, voltage, vol,   PZ003_RIR_VOLTAGE,   1, lo_hi, -2, volt),
+    PZ_REG(metrics, current, cur,   PZ003_RIR_CURRENT,   1, lo_hi, -2, amp),
+    PZ_REG(metrics, power,   pwr,   PZ003_RIR_POWER_L,   2, lo_hi, -1, watt),
+    PZ_REG(metrics, energy,  enrg,  PZ003_RIR_ENERGY_L,  2, lo_hi,  0, watthour),
+    PZ_REG(metrics, alarmh,  alrmh, PZ003_RIR_ALARM_H,   1, lo_hi,  0, flag),
+    PZ_REG(metrics, alarml,  alrml, PZ003_RIR_ALARM_L,   1, lo_hi,  0, flag)
+>;
+static_assert(regmap::count == PZ003_RIR_DATA_LEN && regmap::data_len == PZ003_RIR_RESP_LEN, "PZEM003 register map mismatch");
+
+// metrics snapshot
+using snapshot = pzmbus::snapshot_t<metrics>;
+
 /**
  * @brief a structure that reflects PZEM state/data values
  * 
@@ -390,10 +554,23 @@ struct state : pzmbus::state {
     bool alarmh = false;
     bool alarml = false;
     uint8_t irange = 0;     // 100A shunt
+    SeqLatch<snapshot> snap;      // metrics snapshot for cross-task readers
 
     // C-tor - specify pzem model to base struct
     state () : pzmbus::state(pzmbus::pzmodel_t::pzem003) {}
 
+    /**
+     * @brief make a lock-free snapshot of current metrics available for other tasks
+     * should be called by the writer once metrics has been updated
+     */
+    void publish(){ snap.store(snapshot{data, update_us}); }
+
+    /**
+     * @brief get a consistent copy of the last published metrics
+     * could be called from any task, does not block the writer
+     */
+    snapshot getSnapshot() const { return snap.load(); }
+
     /**
      * @brief try to parse PZEM reply packet and update structure state
      * 
@@ -0,0 +1,261 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include "msgq.hpp"
+#include <cmath>
+#include <cstring>
+
+/**
+ * @brief compile-time MODBUS register maps
+ * A meter model is described with a table of register descriptors mapping registers to metrics struct members.
+ * Request frame, reply length check and a decoder for the whole block of registers are generated from the table,
+ * all addresses, offsets and scales are resolved at compile time, so decoding is a sequence of loads and shifts
+ * with no branches and no loops.
+ */
+namespace pzmbus {
+
+// Enumeration of available electricity metrics
+enum class meter_t:uint8_t { vol, cur, pwr, enrg, frq, pf, alrmh, alrml };
+
+// measurement units of register values, 'flag' registers are 0x0000/0xFFFF booleans
+enum class unit_t:uint8_t { none, volt, amp, watt, watthour, hertz, flag };
+
+// order of 16-bit words of a 2-register value, bytes of a register are always big-endian
+enum class word_order_t:uint8_t {
+    lo_hi,      // low word first, PZEM meters
+    hi_lo       // high word first
+};
+
+namespace regmap_impl {
+
+// big-endian register value, a single load and byte swap on ESP32, data block might be unaligned
+inline uint16_t be16(const uint8_t *p){
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap16(v);
+}
+
+inline void put_be16(uint8_t *p, uint16_t v){
+    v = __builtin_bswap16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+constexpr uint16_t max_end(){ return 0; }
+template <typename... E>
+constexpr uint16_t max_end(uint16_t e, E... rest){ return e > max_end(rest...) ? e : max_end(rest...); }
+
+constexpr bool all_after(uint16_t){ return true; }
+template <typename... A>
+constexpr bool all_after(uint16_t begin, uint16_t a, A... rest){ return a >= begin && all_after(begin, rest...); }
+
+constexpr double exp10i(int8_t e){ return e > 0 ? 10.0 * exp10i(e - 1) : e < 0 ? exp10i(e + 1) / 10.0 : 1.0; }
+
+}   // namespace regmap_impl
+
+/**
+ * @brief register descriptor, maps one or two consecutive registers to a metrics struct member
+ * use PZ_REG() macro to declare it without repeating the member type
+ *
+ * @tparam M - metrics struct
+ * @tparam V - member type
+ * @tparam field - pointer to member
+ * @tparam key - metric the register represents
+ * @tparam addr - register address
+ * @tparam words - number of registers, 1 or 2
+ * @tparam order - word order of a 2-register value
+ * @tparam exp - decimal exponent of register LSB, i.e. -1 for 0.1 V
+ * @tparam unit - measurement unit
+ */
+template <class M, typename V, V M::*field, meter_t key, uint16_t addr, uint8_t words, word_order_t order, int8_t exp, unit_t unit>
+struct reg {
+    static_assert(words == 1 || words == 2, "register value could be 16 or 32 bit");
+    static_assert(sizeof(V) * 8 >= words * 16, "member is too narrow for register value");
+
+    static constexpr meter_t metric = key;
+    static constexpr uint16_t address = addr;
+    static constexpr uint16_t end = addr + words;   // address past the last register
+    static constexpr int8_t exponent = exp;
+    static constexpr unit_t units = unit;
+
+    /**
+     * @brief decode register value into metrics member
+     *
+     * @tparam begin - address of the first register in data block
+     * @param data - data block of a reply
+     */
+    template <uint16_t begin>
+    static void decode(M &m, const uint8_t *data){
+        const uint8_t *p = data + (addr - begin) * 2;
+        // word count and order are constants, only one of the expressions remains
+        uint32_t v = words == 1 ? regmap_impl::be16(p) :
+                     order == word_order_t::lo_hi ? regmap_impl::be16(p) | static_cast<uint32_t>(regmap_impl::be16(p + 2)) << 16 :
+                                                    static_cast<uint32_t>(regmap_impl::be16(p)) << 16 | regmap_impl::be16(p + 2);
+        m.*field = static_cast<V>(v);
+    }
+
+    /**
+     * @brief encode metrics member into register value, inverse of decode()
+     *
+     * @tparam begin - address of the first register in data block
+     * @param data - data block of a reply
+     */
+    template <uint16_t begin>
+    static void encode(const M &m, uint8_t *data){
+        uint8_t *p = data + (addr - begin) * 2;
+        uint32_t v = m.*field;
+        if (words == 1)
+            regmap_impl::put_be16(p, v);
+        else if (order == word_order_t::lo_hi){
+            regmap_impl::put_be16(p, v & 0xffff);
+            regmap_impl::put_be16(p + 2, v >> 16);
+        } else {
+            regmap_impl::put_be16(p, v >> 16);
+            regmap_impl::put_be16(p + 2, v & 0xffff);
+        }
+    }
+
+    // raw value
+    static uint32_t raw(const M &m){ return m.*field; }
+
+    // value in units, same arithmetic as a hand-written 'raw / 10.0'
+    static float value(const M &m){
+        if (unit == unit_t::flag)
+            return m.*field ? 1.0 : 0.0;
+        return exp < 0 ? (m.*field) / regmap_impl::exp10i(-exp) : (m.*field) * regmap_impl::exp10i(exp);
+    }
+
+    // register LSB in units
+    static constexpr float scale(){ return unit == unit_t::flag ? 1.0f : static_cast<float>(regmap_impl::exp10i(exp)); }
+};
+
+/**
+ * @brief register map, a block of registers read with a single request
+ *
+ * @tparam M - metrics struct
+ * @tparam fcode - MODBUS function code to read the block
+ * @tparam begin - address of the first register
+ * @tparam R - register descriptors
+ */
+template <class M, uint8_t fcode, uint16_t begin, class... R>
+struct regmap {
+    static_assert(sizeof...(R) > 0, "register map is empty");
+    static_assert(regmap_impl::all_after(begin, R::address...), "register address is below map begin");
+
+    static constexpr uint8_t func = fcode;
+    static constexpr uint16_t first = begin;
+    // number of registers to read, up to the last one described
+    static constexpr uint16_t count = regmap_impl::max_end(R::end...) - begin;
+    // data bytes in reply, a single byte field in MODBUS frame
+    static constexpr uint8_t data_len = count * 2;
+    // reply frame size: addr, func, len, data, crc16
+    static constexpr size_t reply_size = data_len + 5;
+    // request frame size: addr, func, reg addr, reg count, crc16
+    static constexpr size_t request_size = 8;
+
+    static_assert(count * 2 < 256, "register block does not fit in a single reply");
+
+    /**
+     * @brief request message for the whole block
+     * frame is made of constants, only slave address and CRC are set at run time
+     *
+     * @param addr - slave device modbus address
+     * @return TX_msg*
+     */
+    static TX_msg* request(uint8_t addr, bool w4r = true){
+        TX_msg *msg = new TX_msg(request_size);
+        if (!msg)
+            return nullptr;
+
+        msg->data[0] = addr;
+        msg->data[1] = fcode;
+        msg->data[2] = begin >> 8;
+        msg->data[3] = begin & 0xff;
+        msg->data[4] = count >> 8;
+        msg->data[5] = count & 0xff;
+        msg->w4rx = w4r;
+        modbus::setcrc16(msg->data, request_size);
+        return msg;
+    }
+
+    /**
+     * @brief check if message is a reply to the block request
+     * message must be long enough to hold the data it's length byte claims
+     */
+    static bool match(const RX_msg *m){
+        return m->cmd == fcode && m->len >= reply_size && m->rawdata[2] == data_len;
+    }
+
+    // decode data block of a matching reply
+    static void decode(M &m, const uint8_t *data){
+        using expand = int[];
+        (void)expand{0, (R::template decode<begin>(m, data), 0)...};
+    }
+
+    /**
+     * @brief encode metrics struct into data block, the way meter replies to the block request
+     * registers not described in the map are zeroed
+     *
+     * @param data - buffer of data_len bytes
+     */
+    static void encode(const M &m, uint8_t *data){
+        memset(data, 0, data_len);
+        using expand = int[];
+        (void)expand{0, (R::template encode<begin>(m, data), 0)...};
+    }
+
+    /**
+     * @brief decode reply into metrics struct
+     *
+     * @return true on success
+     * @return false if message is not a reply to the block request
+     */
+    static bool parse(M &m, const RX_msg *msg){
+        if (!match(msg))
+            return false;
+        decode(m, &msg->rawdata[3]);
+        return true;
+    }
+
+    /**
+     * @brief metric value in units
+     *
+     * @return float - value or NAN if map has no such metric
+     */
+    static float asFloat(const M &m, meter_t k){
+        float v = NAN;
+        using expand = int[];
+        (void)expand{0, (R::metric == k ? (v = R::value(m), 0) : 0)...};
+        return v;
+    }
+
+    /**
+     * @brief register LSB in units
+     *
+     * @return float - scale or 0 if map has no such metric
+     */
+    static float scale(meter_t k){
+        float s = 0;
+        using expand = int[];
+        (void)expand{0, (R::metric == k ? (s = R::scale(), 0) : 0)...};
+        return s;
+    }
+};
+
+}   // namespace pzmbus
+
+/**
+ * @brief register descriptor of a metrics struct member
+ * i.e. PZ_REG(metrics, power, pwr, 0x0003, 2, lo_hi, -1, watt) - 32 bit power value in registers 3-4, low word first, 0.1 W LSB
+ */
+#define PZ_REG(M, field, metric, addr, words, order, exp, unit) \
+    pzmbus::reg<M, decltype(M::field), &M::field, pzmbus::meter_t::metric, addr, words, pzmbus::word_order_t::order, exp, pzmbus::unit_t::unit>
@@ -0,0 +1,71 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief single-writer, multiple-readers lock-free value container
+ * This is a sequence counter 'latch' - value is kept in two copies, writer updates them one by one
+ * while the sequence counter directs readers to the copy that is not being modified at the moment.
+ * Writer never waits for the readers, readers never wait for the writer to finish an update,
+ * reader retries a copy only if writer has managed to complete an update while the copy was taken.
+ *
+ * Must be used with a single writer only!
+ *
+ * @tparam T - value type, must be copy-assignable, should not contain pointers to dynamic data
+ */
+template <class T>
+class SeqLatch {
+    std::atomic<uint32_t> seq{0};
+    T v[2];
+
+public:
+    SeqLatch() = default;
+    SeqLatch(const SeqLatch&) = delete;
+    SeqLatch& operator=(const SeqLatch&) = delete;
+
+    /**
+     * @brief update value
+     * must be called from one writer context only
+     */
+    void store(const T &val){
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_release);        // readers switch to v[1], publishes it's previous update
+        std::atomic_thread_fence(std::memory_order_release);
+        v[0] = val;
+        seq.store(s + 2, std::memory_order_release);        // readers switch back to v[0]
+        std::atomic_thread_fence(std::memory_order_release);
+        v[1] = val;
+    }
+
+    /**
+     * @brief get a consistent copy of the value
+     * could be called from any context, never blocks
+     */
+    T load() const {
+        T val;
+        uint32_t s;
+        do {
+            s = seq.load(std::memory_order_acquire);
+            val = v[s & 1];
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (seq.load(std::memory_order_acquire) != s);
+        return val;
+    }
+
+    /**
+     * @brief number of updates made so far
+     */
+    uint32_t version() const { return seq.load(std::memory_order_acquire) / 2; }
+};
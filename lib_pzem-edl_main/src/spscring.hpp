@@ -0,0 +1,122 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief overflow/usage counters for SPSCRing
+ */
+struct SPSCRing_stats {
+    uint32_t pushed;        // items accepted
+    uint32_t popped;        // items taken by consumer
+    uint32_t drops;         // items rejected due to ring being full
+    uint32_t hwm;           // max ring fill level observed by producer
+};
+
+/**
+ * @brief single-producer, single-consumer lock-free ring buffer with a fixed capacity
+ * Producer never blocks - if ring is full, new item is rejected and counted as a drop,
+ * consumer takes items one by one or in batches.
+ * Storage is allocated statically within the object, no heap allocations.
+ *
+ * Must be used with one producer and one consumer context only!
+ *
+ * @tparam T - item type, must be copy-assignable
+ * @tparam N - ring capacity, must be a power of 2
+ */
+template <class T, size_t N>
+class SPSCRing {
+    static_assert(N && !(N & (N - 1)), "SPSCRing capacity must be a power of 2");
+
+    T items[N];
+    std::atomic<uint32_t> head{0};      // next slot to write, owned by producer
+    std::atomic<uint32_t> tail{0};      // next slot to read, owned by consumer
+
+    // counters
+    std::atomic<uint32_t> _drops{0};
+    uint32_t _pushed{0};                // producer-only
+    uint32_t _hwm{0};                   // producer-only
+
+public:
+    SPSCRing() = default;
+    SPSCRing(const SPSCRing&) = delete;
+    SPSCRing& operator=(const SPSCRing&) = delete;
+
+    /**
+     * @brief put an item to the ring
+     * must be called from producer context only
+     * @return true - item accepted
+     * @return false - ring is full, item dropped
+     */
+    bool push(const T &val){
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t used = h - tail.load(std::memory_order_acquire);
+        if (used >= N){
+            _drops.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        items[h & (N - 1)] = val;
+        head.store(h + 1, std::memory_order_release);
+        ++_pushed;
+        if (used + 1 > _hwm)
+            _hwm = used + 1;
+        return true;
+    }
+
+    /**
+     * @brief take a single item from the ring
+     * must be called from consumer context only
+     * @return true - item fetched
+     * @return false - ring is empty
+     */
+    bool pop(T &val){
+        return pop(&val, 1);
+    }
+
+    /**
+     * @brief take up to 'max' items from the ring in one go
+     * must be called from consumer context only
+     * @param dst - destination array
+     * @param max - max number of items to take
+     * @return size_t - number of items fetched
+     */
+    size_t pop(T *dst, size_t max){
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t avail = head.load(std::memory_order_acquire) - t;
+        size_t n = avail < max ? avail : max;
+        for (size_t i = 0; i != n; ++i)
+            dst[i] = items[(t + i) & (N - 1)];
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * @brief number of items in the ring
+     * value is approximate when called outside of producer/consumer context
+     */
+    size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    bool empty() const { return !size(); }
+
+    static constexpr size_t capacity() { return N; }
+
+    /**
+     * @brief get ring counters
+     * values are approximate when called outside of producer context
+     */
+    SPSCRing_stats getStats() const {
+        return SPSCRing_stats { _pushed, tail.load(std::memory_order_relaxed), _drops.load(std::memory_order_relaxed), _hwm };
+    }
+};
@@ -0,0 +1,437 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "tcpq.hpp"
+#include "pzem_modbus.hpp"
+#include "esp_timer.h"
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define MBAP_HDR_LEN            7       // tid, proto id, length, unit id
+#define MBAP_LEN_MAX            254     // unit id + PDU
+
+TcpQ::TcpQ(const TCP_cfg &c) : cfg(c) {
+    if (c.host)
+        host.reset(strcpy(new char[strlen(c.host) + 1], c.host));
+    cfg.host = host.get();
+}
+
+TcpQ::~TcpQ(){
+    stopQueues();
+    rx_callback = nullptr;
+}
+
+bool TcpQ::startQueues(){
+    if (t_io)
+        return true;
+    if (!cfg.host)
+        return false;
+
+    if (!tx_msg_q)
+#ifdef PZEM_EDL_STATIC_ALLOC
+        tx_msg_q = xQueueCreateStatic(tx_msg_q_DEPTH, sizeof(TX_msg*), tx_msg_q_storage, &tx_msg_q_buff);
+#else
+        tx_msg_q = xQueueCreate(tx_msg_q_DEPTH, sizeof(TX_msg*));
+#endif
+    if (!tx_msg_q)
+        return false;
+
+    quit = false;
+#ifdef PZEM_EDL_STATIC_ALLOC
+    t_io = xTaskCreateStaticPinnedToCore(TcpQ::ioTask, TCPQ_TASK_NAME, TCPQ_TASK_STACK, reinterpret_cast<void *>(this), cfg.prio, t_io_stack, &t_io_buff, cfg.core);
+    return t_io;
+#else
+    TaskHandle_t h = nullptr;
+    if (xTaskCreatePinnedToCore(TcpQ::ioTask, TCPQ_TASK_NAME, cfg.stack, reinterpret_cast<void *>(this), cfg.prio, &h, cfg.core) != pdPASS)
+        return false;
+    t_io = h;
+    return true;
+#endif
+}
+
+void TcpQ::stopQueues(){
+    if (t_io){
+        quit = true;
+#ifdef PZEM_EDL_STATIC_ALLOC
+        // static task buffers can't be reused until task is deleted
+        while (!parked)
+            vTaskDelay(1);
+        TaskHandle_t h = t_io;
+        t_io = nullptr;
+        vTaskDelete(h);
+        parked = false;
+#else
+        while (t_io)
+            vTaskDelay(1);
+#endif
+        quit = false;
+    }
+
+    if (tx_msg_q){
+        TX_msg *msg;
+        while (xQueueReceive(tx_msg_q, &msg, 0) == pdTRUE)
+            delete msg;
+        vQueueDelete(tx_msg_q);
+        tx_msg_q = nullptr;
+    }
+}
+
+bool TcpQ::txenqueue(TX_msg *msg){
+    if (!msg)
+        return false;
+
+    PZTRACE_INSTANT(txenqueue, msg->data[0]);
+    if (!tx_msg_q || xQueueSendToBack(tx_msg_q, (void *) &msg, (TickType_t)0) != pdTRUE){
+        ++stats.tx_drops;
+        delete msg;
+        return false;
+    }
+    return true;
+}
+
+uint8_t TcpQ::slots() const {
+    if (cfg.proto == tcpproto_t::rtu || !cfg.inflight)
+        return 1;
+    return cfg.inflight < TCPQ_INFLIGHT ? cfg.inflight : TCPQ_INFLIGHT;
+}
+
+void TcpQ::open(int64_t now){
+    char port[6];
+    snprintf(port, sizeof(port), "%u", cfg.port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *ai = nullptr;
+
+    if (getaddrinfo(cfg.host, port, &hints, &ai) != 0 || !ai){
+        ESP_LOGW(TAG, "can't resolve %s", cfg.host);
+        drop(now, true);
+        return;
+    }
+
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock >= 0){
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS){
+            connecting = true;
+            conn_deadline = now + TCPQ_CONNECT_TIMEOUT * 1000LL;
+        } else
+            drop(now, true);
+    } else
+        drop(now, true);
+
+    freeaddrinfo(ai);
+}
+
+void TcpQ::drop(int64_t now, bool failed){
+    if (sock >= 0){
+        close(sock);
+        sock = -1;
+    }
+    if (failed)
+        ++tstats.conn_fails;
+    else
+        ++tstats.disconnects;
+
+    // requests that were sent won't get a reply anymore
+    stats.rx_timeouts += n_inflight;
+    n_inflight = 0;
+    rxlen = txlen = txoff = 0;
+    connecting = false;
+    link_up = false;
+
+    backoff = backoff ? backoff * 2 : TCPQ_RECONNECT_MIN;
+    if (backoff > TCPQ_RECONNECT_MAX)
+        backoff = TCPQ_RECONNECT_MAX;
+    reconnect_us = now + backoff * 1000LL;
+    ESP_LOGI(TAG, "%s:%u link down, reconnect in %u ms", cfg.host, cfg.port, static_cast<unsigned>(backoff));
+}
+
+void TcpQ::send_msg(TX_msg *msg, int64_t now){
+    if (msg->len < 4 || msg->len + 4 > sizeof(txbuf)){
+        ++stats.tx_drops;
+        return;
+    }
+
+    if (cfg.proto == tcpproto_t::mbap){
+        // MBAP header replaces CRC, unit id is the slave address
+        uint16_t len = msg->len - 2;
+        ++tid_seq;
+        txbuf[0] = tid_seq >> 8;
+        txbuf[1] = tid_seq & 0xff;
+        txbuf[2] = txbuf[3] = 0;
+        txbuf[4] = len >> 8;
+        txbuf[5] = len & 0xff;
+        memcpy(&txbuf[6], msg->data, len);
+        txlen = len + 6;
+    } else {
+        memcpy(txbuf, msg->data, msg->len);
+        txlen = msg->len;
+    }
+    txoff = 0;
+
+    if (msg->w4rx){
+        inflight[n_inflight++] = { tid_seq, msg->data[0], now };
+        if (n_inflight > tstats.inflight_max)
+            tstats.inflight_max = n_inflight;
+    }
+    ++stats.tx_frames;
+}
+
+bool TcpQ::flush(){
+    while (txoff != txlen){
+        ssize_t n = send(sock, txbuf + txoff, txlen - txoff, 0);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        txoff += n;
+    }
+    txoff = txlen = 0;
+    return true;
+}
+
+void TcpQ::complete(size_t i){
+    inflight[i] = inflight[--n_inflight];
+}
+
+void TcpQ::deliver(const uint8_t *data, size_t len, bool addcrc){
+    ++stats.rx_frames;
+    if (!rx_callback){
+        ++stats.rx_drops;
+        return;
+    }
+
+    size_t size = addcrc ? len + 2 : len;
+    uint8_t *buff = RX_msg::buff_alloc(size);
+    if (!buff){
+        ++stats.rx_drops;
+        return;
+    }
+    memcpy(buff, data, len);
+    if (addcrc)
+        modbus::setcrc16(buff, size);
+
+    RX_msg *msg = new RX_msg(buff, size);
+    if (!msg){
+        RX_msg::buff_free(buff);
+        ++stats.rx_drops;
+        return;
+    }
+    if (!msg->valid)
+        ++stats.rx_crc_err;
+    rx_callback(msg);       // handler takes ownership on the message
+}
+
+bool TcpQ::parse(bool idle){
+    for (;;){
+        size_t flen = 0;
+
+        if (cfg.proto == tcpproto_t::mbap){
+            if (rxlen < MBAP_HDR_LEN)
+                return true;
+            uint16_t len = rxbuf[4] << 8 | rxbuf[5];
+            if (rxbuf[2] || rxbuf[3] || len < 2 || len > MBAP_LEN_MAX){
+                ++tstats.proto_errors;
+                return false;       // stream is out of sync
+            }
+            flen = len + 6;
+            if (rxlen < flen)
+                return true;
+
+            uint16_t tid = rxbuf[0] << 8 | rxbuf[1];
+            for (size_t i = 0; i != n_inflight; ++i){
+                if (inflight[i].tid == tid){
+                    complete(i);
+                    break;
+                }
+            }
+            deliver(&rxbuf[6], len, true);
+        } else {
+            if (rxlen < 2)
+                return true;
+            // RTU has no length field, it is derived from function code
+            uint8_t fc = rxbuf[1];
+            if (fc & 0x80)
+                flen = 5;
+            else if (fc == CMD_RHR || fc == CMD_RIR)
+                flen = rxlen < 3 ? 0 : 5 + rxbuf[2];
+            else if (fc == CMD_WSR)
+                flen = GENERIC_MSG_SIZE;
+            else if (fc == CMD_RST_ENRG)
+                flen = ENERGY_RST_MSG_SIZE;
+
+            if (!flen){
+                // unknown size, frame ends with a pause
+                if (!idle)
+                    return true;
+                flen = rxlen;
+            } else if (rxlen < flen){
+                if (!idle)
+                    return true;
+                flen = rxlen;       // truncated frame, deliver it to be counted as a CRC error
+            }
+
+            for (size_t i = 0; i != n_inflight; ++i){
+                if (inflight[i].addr == rxbuf[0]){
+                    complete(i);
+                    break;
+                }
+            }
+            deliver(rxbuf, flen, false);
+        }
+
+        // got a reply, gateway is alive
+        backoff = 0;
+        rxlen -= flen;
+        memmove(rxbuf, rxbuf + flen, rxlen);
+    }
+}
+
+bool TcpQ::receive(int64_t now){
+    for (;;){
+        if (rxlen == sizeof(rxbuf)){
+            // RTU garbage that does not make a frame, MBAP frame always fits
+            ++stats.rx_ovf;
+            rxlen = 0;
+        }
+        ssize_t n = recv(sock, rxbuf + rxlen, sizeof(rxbuf) - rxlen, 0);
+        if (n == 0)
+            return false;           // closed by peer
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        rxlen += n;
+        rx_us = now;
+        if (!parse(false))
+            return false;
+    }
+}
+
+void TcpQ::ioLoop(){
+    while (!quit){
+        int64_t now = esp_timer_get_time();
+
+        if (sock < 0){
+            if (now < reconnect_us){
+                // link is down, requests would go stale while waiting
+                TX_msg *msg;
+                if (xQueueReceive(tx_msg_q, &msg, pdMS_TO_TICKS(TCPQ_IDLE_MS)) == pdTRUE){
+                    ++stats.tx_drops;
+                    delete msg;
+                }
+                continue;
+            }
+            open(now);
+            continue;
+        }
+
+        // pick next request if there is a free transaction slot and previous frame is out
+        if (!connecting && !txlen){
+            TX_msg *msg = nullptr;
+            bool idle = !n_inflight && !rxlen;
+            if (n_inflight < slots() &&
+                xQueueReceive(tx_msg_q, &msg, idle ? pdMS_TO_TICKS(TCPQ_IDLE_MS) : 0) == pdTRUE){
+                now = esp_timer_get_time();
+                send_msg(msg, now);
+                delete msg;
+            }
+            if (txlen && !flush()){
+                drop(now, false);
+                continue;
+            }
+        }
+
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(sock, &rfds);
+        if (connecting || txlen)
+            FD_SET(sock, &wfds);
+        // do not sleep if there are more requests to send
+        bool more = !connecting && !txlen && n_inflight < slots() && uxQueueMessagesWaiting(tx_msg_q);
+        struct timeval tv = { 0, more ? 0 : TCPQ_POLL_MS * 1000 };
+        int r = select(sock + 1, &rfds, &wfds, nullptr, &tv);
+        now = esp_timer_get_time();
+        if (r < 0 && errno != EINTR){
+            drop(now, connecting);
+            continue;
+        }
+
+        if (connecting){
+            if (r > 0 && (FD_ISSET(sock, &wfds) || FD_ISSET(sock, &rfds))){
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err){
+                    drop(now, true);
+                    continue;
+                }
+                connecting = false;
+                link_up = true;
+                ++tstats.connects;
+                ESP_LOGI(TAG, "%s:%u link up", cfg.host, cfg.port);
+            } else if (now > conn_deadline){
+                drop(now, true);
+                continue;
+            }
+            continue;
+        }
+
+        if (r > 0 && FD_ISSET(sock, &wfds) && !flush()){
+            drop(now, false);
+            continue;
+        }
+        if (r > 0 && FD_ISSET(sock, &rfds) && !receive(now)){
+            drop(now, false);
+            continue;
+        }
+
+        // RTU frame of unknown length ends with a pause
+        if (rxlen && cfg.proto == tcpproto_t::rtu && now - rx_us > TCPQ_RTU_IDLE_MS * 1000LL)
+            parse(true);
+
+        // expire transactions left without reply
+        for (size_t i = 0; i < n_inflight; ){
+            if (now - inflight[i].sent_us > cfg.timeout * 1000LL){
+                ++stats.rx_timeouts;
+                complete(i);
+            } else
+                ++i;
+        }
+    }
+
+    if (sock >= 0){
+        close(sock);
+        sock = -1;
+    }
+    n_inflight = 0;
+    rxlen = txlen = txoff = 0;
+    connecting = false;
+    link_up = false;
+#ifdef PZEM_EDL_STATIC_ALLOC
+    // signal stopQueues() that IO task is not running anymore and wait to be deleted
+    parked = true;
+    for (;;)
+        vTaskDelay(portMAX_DELAY);
+#else
+    // signal stopQueues() that IO task is not running anymore
+    t_io = nullptr;
+    vTaskDelete(NULL);
+#endif
+}
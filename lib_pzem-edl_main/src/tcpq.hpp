@@ -0,0 +1,193 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include "msgq.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include <atomic>
+
+#define TCPQ_PORT               502             // default Modbus TCP port
+#define TCPQ_INFLIGHT           4               // MBAP transactions in flight
+#define TCPQ_REPLY_TIMEOUT      1000            // ms, gateway adds network round-trip and it's own queueing on top of PZEM_UART_TIMEOUT
+#define TCPQ_CONNECT_TIMEOUT    3000            // ms
+#define TCPQ_RECONNECT_MIN      500             // ms, first reconnect delay, doubled on each failed attempt
+#define TCPQ_RECONNECT_MAX      30000           // ms, max reconnect delay
+#define TCPQ_POLL_MS            5               // socket poll interval while transactions are in flight
+#define TCPQ_IDLE_MS            50              // TX queue wait while the line is idle
+#define TCPQ_RTU_IDLE_MS        20              // RTU-over-TCP end of frame gap for replies of unknown length
+#define TCPQ_BUF_SIZE           260             // max MBAP ADU
+#ifndef TCPQ_TASK_PRIO
+#define TCPQ_TASK_PRIO          2
+#endif
+#ifndef TCPQ_TASK_STACK
+#define TCPQ_TASK_STACK         4096
+#endif
+#define TCPQ_TASK_NAME          "TCPQ"
+
+// MODBUS framing over TCP connection
+enum class tcpproto_t : uint8_t {
+    mbap,               // Modbus TCP, MBAP header with transaction id, no CRC
+    rtu                 // RTU frames as is, transparent RS485 gateway
+};
+
+/**
+ * @brief TCP port instance configuration structure
+ */
+struct TCP_cfg {
+    const char *host;                   // gateway host name or IP, copied by TcpQ
+    uint16_t port;
+    tcpproto_t proto;
+    uint8_t inflight = TCPQ_INFLIGHT;   // max transactions in flight, MBAP only, RTU-over-TCP has no transaction ids and runs one at a time
+    uint32_t timeout = TCPQ_REPLY_TIMEOUT;  // reply timeout, ms
+    UBaseType_t prio = TCPQ_TASK_PRIO;  // IO task options
+    uint32_t stack = TCPQ_TASK_STACK;   // ignored in static allocation mode, stack size is fixed at build time with TCPQ_TASK_STACK
+    BaseType_t core = UARTQ_TASK_CORE;
+
+    TCP_cfg (const char *_host = nullptr, uint16_t _port = TCPQ_PORT, tcpproto_t _proto = tcpproto_t::mbap) :
+        host(_host), port(_port), proto(_proto) {}
+};
+
+/**
+ * @brief TCP connection counters
+ */
+struct TcpQ_stats {
+    uint32_t connects = 0;      // connections established
+    uint32_t conn_fails = 0;    // failed connection attempts
+    uint32_t disconnects = 0;   // connections closed by peer or on error
+    uint32_t proto_errors = 0;  // malformed MBAP frames, connection is reset to resync
+    uint8_t inflight_max = 0;   // max transactions in flight seen
+};
+
+/**
+ * @brief MODBUS over TCP message queue, talks to PZEM devices behind RS485-to-Ethernet gateway
+ * RTU frames from TX queue are sent either as Modbus TCP (MBAP header, CRC stripped) or as is (RTU-over-TCP),
+ * replies are delivered to RX handler as RTU frames with CRC, so devices and pool do not know the difference.
+ *
+ * A single IO task runs a non-blocking socket, connection is kept open and reused for all the requests.
+ * MBAP transaction ids allow up to 'inflight' requests to be sent without waiting for replies,
+ * RTU-over-TCP is serialized the same way UartQ does it - 'w4rx' messages wait for the reply to the previous one.
+ * Requests are dropped while the link is down, reconnect delay grows exponentially until gateway replies again.
+ */
+class TcpQ : public MsgQ {
+
+public:
+    explicit TcpQ(const TCP_cfg &cfg);
+
+    // Class dtor
+    virtual ~TcpQ();
+
+    // Copy semantics : forbidden
+    TcpQ(const TcpQ&) = delete;
+    TcpQ& operator=(const TcpQ&) = delete;
+
+    /**
+     * @brief start IO task, connection is established in background
+     *
+     * @return true if success
+     * @return false on any error
+     */
+    bool startQueues() override;
+
+    /**
+     * @brief stop IO task and close connection
+     */
+    void stopQueues() override;
+
+    /**
+     * @brief enqueue PZEM message, it is sent once connection is up and there is a free transaction slot
+     * this method will take ownership on TX_msg object and 'delete' it
+     *
+     * @param msg PZEM command message object
+     * @return true - if mesage has been enqueue's successfully
+     * @return false - if enqueue failed due to Q is full or any other issue
+     */
+    bool txenqueue(TX_msg *msg) override;
+
+    // connection is established
+    bool connected() const { return link_up; }
+
+    const TcpQ_stats& getTcpStats() const { return tstats; }
+
+private:
+    // transaction in flight
+    struct xact {
+        uint16_t tid;           // MBAP transaction id
+        uint8_t addr;           // slave address
+        int64_t sent_us;
+    };
+
+    TCP_cfg cfg;
+    std::unique_ptr<char[]> host;
+    QueueHandle_t tx_msg_q = nullptr;
+    volatile TaskHandle_t t_io = nullptr;
+    std::atomic<bool> quit{false};
+#ifdef PZEM_EDL_STATIC_ALLOC
+    std::atomic<bool> parked{false};    // IO task has finished and waits to be deleted by stopQueues()
+    StaticQueue_t   tx_msg_q_buff;
+    uint8_t         tx_msg_q_storage[tx_msg_q_DEPTH * sizeof(TX_msg*)];
+    StaticTask_t    t_io_buff;
+    StackType_t     t_io_stack[TCPQ_TASK_STACK];
+#endif
+    std::atomic<bool> link_up{false};
+    TcpQ_stats tstats;
+
+    // IO task state
+    int sock = -1;
+    bool connecting = false;
+    int64_t conn_deadline = 0;          // connect timeout, us
+    int64_t reconnect_us = 0;           // next connect attempt time, us
+    uint32_t backoff = 0;               // current reconnect delay, ms
+    uint16_t tid_seq = 0;
+    xact inflight[TCPQ_INFLIGHT];
+    uint8_t n_inflight = 0;
+    uint8_t rxbuf[TCPQ_BUF_SIZE];
+    size_t rxlen = 0;
+    int64_t rx_us = 0;                  // last data received time, us
+    uint8_t txbuf[TCPQ_BUF_SIZE];       // frame being sent, socket buffer might take it partially
+    size_t txlen = 0;
+    size_t txoff = 0;
+
+    static void ioTask(void* pvParams){
+        (reinterpret_cast<TcpQ*>(pvParams))->ioLoop();
+    }
+
+    void ioLoop();
+
+    // start non-blocking connect
+    void open(int64_t now);
+
+    // close connection and schedule reconnect
+    void drop(int64_t now, bool failed);
+
+    // encode message into txbuf and start sending
+    void send_msg(TX_msg *msg, int64_t now);
+
+    // write txbuf leftover to socket
+    bool flush();
+
+    // read from socket and deliver complete frames
+    bool receive(int64_t now);
+
+    // extract MBAP/RTU frames from rxbuf, 'idle' - line has been idle long enough to end an RTU frame of unknown size
+    bool parse(bool idle);
+
+    // deliver an RTU frame to RX handler
+    void deliver(const uint8_t *data, size_t len, bool addcrc);
+
+    // remove transaction from in-flight list
+    void complete(size_t i);
+
+    // number of transactions allowed in flight
+    uint8_t slots() const;
+};
@@ -23,6 +23,7 @@ GitHub: https://github.com/vortigont/pzem-edl
 #endif
 
 #include <cstdlib>
+#include <functional>
 #include <list>
 
 // PSRAM support
@@ -64,6 +65,7 @@ template <typename T>
 class TimeSeries : public RingBuff<T> {
 	uint32_t							  tstamp;	 // last update timestamp mark
 	uint32_t							  interval;	 // time interval between series
+	uint32_t							  seq{0};	 // total number of samples pushed, never reset
 	const char*							  _descr;	 // Mnemonic name for the instance
 	std::unique_ptr<AveragingFunction<T>> _avg;		 // averaging instance
 
@@ -91,10 +93,32 @@ class TimeSeries : public RingBuff<T> {
 	 */
 	void	 push(const T& val, uint32_t time);
 
+	/**
+	 * @brief set series state after samples were bulk-loaded into RingBuff storage
+	 * averaging function is reset
+	 *
+	 * @param head - storage index of the oldest sample
+	 * @param size - number of samples
+	 * @param _seq - sequence number for the next sample, the newest sample loaded has seq '_seq - 1'
+	 * @param t - time mark for the newest sample
+	 */
+	void	 restore(int head, int size, uint32_t _seq, uint32_t t);
+
 	uint32_t getTstamp() const {
 		return tstamp;
 	}
 
+	/**
+	 * @brief get sample sequence counter
+	 * each sample pushed to the buffer gets a sequence number that is never reused, even after clear()
+	 * so the oldest sample in buffer has seq number 'getSeq() - getSize()' and the newest one - 'getSeq() - 1'
+	 * timestamp of a sample could be derived as 'getTstamp() - (getSeq() - seq) * getInterval()'
+	 * @return uint32_t - sequence number for the next sample to be pushed
+	 */
+	uint32_t getSeq() const {
+		return seq;
+	}
+
 	uint32_t getInterval() const {
 		return interval;
 	}
@@ -135,16 +159,19 @@ void TimeSeries<T>::push(const T& val, uint32_t time) {
 		return;
 	}
 
-	if (time >= 2 * interval) {							// пропущено несколько выборок
-		if (time / interval > RingBuff<T>::capacity) {	// пропустили выборок больше чем весь текущий буфер - сбрасываем всё
-			clear(_t);
-		} else {
-			// заполняем пропуски последним известным значением, это неверные данные, но других всё равно нет
-			do {
-				RingBuff<T>::push_back(val);
-				time -= interval;
-			} while (time > interval);
+	uint32_t n = time / interval;	// number of intervals passed since last sample
+
+	if (n > RingBuff<T>::capacity) {	// пропустили выборок больше чем весь текущий буфер - сбрасываем всё
+		clear(_t);
+		n = 1;
+	} else {
+		// заполняем пропуски последним известным значением, это неверные данные, но других всё равно нет
+		for (uint32_t i = 1; i < n; ++i) {
+			RingBuff<T>::push_back(val);
+			++seq;
 		}
+		// keep time mark on the interval grid, so that derived timestamps of the stored samples never change
+		_t = tstamp + n * interval;
 	}
 
 	// if we have averaging - use it
@@ -156,9 +183,18 @@ void TimeSeries<T>::push(const T& val, uint32_t time) {
 	} else
 		RingBuff<T>::push_back(val);
 
+	++seq;
 	tstamp = _t;  // обновляем метку времени
 }
 
+template <typename T>
+void TimeSeries<T>::restore(int head, int size, uint32_t _seq, uint32_t t) {
+	RingBuff<T>::assign(head, size);
+	seq = _seq;
+	tstamp = t;
+	if (_avg) _avg->reset();
+}
+
 template <typename T>
 void TimeSeries<T>::setInterval(uint32_t _interval, uint32_t newtime) {
 	if (interval > 0) {
@@ -286,6 +322,14 @@ class TSContainer {
 		 return tschain.size();
 	};
 
+	/**
+	 * @brief run a function over each TimeSeries in the container, in order of addition
+	 */
+	void foreach(std::function<void (TimeSeries<T>& ts)> f) {
+		for (auto i = tschain.begin(); i != tschain.end(); ++i)
+			f(*i->get());
+	}
+
    protected:
 	std::list<std::shared_ptr<TimeSeries<T>>> tschain;	// time-series chain
 };
@@ -337,7 +381,7 @@ bool TSContainer<T>::setTSinterval(uint8_t id, uint32_t _interval, uint32_t newt
 template <typename T>
 void TSContainer<T>::clear() {
 	for (auto i = tschain.begin(); i != tschain.end(); ++i) {
-		i->get()->clear();
+		i->get()->clear(i->get()->getTstamp());
 	}
 }
 
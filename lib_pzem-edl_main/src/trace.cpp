@@ -0,0 +1,89 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "trace.hpp"
+#include <cstdio>
+#include <cstring>
+
+namespace pztrace {
+
+#ifdef PZEM_EDL_TRACE
+Recorder recorder;
+#endif
+
+static const char* const ev_names[] = {"poll", "txenqueue", "rts_wait", "uart_write", "rx_event", "parse", "ts_push"};
+static_assert(sizeof(ev_names) / sizeof(ev_names[0]) == static_cast<size_t>(ev_t::_count), "trace event names mismatch");
+
+const char* ev_name(ev_t ev){
+    return ev < ev_t::_count ? ev_names[static_cast<size_t>(ev)] : "unknown";
+}
+
+bool Recorder::get(uint32_t i, record &r) const {
+    const slot &s = ring[i & (PZTRACE_RING_SIZE - 1)];
+    if (s.seq.load(std::memory_order_acquire) != i + 1)
+        return false;
+    r = s.r;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return s.seq.load(std::memory_order_relaxed) == i + 1;
+}
+
+size_t Recorder::copy(record *dst, size_t max) const {
+    uint32_t h = head.load(std::memory_order_acquire);
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (h - t > PZTRACE_RING_SIZE)
+        t = h - PZTRACE_RING_SIZE;
+
+    size_t n = 0;
+    for (uint32_t i = t; i != h && n != max; ++i){
+        if (get(i, dst[n]))
+            ++n;
+    }
+    return n;
+}
+
+size_t Recorder::dump(std::function<void (const char *data, size_t len)> out) const {
+    if (!out)
+        return 0;
+
+    uint32_t h = head.load(std::memory_order_acquire);
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (h - t > PZTRACE_RING_SIZE)
+        t = h - PZTRACE_RING_SIZE;
+
+    static const char hdr[] = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    out(hdr, sizeof(hdr) - 1);
+
+    char buff[160];
+    size_t n = 0;
+    int64_t ts = 0;
+    uint32_t last = 0;
+    record r;
+    for (uint32_t i = t; i != h; ++i){
+        if (!get(i, r))
+            continue;
+        // records come roughly in time order, unwrap 32 bit timestamps relative to the first one
+        ts = n ? ts + static_cast<int32_t>(r.ts - last) : r.ts;
+        last = r.ts;
+        int len = snprintf(buff, sizeof(buff), "%s{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"id\":%u,\"core\":%u}}",
+            n ? "," : "", ev_name(r.ev), static_cast<char>(r.ph), r.ph == ph_t::instant ? "\"s\":\"t\"," : "",
+            static_cast<long long>(ts), static_cast<unsigned>(r.tid), r.id, r.core);
+        if (len > 0)
+            out(buff, static_cast<size_t>(len) < sizeof(buff) ? len : sizeof(buff) - 1);
+        ++n;
+    }
+
+    static const char ftr[] = "]}";
+    out(ftr, sizeof(ftr) - 1);
+    return n;
+}
+
+} // namespace pztrace
@@ -0,0 +1,167 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#ifndef PZTRACE_RING_SIZE
+#define PZTRACE_RING_SIZE       256             // number of trace records kept, must be a power of 2
+#endif
+
+#ifndef PZTRACE_CLOCK
+#define PZTRACE_CLOCK()         esp_timer_get_time()    // timestamp source, us. Most of the record cost is the timer read
+#endif
+
+/*
+ * Trace points are compiled in only with PZEM_EDL_TRACE build flag,
+ * otherwise macros expand to nothing and recorder is not instantiated
+ */
+#ifdef PZEM_EDL_TRACE
+#define PZTRACE_BEGIN(ev, id)   pztrace::recorder.add(pztrace::ev_t::ev, pztrace::ph_t::begin, id)
+#define PZTRACE_END(ev, id)     pztrace::recorder.add(pztrace::ev_t::ev, pztrace::ph_t::end, id)
+#define PZTRACE_INSTANT(ev, id) pztrace::recorder.add(pztrace::ev_t::ev, pztrace::ph_t::instant, id)
+#else
+#define PZTRACE_BEGIN(ev, id)   do {} while (0)
+#define PZTRACE_END(ev, id)     do {} while (0)
+#define PZTRACE_INSTANT(ev, id) do {} while (0)
+#endif
+
+namespace pztrace {
+
+/**
+ * @brief trace points along poll/reply path
+ */
+enum class ev_t : uint8_t {
+    poll = 0,       // poll timer fired for a device
+    txenqueue,      // TX message placed into the port queue
+    rts_wait,       // TX task waits for the reply to the previous request
+    uart_write,     // TX frame written to UART
+    rx_event,       // RX data event handled by UART RX task
+    parse,          // device parses a reply
+    ts_push,        // sample is pushed into TimeSeries container
+    _count
+};
+
+/**
+ * @brief record phase, values match Chrome trace_event 'ph' field
+ */
+enum class ph_t : uint8_t {
+    begin   = 'B',
+    end     = 'E',
+    instant = 'i'
+};
+
+struct record {
+    uint32_t ts;        // PZTRACE_CLOCK() time, us, wraps every ~71 min
+    uint32_t tid;       // task handle
+    ev_t ev;
+    ph_t ph;
+    uint8_t id;         // device id or modbus address
+    uint8_t core;       // CPU core
+};
+
+const char* ev_name(ev_t ev);
+
+/**
+ * @brief multi-producer lock-free ring of trace records
+ * Writers claim a slot with a single atomic increment and never wait, the oldest records are overwritten.
+ * Each slot carries a sequence number, so the reader skips records that are being written
+ * or have been overwritten while the dump is in progress.
+ */
+class Recorder {
+    static_assert(PZTRACE_RING_SIZE && !(PZTRACE_RING_SIZE & (PZTRACE_RING_SIZE - 1)), "PZTRACE_RING_SIZE must be a power of 2");
+
+    struct slot {
+        std::atomic<uint32_t> seq{0};   // record number + 1, 0 - slot is being written
+        record r;
+    };
+
+    slot ring[PZTRACE_RING_SIZE];
+    std::atomic<uint32_t> head{0};      // total number of records ever added
+    std::atomic<uint32_t> tail{0};      // records below this number are cleared
+    std::atomic<bool> on{true};
+
+    // read record number i, false if it is being written or has been overwritten
+    bool get(uint32_t i, record &r) const;
+
+public:
+    Recorder() = default;
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    /**
+     * @brief add a trace record
+     * could be called from any task, never blocks
+     */
+    void add(ev_t ev, ph_t ph, uint8_t id){
+        if (!on.load(std::memory_order_relaxed))
+            return;
+        uint32_t i = head.fetch_add(1, std::memory_order_relaxed);
+        slot &s = ring[i & (PZTRACE_RING_SIZE - 1)];
+        s.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.r.ts = static_cast<uint32_t>(PZTRACE_CLOCK());
+        s.r.tid = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(xTaskGetCurrentTaskHandle()));
+        s.r.ev = ev;
+        s.r.ph = ph;
+        s.r.id = id;
+        s.r.core = static_cast<uint8_t>(xPortGetCoreID());
+        s.seq.store(i + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief pause/resume recording at run-time
+     */
+    void enable(bool state){ on.store(state, std::memory_order_relaxed); }
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief drop all records
+     */
+    void clear(){ tail.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+    /**
+     * @brief total number of records added so far, including the overwritten ones
+     */
+    uint32_t count() const { return head.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief take a consistent copy of the ring contents, oldest first
+     *
+     * @param dst - array to copy records to
+     * @param max - array size
+     * @return size_t - number of records copied
+     */
+    size_t copy(record *dst, size_t max) const;
+
+    /**
+     * @brief dump ring contents as Chrome trace_event JSON ({"traceEvents":[...]})
+     * output could be loaded to chrome://tracing or ui.perfetto.dev
+     * records are formatted one by one, no memory is allocated for the whole dump
+     *
+     * @param out - output function, called with chunks of text
+     * @return size_t - number of records dumped
+     */
+    size_t dump(std::function<void (const char *data, size_t len)> out) const;
+};
+
+#ifdef PZEM_EDL_TRACE
+extern Recorder recorder;       // trace points recorder
+#endif
+
+} // namespace pztrace
@@ -0,0 +1,116 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+/*
+    TimeSeries archive file format
+    shared by the device side writer (tsarchive.hpp) and host reader library, must not depend on anything else
+
+    File is little-endian, all fields are naturally aligned, so it could be mapped to memory and read in place:
+
+    | file_hdr | tier_hdr x ntiers | tier 1 records | tier 2 records | ...
+
+    Each tier is a fixed-size array of 'count' records, oldest first, starting at 'offset' from the beginning of file.
+    Record 'i' of a tier has timestamp 'base_time + i * interval'. Meter values are kept in device units,
+    value in SI units is 'raw * scale[field]'. Records for samples that were not available when archive was
+    written are kept in place, but have no TSA_VALID flag.
+*/
+
+#pragma once
+#include <stdint.h>
+
+#define TSA_MAGIC           0x41545a50      // 'PZTA'
+#define TSA_VERSION         1
+#define TSA_ALIGN           8               // tier data alignment
+#define TSA_DESCR_LEN       16
+
+// record flags
+#define TSA_VALID           0x0001          // record holds a sample
+
+namespace tsarchive {
+
+// meter fields, index of scale[] array
+enum field_t : uint8_t {
+    voltage = 0,
+    current,
+    power,
+    energy,
+    freq,
+    pf,
+    _fields
+};
+
+struct file_hdr {
+    uint32_t magic;         // TSA_MAGIC
+    uint16_t ver;           // TSA_VERSION
+    uint16_t hdr_size;      // sizeof(file_hdr)
+    uint16_t tier_size;     // sizeof(tier_hdr)
+    uint16_t rec_size;      // sizeof(record)
+    uint8_t  model;         // pzmbus::pzmodel_t of the meter
+    uint8_t  ntiers;        // number of tier headers following file header
+    uint16_t reserved;
+    int32_t  energy_offset; // energy counter offset set by user, Wh, not applied to records
+    uint32_t created;       // archive creation time, unixtime
+    uint64_t size;          // total file size
+};
+
+struct tier_hdr {
+    uint8_t  id;            // TimeSeries id
+    uint8_t  reserved[3];
+    uint32_t interval;      // sampling interval, sec
+    uint32_t base_time;     // timestamp of the first record, unixtime
+    uint32_t first_seq;     // TimeSeries sequence number of the first record
+    uint32_t count;         // number of records
+    uint32_t capacity;      // TimeSeries capacity
+    uint64_t offset;        // records offset from the beginning of file, TSA_ALIGN aligned
+    float    scale[_fields];// raw value to SI units multiplier, per field, 0 - field is not available for the meter
+    char     descr[TSA_DESCR_LEN];  // TimeSeries description, null-terminated
+};
+
+struct record {
+    uint32_t current;
+    uint32_t power;
+    uint32_t energy;
+    uint16_t voltage;
+    uint16_t freq;
+    uint16_t pf;
+    uint16_t flags;         // TSA_VALID
+
+    // raw value of a field
+    uint32_t raw(field_t f) const {
+        switch (f){
+            case field_t::voltage : return voltage;
+            case field_t::current : return current;
+            case field_t::power : return power;
+            case field_t::energy : return energy;
+            case field_t::freq : return freq;
+            case field_t::pf : return pf;
+            default : return 0;
+        }
+    }
+};
+
+static_assert(sizeof(file_hdr) == 32, "tsarchive::file_hdr layout");
+static_assert(sizeof(tier_hdr) == 72, "tsarchive::tier_hdr layout");
+static_assert(sizeof(record) == 20, "tsarchive::record layout");
+
+// offset of the records for the tier following a tier at 'offset' with 'count' records
+inline uint64_t next_offset(uint64_t offset, uint32_t count){
+    uint64_t end = offset + static_cast<uint64_t>(count) * sizeof(record);
+    return (end + TSA_ALIGN - 1) / TSA_ALIGN * TSA_ALIGN;
+}
+
+// offset of the first tier records
+inline uint64_t data_offset(uint8_t ntiers){
+    return next_offset(sizeof(file_hdr) + static_cast<uint64_t>(ntiers) * sizeof(tier_hdr), 0);
+}
+
+} // namespace tsarchive
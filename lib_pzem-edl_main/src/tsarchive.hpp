@@ -0,0 +1,262 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include "tsarchive.h"
+#include "timeseries.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace tsarchive {
+
+/**
+ * @brief metrics to archive record mapping
+ * specialized for each meter metrics type
+ */
+template <class T>
+struct meter;
+
+template <>
+struct meter<pz004::metrics> {
+    static constexpr pzmbus::pzmodel_t model = pzmbus::pzmodel_t::pzem004v3;
+    static void scales(float *s){
+        s[field_t::voltage] = pz004::regmap::scale(pzmbus::meter_t::vol);
+        s[field_t::current] = pz004::regmap::scale(pzmbus::meter_t::cur);
+        s[field_t::power] = pz004::regmap::scale(pzmbus::meter_t::pwr);
+        s[field_t::energy] = pz004::regmap::scale(pzmbus::meter_t::enrg);
+        s[field_t::freq] = pz004::regmap::scale(pzmbus::meter_t::frq);
+        s[field_t::pf] = pz004::regmap::scale(pzmbus::meter_t::pf);
+    }
+    static void set(record &r, const pz004::metrics &m){
+        r = {m.current, m.power, m.energy, m.voltage, m.freq, m.pf, TSA_VALID};
+    }
+};
+
+template <>
+struct meter<pz003::metrics> {
+    static constexpr pzmbus::pzmodel_t model = pzmbus::pzmodel_t::pzem003;
+    static void scales(float *s){
+        s[field_t::voltage] = pz003::regmap::scale(pzmbus::meter_t::vol);
+        s[field_t::current] = pz003::regmap::scale(pzmbus::meter_t::cur);
+        s[field_t::power] = pz003::regmap::scale(pzmbus::meter_t::pwr);
+        s[field_t::energy] = pz003::regmap::scale(pzmbus::meter_t::enrg);
+        s[field_t::freq] = pz003::regmap::scale(pzmbus::meter_t::frq);
+        s[field_t::pf] = pz003::regmap::scale(pzmbus::meter_t::pf);
+    }
+    static void set(record &r, const pz003::metrics &m){
+        r = {m.current, m.power, m.energy, m.voltage, 0, 0, TSA_VALID};
+    }
+};
+
+/**
+ * @brief makes archive file out of TimeSeries windows
+ * Archive is generated on the fly by byte offset, i.e. to feed a web server response filler,
+ * no memory is allocated for the records. Sample windows are fixed when TimeSeries are added,
+ * samples overwritten in ring buffers while archive is being read are written as records without TSA_VALID flag,
+ * so file layout never changes.
+ *
+ * @tparam T - metrics type
+ */
+template <class T>
+class Writer {
+    struct tier {
+        const TimeSeries<T> *ts;
+        tier_hdr h;
+    };
+
+    file_hdr fh;
+    std::vector<tier> tiers;
+    std::vector<uint8_t> head;      // file and tier headers image, made on the first read()
+
+    // make record for sample k of tier t
+    void mkrecord(const tier &t, uint32_t k, record &r) const;
+
+    // add samples window [first, first + cnt) of a TimeSeries
+    bool window(const TimeSeries<T> *ts, uint32_t first, uint32_t cnt);
+
+public:
+    /**
+     * @param energy_offset - user energy counter offset to put in header, Wh
+     * @param now - archive creation time
+     */
+    explicit Writer(int32_t energy_offset = 0, uint32_t now = 0);
+
+    /**
+     * @brief add TimeSeries to the archive, must be called before the first read()
+     *
+     * @param ts - TimeSeries, must outlive the Writer
+     * @param cnt - archive last 'cnt' samples only, 0 - all samples
+     * @return true on success
+     */
+    bool add(const TimeSeries<T> *ts, uint32_t cnt = 0);
+
+    /**
+     * @brief add TimeSeries samples following the given sequence number, i.e. to resume fetching after the last sample received
+     * if the next sample after 'after_seq' is not in the buffer anymore, samples are taken from the oldest one,
+     * so the tier's first_seq shows how many samples were lost. If 'after_seq' is ahead of TimeSeries (it was reset),
+     * tier has no records and it's first_seq is the sequence number of the next sample to be pushed
+     *
+     * @param ts - TimeSeries, must outlive the Writer
+     * @param after_seq - sequence number of the last sample a client has
+     * @param cnt - archive first 'cnt' samples of the window only, 0 - all samples
+     * @return true on success
+     */
+    bool addAfter(const TimeSeries<T> *ts, uint32_t after_seq, uint32_t cnt = 0);
+
+    // number of tiers added
+    size_t tiersCount() const { return tiers.size(); }
+
+    // total archive size, bytes
+    uint64_t size() const { return fh.size; }
+
+    /**
+     * @brief read archive bytes
+     *
+     * @param dst - destination buffer
+     * @param len - buffer size
+     * @param index - archive offset
+     * @return size_t - number of bytes read, 0 at the end of archive
+     */
+    size_t read(uint8_t *dst, size_t len, size_t index);
+};
+
+
+//
+//  ===== Implementation follows below =====
+
+template <class T>
+Writer<T>::Writer(int32_t energy_offset, uint32_t now){
+    fh = {TSA_MAGIC, TSA_VERSION, sizeof(file_hdr), sizeof(tier_hdr), sizeof(record),
+          static_cast<uint8_t>(meter<T>::model), 0, 0, energy_offset, now, data_offset(0)};
+}
+
+template <class T>
+bool Writer<T>::add(const TimeSeries<T> *ts, uint32_t cnt){
+    if (!ts)
+        return false;
+    uint32_t size = ts->getSize();
+    if (cnt && cnt < size)
+        size = cnt;
+    return window(ts, ts->getSeq() - size, size);
+}
+
+template <class T>
+bool Writer<T>::addAfter(const TimeSeries<T> *ts, uint32_t after_seq, uint32_t cnt){
+    if (!ts)
+        return false;
+    uint32_t next = ts->getSeq();
+    uint32_t first = after_seq + 1;
+    uint32_t oldest = next - ts->getSize();
+    if (static_cast<int32_t>(first - next) > 0)
+        first = next;           // client is ahead, series has been reset
+    else if (static_cast<int32_t>(first - oldest) < 0)
+        first = oldest;         // samples are lost
+    uint32_t size = next - first;
+    if (cnt && cnt < size)
+        size = cnt;
+    return window(ts, first, size);
+}
+
+template <class T>
+bool Writer<T>::window(const TimeSeries<T> *ts, uint32_t first, uint32_t cnt){
+    if (!head.empty() || tiers.size() == UINT8_MAX)
+        return false;
+
+    tier t{ts, {}};
+    t.h.id = ts->id;
+    t.h.interval = ts->getInterval();
+    t.h.count = cnt;
+    t.h.first_seq = first;
+    // timestamp of a sample is 'getTstamp() - (getSeq() - seq) * getInterval()'
+    t.h.base_time = ts->getTstamp() - (ts->getSeq() - first) * ts->getInterval();
+    t.h.capacity = ts->capacity;
+    meter<T>::scales(t.h.scale);
+    if (ts->getDescr())
+        strncpy(t.h.descr, ts->getDescr(), sizeof(t.h.descr) - 1);
+    tiers.push_back(t);
+
+    // lay out tiers data
+    fh.ntiers = tiers.size();
+    uint64_t offset = data_offset(fh.ntiers);
+    for (auto &i : tiers){
+        i.h.offset = offset;
+        offset = next_offset(offset, i.h.count);
+    }
+    fh.size = offset;
+    return true;
+}
+
+template <class T>
+void Writer<T>::mkrecord(const tier &t, uint32_t k, record &r) const {
+    const TimeSeries<T> *ts = t.ts;
+    uint32_t seq = t.h.first_seq + k;
+    uint32_t oldest = ts->getSeq() - ts->getSize();
+    // sample must still be in the buffer and keep it's time mark, i.e. series was not cleared or re-intervaled
+    if (static_cast<int32_t>(seq - oldest) < 0 || static_cast<int32_t>(ts->getSeq() - seq) <= 0 || ts->getInterval() != t.h.interval ||
+        ts->getTstamp() - (ts->getSeq() - seq) * t.h.interval != t.h.base_time + k * t.h.interval){
+        r = {};
+        return;
+    }
+    const T *m = ts->at(seq - oldest);
+    if (m)
+        meter<T>::set(r, *m);
+    else
+        r = {};
+}
+
+template <class T>
+size_t Writer<T>::read(uint8_t *dst, size_t len, size_t index){
+    if (head.empty()){
+        head.resize(data_offset(fh.ntiers));
+        memcpy(head.data(), &fh, sizeof(fh));
+        for (size_t i = 0; i != tiers.size(); ++i)
+            memcpy(head.data() + sizeof(fh) + i * sizeof(tier_hdr), &tiers[i].h, sizeof(tier_hdr));
+    }
+
+    size_t done = 0;
+    while (done != len && index < fh.size){
+        // headers
+        if (index < head.size()){
+            size_t n = std::min(len - done, head.size() - index);
+            memcpy(dst + done, head.data() + index, n);
+            done += n;
+            index += n;
+            continue;
+        }
+
+        // records, tier data blocks are sorted by offset
+        auto t = std::find_if(tiers.cbegin(), tiers.cend(), [index](const tier &i){ return index < next_offset(i.h.offset, i.h.count); });
+        if (t == tiers.cend())
+            break;
+        uint64_t pos = index - t->h.offset;
+        uint32_t k = pos / sizeof(record);
+        if (k >= t->h.count){
+            // alignment padding
+            size_t n = std::min<uint64_t>(len - done, next_offset(t->h.offset, t->h.count) - index);
+            memset(dst + done, 0, n);
+            done += n;
+            index += n;
+            continue;
+        }
+        record r;
+        mkrecord(*t, k, r);
+        size_t roff = pos % sizeof(record);
+        size_t n = std::min(len - done, sizeof(record) - roff);
+        memcpy(dst + done, reinterpret_cast<const uint8_t*>(&r) + roff, n);
+        done += n;
+        index += n;
+    }
+    return done;
+}
+
+} // namespace tsarchive
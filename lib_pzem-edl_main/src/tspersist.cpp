@@ -0,0 +1,129 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "tspersist.hpp"
+#include "modbus_crc16.h"
+#include <unistd.h>
+
+#define TSPERSIST_SEG_MAGIC     0x4c53545a      // 'ZTSL'
+#define TSPERSIST_REC_MAGIC     0x525a          // 'ZR'
+#define TSPERSIST_VER           1
+#define TSPERSIST_SCRATCH       64              // scratch buffer for payload parts that are not loaded, bytes
+
+namespace tspersist {
+
+bool write_seghdr(FILE *f, uint32_t gen, uint16_t esize){
+    seg_hdr h{TSPERSIST_SEG_MAGIC, TSPERSIST_VER, esize, gen, 0, 0};
+    h.crc = modbus::crc16(reinterpret_cast<const uint8_t*>(&h), sizeof(h) - sizeof(h.crc));
+    return fwrite(&h, sizeof(h), 1, f) == 1;
+}
+
+bool read_seghdr(FILE *f, seg_hdr &h, uint16_t esize){
+    if (fseek(f, 0, SEEK_SET) || fread(&h, sizeof(h), 1, f) != 1)
+        return false;
+    return h.magic == TSPERSIST_SEG_MAGIC && h.ver == TSPERSIST_VER && h.esize == esize && h.gen &&
+        h.crc == modbus::crc16(reinterpret_cast<const uint8_t*>(&h), sizeof(h) - sizeof(h.crc));
+}
+
+size_t write_rec(FILE *f, rec_t type, uint8_t tsid, uint32_t interval, uint32_t seq, uint32_t tstamp, uint16_t esize, chunk a, chunk b){
+    size_t count = a.count + b.count;
+    if (!f || count * esize > UINT16_MAX)
+        return 0;
+
+    rec_hdr h{TSPERSIST_REC_MAGIC, type, tsid, static_cast<uint16_t>(count), 0, interval, seq, tstamp, 0};
+    uint16_t crc = modbus::crc16(static_cast<const uint8_t*>(a.data), a.count * esize);
+    h.pcrc = modbus::crc16(static_cast<const uint8_t*>(b.data), b.count * esize, crc);
+    h.hcrc = modbus::crc16(reinterpret_cast<const uint8_t*>(&h), sizeof(h) - sizeof(h.hcrc));
+
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+        return 0;
+    if (a.count && fwrite(a.data, esize, a.count, f) != a.count)
+        return 0;
+    if (b.count && fwrite(b.data, esize, b.count, f) != b.count)
+        return 0;
+    return sizeof(h) + count * esize;
+}
+
+size_t scan(FILE *f, uint8_t seg, uint32_t gen, uint16_t esize, long fsize, std::function<void (const rec_ref &r)> cb){
+    size_t bad = 0;
+    long pos = sizeof(seg_hdr);
+    rec_ref r;
+    r.gen = gen;
+    r.seg = seg;
+
+    while (pos + static_cast<long>(sizeof(rec_hdr)) <= fsize){
+        if (fseek(f, pos, SEEK_SET) || fread(&r.h, sizeof(r.h), 1, f) != 1)
+            break;
+
+        long next = pos + sizeof(rec_hdr) + r.h.count * esize;
+        if (r.h.magic == TSPERSIST_REC_MAGIC && (r.h.type == rec_t::block || r.h.type == rec_t::head) && next <= fsize &&
+            r.h.hcrc == modbus::crc16(reinterpret_cast<const uint8_t*>(&r.h), sizeof(r.h) - sizeof(r.h.hcrc))){
+            r.offset = pos + sizeof(rec_hdr);
+            cb(r);
+            pos = next;
+            continue;
+        }
+
+        // torn or damaged record, look for the next record magic
+        ++bad;
+        if (fseek(f, ++pos, SEEK_SET))
+            break;
+        int c, prev = -1;
+        while ((c = fgetc(f)) != EOF){
+            if (prev == (TSPERSIST_REC_MAGIC & 0xff) && c == (TSPERSIST_REC_MAGIC >> 8))
+                break;
+            prev = c;
+            ++pos;
+        }
+        if (c == EOF)
+            break;
+        --pos;      // points to the first magic byte
+    }
+    return bad;
+}
+
+bool load(FILE *f, const rec_ref &r, uint16_t esize, uint32_t from, uint32_t to, void *dst){
+    if (!f || from < r.h.seq || to > r.end() || from > to || fseek(f, r.offset, SEEK_SET))
+        return false;
+
+    uint16_t crc = 0xffff;
+    // skip samples below 'from', to a scratch buffer to keep crc going
+    auto skip = [f, &crc](size_t len){
+        uint8_t buff[TSPERSIST_SCRATCH];
+        while (len){
+            size_t n = len < sizeof(buff) ? len : sizeof(buff);
+            if (fread(buff, 1, n, f) != n)
+                return false;
+            crc = modbus::crc16(buff, n, crc);
+            len -= n;
+        }
+        return true;
+    };
+
+    size_t len = (to - from) * esize;
+    if (!skip((from - r.h.seq) * esize) || fread(dst, 1, len, f) != len)
+        return false;
+    crc = modbus::crc16(static_cast<const uint8_t*>(dst), len, crc);
+    if (!skip((r.end() - to) * esize))
+        return false;
+    return crc == r.h.pcrc;
+}
+
+std::string segname(const std::string &path, uint8_t idx){
+    return path + '.' + std::to_string(idx);
+}
+
+bool flush(FILE *f){
+    return f && !fflush(f) && !fsync(fileno(f));
+}
+
+} // namespace tspersist
@@ -0,0 +1,622 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2021
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+#include "timeseries.hpp"
+#include "esp_timer.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifndef TSPERSIST_SEGMENTS
+#define TSPERSIST_SEGMENTS      4               // number of log segment files, oldest one is reused when current is full
+#endif
+#ifndef TSPERSIST_SEG_SIZE
+#define TSPERSIST_SEG_SIZE      (64*1024)       // log segment size, bytes (soft limit)
+#endif
+#ifndef TSPERSIST_BLOCK
+#define TSPERSIST_BLOCK         32              // number of samples in a sealed block
+#endif
+#ifndef TSPERSIST_SNAPSHOT
+#define TSPERSIST_SNAPSHOT      60              // head snapshot period, sec
+#endif
+#ifndef TSPERSIST_MAX_TIERS
+#define TSPERSIST_MAX_TIERS     4               // max number of TimeSeries persisted per container
+#endif
+
+/*
+ * Log layout
+ * Log is a set of TSPERSIST_SEGMENTS files '<path>.0'...'<path>.N', each one starts with a segment header
+ * followed by records. Records are only appended. When current segment is full, the oldest one is truncated
+ * and reused, so flash writes are spread evenly over the files (LittleFS adds block-level wear leveling on top).
+ *
+ * Two types of records are written:
+ *  - block: a sealed run of TSPERSIST_BLOCK samples of a TimeSeries, written once the last sample is pushed
+ *  - head: samples pushed after the last sealed block, written periodically and on end()
+ *
+ * Each record carries TimeSeries id, interval, sequence number of the first sample and time mark of the last one,
+ * header and payload are protected by crc16, so a torn write is detected and skipped on restore.
+ * Samples are stored as raw bytes of T in native byte order, same as they are kept in RingBuff memory.
+ * Blocks still needed by a TimeSeries are copied from RAM to the current segment before the oldest segment
+ * gets truncated, so that history is never kept in RAM only.
+ *
+ * Restore reads record headers only, then loads payloads of the newest consecutive blocks straight into
+ * TimeSeries ring buffer memory.
+ */
+
+namespace tspersist {
+
+enum class rec_t : uint8_t {
+    block = 1,      // sealed block of samples
+    head            // unsealed samples snapshot
+};
+
+struct __attribute__((packed)) seg_hdr {
+    uint32_t magic;
+    uint16_t ver;
+    uint16_t esize;         // sizeof(T)
+    uint32_t gen;           // segment generation, increments on each reuse
+    uint16_t reserved;
+    uint16_t crc;
+};
+
+struct __attribute__((packed)) rec_hdr {
+    uint16_t magic;
+    rec_t    type;
+    uint8_t  tsid;          // TimeSeries id
+    uint16_t count;         // number of samples
+    uint16_t pcrc;          // payload crc16
+    uint32_t interval;      // TimeSeries interval
+    uint32_t seq;           // sequence number of the first sample
+    uint32_t tstamp;        // time mark of the last sample
+    uint16_t hcrc;          // header crc16
+};
+
+// record found in log while scanning
+struct rec_ref {
+    rec_hdr h;
+    uint32_t gen;           // segment generation
+    uint32_t offset;        // payload offset in segment file
+    uint8_t seg;            // segment index
+
+    uint32_t end() const { return h.seq + h.count; }
+};
+
+// range of sample sequence numbers [first, end)
+struct span {
+    uint32_t first = 0;
+    uint32_t end = 0;
+
+    bool empty() const { return first == end; }
+    void add(uint32_t f, uint32_t e){
+        if (empty()){ first = f; end = e; return; }
+        if (f < first) first = f;
+        if (e > end) end = e;
+    }
+};
+
+// pointer to a run of samples in RingBuff storage
+struct chunk {
+    const void *data;
+    size_t count;
+};
+
+/**
+ * @brief write segment header to a truncated file
+ */
+bool write_seghdr(FILE *f, uint32_t gen, uint16_t esize);
+
+/**
+ * @brief read and validate segment header
+ * @return false if header is missing, damaged or written for a different sample size
+ */
+bool read_seghdr(FILE *f, seg_hdr &h, uint16_t esize);
+
+/**
+ * @brief append a record to the file
+ * payload is provided as up to two chunks, as samples might wrap around RingBuff storage
+ *
+ * @return size_t - number of bytes written, 0 on error
+ */
+size_t write_rec(FILE *f, rec_t type, uint8_t tsid, uint32_t interval, uint32_t seq, uint32_t tstamp, uint16_t esize, chunk a, chunk b);
+
+/**
+ * @brief scan segment file for records, calls f() for each valid record header
+ * damaged records are skipped, scan resyncs on the next valid header
+ *
+ * @param fsize - file size
+ * @return size_t - number of damaged records/areas skipped
+ */
+size_t scan(FILE *f, uint8_t seg, uint32_t gen, uint16_t esize, long fsize, std::function<void (const rec_ref &r)> cb);
+
+/**
+ * @brief read samples [from, to) of a record payload into dst, crc is checked over the whole payload
+ * samples outside of the requested range are read to a scratch buffer
+ *
+ * @return true if samples were read and crc matches
+ */
+bool load(FILE *f, const rec_ref &r, uint16_t esize, uint32_t from, uint32_t to, void *dst);
+
+// make segment file name '<path>.<idx>'
+std::string segname(const std::string &path, uint8_t idx);
+
+// sync file data to storage
+bool flush(FILE *f);
+
+} // namespace tspersist
+
+
+struct TSPersist_stats {
+    uint32_t blocks = 0;        // sealed blocks written
+    uint32_t heads = 0;         // head snapshots written
+    uint32_t carried = 0;       // blocks copied over on segment reuse
+    uint32_t rotations = 0;     // segments reused
+    uint32_t wr_errors = 0;     // write failures
+    uint32_t bad_records = 0;   // damaged records/areas found on restore
+    uint32_t restored = 0;      // samples restored by the last begin()
+    uint32_t restore_us = 0;    // restore time, us
+};
+
+
+/**
+ * @brief crash-safe persistence for TSContainer tiers
+ * Sealed blocks and head snapshots are appended to a log on a filesystem, any that supports stdio,
+ * i.e. LittleFS mounted via VFS on ESP32 (path like "/littlefs/tslog") or a plain file on Linux.
+ * Log is not thread-safe, sync() must be called from the same task that pushes samples to the container.
+ *
+ * @tparam T - TimeSeries data type
+ */
+template <typename T>
+class TSPersist {
+    static_assert(TSPERSIST_SEGMENTS > 1, "TSPERSIST_SEGMENTS must be 2 at least");
+
+    struct tier {
+        uint8_t id = 0;             // TimeSeries id, 0 - unused slot
+        uint32_t sealed = 0;        // samples below this seq are in sealed blocks
+        uint32_t snap_seq = 0;      // seq of the last head snapshot
+    };
+
+    struct segment {
+        uint32_t gen = 0;           // 0 - segment does not exist
+        long size = 0;
+        tspersist::span blk[TSPERSIST_MAX_TIERS];   // sealed samples stored in segment, per tier
+    };
+
+    TSContainer<T> &c;
+    std::string path;
+    size_t seg_size;
+    uint16_t blk_len;
+    uint32_t snap_period;           // us
+    int64_t last_snap = 0;
+    FILE *f = nullptr;              // current segment
+    uint8_t cur = 0;
+    tier tiers[TSPERSIST_MAX_TIERS];
+    segment segs[TSPERSIST_SEGMENTS];
+    TSPersist_stats stats;
+
+    // make a chunk pair for samples [from, to) of a TimeSeries
+    void chunks(const TimeSeries<T> *ts, uint32_t from, uint32_t to, tspersist::chunk &a, tspersist::chunk &b) const;
+
+    // write a record for samples [from, to) to current segment
+    bool write(tspersist::rec_t type, const TimeSeries<T> *ts, uint8_t slot, uint32_t from, uint32_t to);
+
+    // restore single TimeSeries from scanned records
+    void restore(TimeSeries<T> *ts, uint8_t slot, std::vector<tspersist::rec_ref> &recs, FILE **files);
+
+    // the oldest or a missing segment, to be reused next
+    uint8_t oldest() const;
+
+    // live samples range to be carried over from a segment for a tier
+    void carry_range(uint8_t seg, uint8_t slot, uint32_t &from, uint32_t &to) const;
+
+    // current segment has no room left for new records and blocks carried over on rotation
+    bool full() const;
+
+    // reuse the oldest segment as a new current one
+    bool rotate();
+
+    // write head snapshots for all tiers
+    void snapshot_heads(bool force);
+
+public:
+    /**
+     * @brief Construct a new TSPersist object
+     *
+     * @param container - TimeSeries container to persist, must outlive TSPersist
+     * @param _path - log files path prefix
+     * @param _seg_size - log segment size
+     * @param block - samples per sealed block
+     */
+    TSPersist(TSContainer<T> &container, const char *_path, size_t _seg_size = TSPERSIST_SEG_SIZE, uint16_t block = TSPERSIST_BLOCK)
+        : c(container), path(_path), seg_size(_seg_size), blk_len(block ? block : 1), snap_period(TSPERSIST_SNAPSHOT * 1000000UL) {}
+
+    ~TSPersist(){ end(); }
+
+    // Copy semantics : forbidden
+    TSPersist(const TSPersist&) = delete;
+    TSPersist& operator=(const TSPersist&) = delete;
+
+    /**
+     * @brief restore container tiers from the log and open log for writing
+     * must be called after all TimeSeries are added to the container, and again each time tiers are recreated.
+     * Each tier is restored from records with matching id and interval, records for other tiers are left to expire
+     *
+     * @return true if log is ready for writing
+     */
+    bool begin();
+
+    /**
+     * @brief write sealed blocks and a periodic head snapshot
+     * call after samples are pushed to the container
+     */
+    void sync();
+
+    /**
+     * @brief write head snapshots now, i.e. before a planned restart
+     */
+    void snapshot(){ if (f) snapshot_heads(true); }
+
+    /**
+     * @brief write head snapshots and close log
+     */
+    void end();
+
+    /**
+     * @brief remove log files
+     * log is closed, begin() must be called to start a new one
+     */
+    void erase();
+
+    /**
+     * @brief set head snapshot period
+     * samples pushed after the last sealed block and the last snapshot are lost on power failure
+     *
+     * @param sec - period, sec
+     */
+    void setSnapshotPeriod(uint32_t sec){ snap_period = sec * 1000000UL; }
+
+    bool active() const { return f; }
+
+    const TSPersist_stats& getStats() const { return stats; }
+};
+
+
+//
+//  ===== Implementation follows below =====
+
+template <typename T>
+void TSPersist<T>::chunks(const TimeSeries<T> *ts, uint32_t from, uint32_t to, tspersist::chunk &a, tspersist::chunk &b) const {
+    a = {nullptr, 0};
+    b = {nullptr, 0};
+    if (from == to)
+        return;
+    const T *p = ts->at(from - (ts->getSeq() - ts->getSize()));
+    size_t idx = p - ts->storage();
+    size_t n = to - from;
+    a = {p, std::min(n, ts->capacity - idx)};
+    if (a.count != n)
+        b = {ts->storage(), n - a.count};
+}
+
+template <typename T>
+bool TSPersist<T>::write(tspersist::rec_t type, const TimeSeries<T> *ts, uint8_t slot, uint32_t from, uint32_t to) {
+    tspersist::chunk a, b;
+    chunks(ts, from, to, a, b);
+    uint32_t t = ts->getTstamp() - (ts->getSeq() - to) * ts->getInterval();
+    size_t len = tspersist::write_rec(f, type, ts->id, ts->getInterval(), from, t, sizeof(T), a, b);
+    if (!len){
+        ++stats.wr_errors;
+        return false;
+    }
+    segs[cur].size += len;
+    if (type == tspersist::rec_t::block)
+        segs[cur].blk[slot].add(from, to);
+    return true;
+}
+
+template <typename T>
+bool TSPersist<T>::begin() {
+    end();
+    int64_t t0 = esp_timer_get_time();
+    stats.restored = 0;
+
+    // assign tier slots
+    for (auto &t : tiers)
+        t = tier();
+    size_t n = 0;
+    c.foreach([this, &n](TimeSeries<T> &ts){
+        if (n != TSPERSIST_MAX_TIERS)
+            tiers[n++].id = ts.id;
+    });
+
+    // scan segments
+    FILE *files[TSPERSIST_SEGMENTS] = {};
+    std::vector<tspersist::rec_ref> recs;
+    for (uint8_t i = 0; i != TSPERSIST_SEGMENTS; ++i){
+        segs[i] = segment();
+        files[i] = fopen(tspersist::segname(path, i).c_str(), "rb");
+        if (!files[i])
+            continue;
+        tspersist::seg_hdr h;
+        if (!tspersist::read_seghdr(files[i], h, sizeof(T))){
+            fclose(files[i]);
+            files[i] = nullptr;
+            continue;
+        }
+        fseek(files[i], 0, SEEK_END);
+        segs[i].gen = h.gen;
+        segs[i].size = ftell(files[i]);
+        stats.bad_records += tspersist::scan(files[i], i, h.gen, sizeof(T), segs[i].size, [this, &recs](const tspersist::rec_ref &r){
+            recs.push_back(r);
+        });
+    }
+
+    // restore tiers
+    for (uint8_t s = 0; s != TSPERSIST_MAX_TIERS && tiers[s].id; ++s){
+        auto ts = c.getTS(tiers[s].id);
+        restore(ts, s, recs, files);
+        tiers[s].sealed = ts->getSeq() - ts->getSize();
+        // sealed blocks stored in segments
+        for (const auto &r : recs){
+            if (r.h.type == tspersist::rec_t::block && r.h.tsid == ts->id && r.h.interval == ts->getInterval()){
+                segs[r.seg].blk[s].add(r.h.seq, r.end());
+                if (r.end() > tiers[s].sealed && r.end() <= ts->getSeq())
+                    tiers[s].sealed = r.end();
+            }
+        }
+        tiers[s].snap_seq = ts->getSeq();
+    }
+    for (auto &fh : files){
+        if (fh)
+            fclose(fh);
+    }
+    recs.clear();
+    recs.shrink_to_fit();
+    stats.restore_us = esp_timer_get_time() - t0;
+
+    // continue with the newest segment, it is only used to carry over live blocks before the oldest one is reused
+    uint8_t newest = 0;
+    for (uint8_t i = 1; i != TSPERSIST_SEGMENTS; ++i){
+        if (segs[i].gen > segs[newest].gen)
+            newest = i;
+    }
+    if (segs[newest].gen){
+        f = fopen(tspersist::segname(path, newest).c_str(), "ab");
+        cur = newest;
+    }
+    last_snap = esp_timer_get_time();
+    return rotate();
+}
+
+template <typename T>
+void TSPersist<T>::restore(TimeSeries<T> *ts, uint8_t slot, std::vector<tspersist::rec_ref> &recs, FILE **files) {
+    // records for this tier, sealed blocks and head snapshots
+    std::vector<tspersist::rec_ref> mine;
+    auto newer = [](const tspersist::rec_ref &a, const tspersist::rec_ref &b){
+        return a.gen != b.gen ? a.gen > b.gen : a.offset > b.offset;
+    };
+    for (const auto &r : recs){
+        if (r.h.tsid == ts->id && r.h.interval == ts->getInterval())
+            mine.push_back(r);
+    }
+    if (mine.empty())
+        return;
+
+    // newest samples first, duplicates with the same end - the most recently written first
+    std::sort(mine.begin(), mine.end(), [&newer](const tspersist::rec_ref &a, const tspersist::rec_ref &b){
+        return a.end() != b.end() ? a.end() > b.end() : newer(a, b);
+    });
+
+    // the newest record is either a block or the head snapshot, it gives time mark of the newest sample
+    const uint32_t top = mine.front().end();
+    const uint32_t tstamp = mine.front().h.tstamp;
+    T *dst = ts->storage();
+    if (!dst || !ts->capacity){
+        // no memory for samples, keep sequence numbers going
+        ts->restore(0, 0, top, tstamp);
+        return;
+    }
+
+    // load consecutive runs of samples going back from the newest one, seq 's' goes to dst[s - first]
+    uint32_t end = top;
+    uint32_t first = end - std::min<uint32_t>(end, ts->capacity);
+    uint32_t cursor = end;
+    for (const auto &r : mine){
+        if (r.h.tstamp != tstamp - (top - r.end()) * ts->getInterval())
+            continue;                               // samples from before the series was cleared
+        if (cursor == end && r.end() < end){
+            // newer records are damaged, start from this one, so that they lose only their own samples
+            end = cursor = r.end();
+            first = end - std::min<uint32_t>(end, ts->capacity);
+        }
+        if (cursor == first || r.end() < cursor)
+            break;                                  // done or a gap in history
+        if (r.h.seq >= cursor)
+            continue;                               // already loaded
+        uint32_t from = std::max(r.h.seq, first);
+        if (!tspersist::load(files[r.seg], r, sizeof(T), from, cursor, dst + (from - first))){
+            ++stats.bad_records;
+            continue;
+        }
+        cursor = from;
+    }
+
+    if (cursor == end){
+        // nothing could be loaded
+        ts->restore(0, 0, top, tstamp);
+        return;
+    }
+    ts->restore(cursor - first, end - cursor, end, tstamp - (top - end) * ts->getInterval());
+    stats.restored += end - cursor;
+}
+
+template <typename T>
+uint8_t TSPersist<T>::oldest() const {
+    uint8_t next = 0;
+    for (uint8_t i = 1; i != TSPERSIST_SEGMENTS; ++i){
+        if (segs[i].gen < segs[next].gen)
+            next = i;
+    }
+    return next;
+}
+
+template <typename T>
+void TSPersist<T>::carry_range(uint8_t seg, uint8_t slot, uint32_t &from, uint32_t &to) const {
+    const auto &blk = segs[seg].blk[slot];
+    const auto ts = c.getTS(tiers[slot].id);
+    from = to = 0;
+    if (blk.empty() || !ts)
+        return;
+    from = std::max(blk.first, ts->getSeq() - ts->getSize());
+    to = std::max(from, std::min(blk.end, tiers[slot].sealed));
+}
+
+template <typename T>
+bool TSPersist<T>::full() const {
+    // reserve room for the blocks that would be carried over from the segment reused next
+    size_t reserve = 0;
+    uint8_t next = oldest();
+    for (uint8_t s = 0; s != TSPERSIST_MAX_TIERS && tiers[s].id; ++s){
+        uint32_t from, to;
+        carry_range(next, s, from, to);
+        reserve += (to - from) * sizeof(T) + (to - from + blk_len - 1) / blk_len * sizeof(tspersist::rec_hdr);
+    }
+    // at least half a segment is used for new records, so that a large carry over does not make segments rotate on each write
+    size_t used = segs[cur].size;
+    return used >= seg_size / 2 && used + reserve >= seg_size;
+}
+
+template <typename T>
+bool TSPersist<T>::rotate() {
+    uint8_t next = oldest();
+    uint32_t gen = 0;
+    for (const auto &sg : segs)
+        gen = std::max(gen, sg.gen);
+    if (f && next == cur){
+        ++stats.wr_errors;
+        return false;
+    }
+
+    // carry over sealed blocks that are still in TimeSeries, a block is kept in one segment only,
+    // so it is written again only when it's segment is about to be reused
+    bool carried = false;
+    for (uint8_t s = 0; f && s != TSPERSIST_MAX_TIERS && tiers[s].id; ++s){
+        const auto ts = c.getTS(tiers[s].id);
+        uint32_t from, to;
+        carry_range(next, s, from, to);
+        for (; from < to; from += std::min<uint32_t>(blk_len, to - from)){
+            if (!write(tspersist::rec_t::block, ts, s, from, from + std::min<uint32_t>(blk_len, to - from)))
+                return false;
+            ++stats.carried;
+            carried = true;
+        }
+    }
+    if (carried && !tspersist::flush(f)){
+        ++stats.wr_errors;
+        return false;
+    }
+
+    if (f)
+        fclose(f);
+    f = fopen(tspersist::segname(path, next).c_str(), "wb");
+    segs[next] = segment();
+    if (!f || !tspersist::write_seghdr(f, gen + 1, sizeof(T)) || !tspersist::flush(f)){
+        ++stats.wr_errors;
+        if (f)
+            fclose(f);
+        f = nullptr;
+        return false;
+    }
+    cur = next;
+    segs[cur].gen = gen + 1;
+    segs[cur].size = sizeof(tspersist::seg_hdr);
+    ++stats.rotations;
+
+    // latest heads must survive until this segment is reused
+    snapshot_heads(true);
+    return f;
+}
+
+template <typename T>
+void TSPersist<T>::snapshot_heads(bool force) {
+    bool written = false;
+    for (uint8_t s = 0; s != TSPERSIST_MAX_TIERS && tiers[s].id; ++s){
+        const auto ts = c.getTS(tiers[s].id);
+        if (!ts || (!force && tiers[s].snap_seq == ts->getSeq()))
+            continue;
+        uint32_t from = std::max(tiers[s].sealed, ts->getSeq() - ts->getSize());
+        if (!write(tspersist::rec_t::head, ts, s, from, ts->getSeq()))
+            return;
+        tiers[s].snap_seq = ts->getSeq();
+        ++stats.heads;
+        written = true;
+    }
+    if (written && !tspersist::flush(f))
+        ++stats.wr_errors;
+    last_snap = esp_timer_get_time();
+}
+
+template <typename T>
+void TSPersist<T>::sync() {
+    if (!f)
+        return;
+
+    bool written = false;
+    for (uint8_t s = 0; s != TSPERSIST_MAX_TIERS && tiers[s].id; ++s){
+        const auto ts = c.getTS(tiers[s].id);
+        if (!ts)
+            continue;
+        auto &t = tiers[s];
+        // samples dropped from the series before being sealed, i.e. it was cleared
+        if (ts->getSeq() - t.sealed > static_cast<uint32_t>(ts->getSize()))
+            t.sealed = ts->getSeq() - ts->getSize();
+        while (ts->getSeq() - t.sealed >= blk_len){
+            if (full() && !rotate())
+                return;
+            if (!write(tspersist::rec_t::block, ts, s, t.sealed, t.sealed + blk_len))
+                return;
+            t.sealed += blk_len;
+            ++stats.blocks;
+            written = true;
+        }
+    }
+    if (written && !tspersist::flush(f))
+        ++stats.wr_errors;
+
+    if (esp_timer_get_time() - last_snap >= snap_period){
+        if (full() && !rotate())
+            return;
+        snapshot_heads(false);
+    }
+}
+
+template <typename T>
+void TSPersist<T>::end() {
+    if (!f)
+        return;
+    snapshot_heads(false);
+    fclose(f);
+    f = nullptr;
+}
+
+template <typename T>
+void TSPersist<T>::erase() {
+    if (f){
+        fclose(f);
+        f = nullptr;
+    }
+    for (uint8_t i = 0; i != TSPERSIST_SEGMENTS; ++i){
+        remove(tspersist::segname(path, i).c_str());
+        segs[i] = segment();
+    }
+}
@@ -26,4 +26,37 @@ CREATE TABLE `data` (
 
 CREATE INDEX dtime ON data (dtime);
 
+--
+-- Rollup tables, maintained by collector/pzcollect on ingest and used by stat reports
+-- 'pzcollect --db <file> --rebuild-rollups' fills them from `data` table
+--
+
+-- `hour` is the start of the local hour, UTC like `dtime`
+CREATE TABLE IF NOT EXISTS `data_hourly` (
+  `devid` INT       NOT NULL references meters(id),
+  `hour` timestamp  NOT NULL,
+  `cnt` INT         NOT NULL,   -- number of samples
+  `sumP` REAL       NOT NULL,   -- SUM(P)
+  `maxP` REAL       NOT NULL,   -- MAX(P)
+  `sumPF` REAL      NOT NULL,   -- SUM(P/(U*I))
+  `cntPF` INT       NOT NULL,   -- COUNT(P/(U*I))
+  `minW` INT        NOT NULL,   -- MIN(W)
+  `maxW` INT        NOT NULL,   -- MAX(W)
+  PRIMARY KEY (`devid`, `hour`)
+);
+
+-- `date` is the local date, like DATE(dtime, 'localtime')
+CREATE TABLE IF NOT EXISTS `data_daily` (
+  `devid` INT       NOT NULL references meters(id),
+  `date` TEXT       NOT NULL,
+  `cnt` INT         NOT NULL,
+  `sumP` REAL       NOT NULL,
+  `maxP` REAL       NOT NULL,
+  `sumPF` REAL      NOT NULL,
+  `cntPF` INT       NOT NULL,
+  `minW` INT        NOT NULL,
+  `maxW` INT        NOT NULL,
+  PRIMARY KEY (`devid`, `date`)
+);
+
 INSERT INTO meters VALUES ('1','MainMeter', 'Default PowerMeter', 'esp-pzem01');
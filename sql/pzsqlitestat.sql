@@ -1,3 +1,6 @@
+-- Stat queries read hourly/daily rollup tables, same as www/inc/sqlite.reqs.php
+-- day hours are 7:00-22:00, devid='1'
+
 /*
 SELECT
     allday.date AS 'date',
@@ -12,27 +15,26 @@ SELECT
     allday.AvgpF AS PF
 FROM
     ( SELECT
-        DATE(dtime, 'localtime') AS 'date',
-        ROUND( (cast(MAX(W) as real)- MIN(W))/1000,2 ) AS Energy,
-        ROUND(cast (MAX(P) as real)/1000,2) AS `MaxP`,
-        ROUND(AVG(P)) AS `AvgP`,
-        ROUND(100*AVG(p/(U*I)),1) as `AvgpF`
-        FROM data
+        date,
+        ROUND( (cast(maxW as real) - minW)/1000,2 ) AS Energy,
+        ROUND( maxP/1000,2 ) AS `MaxP`,
+        ROUND( sumP/cnt ) AS `AvgP`,
+        ROUND( 100*sumPF/cntPF,1 ) as `AvgpF`
+        FROM data_daily
         WHERE devid='1'
-            AND DATETIME(dtime, 'localtime') > DATE('now', '-1 MONTH', 'localtime')
-        GROUP by DATE(dtime, 'localtime')
+            AND date >= DATE('now', '-1 MONTH', 'localtime')
      ) allday
 LEFT JOIN
     ( SELECT
-        DATE(dtime, 'localtime') AS 'date',
-        ROUND( (cast(MAX(W) as real)- MIN(W))/1000,2 ) AS Energy,
-        ROUND(AVG(P)) AS `AvgP`,
-        ROUND(100*AVG(p/(U*I)),1) as `AvgpF`
-      FROM data
+        DATE(hour, 'localtime') AS 'date',
+        ROUND( (cast(MAX(maxW) as real) - MIN(minW))/1000,2 ) AS Energy,
+        ROUND( SUM(sumP)/SUM(cnt) ) AS `AvgP`,
+        ROUND( 100*SUM(sumPF)/SUM(cntPF),1 ) as `AvgpF`
+      FROM data_hourly
         WHERE devid='1'
-            AND DATETIME(dtime, 'localtime') > DATE('now', '-1 MONTH')
-            AND ( cast(strftime('%H', dtime, 'localtime') as int) > 7 OR cast( strftime('%H', dtime, 'localtime') as int) < 22)
-        GROUP by DATE(dtime, 'localtime')
+            AND DATETIME(hour, 'localtime') > DATE('now', '-1 MONTH')
+            AND ( cast(strftime('%H', hour, 'localtime') as int) > 7 OR cast( strftime('%H', hour, 'localtime') as int) < 22)
+        GROUP by DATE(hour, 'localtime')
     ) dayt
 ON allday.date = dayt.date
 ORDER by date DESC;
@@ -55,16 +57,16 @@ SELECT
     allday.AvgpF AS PF
 FROM
     ( SELECT
-        strftime('%m', dtime, 'localtime') AS 'Month',
-        ROUND( (cast (MAX(W) as real) - MIN(W))/1000, 2 ) AS Energy,
-        ROUND((cast (MAX(W) as real) - MIN(W))/ (MAX(strftime('%d', dtime, 'localtime'))-MIN(strftime('%d', dtime, 'localtime'))+1) /1000, 2 ) AS AEpD,
-        ROUND(cast(MAX(P)as real)/1000,2) AS `MaxP`,
-        ROUND(AVG(P)/1000,2) AS `AvgP`,
-        ROUND(100*AVG(p/(U*I))) as `AvgpF`
-        FROM data
-        WHERE devid='1' AND DATETIME(dtime, 'localtime') > DATE('now', 'start of month', '-1 YEAR', 'localtime')
-        GROUP by strftime('%m', dtime, 'localtime')
-        ORDER by dtime DESC
+        strftime('%m', date) AS 'Month',
+        ROUND( (cast (MAX(maxW) as real) - MIN(minW))/1000, 2 ) AS Energy,
+        ROUND((cast (MAX(maxW) as real) - MIN(minW))/ (MAX(strftime('%d', date))-MIN(strftime('%d', date))+1) /1000, 2 ) AS AEpD,
+        ROUND(MAX(maxP)/1000,2) AS `MaxP`,
+        ROUND(SUM(sumP)/SUM(cnt)/1000,2) AS `AvgP`,
+        ROUND(100*SUM(sumPF)/SUM(cntPF)) as `AvgpF`
+        FROM data_daily
+        WHERE devid='1' AND date >= DATE('now', '-1 YEAR', 'start of month', '1 months', 'localtime')
+        GROUP by strftime('%m', date)
+        ORDER by date DESC
      ) allday
 LEFT JOIN
     ( SELECT
@@ -74,15 +76,15 @@ LEFT JOIN
       ROUND(100*AVG(perday.AvgpF)) as `AvgpF`
       FROM (
         SELECT
-            strftime('%m', dtime, 'localtime') AS 'Month',
-            ROUND( (cast (MAX(W) as real) - MIN(W))/1000,2 ) AS Energy,
-            AVG(P) AS `P`,
-            AVG(p/(U*I)) as `AvgpF`
-        FROM data
+            strftime('%m', hour, 'localtime') AS 'Month',
+            ROUND( (cast (MAX(maxW) as real) - MIN(minW))/1000,2 ) AS Energy,
+            SUM(sumP)/SUM(cnt) AS `P`,
+            SUM(sumPF)/SUM(cntPF) as `AvgpF`
+        FROM data_hourly
             WHERE devid='1'
-		AND cast(strftime('%H', dtime, 'localtime') as int) >= 7 AND cast( strftime('%H', dtime, 'localtime') as int) < 23
-		AND DATETIME(dtime, 'localtime') > DATE('now', 'start of month', '-1 YEAR', 'localtime')
-            GROUP by DATE(dtime)
+		AND cast(strftime('%H', hour, 'localtime') as int) >= 7 AND cast( strftime('%H', hour, 'localtime') as int) < 23
+		AND DATETIME(hour, 'localtime') > DATE('now', '-1 YEAR', 'start of month', '1 months', 'localtime')
+            GROUP by DATE(hour)
         ) perday
      GROUP by perday.Month
     ) dayt
@@ -91,6 +93,20 @@ ON allday.Month = dayt.Month;
 */
 
 
+-- Recalculate rollups from `data` table, same as 'pzcollect --rebuild-rollups'
+-- i.e. for rows stored before rollups were added
+/*
+BEGIN;
+DELETE FROM data_hourly;
+DELETE FROM data_daily;
+INSERT INTO data_hourly SELECT devid, DATETIME(strftime('%Y-%m-%d %H:00:00', dtime, 'localtime'), 'utc') AS h,
+    COUNT(*), TOTAL(P), MAX(P), TOTAL(P/(cast(U as real)*I)), COUNT(P/(cast(U as real)*I)), MIN(W), MAX(W) FROM data GROUP BY devid, h;
+INSERT INTO data_daily SELECT devid, DATE(dtime, 'localtime') AS d,
+    COUNT(*), TOTAL(P), MAX(P), TOTAL(P/(cast(U as real)*I)), COUNT(P/(cast(U as real)*I)), MIN(W), MAX(W) FROM data GROUP BY devid, d;
+COMMIT;
+*/
+
+
 -- Select last recorded values
 SELECT
     DATETIME(dtime, 'localtime') AS dtime, U, I, P, W, ROUND(100*P/(U*I)) as PF
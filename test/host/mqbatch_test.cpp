@@ -0,0 +1,175 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+/*
+	MQTTBatcher host test against a mosquitto stand-in
+
+	Batcher is driven in virtual time (1 tick - 1 second) with a sampler producing a monotonic sequence,
+	while broker goes down, stalls and restarts. Every sample must be delivered exactly once and in order,
+	both with RAM-only spool and with spool overflow to flash.
+
+	usage: mqbatch_test [ticks]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Arduino / TaskScheduler / EmbUI stand-ins used by mqttbatch.h
+#define TASK_SECOND		1000UL
+#define TASK_FOREVER	(-1)
+
+static uint32_t vclock_ms = 0;
+uint32_t millis(){ return vclock_ms; }
+
+struct Task {
+	std::function<void()> cb;
+	bool on{false};
+	void set(unsigned long, long, std::function<void()> f){ cb = std::move(f); }
+	void enableIfNot(){ on = true; }
+};
+
+struct Scheduler {
+	Task *t{nullptr};
+	void addTask(Task &task){ t = &task; }
+	void deleteTask(Task &task){ if (t == &task) t = nullptr; }
+	// run one virtual second
+	void tick(){ vclock_ms += TASK_SECOND; if (t && t->on && t->cb) t->cb(); }
+} ts;
+
+struct EmbUIStub {
+	bool mqttAvailable(){ return false; }
+	void publish(const char*, const char*){}
+} embui;
+
+namespace pzmbus {
+	enum class meter_t { vol, cur, pwr, enrg, frq, pf };
+	struct metrics { float asFloat(meter_t) const { return 0; } };
+}
+
+#include "LittleFS.h"
+FSStub LittleFS;
+
+#define MQTT_SPOOL_RAM		2048				// small RAM ring, so flash spool gets used
+#include "mqttbatch.h"
+#include "mqstandin.hpp"
+
+static int failures = 0;
+#define CHECK(cond, ...) do { if (!(cond)){ ++failures; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+// unpack absolute sample times from published json batches
+static std::vector<uint32_t> unpack(const std::vector<std::string> &msgs){
+	std::vector<uint32_t> v;
+	for (const auto &m : msgs){
+		const char *t0 = strstr(m.c_str(), "\"t0\":");
+		const char *t = strstr(m.c_str(), "\"t\":[");
+		if (!t0 || !t){
+			v.push_back(0);
+			continue;
+		}
+		uint32_t base = strtoul(t0 + 5, nullptr, 10);
+		for (const char *p = t + 5; *p && *p != ']'; ){
+			char *e;
+			v.push_back(base + strtoul(p, &e, 10));
+			p = *e == ',' ? e + 1 : e;
+		}
+	}
+	return v;
+}
+
+/**
+ * @brief run a broker outage scenario
+ * broker is down for the first 'down' ticks, then it is up, stalls for 'stall' ticks, resumes, then runs until drained
+ */
+static void scenario(bool fsspool, unsigned down, unsigned stall){
+	const char *name = fsspool ? "ram+flash spool" : "ram spool";
+	const uint32_t tbase = 1700000000;
+	bool produce = true;
+	uint32_t seq = 0;
+
+	MQTTStandin broker;
+	// reserve a port for the broker before it goes online
+	broker.start();
+	uint16_t port = broker.port();
+	broker.stop();
+
+	MQTTClient client(port);
+	MQTTBatcher mqb("pub/pzem/jbatch", [&client](const char *topic, const char *payload){ return client.publish(topic, payload); });
+	mqb.setup(5, 10, fsspool, [&](mqsample &s){
+		if (!produce)
+			return false;
+		memset(&s, 0, sizeof(s));
+		s.t = tbase + seq++;
+		s.U = 2300;
+		return true;
+	});
+
+	for (unsigned i = 0; i != down; ++i)
+		ts.tick();
+	CHECK(mqb.spoolSize() > 0, "%s: nothing spooled while broker is down", name);
+	CHECK(fsspool == LittleFS.exists(MQTT_SPOOL_FILE), "%s: unexpected flash spool state", name);
+
+	// broker comes up, but stalls while spool is draining
+	CHECK(broker.start(port), "%s: can't start broker", name);
+	for (unsigned i = 0; i != 20; ++i){
+		ts.tick();
+		usleep(2000);
+	}
+	broker.pause(true);
+	for (unsigned i = 0; i != stall; ++i)
+		ts.tick();
+	size_t stalled = broker.messages().size();
+
+	// broker resumes reading, messages rejected while it was stalled must be retried from spool
+	broker.pause(false);
+	for (unsigned i = 0; i != 200; ++i){
+		ts.tick();
+		usleep(1000);
+	}
+	CHECK(broker.messages().size() > stalled, "%s: nothing published after stall", name);
+
+	// stop producing, let the last partial batch to seal and spool to drain
+	produce = false;
+	for (unsigned i = 0; i != 2000 && (mqb.spoolSize() || LittleFS.exists(MQTT_SPOOL_FILE) || broker.messages().size() < (seq + 4) / 5); ++i){
+		ts.tick();
+		usleep(1000);
+	}
+
+	auto got = unpack(broker.messages());
+	CHECK(mqb.drops() == 0, "%s: %u batches dropped", name, mqb.drops());
+	CHECK(!LittleFS.exists(MQTT_SPOOL_FILE), "%s: flash spool is not drained", name);
+	CHECK(got.size() == seq, "%s: produced %u samples, received %zu", name, seq, got.size());
+	for (size_t i = 0; i != got.size(); ++i){
+		if (got[i] != tbase + i){
+			CHECK(false, "%s: sample %zu out of order, t=%u", name, i, got[i]);
+			break;
+		}
+	}
+	printf("%s: %u samples in %zu messages, %zu received before stall\n", name, seq, broker.messages().size(), stalled);
+	broker.stop();
+}
+
+int main(int argc, char *argv[]){
+	unsigned down = argc > 1 ? atoi(argv[1]) : 600;
+
+	char dir[] = "/tmp/mqbatchXXXXXX";
+	if (!mkdtemp(dir)){
+		perror("mkdtemp");
+		return 1;
+	}
+	LittleFS.begin(dir);
+
+	// RAM ring alone holds ~18 batches (90 samples)
+	scenario(false, down / 10, down / 10);
+	scenario(true, down, 300);
+
+	rmdir(dir);
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+/*
+	Mosquitto stand-in for host tests, Linux only
+
+	MQTTStandin is a minimal MQTT 3.1.1 broker listening on a loopback port, it accepts CONNECT, records
+	payloads of QoS0 PUBLISH messages and answers PINGREQ. Broker could be paused (stops reading the socket,
+	so client's TCP buffer fills up like with a stalled link) or stopped (all connections are closed).
+
+	MQTTClient is a minimal QoS0 client behaving like an async client on the device - publish() returns false
+	when there is no connection or not enough room in the TCP send buffer for the whole message.
+*/
+
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MQSTANDIN_SOCK_BUFF		4096		// small socket buffers to make a stalled broker visible quickly
+
+class MQTTStandin {
+	int lsock{-1};
+	int csock{-1};
+	uint16_t _port{0};
+	std::thread thr;
+	std::atomic<bool> run{false};
+	std::atomic<bool> paused{false};
+	std::mutex mtx;
+	std::vector<std::string> msgs;
+	std::vector<uint8_t> rx;
+
+	static void mkbuff(int s){
+		int v = MQSTANDIN_SOCK_BUFF;
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v));
+	}
+
+	// parse complete packets from rx buffer, @return false if connection should be closed
+	bool parse(){
+		for (;;){
+			size_t len = 0, n = 1;
+			for (unsigned shift = 0; ; shift += 7, ++n){
+				if (n >= rx.size())
+					return true;
+				len |= (rx[n] & 0x7f) << shift;
+				if (!(rx[n] & 0x80))
+					break;
+			}
+			size_t hdr = n + 1;
+			if (rx.size() < hdr + len)
+				return true;
+
+			const uint8_t *p = rx.data() + hdr;
+			switch (rx[0] >> 4){
+				case 1 : {	// CONNECT
+					const uint8_t ack[] = {0x20, 0x02, 0x00, 0x00};
+					send(csock, ack, sizeof(ack), MSG_NOSIGNAL);
+					break;
+				}
+				case 3 : {	// PUBLISH, QoS0
+					size_t tlen = p[0] << 8 | p[1];
+					std::lock_guard<std::mutex> lock(mtx);
+					msgs.emplace_back(reinterpret_cast<const char*>(p + 2 + tlen), len - 2 - tlen);
+					break;
+				}
+				case 12 : {	// PINGREQ
+					const uint8_t resp[] = {0xd0, 0x00};
+					send(csock, resp, sizeof(resp), MSG_NOSIGNAL);
+					break;
+				}
+				case 14 :	// DISCONNECT
+					return false;
+				default:
+					break;
+			}
+			rx.erase(rx.begin(), rx.begin() + hdr + len);
+		}
+	}
+
+	void loop(){
+		while (run){
+			if (paused){
+				usleep(1000);
+				continue;
+			}
+			pollfd pfd = { csock < 0 ? lsock : csock, POLLIN, 0 };
+			if (poll(&pfd, 1, 10) <= 0)
+				continue;
+			if (csock < 0){
+				csock = accept(lsock, nullptr, nullptr);
+				rx.clear();
+				continue;
+			}
+			uint8_t buff[1024];
+			ssize_t r = recv(csock, buff, sizeof(buff), 0);
+			if (r > 0)
+				rx.insert(rx.end(), buff, buff + r);
+			if (r <= 0 || !parse()){
+				close(csock);
+				csock = -1;
+			}
+		}
+	}
+
+   public:
+	~MQTTStandin(){ stop(); }
+
+	// start listening, @param port - 0 to pick any free port
+	bool start(uint16_t port = 0){
+		lsock = socket(AF_INET, SOCK_STREAM, 0);
+		int on = 1;
+		setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		mkbuff(lsock);
+		sockaddr_in a{};
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		a.sin_port = htons(port);
+		socklen_t alen = sizeof(a);
+		if (bind(lsock, reinterpret_cast<sockaddr*>(&a), sizeof(a)) || listen(lsock, 1)
+			|| getsockname(lsock, reinterpret_cast<sockaddr*>(&a), &alen)){
+			close(lsock);
+			lsock = -1;
+			return false;
+		}
+		_port = ntohs(a.sin_port);
+		paused = false;
+		run = true;
+		thr = std::thread(&MQTTStandin::loop, this);
+		return true;
+	}
+
+	// close listener and all connections
+	void stop(){
+		run = false;
+		if (thr.joinable())
+			thr.join();
+		if (csock >= 0)
+			close(csock);
+		if (lsock >= 0)
+			close(lsock);
+		csock = lsock = -1;
+	}
+
+	void pause(bool p){ paused = p; }
+	uint16_t port() const { return _port; }
+
+	// payloads received so far
+	std::vector<std::string> messages(){
+		std::lock_guard<std::mutex> lock(mtx);
+		return msgs;
+	}
+};
+
+
+class MQTTClient {
+	int sock{-1};
+	uint16_t _port;
+
+	static void putlen(std::vector<uint8_t> &b, size_t len){
+		do {
+			uint8_t d = len & 0x7f;
+			len >>= 7;
+			b.push_back(len ? d | 0x80 : d);
+		} while (len);
+	}
+
+	static void putstr(std::vector<uint8_t> &b, const char *s, size_t len){
+		b.push_back(len >> 8);
+		b.push_back(len & 0xff);
+		b.insert(b.end(), s, s + len);
+	}
+
+	void drop(){
+		if (sock >= 0)
+			close(sock);
+		sock = -1;
+	}
+
+	// check if connection is still alive, peer shutdown is noticed before anything is lost in a dead socket
+	bool alive(){
+		if (sock < 0)
+			return false;
+		uint8_t c;
+		ssize_t r = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)){
+			drop();
+			return false;
+		}
+		// discard PINGRESP and alike
+		while (r > 0 && (r = recv(sock, &c, 1, MSG_DONTWAIT)) > 0);
+		return true;
+	}
+
+	bool connect(){
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		int v = MQSTANDIN_SOCK_BUFF;
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v));
+		sockaddr_in a{};
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		a.sin_port = htons(_port);
+		if (::connect(sock, reinterpret_cast<sockaddr*>(&a), sizeof(a))){
+			drop();
+			return false;
+		}
+
+		std::vector<uint8_t> b, var;
+		putstr(var, "MQTT", 4);
+		var.insert(var.end(), {0x04, 0x02, 0x00, 0x3c});	// proto level 4, clean session, keepalive 60s
+		putstr(var, "espem", 5);
+		b.push_back(0x10);
+		putlen(b, var.size());
+		b.insert(b.end(), var.begin(), var.end());
+
+		uint8_t ack[4];
+		pollfd pfd = { sock, POLLIN, 0 };
+		if (send(sock, b.data(), b.size(), MSG_NOSIGNAL) != (ssize_t)b.size() || poll(&pfd, 1, 1000) != 1
+			|| recv(sock, ack, sizeof(ack), MSG_WAITALL) != sizeof(ack) || ack[0] != 0x20 || ack[3]){
+			drop();
+			return false;
+		}
+		return true;
+	}
+
+   public:
+	explicit MQTTClient(uint16_t port) : _port(port) {}
+	~MQTTClient(){ drop(); }
+
+	bool connected(){ return alive() || connect(); }
+
+	// publish QoS0 message, @return false if message was not queued for sending
+	bool publish(const char *topic, const char *payload){
+		if (!connected())
+			return false;
+
+		std::vector<uint8_t> b;
+		size_t tlen = strlen(topic), plen = strlen(payload);
+		b.push_back(0x30);
+		putlen(b, 2 + tlen + plen);
+		putstr(b, topic, tlen);
+		b.insert(b.end(), payload, payload + plen);
+
+		// like async tcp, message is rejected if it does not fit send buffer as a whole
+		int sndbuf = 0, queued = 0;
+		socklen_t olen = sizeof(sndbuf);
+		getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &olen);
+		ioctl(sock, SIOCOUTQ, &queued);
+		if ((size_t)(sndbuf / 2 - queued) < b.size())
+			return false;
+
+		if (send(sock, b.data(), b.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)b.size()){
+			drop();
+			return false;
+		}
+		return true;
+	}
+};
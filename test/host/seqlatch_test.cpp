@@ -0,0 +1,94 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+/*
+	SeqLatch stress test
+
+	One writer thread stores values made of a counter, N reader threads load them concurrently and check
+	that every copy is consistent (all fields derived from the same counter) and that counter never goes back.
+	Value is larger than a cache line, so a torn copy spans several lines.
+
+	usage: seqlatch_test [readers] [ms]
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "seqlatch.hpp"
+
+struct sample {
+	uint32_t n;
+	uint32_t inv;			// ~n
+	uint64_t sq;			// n*n
+	uint32_t fill[24];		// all set to n
+	float	 f;				// n/2
+};
+
+static sample make(uint32_t n){
+	sample s;
+	s.n = n;
+	s.inv = ~n;
+	s.sq = static_cast<uint64_t>(n) * n;
+	for (auto &v : s.fill)
+		v = n;
+	s.f = n / 2.0f;
+	return s;
+}
+
+static bool valid(const sample &s){
+	if (s.inv != ~s.n || s.sq != static_cast<uint64_t>(s.n) * s.n || s.f != s.n / 2.0f)
+		return false;
+	for (auto v : s.fill)
+		if (v != s.n)
+			return false;
+	return true;
+}
+
+int main(int argc, char *argv[]){
+	unsigned readers = argc > 1 ? atoi(argv[1]) : 4;
+	unsigned ms = argc > 2 ? atoi(argv[2]) : 1000;
+
+	SeqLatch<sample> latch;
+	latch.store(make(0));
+	std::atomic<bool> run{true};
+	std::atomic<uint64_t> loads{0}, torn{0}, back{0};
+
+	std::vector<std::thread> thr;
+	for (unsigned i = 0; i != readers; ++i)
+		thr.emplace_back([&](){
+			uint32_t last = 0;
+			uint64_t cnt = 0;
+			while (run.load(std::memory_order_relaxed)){
+				sample s = latch.load();
+				++cnt;
+				if (!valid(s))
+					++torn;
+				else if (s.n < last)
+					++back;
+				else
+					last = s.n;
+			}
+			loads += cnt;
+		});
+
+	uint32_t n = 0;
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	while (std::chrono::steady_clock::now() < end)
+		for (unsigned i = 0; i != 1000; ++i)
+			latch.store(make(++n));
+	run = false;
+	for (auto &t : thr)
+		t.join();
+
+	bool ok = !torn && !back && latch.version() == n + 1 && latch.load().n == n;
+	printf("%u stores, %llu loads by %u readers, %llu torn, %llu went back\n", n, static_cast<unsigned long long>(loads.load()),
+		readers, static_cast<unsigned long long>(torn.load()), static_cast<unsigned long long>(back.load()));
+	printf(ok ? "PASSED\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+/// ESPEM - ESP Energy monitor
+//  A code for ESP32 based boards to interface with PeaceFair PZEM PowerMeters
+//  It can poll/collect PowerMeter data and provide it for futher processing in text/json format
+
+//  (c) Emil Muratov 2018-2022  https://github.com/vortigont/espem
+
+// LittleFS stand-in for host tests, files are mapped to a local directory
+
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class File {
+	FILE *_f{nullptr};
+   public:
+	File() = default;
+	explicit File(FILE *f) : _f(f) {}
+	File(File &&rhs) : _f(rhs._f) { rhs._f = nullptr; }
+	~File() { close(); }
+	explicit operator bool() const { return _f; }
+
+	size_t size() const {
+		long pos = ftell(_f);
+		fseek(_f, 0, SEEK_END);
+		long sz = ftell(_f);
+		fseek(_f, pos, SEEK_SET);
+		return sz;
+	}
+	bool seek(size_t pos) { return pos <= size() && !fseek(_f, pos, SEEK_SET); }
+	size_t read(uint8_t *buf, size_t len) { return fread(buf, 1, len, _f); }
+	size_t write(const uint8_t *buf, size_t len) { return fwrite(buf, 1, len, _f); }
+	void close() { if (_f) fclose(_f); _f = nullptr; }
+};
+
+class FSStub {
+	std::string root{"."};
+	std::string path(const char *p) const { return root + p; }
+   public:
+	void begin(const char *dir) { root = dir; }
+	bool exists(const char *p) const { struct stat st; return !stat(path(p).c_str(), &st); }
+	bool remove(const char *p) { return !unlink(path(p).c_str()); }
+	File open(const char *p, const char *mode) { return File(fopen(path(p).c_str(), *mode == 'a' ? "ab+" : "rb")); }
+};
+
+extern FSStub LittleFS;
@@ -95,7 +95,36 @@ $pdoopt = [
 
 // array keys must match with column names in DB
 $sql = "INSERT INTO $datatable (" . implode(',',array_keys($meters) ) . ') VALUES (:' . implode(',:',array_keys($meters)) . ')';
+
+if ($dbengine == 'mysql') {
+    $stmt = $pdo->prepare($sql);
+    $stmt->execute($meters);
+    exit(0);
+}
+
+// SQLite stat reports read hourly/daily rollups, update them with the new row in the same transaction
+// same tables and merge rules as collector/pzcollect, see sql/pzem_sqlite.sql
+$rollup_agg = "COUNT(*), TOTAL(P), MAX(P), TOTAL(P/(cast(U as real)*I)), COUNT(P/(cast(U as real)*I)), MIN(W), MAX(W)
+    FROM $datatable WHERE id = last_insert_rowid() GROUP BY devid";
+$rollup_merge = "DO UPDATE SET cnt = cnt + excluded.cnt, sumP = sumP + excluded.sumP,
+    maxP = max(maxP, excluded.maxP), sumPF = sumPF + excluded.sumPF, cntPF = cntPF + excluded.cntPF,
+    minW = min(minW, excluded.minW), maxW = max(maxW, excluded.maxW)";
+
+// DB made before rollups were added, sql/pzsqlitestat.sql has a query to fill them from existing rows
+$pdo->exec("CREATE TABLE IF NOT EXISTS data_hourly (devid INT NOT NULL references meters(id), hour timestamp NOT NULL,
+    cnt INT NOT NULL, sumP REAL NOT NULL, maxP REAL NOT NULL, sumPF REAL NOT NULL, cntPF INT NOT NULL, minW INT NOT NULL, maxW INT NOT NULL,
+    PRIMARY KEY (devid, hour));
+    CREATE TABLE IF NOT EXISTS data_daily (devid INT NOT NULL references meters(id), date TEXT NOT NULL,
+    cnt INT NOT NULL, sumP REAL NOT NULL, maxP REAL NOT NULL, sumPF REAL NOT NULL, cntPF INT NOT NULL, minW INT NOT NULL, maxW INT NOT NULL,
+    PRIMARY KEY (devid, date))");
+
+$pdo->beginTransaction();
 $stmt = $pdo->prepare($sql);
 $stmt->execute($meters);
+$pdo->exec("INSERT INTO data_hourly SELECT devid, DATETIME(strftime('%Y-%m-%d %H:00:00', dtime, 'localtime'), 'utc'), $rollup_agg
+    ON CONFLICT (devid, hour) $rollup_merge");
+$pdo->exec("INSERT INTO data_daily SELECT devid, DATE(dtime, 'localtime'), $rollup_agg
+    ON CONFLICT (devid, date) $rollup_merge");
+$pdo->commit();
 
 ?>
\ No newline at end of file
@@ -1,8 +1,12 @@
 <?php
 // SQLite reqs
 
-// Select year stat (last 12 month)
-$sql['sqlite']['mstat'] = <<<SQL
+// Stat reports read hourly/daily rollup tables instead of scanning raw data, both collector/pzcollect and pzem_poller.php
+// update them along with each row, for rows stored before, fill them once with 'pzcollect --db <file> --rebuild-rollups'
+// or with the rebuild query from sql/pzsqlitestat.sql
+
+// Select month stat (daily, last month)
+$sql['mstat'] = <<<SQL
 SELECT
     allday.date AS 'date',
     allday.Energy AS Energy,
@@ -16,36 +20,35 @@ SELECT
     allday.AvgpF AS PF
 FROM
     ( SELECT
-        DATE(dtime, 'localtime') AS 'date',
-        ROUND( (cast(MAX(W) as real)- MIN(W))/1000,2 ) AS Energy,
-        ROUND(cast (MAX(P) as real)/1000,2) AS `MaxP`,
-        ROUND(AVG(P)) AS `AvgP`,
-        ROUND(100*AVG(p/(U*I)),1) as `AvgpF`
-        FROM data
+        date,
+        ROUND( (cast(maxW as real) - minW)/1000,2 ) AS Energy,
+        ROUND( maxP/1000,2 ) AS `MaxP`,
+        ROUND( sumP/cnt ) AS `AvgP`,
+        ROUND( 100*sumPF/cntPF,1 ) as `AvgpF`
+        FROM data_daily
         WHERE devid='$devid'
-            AND DATETIME(dtime, 'localtime') > DATE('now', '-1 MONTH', 'localtime')
-        GROUP by DATE(dtime, 'localtime')
+            AND date >= DATE('now', '-1 MONTH', 'localtime')
      ) allday
 LEFT JOIN
     ( SELECT
-        DATE(dtime, 'localtime') AS 'date',
-        ROUND( (cast(MAX(W) as real)- MIN(W))/1000,2 ) AS Energy,
-        ROUND(AVG(P)) AS `AvgP`,
-        ROUND(100*AVG(p/(U*I)),1) as `AvgpF`
-      FROM data
+        DATE(hour, 'localtime') AS 'date',
+        ROUND( (cast(MAX(maxW) as real) - MIN(minW))/1000,2 ) AS Energy,
+        ROUND( SUM(sumP)/SUM(cnt) ) AS `AvgP`,
+        ROUND( 100*SUM(sumPF)/SUM(cntPF),1 ) as `AvgpF`
+      FROM data_hourly
         WHERE devid='$devid'
-            AND DATETIME(dtime, 'localtime') > DATE('now', '-1 MONTH')
-            AND ( cast(strftime('%H', dtime, 'localtime') as int) > $dtsh OR cast( strftime('%H', dtime, 'localtime') as int) < $dteh)
-        GROUP by DATE(dtime, 'localtime')
+            AND DATETIME(hour, 'localtime') > DATE('now', '-1 MONTH')
+            AND ( cast(strftime('%H', hour, 'localtime') as int) > $dtsh OR cast( strftime('%H', hour, 'localtime') as int) < $dteh)
+        GROUP by DATE(hour, 'localtime')
     ) dayt
 ON allday.date = dayt.date
 ORDER by date DESC
-SQL
+SQL;
 
 
 // -- Select monthly stat (last 12 month)
 // -- kW
-$sql['sqlite']['ystat'] = <<<SQL
+$sql['ystat'] = <<<SQL
 SELECT
     allday.Month AS 'Month',
     allday.Energy AS Energy,
@@ -60,16 +63,16 @@ SELECT
     allday.AvgpF AS PF
 FROM
     ( SELECT
-        strftime('%m', dtime, 'localtime') AS 'Month',
-        ROUND( (cast (MAX(W) as real) - MIN(W))/1000, 2 ) AS Energy,
-        ROUND((cast (MAX(W) as real) - MIN(W))/ (MAX(strftime('%d', dtime, 'localtime'))-MIN(strftime('%d', dtime, 'localtime'))+1) /1000, 2 ) AS AEpD,
-        ROUND(cast(MAX(P)as real)/1000,2) AS `MaxP`,
-        ROUND(AVG(P)/1000,2) AS `AvgP`,
-        ROUND(100*AVG(p/(U*I))) as `AvgpF`
-        FROM data
-        WHERE devid='$devid' AND DATETIME(dtime, 'localtime') > DATE('now', '-1 YEAR', 'start of month', '1 months',   'localtime')
-        GROUP by strftime('%m', dtime, 'localtime')
-        ORDER by dtime DESC
+        strftime('%m', date) AS 'Month',
+        ROUND( (cast (MAX(maxW) as real) - MIN(minW))/1000, 2 ) AS Energy,
+        ROUND((cast (MAX(maxW) as real) - MIN(minW))/ (MAX(strftime('%d', date))-MIN(strftime('%d', date))+1) /1000, 2 ) AS AEpD,
+        ROUND(MAX(maxP)/1000,2) AS `MaxP`,
+        ROUND(SUM(sumP)/SUM(cnt)/1000,2) AS `AvgP`,
+        ROUND(100*SUM(sumPF)/SUM(cntPF)) as `AvgpF`
+        FROM data_daily
+        WHERE devid='$devid' AND date >= DATE('now', '-1 YEAR', 'start of month', '1 months',   'localtime')
+        GROUP by strftime('%m', date)
+        ORDER by date DESC
      ) allday
 LEFT JOIN
     ( SELECT
@@ -79,15 +82,15 @@ LEFT JOIN
       ROUND(100*AVG(perday.AvgpF)) as `AvgpF`
       FROM (
         SELECT
-            strftime('%m', dtime, 'localtime') AS 'Month',
-            ROUND( (cast (MAX(W) as real) - MIN(W))/1000,2 ) AS Energy,
-            AVG(P) AS `P`,
-            AVG(p/(U*I)) as `AvgpF`
-        FROM data
+            strftime('%m', hour, 'localtime') AS 'Month',
+            ROUND( (cast (MAX(maxW) as real) - MIN(minW))/1000,2 ) AS Energy,
+            SUM(sumP)/SUM(cnt) AS `P`,
+            SUM(sumPF)/SUM(cntPF) as `AvgpF`
+        FROM data_hourly
             WHERE devid='$devid'
-                AND cast(strftime('%H', dtime, 'localtime') as int) >= $dtsh AND cast( strftime('%H', dtime, 'localtime') as int) <= $dteh
-                AND DATETIME(dtime, 'localtime') > DATE('now', '-1 YEAR', 'start of month', '1 months',   'localtime')
-            GROUP by DATE(dtime)
+                AND cast(strftime('%H', hour, 'localtime') as int) >= $dtsh AND cast( strftime('%H', hour, 'localtime') as int) <= $dteh
+                AND DATETIME(hour, 'localtime') > DATE('now', '-1 YEAR', 'start of month', '1 months',   'localtime')
+            GROUP by DATE(hour)
         ) perday
      GROUP by perday.Month
     ) dayt